@@ -331,6 +331,26 @@ AC_DEFUN([SANE_CHECK_TIFF],
   AC_SUBST(TIFF_LIBS)
 ])
 
+# Checks for zlib, used by scanimage for compressed TIFF output.
+AC_DEFUN([SANE_CHECK_ZLIB],
+[
+  AC_ARG_WITH(zlib,
+    AS_HELP_STRING([--without-zlib], [build without zlib]))
+  if test "$with_zlib" != "no" ; then
+    AC_CHECK_LIB(z,compress2,
+    [
+      AC_CHECK_HEADER(zlib.h,
+      [sane_cv_use_zlib="yes"; ZLIB_LIBS="-lz"],)
+    ],)
+  fi
+  if test "$sane_cv_use_zlib" = "yes" ; then
+     AC_DEFINE(HAVE_LIBZ,1,[Define to 1 if you have the zlib library.])
+  elif test "$with_zlib" = "yes" ; then
+    AC_MSG_ERROR([zlib requested but not found])
+  fi
+  AC_SUBST(ZLIB_LIBS)
+])
+
 # Check for OpenSSL 1.1 or higher (optional)
 AC_DEFUN([SANE_CHECK_SSL], [
 
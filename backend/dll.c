@@ -42,7 +42,7 @@
 
 /* Please increase version number with every change
    (don't forget to update dll.desc) */
-#define DLL_VERSION "1.0.13"
+#define DLL_VERSION "1.0.14"
 
 #ifdef _AIX
 # include "lalloca.h"		/* MUST come first for AIX! */
@@ -63,6 +63,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
 
 #if defined(HAVE_DLOPEN) && defined(HAVE_DLFCN_H)
 # include <dlfcn.h>
@@ -128,8 +131,15 @@ posix_dlsym (void *handle, const char *func)
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
 #include <dirent.h>
 
+#if defined(HAVE_PTHREAD_H) && !defined(__BEOS__)
+# include <pthread.h>
+# define DLL_USE_THREADS
+#endif
+
 #include "../include/sane/sane.h"
 #include "../include/sane/sanei.h"
 
@@ -201,6 +211,7 @@ struct backend
   u_int inited:1;		/* has the backend been initialized? */
   void *handle;			/* handle returned by dlopen() */
   void *(*op[NUM_OPS]) (void);
+  u_int busy:1;			/* is a probe thread still using it? */
 };
 
 #define BE_ENTRY(be,func)       sane_##be##_##func
@@ -241,7 +252,8 @@ struct backend
     BE_ENTRY(name,cancel),                      \
     BE_ENTRY(name,set_io_mode),                 \
     BE_ENTRY(name,get_select_fd)                \
-  }                                             \
+  },                                            \
+  0 /* busy */                                  \
 }
 
 #ifndef __BEOS__
@@ -249,7 +261,7 @@ struct backend
 #include "dll-preload.h"
 #else
 static struct backend preloaded_backends[] = {
- { 0, 0, 0, 0, 0, 0, {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }}
+ { 0, 0, 0, 0, 0, 0, {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, 0}
 };
 #endif
 #endif
@@ -278,6 +290,149 @@ static struct alias *first_alias;
 static SANE_Auth_Callback auth_callback;
 static struct backend *first_backend;
 
+/*
+ * sane_get_devices() initializes and probes the backends on up to
+ * probe_threads threads.  A backend which takes longer than
+ * probe_timeout seconds (0 = wait forever) is left running in the
+ * background and its devices are skipped.  Most backends were never
+ * written to be initialized concurrently, so the parallel probe has to
+ * be asked for with SANE_DLL_THREADS.
+ */
+#define DLL_DEFAULT_PROBE_THREADS 1
+static int probe_threads = DLL_DEFAULT_PROBE_THREADS;
+static int probe_timeout = 0;
+
+/* how long sane_open() and sane_exit() wait for a backend that is still
+   being probed if probe_timeout doesn't say */
+#define DLL_BUSY_TIMEOUT 30
+
+#if defined(_POSIX_TIMERS) && _POSIX_TIMERS > 0 && defined(CLOCK_MONOTONIC)
+# define DLL_HAVE_MONOTONIC
+#endif
+
+/* Time in seconds for probe times and deadlines.  It doesn't jump when
+   the wall clock is set, where the system provides a monotonic clock. */
+static double
+dll_now (void)
+{
+#ifdef DLL_HAVE_MONOTONIC
+  struct timespec ts;
+
+  if (clock_gettime (CLOCK_MONOTONIC, &ts) == 0)
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+  {
+    struct timeval tv;
+
+    gettimeofday (&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+  }
+}
+
+#ifdef DLL_USE_THREADS
+/* protects the probe pools and the busy flags of all backends */
+static pthread_mutex_t probe_lock = PTHREAD_MUTEX_INITIALIZER;
+/* signalled when a probe job is done, set up by probe_cond_init() */
+static pthread_cond_t probe_cond;
+static pthread_once_t probe_cond_once = PTHREAD_ONCE_INIT;
+static int probe_cond_monotonic = 0;
+
+/* time probe_cond with the monotonic clock where it can be */
+static void
+probe_cond_init (void)
+{
+  pthread_condattr_t attr;
+
+  pthread_condattr_init (&attr);
+#if defined(DLL_HAVE_MONOTONIC) && defined(_POSIX_CLOCK_SELECTION) \
+  && _POSIX_CLOCK_SELECTION >= 0
+  if (pthread_condattr_setclock (&attr, CLOCK_MONOTONIC) == 0)
+    probe_cond_monotonic = 1;
+#endif
+  pthread_cond_init (&probe_cond, &attr);
+  pthread_condattr_destroy (&attr);
+}
+
+/* wait on probe_cond for at most SECONDS, called with probe_lock held,
+   returns like pthread_cond_timedwait() */
+static int
+probe_cond_wait (double seconds)
+{
+  struct timespec ts;
+  struct timeval tv;
+  double deadline;
+
+#ifdef DLL_HAVE_MONOTONIC
+  if (probe_cond_monotonic)
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+  else
+#endif
+    {
+      gettimeofday (&tv, NULL);
+      ts.tv_sec = tv.tv_sec;
+      ts.tv_nsec = tv.tv_usec * 1000;
+    }
+  if (seconds < 0)
+    seconds = 0;
+  deadline = ts.tv_nsec / 1e9 + seconds;
+  ts.tv_sec += (time_t) deadline;
+  ts.tv_nsec = (long) ((deadline - (time_t) deadline) * 1e9);
+  return pthread_cond_timedwait (&probe_cond, &probe_lock, &ts);
+}
+
+/* wait until no probe thread uses BE (or any backend if BE is NULL),
+   returns SANE_STATUS_DEVICE_BUSY if that doesn't happen in time */
+static SANE_Status
+wait_for_backend (struct backend *be)
+{
+  struct backend *b;
+  double deadline;
+  int busy;
+
+  deadline = dll_now () + (probe_timeout > 0 ? probe_timeout
+			   : DLL_BUSY_TIMEOUT);
+
+  pthread_mutex_lock (&probe_lock);
+  for (;;)
+    {
+      busy = 0;
+      for (b = first_backend; b; b = b->next)
+	if (b->busy && (!be || b == be))
+	  {
+	    DBG (2, "wait_for_backend: waiting for backend `%s'\n", b->name);
+	    busy = 1;
+	    break;
+	  }
+      if (!busy)
+	break;
+      if (dll_now () >= deadline
+	  || probe_cond_wait (deadline - dll_now ()) == ETIMEDOUT)
+	{
+	  DBG (1, "wait_for_backend: backend `%s' is still busy, giving up\n",
+	       b->name);
+	  break;
+	}
+    }
+  pthread_mutex_unlock (&probe_lock);
+  return busy ? SANE_STATUS_DEVICE_BUSY : SANE_STATUS_GOOD;
+}
+
+/* is a probe thread still using BE? */
+static int
+backend_busy (struct backend *be)
+{
+  int busy;
+
+  pthread_mutex_lock (&probe_lock);
+  busy = be->busy;
+  pthread_mutex_unlock (&probe_lock);
+  return busy;
+}
+#else /* !DLL_USE_THREADS */
+# define wait_for_backend(be) SANE_STATUS_GOOD
+# define backend_busy(be) 0
+#endif /* DLL_USE_THREADS */
+
 #ifndef __BEOS__
 static const char *op_name[] = {
   "init", "exit", "get_devices", "open", "close", "get_option_descriptor",
@@ -888,6 +1043,7 @@ read_dlld (void)
 SANE_Status
 sane_init (SANE_Int * version_code, SANE_Auth_Callback authorize)
 {
+  const char *env;
 #ifndef __BEOS__
   char config_line[PATH_MAX];
   size_t len;
@@ -904,10 +1060,24 @@ sane_init (SANE_Int * version_code, SANE_Auth_Callback authorize)
   DBG_INIT ();
 
   auth_callback = authorize;
+#ifdef DLL_USE_THREADS
+  pthread_once (&probe_cond_once, probe_cond_init);
+#endif
 
   DBG (1, "sane_init: SANE dll backend version %s from %s\n", DLL_VERSION,
        PACKAGE_STRING);
 
+  probe_threads = DLL_DEFAULT_PROBE_THREADS;
+  env = getenv ("SANE_DLL_THREADS");
+  if (env)
+    probe_threads = atoi (env);
+  probe_timeout = 0;
+  env = getenv ("SANE_DLL_TIMEOUT");
+  if (env)
+    probe_timeout = atoi (env);
+  DBG (3, "sane_init: probing backends on up to %d threads, timeout %d s\n",
+       probe_threads, probe_timeout);
+
 #ifndef __BEOS__
   /* chain preloaded backends together: */
   for (i = 0; i < NELEMS (preloaded_backends); ++i)
@@ -983,9 +1153,19 @@ sane_exit (void)
 
   DBG (2, "sane_exit: exiting\n");
 
+  wait_for_backend (NULL);
+
   for (be = first_backend; be; be = next)
     {
       next = be->next;
+      if (backend_busy (be))
+	{
+	  /* a hung probe thread still runs its code: neither call its
+	     exit function nor unload it, and leak the struct it uses */
+	  DBG (1, "sane_exit: backend `%s' is still busy, leaving it loaded\n",
+	       be->name);
+	  continue;
+	}
       if (be->loaded)
 	{
 	  if (be->inited)
@@ -1054,20 +1234,6 @@ sane_exit (void)
   DBG (3, "sane_exit: finished\n");
 }
 
-/* Note that a call to get_devices() implies that we'll have to load
-   all backends.  To avoid this, you can call sane_open() directly
-   (assuming you know the name of the backend/device).  This is
-   appropriate for the command-line interface of SANE, for example.
- */
-SANE_Status
-sane_get_devices (const SANE_Device *** device_list, SANE_Bool local_only)
-{
-  const SANE_Device **be_list;
-  struct backend *be;
-  SANE_Status status;
-  char *full_name;
-  int i, num_devs;
-  size_t len;
 #define ASSERT_SPACE(n) do                                                 \
   {                                                                        \
     if (devlist_len + (n) > devlist_size)                                  \
@@ -1082,95 +1248,581 @@ sane_get_devices (const SANE_Device *** device_list, SANE_Bool local_only)
       }                                                                    \
   } while (0)
 
-  DBG (3, "sane_get_devices\n");
+/* append the devices of backend BE to devlist */
+static SANE_Status
+add_devices (struct backend *be, const SANE_Device **be_list)
+{
+  char *full_name;
+  int i, num_devs;
+  size_t len;
 
-  if (devlist)
-    for (i = 0; i < devlist_len; ++i)
-      free ((void *) devlist[i]);
-  devlist_len = 0;
+  /* count the number of devices for this backend: */
+  for (num_devs = 0; be_list[num_devs]; ++num_devs);
+
+  ASSERT_SPACE (num_devs);
+
+  for (i = 0; i < num_devs; ++i)
+    {
+      SANE_Device *dev;
+      char *mem;
+      struct alias *alias;
+
+      for (alias = first_alias; alias != NULL; alias = alias->next)
+	{
+	  len = strlen (be->name);
+	  if (strlen (alias->oldname) <= len)
+	    continue;
+	  if (strncmp (alias->oldname, be->name, len) == 0
+	      && alias->oldname[len] == ':'
+	      && strcmp (&alias->oldname[len + 1], be_list[i]->name) == 0)
+	    break;
+	}
+
+      if (alias)
+	{
+	  if (!alias->newname)	/* hidden device */
+	    continue;
+
+	  len = strlen (alias->newname);
+	  mem = malloc (sizeof (*dev) + len + 1);
+	  if (!mem)
+	    return SANE_STATUS_NO_MEM;
+
+	  full_name = mem + sizeof (*dev);
+	  strcpy (full_name, alias->newname);
+	}
+      else
+	{
+	  /* create a new device entry with a device name that is the
+	     sum of the backend name a colon and the backend's device
+	     name: */
+	  len = strlen (be->name) + 1 + strlen (be_list[i]->name);
+	  mem = malloc (sizeof (*dev) + len + 1);
+	  if (!mem)
+	    return SANE_STATUS_NO_MEM;
+
+	  full_name = mem + sizeof (*dev);
+	  strcpy (full_name, be->name);
+	  strcat (full_name, ":");
+	  strcat (full_name, be_list[i]->name);
+	}
+
+      dev = (SANE_Device *) mem;
+      dev->name = full_name;
+      dev->vendor = be_list[i]->vendor;
+      dev->model = be_list[i]->model;
+      dev->type = be_list[i]->type;
+
+      devlist[devlist_len++] = dev;
+    }
+  return SANE_STATUS_GOOD;
+}
+
+/* initialize backend BE if needed and ask it for its devices */
+static SANE_Status
+probe_backend (struct backend *be, SANE_Bool local_only,
+	       const SANE_Device ***be_list, double *init_time,
+	       double *probe_time)
+{
+  SANE_Status status;
+  double start;
+
+  *be_list = NULL;
+  *init_time = 0;
+  *probe_time = 0;
+
+  if (!be->inited)
+    {
+      start = dll_now ();
+      status = init (be);
+      *init_time = dll_now () - start;
+      if (status != SANE_STATUS_GOOD)
+	return status;
+    }
+
+  start = dll_now ();
+  status = (*(op_get_devs_t)be->op[OP_GET_DEVS]) (be_list, local_only);
+  *probe_time = dll_now () - start;
+  return status;
+}
+
+static SANE_Status
+merge_devices (struct backend *be, SANE_Status status,
+	       const SANE_Device **be_list, double init_time,
+	       double probe_time)
+{
+  DBG (3, "sane_get_devices: backend `%s': init %.3f s, get_devices %.3f s"
+       " (%s)\n", be->name, init_time, probe_time, sane_strstatus (status));
+
+  if (status != SANE_STATUS_GOOD || !be_list)
+    return SANE_STATUS_GOOD;
+
+  return add_devices (be, be_list);
+}
+
+static SANE_Status
+get_devices_serial (SANE_Bool local_only)
+{
+  const SANE_Device **be_list;
+  struct backend *be;
+  SANE_Status status;
+  double init_time, probe_time;
 
   for (be = first_backend; be; be = be->next)
     {
-      if (!be->inited)
-	if (init (be) != SANE_STATUS_GOOD)
+      if (backend_busy (be))
+	{
+	  DBG (1, "sane_get_devices: backend `%s' is still busy, skipping\n",
+	       be->name);
 	  continue;
+	}
 
-      status = (*(op_get_devs_t)be->op[OP_GET_DEVS]) (&be_list, local_only);
-      if (status != SANE_STATUS_GOOD || !be_list)
-	continue;
+      status = probe_backend (be, local_only, &be_list, &init_time,
+			      &probe_time);
+      status = merge_devices (be, status, be_list, init_time, probe_time);
+      if (status != SANE_STATUS_GOOD)
+	return status;
+    }
+  return SANE_STATUS_GOOD;
+}
+
+#ifdef DLL_USE_THREADS
+
+struct probe_job
+{
+  struct backend *be;
+  SANE_Status status;
+  const SANE_Device **be_list;
+  double start;
+  double init_time;
+  double probe_time;
+  u_int local:1;		/* must be probed by the calling thread */
+  u_int started:1;
+  u_int done:1;
+  u_int abandoned:1;		/* exceeded probe_timeout */
+};
+
+/* Shared between sane_get_devices() and its worker threads, freed by
+   whoever drops the last reference.  Protected by probe_lock.  */
+struct probe_pool
+{
+  struct probe_job *jobs;
+  int num_jobs;
+  int next_job;
+  int refs;
+  SANE_Bool local_only;
+};
+
+static void
+pool_unref (struct probe_pool *pool)
+{
+  if (--pool->refs == 0)
+    {
+      free (pool->jobs);
+      free (pool);
+    }
+}
+
+/* returns the next job for a worker thread, called with probe_lock held */
+static struct probe_job *
+pool_next_job (struct probe_pool *pool)
+{
+  while (pool->next_job < pool->num_jobs
+	 && pool->jobs[pool->next_job].local)
+    pool->next_job++;
 
-      /* count the number of devices for this backend: */
-      for (num_devs = 0; be_list[num_devs]; ++num_devs);
+  if (pool->next_job >= pool->num_jobs)
+    return NULL;
 
-      ASSERT_SPACE (num_devs);
+  return &pool->jobs[pool->next_job++];
+}
+
+static void
+run_job (struct probe_pool *pool, struct probe_job *job)
+{
+  const SANE_Device **be_list;
+  double init_time, probe_time;
+  SANE_Status status;
+
+  job->started = 1;
+  job->start = dll_now ();
+  pthread_mutex_unlock (&probe_lock);
+
+  status = probe_backend (job->be, pool->local_only, &be_list, &init_time,
+			  &probe_time);
+
+  pthread_mutex_lock (&probe_lock);
+  job->status = status;
+  job->be_list = be_list;
+  job->init_time = init_time;
+  job->probe_time = probe_time;
+  job->done = 1;
+  job->be->busy = 0;
+  pthread_cond_broadcast (&probe_cond);
+}
 
-      for (i = 0; i < num_devs; ++i)
+static void *
+probe_worker (void *arg)
+{
+  struct probe_pool *pool = arg;
+  struct probe_job *job;
+
+  pthread_mutex_lock (&probe_lock);
+  while ((job = pool_next_job (pool)) != NULL)
+    {
+      run_job (pool, job);
+      /* sane_get_devices() has started a replacement for us */
+      if (job->abandoned)
 	{
-	  SANE_Device *dev;
-	  char *mem;
-	  struct alias *alias;
+	  DBG (2, "probe_worker: backend `%s' finished after %.3f s\n",
+	       job->be->name, job->init_time + job->probe_time);
+	  break;
+	}
+    }
+  pool_unref (pool);
+  pthread_mutex_unlock (&probe_lock);
+  return NULL;
+}
 
-	  for (alias = first_alias; alias != NULL; alias = alias->next)
-	    {
-	      len = strlen (be->name);
-	      if (strlen (alias->oldname) <= len)
-		continue;
-	      if (strncmp (alias->oldname, be->name, len) == 0
-		  && alias->oldname[len] == ':'
-		  && strcmp (&alias->oldname[len + 1], be_list[i]->name) == 0)
-		break;
-	    }
+/* start a detached worker, called with probe_lock held */
+static SANE_Status
+start_worker (struct probe_pool *pool)
+{
+  pthread_attr_t attr;
+  pthread_t thread;
+  int rc;
+
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+  rc = pthread_create (&thread, &attr, probe_worker, pool);
+  pthread_attr_destroy (&attr);
+  if (rc != 0)
+    {
+      DBG (1, "start_worker: pthread_create failed: %s\n", strerror (rc));
+      return SANE_STATUS_NO_MEM;
+    }
+  pool->refs++;
+  return SANE_STATUS_GOOD;
+}
 
-	  if (alias)
-	    {
-	      if (!alias->newname)	/* hidden device */
-		continue;
+static SANE_Status
+get_devices_parallel (SANE_Bool local_only)
+{
+  struct probe_pool *pool;
+  struct probe_job *job;
+  struct backend *be;
+  SANE_Status status = SANE_STATUS_GOOD;
+  double now, wakeup;
+  int i, n, threads, pending, help = 0;
 
-	      len = strlen (alias->newname);
-	      mem = malloc (sizeof (*dev) + len + 1);
-	      if (!mem)
-		return SANE_STATUS_NO_MEM;
+  pool = calloc (1, sizeof (*pool));
+  if (!pool)
+    return SANE_STATUS_NO_MEM;
 
-	      full_name = mem + sizeof (*dev);
-	      strcpy (full_name, alias->newname);
-	    }
-	  else
+  for (n = 0, be = first_backend; be; be = be->next)
+    n++;
+  pool->jobs = calloc (n ? n : 1, sizeof (pool->jobs[0]));
+  if (!pool->jobs)
+    {
+      free (pool);
+      return SANE_STATUS_NO_MEM;
+    }
+  pool->local_only = local_only;
+  pool->refs = 1;
+
+  pthread_mutex_lock (&probe_lock);
+
+  threads = 0;
+  for (be = first_backend; be; be = be->next)
+    {
+      if (be->busy)
+	{
+	  DBG (1, "sane_get_devices: backend `%s' is still busy, skipping\n",
+	       be->name);
+	  continue;
+	}
+      job = &pool->jobs[pool->num_jobs++];
+      job->be = be;
+      be->busy = 1;
+      /* preloaded backends share one copy of the sanei code, which is
+	 not thread-safe, so keep them on this thread */
+      if (be->permanent)
+	job->local = 1;
+      else
+	threads++;
+    }
+
+  if (threads > probe_threads)
+    threads = probe_threads;
+  for (i = 0; i < threads; ++i)
+    if (start_worker (pool) != SANE_STATUS_GOOD)
+      break;
+  DBG (3, "sane_get_devices: probing %d backends on %d threads\n",
+       pool->num_jobs, i);
+  /* do the work ourselves if no worker could be started */
+  if (i == 0)
+    help = 1;
+
+  for (i = 0; i < pool->num_jobs; ++i)
+    {
+      job = &pool->jobs[i];
+      if (!job->local)
+	continue;
+      run_job (pool, job);
+    }
+
+  for (;;)
+    {
+      now = dll_now ();
+      wakeup = now + 1.0;
+      pending = 0;
+      for (i = 0; i < pool->num_jobs; ++i)
+	{
+	  job = &pool->jobs[i];
+	  if (job->done || job->abandoned)
+	    continue;
+	  if (probe_timeout > 0 && job->started)
 	    {
-	      /* create a new device entry with a device name that is the
-	         sum of the backend name a colon and the backend's device
-	         name: */
-	      len = strlen (be->name) + 1 + strlen (be_list[i]->name);
-	      mem = malloc (sizeof (*dev) + len + 1);
-	      if (!mem)
-		return SANE_STATUS_NO_MEM;
-
-	      full_name = mem + sizeof (*dev);
-	      strcpy (full_name, be->name);
-	      strcat (full_name, ":");
-	      strcat (full_name, be_list[i]->name);
+	      if (now - job->start >= probe_timeout)
+		{
+		  DBG (1, "sane_get_devices: backend `%s' did not answer "
+		       "within %d s, skipping it\n", job->be->name,
+		       probe_timeout);
+		  job->abandoned = 1;
+		  /* the thread is stuck with this backend */
+		  if (pool->next_job < pool->num_jobs
+		      && start_worker (pool) != SANE_STATUS_GOOD)
+		    help = 1;
+		  continue;
+		}
+	      if (job->start + probe_timeout < wakeup)
+		wakeup = job->start + probe_timeout;
 	    }
+	  pending++;
+	}
+      if (!pending)
+	break;
+
+      if (help)
+	{
+	  while ((job = pool_next_job (pool)) != NULL)
+	    run_job (pool, job);
+	  help = 0;
+	  continue;
+	}
+
+      if (probe_timeout > 0)
+	probe_cond_wait (wakeup - now);
+      else
+	pthread_cond_wait (&probe_cond, &probe_lock);
+    }
+
+  /* merge in configuration order */
+  for (i = 0; i < pool->num_jobs && status == SANE_STATUS_GOOD; ++i)
+    {
+      job = &pool->jobs[i];
+      if (job->abandoned)
+	continue;
+      status = merge_devices (job->be, job->status, job->be_list,
+			      job->init_time, job->probe_time);
+    }
+
+  pool_unref (pool);
+  pthread_mutex_unlock (&probe_lock);
+  return status;
+}
+
+#endif /* DLL_USE_THREADS */
+
+/*
+ * Device cache: the result of the last sane_get_devices() is stored on
+ * disk so that sane_open() can find the backend of a device without
+ * loading all backends.  The cache is only trusted if the list of
+ * configured backends hasn't changed since it was written.
+ */
+#define DLL_CACHE_FILE "dll-devices.cache"
+
+static char *
+cache_path (void)
+{
+  const char *env;
+  char path[PATH_MAX];
+
+  env = getenv ("SANE_DLL_CACHE");
+  if (env)
+    return env[0] ? strdup (env) : NULL;
+
+  env = getenv ("HOME");
+  if (!env)
+    return NULL;
+
+  snprintf (path, sizeof (path), "%s/.sane/%s", env, DLL_CACHE_FILE);
+  return strdup (path);
+}
+
+/* the configured backends, used to validate the cache */
+static char *
+cache_signature (void)
+{
+  struct backend *be;
+  size_t len = 1;
+  char *sig;
+
+  for (be = first_backend; be; be = be->next)
+    len += strlen (be->name) + 1;
+
+  sig = malloc (len);
+  if (!sig)
+    return NULL;
+
+  sig[0] = '\0';
+  for (be = first_backend; be; be = be->next)
+    {
+      strcat (sig, be->name);
+      if (be->next)
+	strcat (sig, " ");
+    }
+  return sig;
+}
+
+static SANE_Status
+cache_write (FILE *fp, void *data)
+{
+  const char *sig = data;
+  int i;
+
+  fprintf (fp, "# SANE dll device cache, generated automatically\n");
+  fprintf (fp, "backends %s\n", sig);
+  for (i = 0; i < devlist_len && devlist[i]; ++i)
+    fprintf (fp, "device %s\n", devlist[i]->name);
+  return SANE_STATUS_GOOD;
+}
+
+static void
+cache_save (void)
+{
+  char *path, *sig;
+
+  path = cache_path ();
+  if (!path)
+    return;
+
+  sig = cache_signature ();
+  if (sig && sanei_config_write_file (path, cache_write, sig)
+      == SANE_STATUS_GOOD)
+    DBG (4, "cache_save: device list is stored in `%s'\n", path);
+
+  free (sig);
+  free (path);
+}
+
+/* Look up NAME, a device name without a backend prefix, in the device
+   cache.  The empty name, the first available device, is the first
+   device of the last listing.  Returns a malloc'ed full device name or
+   NULL.  */
+static char *
+cache_lookup (const char *name)
+{
+  char line[PATH_MAX], *path, *sig, *dev, *colon, *found = NULL;
+  struct backend *be;
+  FILE *fp;
+  size_t len;
+
+  if (strchr (name, ':'))
+    return NULL;
+  for (be = first_backend; be; be = be->next)
+    if (strcmp (be->name, name) == 0)
+      return NULL;
+
+  path = cache_path ();
+  if (!path)
+    return NULL;
+
+  fp = fopen (path, "r");
+  free (path);
+  if (!fp)
+    return NULL;
 
-	  dev = (SANE_Device *) mem;
-	  dev->name = full_name;
-	  dev->vendor = be_list[i]->vendor;
-	  dev->model = be_list[i]->model;
-	  dev->type = be_list[i]->type;
+  sig = cache_signature ();
+  if (!sig)
+    {
+      fclose (fp);
+      return NULL;
+    }
 
-	  devlist[devlist_len++] = dev;
+  while (!found && fgets (line, sizeof (line), fp))
+    {
+      len = strlen (line);
+      if (len && line[len - 1] == '\n')
+	line[--len] = '\0';
+
+      if (strncmp (line, "backends ", 9) == 0)
+	{
+	  if (strcmp (line + 9, sig) != 0)
+	    {
+	      DBG (3, "cache_lookup: configuration has changed, ignoring "
+		   "cache\n");
+	      break;
+	    }
+	  continue;
 	}
+      if (strncmp (line, "device ", 7) != 0)
+	continue;
+
+      dev = line + 7;
+      colon = strchr (dev, ':');
+      if (colon && (name[0] == '\0' || strcmp (colon + 1, name) == 0))
+	found = strdup (dev);
     }
 
+  fclose (fp);
+  free (sig);
+  return found;
+}
+
+/* Note that a call to get_devices() implies that we'll have to load
+   all backends.  To avoid this, you can call sane_open() directly
+   (assuming you know the name of the backend/device).  This is
+   appropriate for the command-line interface of SANE, for example.
+ */
+SANE_Status
+sane_get_devices (const SANE_Device *** device_list, SANE_Bool local_only)
+{
+  SANE_Status status;
+  double start;
+  int i;
+
+  DBG (3, "sane_get_devices\n");
+
+  if (devlist)
+    for (i = 0; i < devlist_len; ++i)
+      free ((void *) devlist[i]);
+  devlist_len = 0;
+
+  start = dll_now ();
+#ifdef DLL_USE_THREADS
+  if (probe_threads > 1)
+    status = get_devices_parallel (local_only);
+  else
+#endif
+    status = get_devices_serial (local_only);
+  if (status != SANE_STATUS_GOOD)
+    return status;
+
   /* terminate device list with NULL entry: */
   ASSERT_SPACE (1);
   devlist[devlist_len++] = 0;
 
   *device_list = (const SANE_Device **) devlist;
-  DBG (3, "sane_get_devices: found %d devices\n", devlist_len - 1);
+  DBG (3, "sane_get_devices: found %d devices in %.3f s\n", devlist_len - 1,
+       dll_now () - start);
+
+  cache_save ();
   return SANE_STATUS_GOOD;
 }
 
-SANE_Status
-sane_open (SANE_String_Const full_name, SANE_Handle * meta_handle)
+static SANE_Status
+open_device (SANE_String_Const full_name, SANE_Handle * meta_handle)
 {
   char *be_name;
   const char *dev_name;
@@ -1284,6 +1936,10 @@ sane_open (SANE_String_Const full_name, SANE_Handle * meta_handle)
     }
   free(be_name);
 
+  status = wait_for_backend (be);
+  if (status != SANE_STATUS_GOOD)
+    return status;
+
   if (!be->inited)
     {
       status = init (be);
@@ -1307,6 +1963,31 @@ sane_open (SANE_String_Const full_name, SANE_Handle * meta_handle)
   return SANE_STATUS_GOOD;
 }
 
+SANE_Status
+sane_open (SANE_String_Const full_name, SANE_Handle * meta_handle)
+{
+  SANE_Status status;
+  char *cached;
+
+  if (!full_name)
+    full_name = "";
+
+  cached = cache_lookup (full_name);
+  if (cached)
+    {
+      DBG (3, "sane_open: device cache maps `%s' to `%s'\n", full_name,
+	   cached);
+      status = open_device (cached, meta_handle);
+      free (cached);
+      if (status == SANE_STATUS_GOOD)
+	return status;
+      DBG (2, "sane_open: cached device failed (%s), trying `%s'\n",
+	   sane_strstatus (status), full_name);
+    }
+
+  return open_device (full_name, meta_handle);
+}
+
 void
 sane_close (SANE_Handle handle)
 {
@@ -5202,7 +5202,8 @@ read_data_block (Epson_Scanner * s, EpsonDataRec * result)
 
       sleep (1);                /* wait one second for the next attempt */
 
-      DBG (1, "retrying ESC G - %d\n", ++(s->retry_count));
+      ++(s->retry_count);
+      DBG (1, "retrying ESC G - %d\n", s->retry_count);
 
       param[0] = ESC;
       param[1] = s->hw->cmd->start_scanning;
@@ -29,6 +29,10 @@
 
 #include <setjmp.h>
 
+#ifdef ESCL_USE_THREADS
+#include <pthread.h>
+#endif
+
 #include "../include/sane/saneopts.h"
 #include "../include/sane/sanei.h"
 #include "../include/sane/sanei_backend.h"
@@ -142,12 +146,17 @@ escl_free_handler(escl_sane_t *handler)
     if (handler == NULL)
         return;
 
+    /* the next page may still be received for this device */
+    if (handler->scanner)
+        escl_prefetch_abort(handler->scanner);
     escl_free_device(handler->device);
     free(handler);
 }
 
 SANE_Status escl_parse_name(SANE_String_Const name, ESCL_Device *device);
 
+static void escl_curl_share_free(void);
+
 static SANE_Status
 escl_check_and_add_device(ESCL_Device *current)
 {
@@ -207,10 +216,27 @@ escl_add_in_list(ESCL_Device *current)
 }
 
 /**
- * \fn SANE_Status escl_device_add(int port_nb, const char *model_name, char *ip_address, char *type)
+ * \fn int escl_device_tls(const char *ip_address, int port_nb, const char *type)
+ * \brief Function that checks whether the https service at 'ip_address' is
+ *        reachable with the TLS versions curl supports.
+ *
+ * \return 1 if it is, 0 otherwise (and for http services)
+ */
+int
+escl_device_tls(const char *ip_address, int port_nb, const char *type)
+{
+    char url_port[512] = { 0 };
+
+    snprintf(url_port, sizeof(url_port), "https://%s:%d", ip_address, port_nb);
+    return escl_is_tls(url_port, (char *)type);
+}
+
+/**
+ * \fn SANE_Status escl_device_add(int port_nb, const char *model_name, char *ip_address, char *type, int tls_version)
  * \brief Function that browses my list ('for' loop) and returns the "escl_add_in_list" function to
  *        adds all the element needed to my list :
  *        the port number, the model name, the ip address and the type of the url (http / https).
+ *        'tls_version' is the result of escl_device_tls() for this service.
  *
  * \return escl_add_in_list(current)
  */
@@ -220,16 +246,13 @@ escl_device_add(int port_nb,
                 char *ip_address,
                 const char *is,
                 const char *uuid,
-                char *type)
+                char *type,
+                int tls_version)
 {
     char tmp[PATH_MAX] = { 0 };
     char *model = NULL;
-    char url_port[512] = { 0 };
-    int tls_version = 0;
     ESCL_Device *current = NULL;
     DBG (10, "escl_device_add\n");
-    snprintf(url_port, sizeof(url_port), "https://%s:%d", ip_address, port_nb);
-    tls_version = escl_is_tls(url_port, type);
 
     for (current = list_devices_primary; current; current = current->next) {
 	if ((strcmp(current->ip_address, ip_address) == 0) ||
@@ -282,6 +305,29 @@ escl_device_add(int port_nb,
     return escl_add_in_list(current);
 }
 
+/**
+ * \fn void escl_device_remove(int port_nb, const char *ip_address)
+ * \brief Function that removes the device listening on 'ip_address' and
+ *        'port_nb' from my list, once its service has left the network.
+ */
+void
+escl_device_remove(int port_nb, const char *ip_address)
+{
+    ESCL_Device **prev, *current;
+
+    for (prev = &list_devices_primary; (current = *prev); ) {
+        if (current->port_nb == port_nb &&
+            !strcmp(current->ip_address, ip_address)) {
+            DBG (10, "escl_device_remove [%s:%d]\n", ip_address, port_nb);
+            *prev = current->next;
+            escl_free_device(current);
+            --num_devices;
+            continue;
+        }
+        prev = &current->next;
+    }
+}
+
 /**
  * \fn static inline size_t max_string_size(const SANE_String_Const strings[])
  * \brief Function that browses the string ('for' loop) and counts the number of character in the string.
@@ -457,6 +503,9 @@ sane_exit(void)
 	free (devlist);
     list_devices_primary = NULL;
     devlist = NULL;
+    escl_devices_free();
+    escl_capabilities_cache_free();
+    escl_curl_share_free();
     curl_global_cleanup();
 }
 
@@ -1306,6 +1355,8 @@ sane_cancel(SANE_Handle h)
       fclose(handler->scanner->tmp);
       handler->scanner->tmp = NULL;
     }
+    escl_decode_end(handler->scanner);
+    escl_prefetch_abort(handler->scanner);
     handler->scanner->work = SANE_FALSE;
     handler->cancel = SANE_TRUE;
     escl_scanner(handler->device, handler->scanner->scanJob, handler->result, SANE_TRUE);
@@ -1667,7 +1718,8 @@ sane_start(SANE_Handle h)
        if (status != SANE_STATUS_GOOD)
           return (status);
     }
-    else
+    /* the next page is already asked for, the feeder may look empty now */
+    else if (handler->scanner->prefetch == NULL)
     {
        SANE_Status job = SANE_STATUS_UNSUPPORTED;
        SANE_Status st = escl_status(handler->device,
@@ -1681,7 +1733,13 @@ sane_start(SANE_Handle h)
          return SANE_STATUS_NO_DOCS;
        }
     }
-    status = escl_scan(handler->scanner, handler->device, handler->scanner->scanJob, handler->result);
+    escl_decode_end(handler->scanner);
+    /* JPEG and PNG are decoded line by line while they are received */
+    if (!strcmp(handler->scanner->caps[handler->scanner->source].default_format, "image/jpeg") ||
+        !strcmp(handler->scanner->caps[handler->scanner->source].default_format, "image/png"))
+       status = escl_scan_stream(handler->scanner, handler->device, handler->scanner->scanJob, handler->result);
+    else
+       status = escl_scan(handler->scanner, handler->device, handler->scanner->scanJob, handler->result);
     if (status != SANE_STATUS_GOOD)
        return (status);
     if (!strcmp(handler->scanner->caps[handler->scanner->source].default_format, "image/jpeg"))
@@ -1779,7 +1837,16 @@ sane_read(SANE_Handle h, SANE_Byte *buf, SANE_Int maxlen, SANE_Int *len)
             return (status);
         handler->decompress_scan_data = SANE_TRUE;
     }
-    if (handler->scanner->img_data == NULL)
+    if (handler->scanner->decoder) {
+        status = escl_decode_read(handler->scanner, buf, maxlen, len);
+        if (status == SANE_STATUS_GOOD)
+            return (status);
+        escl_decode_end(handler->scanner);
+        handler->end_read = SANE_TRUE;
+        if (status != SANE_STATUS_EOF)
+            return (status);
+    }
+    else if (handler->scanner->img_data == NULL)
         return (SANE_STATUS_INVAL);
     if (!handler->end_read) {
         readbyte = min((handler->scanner->img_size - handler->scanner->img_read), maxlen);
@@ -1810,6 +1877,10 @@ sane_read(SANE_Handle h, SANE_Byte *buf, SANE_Int maxlen, SANE_Int *len)
           DBG(10, "eSCL : command returned status %s\n", sane_strstatus(st));
           if (_go_next_page(st, job) == SANE_STATUS_GOOD)
 	     next_page = SANE_TRUE;
+          /* the feeder goes on while the frontend writes this page */
+          if (next_page)
+             escl_prefetch_start(handler->scanner, handler->device,
+                                 handler->scanner->scanJob, handler->result);
           handler->scanner->work = SANE_TRUE;
           handler->ps.last_frame = !next_page;
         }
@@ -1830,6 +1901,98 @@ sane_set_io_mode(SANE_Handle __sane_unused__ handle, SANE_Bool __sane_unused__ n
     return (SANE_STATUS_UNSUPPORTED);
 }
 
+/* connections, TLS sessions and name lookups kept between the requests
+   sent to one device */
+typedef struct escl_share {
+    struct escl_share *next;
+    char *key;
+    CURLSH *share;
+} escl_share_t;
+
+static escl_share_t *list_shares = NULL;
+
+#ifdef ESCL_USE_THREADS
+/* the next ADF page is received by another thread (see escl_scan.c), which
+   looks up the device in this list too, but never uses its share: libcurl
+   doesn't support a connection cache that is used by several threads at
+   once */
+static pthread_mutex_t list_shares_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static CURLSH *
+escl_curl_share_find(const char *key)
+{
+    escl_share_t *current = NULL;
+
+    for (current = list_shares; current; current = current->next) {
+        if (!strcmp(current->key, key))
+            return (current->share);
+    }
+    current = (escl_share_t *)calloc(1, sizeof(escl_share_t));
+    if (current == NULL)
+        return (NULL);
+    current->key = strdup(key);
+    current->share = curl_share_init();
+    if (current->key == NULL || current->share == NULL) {
+        if (current->share)
+            curl_share_cleanup(current->share);
+        free(current->key);
+        free(current);
+        return (NULL);
+    }
+    curl_share_setopt(current->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(current->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+    curl_share_setopt(current->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+    DBG( 10, "escl_curl_share: new connection cache for %s\n", key);
+    current->next = list_shares;
+    list_shares = current;
+    return (current->share);
+}
+
+/**
+ * \fn static CURLSH *escl_curl_share(const char *key)
+ * \brief Finds the share handle of the device whose address is 'key', or
+ *        creates it.  Every request sent to the device goes through it, so
+ *        the connection is kept alive from one request to the next, and
+ *        from one job to the next.
+ *
+ * \return the share handle, NULL if it can't be created
+ */
+static CURLSH *
+escl_curl_share(const char *key)
+{
+    CURLSH *share = NULL;
+
+#ifdef ESCL_USE_THREADS
+    pthread_mutex_lock(&list_shares_lock);
+#endif
+    share = escl_curl_share_find(key);
+#ifdef ESCL_USE_THREADS
+    pthread_mutex_unlock(&list_shares_lock);
+#endif
+    return (share);
+}
+
+/**
+ * \fn void escl_curl_share_free(void)
+ * \brief Closes the connections kept alive.  No request may be in progress.
+ */
+static void
+escl_curl_share_free(void)
+{
+    escl_share_t *next = NULL;
+
+    while (list_shares != NULL) {
+        next = list_shares->next;
+        curl_share_cleanup(list_shares->share);
+        free(list_shares->key);
+        free(list_shares);
+        list_shares = next;
+    }
+}
+
 /**
  * \fn void escl_curl_url(CURL *handle, const ESCL_Device *device, SANE_String_Const path)
  * \brief Uses the device info in 'device' and the path from 'path' to construct
@@ -1841,6 +2004,7 @@ escl_curl_url(CURL *handle, const ESCL_Device *device, SANE_String_Const path)
 {
     int url_len;
     char *url;
+    CURLSH *share = NULL;
 
     url_len = snprintf(NULL, 0, "%s://%s:%d%s",
                        (device->https ? "https" : "http"), device->ip_address,
@@ -1853,6 +2017,22 @@ escl_curl_url(CURL *handle, const ESCL_Device *device, SANE_String_Const path)
 
     DBG( 10, "escl_curl_url: URL: %s\n", url );
     curl_easy_setopt(handle, CURLOPT_URL, url);
+    /* the connection cache is per device: address and local socket */
+    url[url_len - 1 - strlen(path)] = '\0';
+    if (device->unix_socket != NULL) {
+        char *key = NULL;
+
+        key = (char *)malloc(strlen(url) + strlen(device->unix_socket) + 2);
+        if (key != NULL) {
+            sprintf(key, "%s %s", url, device->unix_socket);
+            share = escl_curl_share(key);
+            free(key);
+        }
+    }
+    else
+        share = escl_curl_share(url);
+    if (share != NULL)
+        curl_easy_setopt(handle, CURLOPT_SHARE, share);
     free(url);
     DBG( 10, "Before use hack\n");
     if (device->hack) {
@@ -50,6 +50,10 @@
 
 #include <curl/curl.h>
 
+#if defined(HAVE_PTHREAD_H) && !defined(__BEOS__)
+# define ESCL_USE_THREADS
+#endif
+
 #ifndef BACKEND_NAME
 #define BACKEND_NAME escl
 #endif
@@ -152,6 +156,9 @@ typedef struct support
     int step;
 } support_t;
 
+struct escl_stream;
+struct escl_prefetch;
+
 typedef struct capabilities
 {
     caps_t caps[3];
@@ -164,6 +171,15 @@ typedef struct capabilities
     long img_size;
     long img_read;
     size_t real_read;
+    struct escl_stream *stream;
+    struct escl_prefetch *prefetch;
+    void *decoder;
+    SANE_Status (*decode_row)(struct capabilities *scanner, unsigned char *row);
+    void (*decode_end)(struct capabilities *scanner);
+    unsigned char *row;
+    int row_size;
+    int row_read;
+    int rows_left;
     SANE_Bool work;
     support_t *brightness;
     support_t *contrast;
@@ -221,12 +237,16 @@ enum
 #define MM_TO_PIXEL(millimeters, dpi) (SANE_Word)round(SANE_UNFIX(millimeters) * (dpi) / 25.4)
 
 ESCL_Device *escl_devices(SANE_Status *status);
+void escl_devices_free(void);
+int escl_device_tls(const char *ip_address, int port_nb, const char *type);
 SANE_Status escl_device_add(int port_nb,
                             const char *model_name,
                             char *ip_address,
                             const char *is,
                             const char *uuid,
-                            char *type);
+                            char *type,
+                            int tls_version);
+void escl_device_remove(int port_nb, const char *ip_address);
 
 SANE_Status escl_status(const ESCL_Device *device,
                         int source,
@@ -237,6 +257,8 @@ capabilities_t *escl_capabilities(ESCL_Device *device,
                                   char *blacklist,
                                   SANE_Status *status);
 
+void escl_capabilities_cache_free(void);
+
 char *escl_newjob(capabilities_t *scanner,
                   const ESCL_Device *device,
                   SANE_Status *status);
@@ -246,6 +268,33 @@ SANE_Status escl_scan(capabilities_t *scanner,
                       char *scanJob,
                       char *result);
 
+SANE_Status escl_scan_stream(capabilities_t *scanner,
+                             const ESCL_Device *device,
+                             char *scanJob,
+                             char *result);
+
+size_t escl_stream_read(capabilities_t *scanner,
+                        unsigned char *buf,
+                        size_t len);
+
+SANE_Status escl_stream_status(capabilities_t *scanner);
+
+void escl_stream_close(capabilities_t *scanner);
+
+SANE_Status escl_decode_read(capabilities_t *scanner,
+                             unsigned char *buf,
+                             int maxlen,
+                             int *len);
+
+void escl_decode_end(capabilities_t *scanner);
+
+void escl_prefetch_start(capabilities_t *scanner,
+                         const ESCL_Device *device,
+                         char *scanJob,
+                         char *result);
+
+void escl_prefetch_abort(capabilities_t *scanner);
+
 void escl_scanner(const ESCL_Device *device,
                   char *scanJob,
                   char *result,
@@ -268,6 +317,14 @@ unsigned char *escl_crop_surface(capabilities_t *scanner,
                                  int *width,
                                  int *height);
 
+void escl_crop_geometry(capabilities_t *scanner,
+                        int w,
+                        int h,
+                        int *x_off,
+                        int *y_off,
+                        int *width,
+                        int *height);
+
 // JPEG
 SANE_Status get_JPEG_data(capabilities_t *scanner,
                           int *width,
@@ -29,17 +29,37 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <libxml/parser.h>
 
 #include "../include/sane/saneopts.h"
 
+/* Time during which the capabilities received from a device are used
+   without asking it again, in seconds.  After that, they are asked again,
+   conditionally when the device gave them an ETag. */
+#define CAPABILITIES_TTL 60
+
 struct cap
 {
     char *memory;
     size_t size;
 };
 
+/* capabilities received from a device, kept from one 'sane_open' to the
+   next */
+struct cached_cap
+{
+    struct cached_cap *next;
+    char *key;
+    char *etag;
+    struct cap body;
+    struct cap header;
+    time_t date;
+};
+
+static struct cached_cap *list_caps = NULL;
+
 static size_t
 header_callback(void *str, size_t size, size_t nmemb, void *userp)
 {
@@ -524,6 +544,200 @@ _delete_pdf(capabilities_t *scanner)
     }
 }
 
+/**
+ * \fn static SANE_Bool cap_copy(struct cap *dst, const struct cap *src)
+ * \brief Replaces the content of 'dst' by a copy of the content of 'src'.
+ *
+ * \return SANE_TRUE if everything is OK, SANE_FALSE otherwise
+ */
+static SANE_Bool
+cap_copy(struct cap *dst, const struct cap *src)
+{
+    char *memory = malloc(src->size + 1);
+
+    if (memory == NULL)
+        return (SANE_FALSE);
+    memcpy(memory, src->memory, src->size);
+    memory[src->size] = 0;
+    free(dst->memory);
+    dst->memory = memory;
+    dst->size = src->size;
+    return (SANE_TRUE);
+}
+
+/**
+ * \fn static char *get_etag(const char *header)
+ * \brief Finds the value of the 'ETag' header in the headers received.
+ *
+ * \return the value (to free), NULL if there is none
+ */
+static char *
+get_etag(const char *header)
+{
+    const char *etag = NULL;
+    size_t len = 0;
+
+    if (header == NULL)
+        return (NULL);
+    etag = strcasestr(header, "\nETag:");
+    if (etag == NULL)
+        return (NULL);
+    etag += strlen("\nETag:");
+    while (*etag == ' ' || *etag == '\t')
+        etag++;
+    len = strcspn(etag, "\r\n");
+    if (len == 0)
+        return (NULL);
+    return (strndup(etag, len));
+}
+
+/**
+ * \fn static struct cached_cap *find_cached_cap(const char *key)
+ * \brief Finds the capabilities kept for the device whose address is 'key'.
+ *
+ * \return the capabilities, NULL if there are none
+ */
+static struct cached_cap *
+find_cached_cap(const char *key)
+{
+    struct cached_cap *cached = NULL;
+
+    for (cached = list_caps; cached; cached = cached->next) {
+        if (!strcmp(cached->key, key))
+            return (cached);
+    }
+    return (NULL);
+}
+
+/**
+ * \fn static void keep_cap(const char *key, const struct cap *body, const struct cap *header)
+ * \brief Keeps the capabilities received from the device whose address is
+ *        'key', for the next time it is opened.
+ */
+static void
+keep_cap(const char *key, const struct cap *body, const struct cap *header)
+{
+    struct cached_cap *cached = find_cached_cap(key);
+
+    if (cached == NULL) {
+        cached = (struct cached_cap *)calloc(1, sizeof(struct cached_cap));
+        if (cached == NULL)
+            return;
+        cached->key = strdup(key);
+        if (cached->key == NULL) {
+            free(cached);
+            return;
+        }
+        cached->next = list_caps;
+        list_caps = cached;
+    }
+    free(cached->etag);
+    cached->etag = get_etag(header->memory);
+    if (!cap_copy(&cached->body, body) || !cap_copy(&cached->header, header)) {
+        /* never used: it is too old */
+        cached->date = 0;
+        return;
+    }
+    cached->date = time(NULL);
+    DBG( 10, "Capabilities of %s kept (ETag %s)\n", key,
+         cached->etag ? cached->etag : "none");
+}
+
+/**
+ * \fn void escl_capabilities_cache_free(void)
+ * \brief Forgets the capabilities kept for all the devices.
+ *        This function is called in the 'sane_exit' function.
+ */
+void
+escl_capabilities_cache_free(void)
+{
+    struct cached_cap *next = NULL;
+
+    while (list_caps != NULL) {
+        next = list_caps->next;
+        free(list_caps->key);
+        free(list_caps->etag);
+        free(list_caps->body.memory);
+        free(list_caps->header.memory);
+        free(list_caps);
+        list_caps = next;
+    }
+}
+
+/**
+ * \fn static SANE_Status get_capabilities(ESCL_Device *device, struct cap *var, struct cap *header)
+ * \brief Receives the capabilities of the scanner in 'var', and the headers
+ *        of the answer in 'header'.  The ones received recently are used
+ *        again without a request, older ones are only received again if
+ *        they changed.
+ *
+ * \return SANE_STATUS_GOOD if everything is OK, SANE_STATUS_INVAL if the scanner didn't respond
+ */
+static SANE_Status
+get_capabilities(ESCL_Device *device, struct cap *var, struct cap *header)
+{
+    CURL *curl_handle = NULL;
+    struct curl_slist *headers = NULL;
+    struct curl_slist *hack = NULL;
+    struct cached_cap *cached = NULL;
+    const char *scanner_capabilities = "/eSCL/ScannerCapabilities";
+    char key[1024] = { 0 };
+    long answer = 0;
+
+    snprintf(key, sizeof(key), "%s://%s:%d %s",
+             (device->https ? "https" : "http"), device->ip_address,
+             device->port_nb, device->unix_socket ? device->unix_socket : "");
+    cached = find_cached_cap(key);
+    if (cached && cached->date &&
+        time(NULL) - cached->date < CAPABILITIES_TTL &&
+        cap_copy(var, &cached->body) && cap_copy(header, &cached->header)) {
+        DBG( 10, "Capabilities of %s used again\n", key);
+        return (SANE_STATUS_GOOD);
+    }
+    curl_handle = curl_easy_init();
+    if (curl_handle == NULL)
+        return (SANE_STATUS_NO_MEM);
+    escl_curl_url(curl_handle, device, scanner_capabilities);
+    if (cached && cached->date && cached->etag) {
+        char *if_none_match = NULL;
+
+        for (hack = device->hack; hack; hack = hack->next)
+            headers = curl_slist_append(headers, hack->data);
+        if_none_match = malloc(strlen("If-None-Match: ") + strlen(cached->etag) + 1);
+        if (if_none_match) {
+            sprintf(if_none_match, "If-None-Match: %s", cached->etag);
+            headers = curl_slist_append(headers, if_none_match);
+            free(if_none_match);
+        }
+        curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, headers);
+    }
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, memory_callback_c);
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)var);
+    curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, header_callback);
+    curl_easy_setopt(curl_handle, CURLOPT_HEADERDATA, (void *)header);
+    curl_easy_setopt(curl_handle, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl_handle, CURLOPT_MAXREDIRS, 3L);
+    CURLcode res = curl_easy_perform(curl_handle);
+    if (res == CURLE_OK)
+        DBG( 10, "Create NewJob : the scanner header responded : [%s]\n", header->memory);
+    if (res != CURLE_OK) {
+        DBG( 10, "The scanner didn't respond: %s\n", curl_easy_strerror(res));
+        curl_easy_cleanup(curl_handle);
+        curl_slist_free_all(headers);
+        return (SANE_STATUS_INVAL);
+    }
+    curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &answer);
+    curl_easy_cleanup(curl_handle);
+    curl_slist_free_all(headers);
+    if (answer == 304 && cached && cap_copy(var, &cached->body)) {
+        DBG( 10, "Capabilities of %s not modified\n", key);
+        cached->date = time(NULL);
+    }
+    else if (answer == 200)
+        keep_cap(key, var, header);
+    return (SANE_STATUS_GOOD);
+}
+
 /**
  * \fn capabilities_t *escl_capabilities(const ESCL_Device *device, SANE_Status *status)
  * \brief Function that finally recovers all the capabilities of the scanner, using curl.
@@ -536,13 +750,11 @@ capabilities_t *
 escl_capabilities(ESCL_Device *device, char *blacklist, SANE_Status *status)
 {
     capabilities_t *scanner = (capabilities_t*)calloc(1, sizeof(capabilities_t));
-    CURL *curl_handle = NULL;
     struct cap *var = NULL;
     struct cap *header = NULL;
     xmlDoc *data = NULL;
     xmlNode *node = NULL;
     int i = 0;
-    const char *scanner_capabilities = "/eSCL/ScannerCapabilities";
     SANE_Bool use_pdf = SANE_TRUE;
 
     *status = SANE_STATUS_GOOD;
@@ -558,22 +770,9 @@ escl_capabilities(ESCL_Device *device, char *blacklist, SANE_Status *status)
         *status = SANE_STATUS_NO_MEM;
     header->memory = malloc(1);
     header->size = 0;
-    curl_handle = curl_easy_init();
-    escl_curl_url(curl_handle, device, scanner_capabilities);
-    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, memory_callback_c);
-    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)var);
-    curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, header_callback);
-    curl_easy_setopt(curl_handle, CURLOPT_HEADERDATA, (void *)header);
-    curl_easy_setopt(curl_handle, CURLOPT_FOLLOWLOCATION, 1L);
-    curl_easy_setopt(curl_handle, CURLOPT_MAXREDIRS, 3L);
-    CURLcode res = curl_easy_perform(curl_handle);
-    if (res == CURLE_OK)
-        DBG( 10, "Create NewJob : the scanner header responded : [%s]\n", header->memory);
-    if (res != CURLE_OK) {
-        DBG( 10, "The scanner didn't respond: %s\n", curl_easy_strerror(res));
-        *status = SANE_STATUS_INVAL;
+    *status = get_capabilities(device, var, header);
+    if (*status != SANE_STATUS_GOOD)
         goto clean_data;
-    }
     DBG( 10, "XML Capabilities[\n%s\n]\n", var->memory);
     data = xmlReadMemory(var->memory, var->size, "file.xml", NULL, 0);
     if (data == NULL) {
@@ -622,7 +821,6 @@ clean:
 clean_data:
     xmlCleanupParser();
     xmlMemoryDump();
-    curl_easy_cleanup(curl_handle);
     if (header)
       free(header->memory);
     free(header);
@@ -28,23 +28,25 @@
 #include <stdlib.h>
 #include <string.h>
 
-unsigned char *
-escl_crop_surface(capabilities_t *scanner,
-               unsigned char *surface,
-	       int w,
-	       int h,
-	       int bps,
-	       int *width,
-	       int *height)
+/**
+ * \fn void escl_crop_geometry(capabilities_t *scanner, int w, int h, int *x_off, int *y_off, int *width, int *height)
+ * \brief Computes the part of a 'w' x 'h' image that is kept, from the
+ *        position and the size asked for the scan.
+ */
+void
+escl_crop_geometry(capabilities_t *scanner,
+               int w,
+               int h,
+               int *x_off,
+               int *y_off,
+               int *width,
+               int *height)
 {
     double ratio = 1.0;
-    int x_off = 0, x = 0;
-    int real_w = 0;
-    int y_off = 0, y = 0;
-    int real_h = 0;
-    unsigned char *surface_crop = NULL;
 
     DBG( 10, "Escl Image Crop\n");
+    *x_off = 0;
+    *y_off = 0;
     ratio = (double)w / (double)scanner->caps[scanner->source].width;
     scanner->caps[scanner->source].width = w;
     if (scanner->caps[scanner->source].pos_x < 0)
@@ -52,51 +54,57 @@ escl_crop_surface(capabilities_t *scanner,
     if (scanner->caps[scanner->source].pos_x &&
         (scanner->caps[scanner->source].width >
         scanner->caps[scanner->source].pos_x))
-       x_off = (int)((double)scanner->caps[scanner->source].pos_x * ratio);
-    real_w = scanner->caps[scanner->source].width - x_off;
+       *x_off = (int)((double)scanner->caps[scanner->source].pos_x * ratio);
+    *width = scanner->caps[scanner->source].width - *x_off;
 
     scanner->caps[scanner->source].height = h;
     if (scanner->caps[scanner->source].pos_y &&
         (scanner->caps[scanner->source].height >
         scanner->caps[scanner->source].pos_y))
-       y_off = (int)((double)scanner->caps[scanner->source].pos_y * ratio);
-    real_h = scanner->caps[scanner->source].height - y_off;
+       *y_off = (int)((double)scanner->caps[scanner->source].pos_y * ratio);
+    *height = scanner->caps[scanner->source].height - *y_off;
 
     DBG( 10, "Escl Image Crop [%dx%d|%dx%d]\n", scanner->caps[scanner->source].pos_x, scanner->caps[scanner->source].pos_y,
 		    scanner->caps[scanner->source].width, scanner->caps[scanner->source].height);
+}
+
+/**
+ * \fn unsigned char *escl_crop_surface(capabilities_t *scanner, unsigned char *surface, int w, int h, int bps, int *width, int *height)
+ * \brief Trims the decoded image in place: the lines kept are moved to the
+ *        front of 'surface', so no second image is allocated.
+ *
+ * \return the image, which becomes the data read by 'sane_read'
+ */
+unsigned char *
+escl_crop_surface(capabilities_t *scanner,
+               unsigned char *surface,
+	       int w,
+	       int h,
+	       int bps,
+	       int *width,
+	       int *height)
+{
+    int x_off = 0;
+    int real_w = 0;
+    int y_off = 0, y = 0;
+    int real_h = 0;
+
+    escl_crop_geometry(scanner, w, h, &x_off, &y_off, &real_w, &real_h);
 
     *width = real_w;
     *height = real_h;
     DBG( 10, "Escl Image Crop [%dx%d]\n", *width, *height);
-    if (x_off > 0 || real_w < scanner->caps[scanner->source].width ||
-        y_off > 0 || real_h < scanner->caps[scanner->source].height) {
-          surface_crop = (unsigned char *)malloc (sizeof (unsigned char) * real_w
-                     * real_h * bps);
-	  if(!surface_crop) {
-             DBG( 10, "Escl Crop : Surface_crop Memory allocation problem\n");
-	     free(surface);
-	     surface = NULL;
-	     goto finish;
-	  }
+    if (x_off > 0 || real_w < w || y_off > 0 || real_h < h) {
+          /* a line never moves past where it was, so the lines can be
+             moved one after the other */
           for (y = 0; y < real_h; y++)
-          {
-             for (x = 0; x < real_w; x++)
-             {
-                surface_crop[(y * real_w * bps) + (x * bps)] =
-                   surface[((y + y_off) * w  * bps) + ((x + x_off) * bps)];
-                surface_crop[(y * real_w * bps) + (x * bps) + 1] =
-	           surface[((y + y_off) * w  * bps) + ((x + x_off) * bps) + 1];
-	        surface_crop[(y * real_w * bps) + (x * bps) + 2] =
-	           surface[((y + y_off) * w  * bps) + ((x + x_off) * bps) + 2];
-             }
-          }
-          free(surface);
-	  surface = surface_crop;
+             memmove(surface + (size_t)y * real_w * bps,
+                     surface + ((size_t)(y + y_off) * w + x_off) * bps,
+                     (size_t)real_w * bps);
     }
     // we don't need row pointers anymore
     scanner->img_data = surface;
     scanner->img_size = (int)(real_w * real_h * bps);
     scanner->img_read = 0;
-finish:
     return surface;
 }
@@ -27,19 +27,293 @@
 #include "escl.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <arpa/inet.h>
+#include <sys/time.h>
 
 #include <avahi-client/lookup.h>
 #include <avahi-common/error.h>
+#include <avahi-common/malloc.h>
 #include <avahi-common/simple-watch.h>
+#ifdef ESCL_USE_THREADS
+#include <pthread.h>
+#include <avahi-common/thread-watch.h>
+#endif
 
 #include "../include/sane/sanei.h"
+#include "../include/sane/sanei_config.h"
+
+/* How long the first enumeration waits for the initial browse when
+   there is no cached device to return instead (in seconds). */
+#define ESCL_BROWSE_TIMEOUT 10
+
+#define ESCL_CACHE_FILE "escl-devices.cache"
+
+/*
+ * An eSCL service as announced over mDNS.  Resolved services are
+ * queued on 'pending' by the Avahi callbacks; escl_devices() moves them
+ * to 'known' and adds them to the device list.  'known' also holds the
+ * devices loaded from the cache file, and is what gets written back.
+ * Services that leave the network are queued on 'removed' (only the
+ * name, type, interface and protocol are set) and dropped from both.
+ */
+typedef struct escl_service
+{
+    struct escl_service *next;
+    char *name;
+    char *type;
+    char *ip;
+    char *is;
+    char *uuid;
+    int port;
+    int tls;
+    AvahiIfIndex interface;
+    AvahiProtocol protocol;
+    SANE_Bool seen;
+} escl_service_t;
 
+static escl_service_t *pending = NULL;
+static escl_service_t *removed = NULL;
+static escl_service_t *known = NULL;
+
+/* browse state, shared with the Avahi thread */
+static int browsing = 0;
+static int resolving = 0;
+static SANE_Bool browse_failed = SANE_FALSE;
+
+static SANE_Bool cache_loaded = SANE_FALSE;
+static SANE_Bool cache_dirty = SANE_FALSE;
+static SANE_Bool cache_pruned = SANE_FALSE;
+
+#ifdef ESCL_USE_THREADS
+static AvahiThreadedPoll *threaded_poll = NULL;
+static AvahiClient *browse_client = NULL;
+static SANE_Bool browse_waited = SANE_FALSE;
+static pthread_mutex_t browse_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t browse_cond = PTHREAD_COND_INITIALIZER;
+#else
 static AvahiSimplePoll *simple_poll = NULL;
-static int count_finish = 0;
+#endif
+
+static void
+browse_state_lock(void)
+{
+#ifdef ESCL_USE_THREADS
+    pthread_mutex_lock(&browse_lock);
+#endif
+}
+
+static void
+browse_state_unlock(void)
+{
+#ifdef ESCL_USE_THREADS
+    pthread_mutex_unlock(&browse_lock);
+#endif
+}
+
+/* Called with the state lock held. */
+static SANE_Bool
+browse_done(void)
+{
+    return (browse_failed || (browsing <= 0 && resolving <= 0));
+}
+
+/* Called with the state lock held after the browse state changed:
+   wakes up escl_devices(), or ends the poll loop when browsing
+   synchronously. */
+static void
+browse_update(void)
+{
+#ifdef ESCL_USE_THREADS
+    pthread_cond_broadcast(&browse_cond);
+#else
+    if (browse_done())
+        avahi_simple_poll_quit(simple_poll);
+#endif
+}
+
+static void
+service_free(escl_service_t *s)
+{
+    free(s->name);
+    free(s->type);
+    free(s->ip);
+    free(s->is);
+    free(s->uuid);
+    free(s);
+}
+
+static void
+service_list_free(escl_service_t *list)
+{
+    escl_service_t *next;
+
+    for (; list; list = next) {
+        next = list->next;
+        service_free(list);
+    }
+}
+
+static escl_service_t *
+service_new(int port, const char *name, const char *ip,
+            const char *is, const char *uuid, const char *type, int tls)
+{
+    escl_service_t *s = (escl_service_t*)calloc(1, sizeof(*s));
+
+    if (s == NULL)
+        return (NULL);
+    s->port = port;
+    s->tls = tls;
+    s->interface = AVAHI_IF_UNSPEC;
+    s->protocol = AVAHI_PROTO_UNSPEC;
+    s->name = strdup(name);
+    s->type = strdup(type);
+    s->ip = strdup(ip);
+    s->is = is ? strdup(is) : NULL;
+    s->uuid = uuid ? strdup(uuid) : NULL;
+    if (!s->name || !s->type || !s->ip ||
+        (is && !s->is) || (uuid && !s->uuid)) {
+        service_free(s);
+        return (NULL);
+    }
+    return (s);
+}
+
+static escl_service_t *
+service_find(const escl_service_t *s)
+{
+    escl_service_t *k;
+
+    for (k = known; k; k = k->next)
+        if (k->port == s->port && !strcmp(k->name, s->name) &&
+            !strcmp(k->type, s->type) && !strcmp(k->ip, s->ip))
+            return (k);
+    return (NULL);
+}
+
+/* Whether 's' is the announcement that 'r' (from 'removed') withdraws. */
+static SANE_Bool
+service_is_removed(const escl_service_t *s, const escl_service_t *r)
+{
+    return (s->interface == r->interface && s->protocol == r->protocol &&
+            !strcmp(s->name, r->name) && !strcmp(s->type, r->type));
+}
+
+static char *
+cache_path(void)
+{
+    const char *env;
+    char path[PATH_MAX];
+
+    env = getenv("SANE_ESCL_CACHE");
+    if (env)
+        return env[0] ? strdup(env) : NULL;
+
+    env = getenv("HOME");
+    if (!env)
+        return (NULL);
+
+    snprintf(path, sizeof(path), "%s/.sane/%s", env, ESCL_CACHE_FILE);
+    return strdup(path);
+}
+
+/**
+ * \fn static void escl_cache_load(void)
+ * \brief Function that reads the devices found by the last browse from
+ *        the cache file into the 'known' list.
+ *        Each line holds the type, port, TLS support, address, uuid, 'is'
+ *        and name of a service, separated by tabs.
+ */
+static void
+escl_cache_load(void)
+{
+    char line[PATH_MAX], *path, *f[7], *p;
+    escl_service_t *s;
+    FILE *fp;
+    size_t len;
+    int i;
+
+    path = cache_path();
+    if (!path)
+        return;
+    fp = fopen(path, "r");
+    free(path);
+    if (!fp)
+        return;
+
+    while (fgets(line, sizeof(line), fp)) {
+        len = strlen(line);
+        if (len && line[len - 1] == '\n')
+            line[--len] = '\0';
+        if (strncmp(line, "device ", 7) != 0)
+            continue;
+        p = line + 7;
+        for (i = 0; i < 7 && p; i++) {
+            f[i] = p;
+            p = strchr(p, '\t');
+            if (p)
+                *p++ = '\0';
+        }
+        if (i < 7 || p || !f[0][0] || !f[3][0] || !f[6][0])
+            continue;
+        s = service_new(atoi(f[1]), f[6], f[3], f[5][0] ? f[5] : NULL,
+                        f[4][0] ? f[4] : NULL, f[0], atoi(f[2]));
+        if (s == NULL || s->port <= 0) {
+            if (s)
+                service_free(s);
+            continue;
+        }
+        s->next = known;
+        known = s;
+    }
+    fclose(fp);
+}
+
+/* Writes the services seen by the browse, one per line. */
+static SANE_Status
+escl_cache_write(FILE *fp, void *data)
+{
+    escl_service_t *k;
+    int *count = data;
+
+    fprintf(fp, "# SANE escl device cache, generated automatically\n");
+    for (k = known; k; k = k->next) {
+        if (!k->seen || strpbrk(k->name, "\t\n") ||
+            (k->is && strpbrk(k->is, "\t\n")) ||
+            (k->uuid && strpbrk(k->uuid, "\t\n")))
+            continue;
+        fprintf(fp, "device %s\t%d\t%d\t%s\t%s\t%s\t%s\n", k->type, k->port,
+                k->tls, k->ip, k->uuid ? k->uuid : "", k->is ? k->is : "",
+                k->name);
+        (*count)++;
+    }
+    return (ferror(fp) ? SANE_STATUS_IO_ERROR : SANE_STATUS_GOOD);
+}
+
+/**
+ * \fn static void escl_cache_save(void)
+ * \brief Function that writes the services seen by the browse to the
+ *        cache file, so that the next process can list them at once.
+ */
+static void
+escl_cache_save(void)
+{
+    char *path;
+    int count = 0;
+
+    path = cache_path();
+    if (!path)
+        return;
+    if (sanei_config_write_file(path, escl_cache_write, &count) ==
+        SANE_STATUS_GOOD)
+        DBG(4, "escl_cache_save: stored %d devices in `%s'\n", count, path);
+    else
+        DBG(2, "escl_cache_save: can't write `%s'\n", path);
+    free(path);
+}
 
 /**
  * \fn static void resolve_callback(AvahiServiceResolver *r, AVAHI_GCC_UNUSED
@@ -50,10 +324,10 @@ static int count_finish = 0;
  *                            AvahiStringList *txt, AvahiLookupResultFlags flags,
  *                            void *userdata)
  * \brief Callback function that will check if the selected scanner follows the escl
- *  protocol or not.
+ *  protocol or not, and queues it for escl_devices() if it does.
  */
 static void
-resolve_callback(AvahiServiceResolver *r, AVAHI_GCC_UNUSED AvahiIfIndex interface,
+resolve_callback(AvahiServiceResolver *r, AvahiIfIndex interface,
                             AvahiProtocol protocol,
                             AvahiResolverEvent event,
                             const char *name,
@@ -66,11 +340,11 @@ resolve_callback(AvahiServiceResolver *r, AVAHI_GCC_UNUSED AvahiIfIndex interfac
                             AvahiLookupResultFlags __sane_unused__ flags,
                             void __sane_unused__ *userdata)
 {
-    char a[(AVAHI_ADDRESS_STR_MAX + 10)] = { 0 };
     char *t;
     const char *is;
     const char *uuid;
     AvahiStringList   *s;
+    escl_service_t *service = NULL;
     assert(r);
     switch (event) {
         case AVAHI_RESOLVER_FAILURE:
@@ -93,7 +367,7 @@ resolve_callback(AvahiServiceResolver *r, AVAHI_GCC_UNUSED AvahiIfIndex interfac
 		   break;
 	    }
             t = avahi_string_list_to_string(txt);
-            if (strstr(t, "\"rs=eSCL\"") || strstr(t, "\"rs=/eSCL\"")) {
+            if (t && (strstr(t, "\"rs=eSCL\"") || strstr(t, "\"rs=/eSCL\""))) {
 	        s = avahi_string_list_find(txt, "is");
 	        if (s && s->size > 3)
 	            is = (const char*)s->text + 3;
@@ -104,16 +378,64 @@ resolve_callback(AvahiServiceResolver *r, AVAHI_GCC_UNUSED AvahiIfIndex interfac
 	            uuid = (const char*)s->text + 5;
 	        else
 	            uuid = (const char*)NULL;
-                DBG (10, "resolve_callback [%s]\n", a);
+                DBG (10, "resolve_callback [%s]\n", psz_addr);
                 if (strstr(psz_addr, "127.0.0.1") != NULL) {
-                    escl_device_add(port, name, "localhost", is, uuid, (char*)type);
+                    service = service_new(port, name, "localhost", is, uuid, type, -1);
                     DBG (10,"resolve_callback fix redirect [localhost]\n");
                 }
                 else
-                    escl_device_add(port, name, psz_addr, is, uuid, (char*)type);
+                    service = service_new(port, name, psz_addr, is, uuid, type, -1);
             }
+            avahi_free(t);
+            free(psz_addr);
 	}
     }
+    avahi_service_resolver_free(r);
+
+    browse_state_lock();
+    if (service) {
+        service->interface = interface;
+        service->protocol = protocol;
+        service->next = pending;
+        pending = service;
+    }
+    resolving--;
+    browse_update();
+    browse_state_unlock();
+}
+
+/**
+ * \fn static void browse_service_removed(AvahiIfIndex interface,
+ * AvahiProtocol protocol, const char *name, const char *type)
+ * \brief Function that forgets a service that left the network before
+ *        escl_devices() picked it up, and queues its removal from the
+ *        device list otherwise.
+ */
+static void
+browse_service_removed(AvahiIfIndex interface, AvahiProtocol protocol,
+                       const char *name, const char *type)
+{
+    escl_service_t *r, *s, **prev;
+
+    DBG (10, "browse_callback remove [%s]\n", name);
+    r = service_new(0, name, "", NULL, NULL, type, 0);
+    if (r == NULL)
+        return;
+    r->interface = interface;
+    r->protocol = protocol;
+
+    browse_state_lock();
+    for (prev = &pending; (s = *prev); ) {
+        if (service_is_removed(s, r)) {
+            *prev = s->next;
+            service_free(s);
+            continue;
+        }
+        prev = &s->next;
+    }
+    r->next = removed;
+    removed = r;
+    browse_state_unlock();
 }
 
 /**
@@ -136,24 +458,35 @@ browse_callback(AvahiServiceBrowser *b, AvahiIfIndex interface,
     assert(b);
     switch (event) {
     case AVAHI_BROWSER_FAILURE:
-        avahi_simple_poll_quit(simple_poll);
+        browse_state_lock();
+        browse_failed = SANE_TRUE;
+        browse_update();
+        browse_state_unlock();
         return;
     case AVAHI_BROWSER_NEW:
+        browse_state_lock();
+        resolving++;
+        browse_state_unlock();
         if (!(avahi_service_resolver_new(c, interface, protocol, name,
                                                                type, domain,
                                                                AVAHI_PROTO_UNSPEC, 0,
-                                                               resolve_callback, c)))
-            break;
+                                                               resolve_callback, c))) {
+            browse_state_lock();
+            resolving--;
+            browse_update();
+            browse_state_unlock();
+        }
+        break;
     case AVAHI_BROWSER_REMOVE:
+        browse_service_removed(interface, protocol, name, type);
         break;
     case AVAHI_BROWSER_ALL_FOR_NOW:
+        browse_state_lock();
+        browsing--;
+        browse_update();
+        browse_state_unlock();
+        break;
     case AVAHI_BROWSER_CACHE_EXHAUSTED:
-        if (event != AVAHI_BROWSER_CACHE_EXHAUSTED)
-           {
-		count_finish++;
-		if (count_finish == 2)
-            		avahi_simple_poll_quit(simple_poll);
-	   }
         break;
     }
 }
@@ -170,14 +503,143 @@ client_callback(AvahiClient *c, AvahiClientState state,
                          AVAHI_GCC_UNUSED void *userdata)
 {
     assert(c);
-    if (state == AVAHI_CLIENT_FAILURE)
-        avahi_simple_poll_quit(simple_poll);
+    if (state == AVAHI_CLIENT_FAILURE) {
+        browse_state_lock();
+        browse_failed = SANE_TRUE;
+        browse_update();
+        browse_state_unlock();
+    }
 }
 
+/**
+ * \fn static SANE_Status escl_browse_start(const AvahiPoll *poll, AvahiClient **client)
+ * \brief Function that creates the Avahi client and the browsers for the
+ *        "_uscan._tcp" and "_uscans._tcp" services on 'poll'.
+ *        The browsers belong to the client and go away with it.
+ *
+ * \return SANE_STATUS_GOOD if the browse is running, SANE_STATUS_INVAL otherwise.
+ */
+static SANE_Status
+escl_browse_start(const AvahiPoll *poll, AvahiClient **client)
+{
+    int error;
+
+    browse_state_lock();
+    browsing = 2;
+    resolving = 0;
+    browse_failed = SANE_FALSE;
+    browse_state_unlock();
+
+    *client = avahi_client_new(poll, 0, client_callback, NULL, &error);
+    if (!*client) {
+        DBG( 10, "Failed to create client: %s\n", avahi_strerror(error));
+        return (SANE_STATUS_INVAL);
+    }
+    if (!avahi_service_browser_new(*client, AVAHI_IF_UNSPEC,
+                                   AVAHI_PROTO_UNSPEC, "_uscan._tcp",
+                                   NULL, 0, browse_callback, *client) ||
+        !avahi_service_browser_new(*client, AVAHI_IF_UNSPEC,
+                                   AVAHI_PROTO_UNSPEC, "_uscans._tcp",
+                                   NULL, 0, browse_callback, *client)) {
+        DBG( 10, "Failed to create service browser: %s\n",
+                              avahi_strerror(avahi_client_errno(*client)));
+        avahi_client_free(*client);
+        *client = NULL;
+        return (SANE_STATUS_INVAL);
+    }
+    return (SANE_STATUS_GOOD);
+}
+
+#ifdef ESCL_USE_THREADS
+/**
+ * \fn static SANE_Status escl_browse(void)
+ * \brief Function that starts the background browse on the first call ;
+ *        the Avahi thread then keeps running until escl_devices_free().
+ *        When there is no cached device to return, the first call waits
+ *        (at most ESCL_BROWSE_TIMEOUT seconds) for the initial browse.
+ *
+ * \return SANE_STATUS_GOOD if the browse is running.
+ */
+static SANE_Status
+escl_browse(void)
+{
+    struct timeval now;
+    struct timespec deadline;
+    SANE_Status status;
+
+    if (!threaded_poll) {
+        if (!(threaded_poll = avahi_threaded_poll_new())) {
+            DBG( 10, "Failed to create threaded poll object.\n");
+            return (SANE_STATUS_INVAL);
+        }
+        status = escl_browse_start(avahi_threaded_poll_get(threaded_poll),
+                                   &browse_client);
+        if (status == SANE_STATUS_GOOD &&
+            avahi_threaded_poll_start(threaded_poll) < 0) {
+            DBG( 10, "Failed to start the browse thread.\n");
+            avahi_client_free(browse_client);
+            browse_client = NULL;
+            status = SANE_STATUS_INVAL;
+        }
+        if (status != SANE_STATUS_GOOD) {
+            avahi_threaded_poll_free(threaded_poll);
+            threaded_poll = NULL;
+            return (status);
+        }
+    }
+
+    if (browse_waited || known)
+        return (SANE_STATUS_GOOD);
+    browse_waited = SANE_TRUE;
+
+    gettimeofday(&now, NULL);
+    deadline.tv_sec = now.tv_sec + ESCL_BROWSE_TIMEOUT;
+    deadline.tv_nsec = now.tv_usec * 1000;
+    pthread_mutex_lock(&browse_lock);
+    while (!browse_done())
+        if (pthread_cond_timedwait(&browse_cond, &browse_lock,
+                                   &deadline) == ETIMEDOUT) {
+            DBG( 10, "Browse not finished after %d s.\n", ESCL_BROWSE_TIMEOUT);
+            break;
+        }
+    pthread_mutex_unlock(&browse_lock);
+    return (SANE_STATUS_GOOD);
+}
+#else
+/**
+ * \fn static SANE_Status escl_browse(void)
+ * \brief Function that runs a complete browse ; without threads there is
+ *        nothing to keep it running in the background.
+ *
+ * \return SANE_STATUS_GOOD if the browse could run.
+ */
+static SANE_Status
+escl_browse(void)
+{
+    AvahiClient *client = NULL;
+    SANE_Status status;
+
+    if (!(simple_poll = avahi_simple_poll_new())) {
+        DBG( 10, "Failed to create simple poll object.\n");
+        return (SANE_STATUS_INVAL);
+    }
+    status = escl_browse_start(avahi_simple_poll_get(simple_poll), &client);
+    if (status == SANE_STATUS_GOOD) {
+        avahi_simple_poll_loop(simple_poll);
+        avahi_client_free(client);
+    }
+    avahi_simple_poll_free(simple_poll);
+    simple_poll = NULL;
+    return (status);
+}
+#endif
+
 /**
  * \fn ESCL_Device *escl_devices(SANE_Status *status)
- * \brief Function that calls all the avahi functions and then, recovers the
- * connected eSCL devices.
+ * \brief Function that recovers the connected eSCL devices.
+ *        The first call lists the devices of the cache file and starts
+ *        the browse ; every call then adds the services resolved since the
+ *        previous one, so it doesn't wait for the network.
  *        This function is called in the 'sane_get_devices' function.
  *
  * \return NULL (the eSCL devices found)
@@ -185,49 +647,124 @@ client_callback(AvahiClient *c, AvahiClientState state,
 ESCL_Device *
 escl_devices(SANE_Status *status)
 {
-    AvahiClient *client = NULL;
-    AvahiServiceBrowser *sb = NULL;
-    int error;
+    escl_service_t *list, *gone, *s, *k, *next, **prev;
+    SANE_Bool done, failed, dropped = SANE_FALSE;
 
-    count_finish = 0;
+    if (!cache_loaded) {
+        cache_loaded = SANE_TRUE;
+        escl_cache_load();
+#ifdef ESCL_USE_THREADS
+        for (k = known; k; k = k->next)
+            escl_device_add(k->port, k->name, k->ip, k->is, k->uuid,
+                            k->type, k->tls);
+#endif
+    }
 
-    *status = SANE_STATUS_GOOD;
-    if (!(simple_poll = avahi_simple_poll_new())) {
-        DBG( 10, "Failed to create simple poll object.\n");
-        *status = SANE_STATUS_INVAL;
-        goto fail;
+    *status = escl_browse();
+
+    browse_state_lock();
+    list = pending;
+    pending = NULL;
+    gone = removed;
+    removed = NULL;
+    done = browse_done();
+    failed = browse_failed;
+    browse_state_unlock();
+
+    /* a service that left the network is dropped from the device list
+       and from the cache ; 'pending' only holds what was resolved after
+       the removal */
+    for (s = gone; s; s = next) {
+        next = s->next;
+        for (prev = &known; *prev; ) {
+            k = *prev;
+            if (!k->seen || !service_is_removed(k, s)) {
+                prev = &k->next;
+                continue;
+            }
+            escl_device_remove(k->port, k->ip);
+            *prev = k->next;
+            service_free(k);
+            cache_dirty = SANE_TRUE;
+            dropped = SANE_TRUE;
+        }
+        service_free(s);
     }
-    client = avahi_client_new(avahi_simple_poll_get(simple_poll), 0,
-                                               client_callback, NULL, &error);
-    if (!client) {
-        DBG( 10, "Failed to create client: %s\n", avahi_strerror(error));
-        *status = SANE_STATUS_INVAL;
-        goto fail;
+    /* escl_device_add() merges the http and https services of a device,
+       put back the ones that are still there */
+    if (dropped)
+        for (k = known; k; k = k->next)
+            escl_device_add(k->port, k->name, k->ip, k->is, k->uuid,
+                            k->type, k->tls);
+
+    for (s = list; s; s = next) {
+        next = s->next;
+        k = service_find(s);
+        if (k) {
+            k->interface = s->interface;
+            k->protocol = s->protocol;
+            service_free(s);
+        } else {
+            /* the TLS probe is a request to the device, only run it
+               for services that aren't known already */
+            s->tls = escl_device_tls(s->ip, s->port, s->type);
+            s->next = known;
+            known = s;
+            k = s;
+            cache_dirty = SANE_TRUE;
+        }
+        k->seen = SANE_TRUE;
+        escl_device_add(k->port, k->name, k->ip, k->is, k->uuid,
+                        k->type, k->tls);
+    }
+
+    if (done && !failed && !cache_pruned) {
+        /* cached devices that didn't answer this browse are dropped
+           from the cache, they stay listed until sane_exit() */
+        cache_pruned = SANE_TRUE;
+        for (prev = &known; *prev; ) {
+            k = *prev;
+            if (k->seen) {
+                prev = &k->next;
+                continue;
+            }
+            *prev = k->next;
+            service_free(k);
+            cache_dirty = SANE_TRUE;
+        }
+    }
+    if (cache_pruned && cache_dirty) {
+        cache_dirty = SANE_FALSE;
+        escl_cache_save();
     }
-    if (!(sb = avahi_service_browser_new(client, AVAHI_IF_UNSPEC,
-                                                                   AVAHI_PROTO_UNSPEC, "_uscan._tcp",
-                                                                   NULL, 0, browse_callback, client))) {
-        DBG( 10, "Failed to create service browser: %s\n",
-                              avahi_strerror(avahi_client_errno(client)));
-        *status = SANE_STATUS_INVAL;
-        goto fail;
-    }
-    if (!(sb = avahi_service_browser_new(client, AVAHI_IF_UNSPEC,
-                                                                   AVAHI_PROTO_UNSPEC,
-                                                                   "_uscans._tcp", NULL, 0,
-                                                                   browse_callback, client))) {
-        DBG( 10, "Failed to create service browser: %s\n",
-                                avahi_strerror(avahi_client_errno(client)));
-        *status = SANE_STATUS_INVAL;
-        goto fail;
-    }
-    avahi_simple_poll_loop(simple_poll);
-fail:
-    if (sb)
-        avahi_service_browser_free(sb);
-    if (client)
-        avahi_client_free(client);
-    if (simple_poll)
-        avahi_simple_poll_free(simple_poll);
     return (NULL);
 }
+
+/**
+ * \fn void escl_devices_free(void)
+ * \brief Function that stops the background browse and frees the
+ *        services. This function is called in the 'sane_exit' function.
+ */
+void
+escl_devices_free(void)
+{
+#ifdef ESCL_USE_THREADS
+    if (threaded_poll) {
+        avahi_threaded_poll_stop(threaded_poll);
+        avahi_client_free(browse_client);
+        avahi_threaded_poll_free(threaded_poll);
+        browse_client = NULL;
+        threaded_poll = NULL;
+    }
+    browse_waited = SANE_FALSE;
+#endif
+    service_list_free(pending);
+    service_list_free(removed);
+    service_list_free(known);
+    pending = NULL;
+    removed = NULL;
+    known = NULL;
+    cache_loaded = SANE_FALSE;
+    cache_dirty = SANE_FALSE;
+    cache_pruned = SANE_FALSE;
+}
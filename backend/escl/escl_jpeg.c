@@ -50,10 +50,17 @@ struct my_error_mgr
 typedef struct
 {
     struct jpeg_source_mgr pub;
-    FILE *ctx;
+    capabilities_t *ctx;
     unsigned char buffer[INPUT_BUFFER_SIZE];
 } my_source_mgr;
 
+/* decoder kept between two calls of "sane_read" */
+struct escl_jpeg
+{
+    struct jpeg_decompress_struct cinfo;
+    struct my_error_mgr jerr;
+};
+
 /**
  * \fn static boolean fill_input_buffer(j_decompress_ptr cinfo)
  * \brief Called in the "skip_input_data" function.
@@ -66,7 +73,7 @@ fill_input_buffer(j_decompress_ptr cinfo)
     my_source_mgr *src = (my_source_mgr *) cinfo->src;
     int nbytes = 0;
 
-    nbytes = fread(src->buffer, 1, INPUT_BUFFER_SIZE, src->ctx);
+    nbytes = escl_stream_read(src->ctx, src->buffer, INPUT_BUFFER_SIZE);
     if (nbytes <= 0) {
         src->buffer[0] = (unsigned char) 0xFF;
         src->buffer[1] = (unsigned char) JPEG_EOI;
@@ -109,11 +116,11 @@ init_source(j_decompress_ptr __sane_unused__ cinfo)
 }
 
 /**
- * \fn static void jpeg_RW_src(j_decompress_ptr cinfo, FILE *ctx)
+ * \fn static void jpeg_RW_src(j_decompress_ptr cinfo, capabilities_t *ctx)
  * \brief Called in the "escl_sane_decompressor" function.
  */
 static void
-jpeg_RW_src(j_decompress_ptr cinfo, FILE *ctx)
+jpeg_RW_src(j_decompress_ptr cinfo, capabilities_t *ctx)
 {
     my_source_mgr *src;
 
@@ -145,67 +152,96 @@ output_no_message(j_common_ptr __sane_unused__ cinfo)
 {
 }
 
+/**
+ * \fn static SANE_Status decode_row(capabilities_t *scanner, unsigned char *row)
+ * \brief Decompresses the next line of the image, as soon as its data has been
+ *        received.
+ *
+ * \return SANE_STATUS_GOOD (if everything is OK, otherwise, SANE_STATUS_IO_ERROR)
+ */
+static SANE_Status
+decode_row(capabilities_t *scanner, unsigned char *row)
+{
+    struct escl_jpeg *jpeg = scanner->decoder;
+    JSAMPROW rowptr[1];
+
+    if (setjmp(jpeg->jerr.escape)) {
+        DBG( 10, "Escl Jpeg : Error reading jpeg\n");
+        return (SANE_STATUS_IO_ERROR);
+    }
+    rowptr[0] = (JSAMPROW)row;
+    if (jpeg_read_scanlines(&jpeg->cinfo, rowptr, (JDIMENSION) 1) != 1)
+        return (SANE_STATUS_IO_ERROR);
+    return (SANE_STATUS_GOOD);
+}
+
+static void
+decode_end(capabilities_t *scanner)
+{
+    struct escl_jpeg *jpeg = scanner->decoder;
+
+    jpeg_destroy_decompress(&jpeg->cinfo);
+    free(jpeg);
+}
+
 /**
  * \fn SANE_Status escl_sane_decompressor(escl_sane_t *handler)
  * \brief Function that aims to decompress the jpeg image to SANE be able to read the image.
- *        This function is called in the "sane_read" function.
+ *        This function is called in the "sane_start" function.  Only the header
+ *        is read here, the lines are decompressed by "sane_read" while the rest
+ *        of the image is still received.
  *
  * \return SANE_STATUS_GOOD (if everything is OK, otherwise, SANE_STATUS_NO_MEM/SANE_STATUS_INVAL)
  */
 SANE_Status
 get_JPEG_data(capabilities_t *scanner, int *width, int *height, int *bps)
 {
-    int start = 0;
-    struct jpeg_decompress_struct cinfo;
-    JSAMPROW rowptr[1];
-    unsigned char *surface = NULL;
-    struct my_error_mgr jerr;
-    int lineSize = 0;
+    struct escl_jpeg *jpeg = NULL;
+    struct jpeg_decompress_struct *cinfo;
     JDIMENSION x_off = 0;
     JDIMENSION y_off = 0;
     JDIMENSION w = 0;
     JDIMENSION h = 0;
-    int pos = 0;
 
-    if (scanner->tmp == NULL)
+    if (scanner->stream == NULL)
         return (SANE_STATUS_INVAL);
-    fseek(scanner->tmp, SEEK_SET, 0);
-    start = ftell(scanner->tmp);
-    cinfo.err = jpeg_std_error(&jerr.errmgr);
-    jerr.errmgr.error_exit = my_error_exit;
-    jerr.errmgr.output_message = output_no_message;
-    if (setjmp(jerr.escape)) {
-        jpeg_destroy_decompress(&cinfo);
-        if (surface != NULL)
-            free(surface);
-	fseek(scanner->tmp, start, SEEK_SET);
+    jpeg = calloc(1, sizeof(*jpeg));
+    if (jpeg == NULL) {
+        DBG( 10, "Escl Jpeg : Memory allocation problem\n");
+        escl_stream_close(scanner);
+        return (SANE_STATUS_NO_MEM);
+    }
+    cinfo = &jpeg->cinfo;
+    cinfo->err = jpeg_std_error(&jpeg->jerr.errmgr);
+    jpeg->jerr.errmgr.error_exit = my_error_exit;
+    jpeg->jerr.errmgr.output_message = output_no_message;
+    if (setjmp(jpeg->jerr.escape)) {
+        jpeg_destroy_decompress(cinfo);
+        free(jpeg);
         DBG( 10, "Escl Jpeg : Error reading jpeg\n");
-        if (scanner->tmp) {
-           fclose(scanner->tmp);
-           scanner->tmp = NULL;
-        }
+        escl_stream_close(scanner);
         return (SANE_STATUS_INVAL);
     }
-    jpeg_create_decompress(&cinfo);
-    jpeg_RW_src(&cinfo, scanner->tmp);
-    jpeg_read_header(&cinfo, TRUE);
-    cinfo.out_color_space = JCS_RGB;
-    cinfo.quantize_colors = FALSE;
-    jpeg_calc_output_dimensions(&cinfo);
-    double ratio = (double)cinfo.output_width / (double)scanner->caps[scanner->source].width;
+    jpeg_create_decompress(cinfo);
+    jpeg_RW_src(cinfo, scanner);
+    jpeg_read_header(cinfo, TRUE);
+    cinfo->out_color_space = JCS_RGB;
+    cinfo->quantize_colors = FALSE;
+    jpeg_calc_output_dimensions(cinfo);
+    double ratio = (double)cinfo->output_width / (double)scanner->caps[scanner->source].width;
     int rw = (int)((double)scanner->caps[scanner->source].width * ratio);
     int rh = (int)((double)scanner->caps[scanner->source].height * ratio);
     int rx = (int)((double)scanner->caps[scanner->source].pos_x * ratio);
     int ry = (int)((double)scanner->caps[scanner->source].pos_y * ratio);
 
 
-    if (cinfo.output_width < (unsigned int)rw)
-          rw = cinfo.output_width;
+    if (cinfo->output_width < (unsigned int)rw)
+          rw = cinfo->output_width;
     if (rx < 0)
           rx = 0;
 
-    if (cinfo.output_height < (unsigned int)rh)
-          rh = cinfo.output_height;
+    if (cinfo->output_height < (unsigned int)rh)
+          rh = cinfo->output_height;
     if (ry < 0)
           ry = 0;
     DBG(10, "1-JPEF Geometry [%dx%d|%dx%d]\n",
@@ -232,38 +268,30 @@ get_JPEG_data(capabilities_t *scanner, int *width, int *height, int *bps)
 	        y_off,
 	        w,
 	        h);
-    jpeg_start_decompress(&cinfo);
-    if (x_off > 0 || w < cinfo.output_width)
-       jpeg_crop_scanline(&cinfo, &x_off, &w);
-    lineSize = w * cinfo.output_components;
+    jpeg_start_decompress(cinfo);
+    if (x_off > 0 || w < cinfo->output_width)
+       jpeg_crop_scanline(cinfo, &x_off, &w);
     if (y_off > 0)
-        jpeg_skip_scanlines(&cinfo, y_off);
-    surface = malloc(cinfo.output_width * cinfo.output_height * cinfo.output_components);
-    if (surface == NULL) {
-        jpeg_destroy_decompress(&cinfo);
+        jpeg_skip_scanlines(cinfo, y_off);
+    scanner->row_size = w * cinfo->output_components;
+    scanner->row = malloc(scanner->row_size);
+    if (scanner->row == NULL) {
+        jpeg_destroy_decompress(cinfo);
+        free(jpeg);
         DBG( 10, "Escl Jpeg : Memory allocation problem\n");
-        if (scanner->tmp) {
-           fclose(scanner->tmp);
-           scanner->tmp = NULL;
-        }
+        escl_stream_close(scanner);
         return (SANE_STATUS_NO_MEM);
     }
-    pos = 0;
-    while (cinfo.output_scanline < (unsigned int)rh) {
-        rowptr[0] = (JSAMPROW)surface + (lineSize * pos); // ..cinfo.output_scanline);
-        jpeg_read_scanlines(&cinfo, rowptr, (JDIMENSION) 1);
-       pos++;
-     }
-    scanner->img_data = surface;
-    scanner->img_size = lineSize * h;
+    scanner->row_read = scanner->row_size;
+    scanner->rows_left = h;
+    scanner->decoder = jpeg;
+    scanner->decode_row = decode_row;
+    scanner->decode_end = decode_end;
+    scanner->img_size = scanner->row_size * h;
     scanner->img_read = 0;
     *width = w;
     *height = h;
-    *bps = cinfo.output_components;
-    // jpeg_finish_decompress(&cinfo);
-    jpeg_destroy_decompress(&cinfo);
-    fclose(scanner->tmp);
-    scanner->tmp = NULL;
+    *bps = cinfo->output_components;
     return (SANE_STATUS_GOOD);
 }
 #else
@@ -364,6 +364,7 @@ wake_up_device:
             else {
                 *status = SANE_STATUS_NO_MEM;
                 DBG( 10, "Create NewJob : The creation of the failed job\n");
+                curl_easy_cleanup(curl_handle);
                 return (NULL);
             }
         }
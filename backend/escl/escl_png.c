@@ -27,6 +27,7 @@
 #include "escl.h"
 
 #include "../include/sane/sanei.h"
+#include "../include/sane/sanei_rowconv.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -41,10 +42,101 @@
 
 #if(defined HAVE_LIBPNG)
 
+/* decoder kept between two calls of "sane_read" */
+struct escl_png
+{
+	png_structp png_ptr;
+	png_infop   info_ptr;
+	png_bytep   line;     /* one full line of the image */
+	png_bytep   image;    /* the whole image, when it is interlaced */
+	int         line_size;
+	int         x_off;    /* bytes cut on the left of a line */
+	int         channels; /* 3, or 4 with alpha */
+	int         depth;    /* 8 or 16 bits per sample */
+	int         direct;   /* lines decoded into the destination as they are */
+	int         skip;     /* lines cut on the top */
+	int         y;
+};
+
+/**
+ * \fn static void read_stream(png_structp png_ptr, png_bytep data, png_size_t length)
+ * \brief Hands the data of the image to libpng, as soon as it has been received.
+ */
+static void
+read_stream(png_structp png_ptr, png_bytep data, png_size_t length)
+{
+	capabilities_t *scanner = png_get_io_ptr (png_ptr);
+	size_t n;
+
+	while (length > 0) {
+		n = escl_stream_read (scanner, data, length);
+		if (n == 0)
+			png_error (png_ptr, "unexpected end of image");
+		data += n;
+		length -= n;
+	}
+}
+
+/**
+ * \fn static SANE_Status decode_row(capabilities_t *scanner, unsigned char *row)
+ * \brief Decompresses the next line of the image and trims it.
+ *
+ * \return SANE_STATUS_GOOD (if everything is OK, otherwise, SANE_STATUS_IO_ERROR)
+ */
+static SANE_Status
+decode_row(capabilities_t *scanner, unsigned char *row)
+{
+	struct escl_png *png = scanner->decoder;
+	png_bytep line;
+	size_t pixels = scanner->row_size / 3;
+
+	if (setjmp (png_jmpbuf (png->png_ptr)))
+	{
+		DBG( 10, "Escl Png : PNG read error.\n");
+		return (SANE_STATUS_IO_ERROR);
+	}
+	png->y++;
+	if (png->image) {
+		line = png->image + (size_t)(png->skip + png->y - 1) * png->line_size;
+		memcpy (row, line + png->x_off, scanner->row_size);
+		return (SANE_STATUS_GOOD);
+	}
+	for (; png->skip > 0; png->skip--)
+		png_read_row (png->png_ptr, png->line, NULL);
+	if (png->direct) {
+		png_read_row (png->png_ptr, row, NULL);
+		return (SANE_STATUS_GOOD);
+	}
+	png_read_row (png->png_ptr, png->line, NULL);
+	// only the samples that are kept are converted
+	line = png->line + png->x_off;
+	if (png->depth == 16)
+		sanei_rowconv_16to8 (line, line, pixels * png->channels);
+	if (png->channels == 4)
+		sanei_rowconv_rgba_to_rgb (line, row, pixels);
+	else
+		memcpy (row, line, scanner->row_size);
+	return (SANE_STATUS_GOOD);
+}
+
+static void
+decode_end(capabilities_t *scanner)
+{
+	struct escl_png *png = scanner->decoder;
+
+	png_destroy_read_struct (&png->png_ptr, &png->info_ptr, NULL);
+	free (png->line);
+	free (png->image);
+	free (png);
+}
+
 /**
  * \fn SANE_Status escl_sane_decompressor(escl_sane_t *handler)
  * \brief Function that aims to decompress the png image to SANE be able to read the image.
- *        This function is called in the "sane_read" function.
+ *        This function is called in the "sane_start" function.  Only the header
+ *        is read here, the lines are decompressed by "sane_read" while the rest
+ *        of the image is still received.  Interlaced images need all of their
+ *        data before the first line is complete, so they are read at once.
  *
  * \return SANE_STATUS_GOOD (if everything is OK, otherwise, SANE_STATUS_NO_MEM/SANE_STATUS_INVAL)
  */
@@ -54,65 +146,71 @@ get_PNG_data(capabilities_t *scanner, int *width, int *height, int *bps)
 	unsigned int  w = 0;
 	unsigned int  h = 0;
 	int           components = 3;
-	unsigned char *surface = NULL;         /* Image data */
+	int           x_off = 0;
+	int           y_off = 0;
+	struct escl_png * volatile png = NULL;
         unsigned int i = 0;
 	png_byte magic[8];
+	png_bytep * volatile row_pointers = NULL;
 	SANE_Status status = SANE_STATUS_GOOD;
 
+	if (scanner->stream == NULL)
+		return (SANE_STATUS_INVAL);
 	// read magic number
-	fread (magic, 1, sizeof (magic), scanner->tmp);
-	// check for valid magic number
-	if (!png_check_sig (magic, sizeof (magic)))
+	if (escl_stream_read (scanner, magic, sizeof (magic)) != sizeof (magic) ||
+	    !png_check_sig (magic, sizeof (magic)))
 	{
 		DBG( 10, "Escl Png : PNG error is not a valid PNG image!\n");
                 status = SANE_STATUS_INVAL;
                 goto close_file;
 	}
+	png = calloc (1, sizeof (*png));
+	if (!png)
+	{
+		DBG( 10, "Escl Png : decoder Memory allocation problem\n");
+                status = SANE_STATUS_NO_MEM;
+                goto close_file;
+	}
 	// create a png read struct
-	png_structp png_ptr = png_create_read_struct
+	png->png_ptr = png_create_read_struct
 		(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-	if (!png_ptr)
+	if (!png->png_ptr)
 	{
 		DBG( 10, "Escl Png : PNG error create a png read struct\n");
                 status = SANE_STATUS_INVAL;
                 goto close_file;
 	}
 	// create a png info struct
-	png_infop info_ptr = png_create_info_struct (png_ptr);
-	if (!info_ptr)
+	png->info_ptr = png_create_info_struct (png->png_ptr);
+	if (!png->info_ptr)
 	{
 		DBG( 10, "Escl Png : PNG error create a png info struct\n");
-		png_destroy_read_struct (&png_ptr, NULL, NULL);
                 status = SANE_STATUS_INVAL;
                 goto close_file;
 	}
 	// initialize the setjmp for returning properly after a libpng
 	//   error occurred
-	if (setjmp (png_jmpbuf (png_ptr)))
+	if (setjmp (png_jmpbuf (png->png_ptr)))
 	{
-		png_destroy_read_struct (&png_ptr, &info_ptr, NULL);
-		if (surface)
-		  free (surface);
 		DBG( 10, "Escl Png : PNG read error.\n");
                 status = SANE_STATUS_INVAL;
                 goto close_file;
 	}
-	// setup libpng for using standard C fread() function
-	//   with our FILE pointer
-	png_init_io (png_ptr, scanner->tmp);
+	// let libpng read the image while it is received
+	png_set_read_fn (png->png_ptr, scanner, read_stream);
 	// tell libpng that we have already read the magic number
-	png_set_sig_bytes (png_ptr, sizeof (magic));
+	png_set_sig_bytes (png->png_ptr, sizeof (magic));
 
 	// read png info
-	png_read_info (png_ptr, info_ptr);
+	png_read_info (png->png_ptr, png->info_ptr);
 
-	int bit_depth, color_type;
+	int bit_depth, color_type, interlace_type;
 	// get some useful information from header
-	bit_depth = png_get_bit_depth (png_ptr, info_ptr);
-	color_type = png_get_color_type (png_ptr, info_ptr);
+	bit_depth = png_get_bit_depth (png->png_ptr, png->info_ptr);
+	color_type = png_get_color_type (png->png_ptr, png->info_ptr);
 	// convert index color images to RGB images
 	if (color_type == PNG_COLOR_TYPE_PALETTE)
-		png_set_palette_to_rgb (png_ptr);
+		png_set_palette_to_rgb (png->png_ptr);
 	else if (color_type != PNG_COLOR_TYPE_RGB && color_type != PNG_COLOR_TYPE_RGB_ALPHA)
 	{
                 DBG(10, "PNG format not supported.\n");
@@ -120,66 +218,94 @@ get_PNG_data(capabilities_t *scanner, int *width, int *height, int *bps)
                 goto close_file;
 	}
 
-    if (color_type ==  PNG_COLOR_TYPE_RGB_ALPHA)
-        components = 4;
-    else
-	components = 3;
-
-    if (png_get_valid (png_ptr, info_ptr, PNG_INFO_tRNS))
-    	png_set_tRNS_to_alpha (png_ptr);
-    if (bit_depth == 16)
-   	png_set_strip_16 (png_ptr);
-    else if (bit_depth < 8)
-   	png_set_packing (png_ptr);
+    components = 3;
+    interlace_type = png_get_interlace_type (png->png_ptr, png->info_ptr);
+    if (interlace_type != PNG_INTERLACE_NONE) {
+        // the frame is RGB: drop the alpha channel, if any
+        png_set_strip_alpha (png->png_ptr);
+        if (bit_depth == 16)
+            png_set_strip_16 (png->png_ptr);
+    }
+#ifndef WORDS_BIGENDIAN
+    // lines are converted here, from native 16 bit samples
+    else if (bit_depth == 16)
+        png_set_swap (png->png_ptr);
+#endif
+    if (bit_depth < 8)
+   	png_set_packing (png->png_ptr);
+    png_set_interlace_handling (png->png_ptr);
     // update info structure to apply transformations
-    png_read_update_info (png_ptr, info_ptr);
+    png_read_update_info (png->png_ptr, png->info_ptr);
     // retrieve updated information
-    png_get_IHDR (png_ptr, info_ptr,
+    png_get_IHDR (png->png_ptr, png->info_ptr,
                  (png_uint_32*)(&w),
 		 (png_uint_32*)(&h),
 		 &bit_depth, &color_type,
-		 NULL, NULL, NULL);
+		 &interlace_type, NULL, NULL);
 
     *bps = components;
-    // we can now allocate memory for storing pixel data
-    surface = (unsigned char *)malloc (sizeof (unsigned char) * w
-                    * h * components);
-    if (!surface) {
-        DBG( 10, "Escl Png : texels Memory allocation problem\n");
-        status = SANE_STATUS_NO_MEM;
-	goto close_file;
-    }
-    png_bytep *row_pointers;
-    // setup a pointer array.  Each one points at the begening of a row.
-    row_pointers = (png_bytep *)malloc (sizeof (png_bytep) * h);
-    if (!row_pointers) {
-        DBG( 10, "Escl Png : row_pointers Memory allocation problem\n");
-        free(surface);
-        status = SANE_STATUS_NO_MEM;
-	goto close_file;
+    png->channels = png_get_channels (png->png_ptr, png->info_ptr);
+    png->depth = bit_depth;
+    png->line_size = png_get_rowbytes (png->png_ptr, png->info_ptr);
+    // If necessary, trim the image.
+    escl_crop_geometry(scanner, w, h, &x_off, &y_off, width, height);
+    png->x_off = x_off * png->channels * (bit_depth / 8);
+    png->skip = y_off;
+    // RGB lines that aren't trimmed need no conversion
+    png->direct = (png->channels == 3 && bit_depth == 8 && *width == (int)w);
+    if (interlace_type != PNG_INTERLACE_NONE) {
+        png->image = (png_bytep)malloc (sizeof (unsigned char) * w
+                        * h * components);
+        row_pointers = (png_bytep *)malloc (sizeof (png_bytep) * h);
+        if (!png->image || !row_pointers) {
+            DBG( 10, "Escl Png : texels Memory allocation problem\n");
+            status = SANE_STATUS_NO_MEM;
+            goto close_file;
+        }
+        // setup a pointer array.  Each one points at the begening of a row.
+        for (i = 0; i < h; ++i)
+            row_pointers[i] = png->image + (size_t)i * png->line_size;
+        // read pixel data using row pointers
+        png_read_image (png->png_ptr, row_pointers);
+        free (row_pointers);
+        row_pointers = NULL;
     }
-    for (i = 0; i < h; ++i)
-    {
-            row_pointers[i] = (png_bytep)(surface +
-                            ((h - (i + 1)) * w * components));
+    else {
+        png->line = (png_bytep)malloc (png->line_size);
+        if (!png->line) {
+            DBG( 10, "Escl Png : line Memory allocation problem\n");
+            status = SANE_STATUS_NO_MEM;
+            goto close_file;
+        }
     }
-    // read pixel data using row pointers
-    png_read_image (png_ptr, row_pointers);
-
-    // If necessary, trim the image.
-    surface = escl_crop_surface(scanner, surface, w, h, components, width, height);
-    if (!surface)  {
+    scanner->row_size = *width * components;
+    scanner->row = malloc (scanner->row_size);
+    if (!scanner->row) {
         DBG( 10, "Escl Png : Surface Memory allocation problem\n");
         status = SANE_STATUS_NO_MEM;
-	goto close_file;
+        goto close_file;
     }
-
-    free (row_pointers);
+    scanner->row_read = scanner->row_size;
+    scanner->rows_left = *height;
+    scanner->decoder = png;
+    scanner->decode_row = decode_row;
+    scanner->decode_end = decode_end;
+    scanner->img_size = scanner->row_size * *height;
+    scanner->img_read = 0;
+    return (SANE_STATUS_GOOD);
 
 close_file:
-    if (scanner->tmp)
-        fclose(scanner->tmp);
-    scanner->tmp = NULL;
+    free (row_pointers);
+    if (png) {
+        if (png->png_ptr)
+            png_destroy_read_struct (&png->png_ptr,
+                                     png->info_ptr ? &png->info_ptr : NULL,
+                                     NULL);
+        free (png->line);
+        free (png->image);
+        free (png);
+    }
+    escl_stream_close(scanner);
     return (status);
 }
 #else
@@ -55,10 +55,8 @@ escl_delete(const ESCL_Device *device, char *uri)
     if (curl_handle != NULL) {
         escl_curl_url(curl_handle, device, uri);
 	curl_easy_setopt(curl_handle, CURLOPT_CUSTOMREQUEST, "DELETE");
-        if (curl_easy_perform(curl_handle) == CURLE_OK) {
+        if (curl_easy_perform(curl_handle) == CURLE_OK)
             curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &answer);
-            return;
-        }
         curl_easy_cleanup(curl_handle);
     }
 }
@@ -92,7 +90,10 @@ CURL_CALL:
         if (curl_easy_perform(curl_handle) == CURLE_OK) {
             curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &answer);
             i++;
-            if (i >= 15) return;
+            if (i >= 15) {
+                curl_easy_cleanup(curl_handle);
+                return;
+            }
         }
         curl_easy_cleanup(curl_handle);
 	char* end = strrchr(scan_cmd, '/');
@@ -29,9 +29,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#ifdef ESCL_USE_THREADS
+# include <pthread.h>
+#endif
 
 #include "../include/sane/sanei.h"
 
+static SANE_Bool prefetch_take(capabilities_t *scanner, const char *path,
+                               SANE_Bool whole, SANE_Status *status);
+
 /**
  * \fn static size_t write_callback(void *str, size_t size, size_t nmemb, void *userp)
  * \brief Callback function that writes the image scanned into the temporary file.
@@ -68,10 +76,12 @@ escl_scan(capabilities_t *scanner, const ESCL_Device *device, char *scanJob, cha
     if (device == NULL)
         return (SANE_STATUS_NO_MEM);
     scanner->real_read = 0;
+    snprintf(scan_cmd, sizeof(scan_cmd), "%s%s%s%s",
+             scan_jobs, scanJob, result, scanner_start);
+    if (prefetch_take(scanner, scan_cmd, SANE_TRUE, &status))
+        return (status);
     curl_handle = curl_easy_init();
     if (curl_handle != NULL) {
-        snprintf(scan_cmd, sizeof(scan_cmd), "%s%s%s%s",
-                 scan_jobs, scanJob, result, scanner_start);
         escl_curl_url(curl_handle, device, scan_cmd);
         curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, write_callback);
         curl_easy_setopt(curl_handle, CURLOPT_FOLLOWLOCATION, 1L);
@@ -100,9 +110,637 @@ cleanup:
     DBG(10, "eSCL scan : [%s]\treal read (%ld)\n", sane_strstatus(status), scanner->real_read);
     if (scanner->real_read == 0)
     {
-       fclose(scanner->tmp);
+       if (scanner->tmp)
+          fclose(scanner->tmp);
        scanner->tmp = NULL;
        return SANE_STATUS_NO_DOCS;
     }
     return (status);
 }
+
+/* NextDocument response while it is being received */
+struct escl_stream
+{
+    CURLM *multi;
+    CURL *curl;
+    unsigned char *data;    /* received, not yet handed to the decoder */
+    size_t size;
+    size_t pos;
+    size_t alloc;
+    int done;
+    CURLcode result;
+    struct escl_prefetch *prefetch;  /* or received in the background */
+    size_t offset;                   /* read from 'prefetch' */
+};
+
+#ifdef ESCL_USE_THREADS
+/* next NextDocument response of an ADF job, received in the background
+   while the frontend is still busy with the current page */
+struct escl_prefetch
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    const ESCL_Device *device;
+    char path[PATH_MAX];
+    FILE *file;        /* disk-backed, however large the page is */
+    size_t size;       /* written to 'file' */
+    int abort;
+    int done;
+    CURLcode result;
+};
+
+/**
+ * \fn static size_t prefetch_callback(void *str, size_t size, size_t nmemb, void *userp)
+ * \brief Callback function that writes the next page into the temporary file,
+ *        and wakes up the decoder waiting for it.
+ *
+ * \return the number of bytes written, 0 stops the transfer
+ */
+static size_t
+prefetch_callback(void *str, size_t size, size_t nmemb, void *userp)
+{
+    struct escl_prefetch *p = (struct escl_prefetch *)userp;
+    size_t len = size * nmemb;
+
+    if (fwrite(str, 1, len, p->file) != len || fflush(p->file) != 0)
+        return 0;
+    pthread_mutex_lock(&p->lock);
+    p->size += len;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    return len;
+}
+
+static int
+prefetch_progress(void *userp,
+                  curl_off_t __sane_unused__ dltotal,
+                  curl_off_t __sane_unused__ dlnow,
+                  curl_off_t __sane_unused__ ultotal,
+                  curl_off_t __sane_unused__ ulnow)
+{
+    struct escl_prefetch *p = (struct escl_prefetch *)userp;
+    int abort;
+
+    pthread_mutex_lock(&p->lock);
+    abort = p->abort;
+    pthread_mutex_unlock(&p->lock);
+    return abort;
+}
+
+static void *
+prefetch_thread(void *arg)
+{
+    struct escl_prefetch *p = (struct escl_prefetch *)arg;
+    CURLcode res = CURLE_FAILED_INIT;
+    CURL *curl_handle = curl_easy_init();
+
+    if (curl_handle != NULL) {
+        escl_curl_url(curl_handle, p->device, p->path);
+        /* the connection cache of the device belongs to the frontend's
+           thread, which keeps sending requests while this page comes in */
+        curl_easy_setopt(curl_handle, CURLOPT_SHARE, NULL);
+        curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, prefetch_callback);
+        curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, p);
+        curl_easy_setopt(curl_handle, CURLOPT_XFERINFOFUNCTION, prefetch_progress);
+        curl_easy_setopt(curl_handle, CURLOPT_XFERINFODATA, p);
+        curl_easy_setopt(curl_handle, CURLOPT_NOPROGRESS, 0L);
+        curl_easy_setopt(curl_handle, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(curl_handle, CURLOPT_FOLLOWLOCATION, 1L);
+        curl_easy_setopt(curl_handle, CURLOPT_MAXREDIRS, 3L);
+        res = curl_easy_perform(curl_handle);
+        curl_easy_cleanup(curl_handle);
+    }
+    pthread_mutex_lock(&p->lock);
+    p->result = res;
+    p->done = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    DBG(10, "eSCL prefetch : %s (%lu)\n", curl_easy_strerror(res), (unsigned long)p->size);
+    return NULL;
+}
+
+/**
+ * \fn static void prefetch_free(struct escl_prefetch *p)
+ * \brief Stops receiving the page, if it is still coming in, and forgets it.
+ */
+static void
+prefetch_free(struct escl_prefetch *p)
+{
+    pthread_mutex_lock(&p->lock);
+    p->abort = 1;
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->thread, NULL);
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+    fclose(p->file);
+    free(p);
+}
+
+/**
+ * \fn static size_t prefetch_read(struct escl_stream *s, unsigned char *buf, size_t len)
+ * \brief Takes up to 'len' bytes of the page received in the background,
+ *        waiting for them if necessary.
+ *
+ * \return the number of bytes, 0 at the end of the page
+ */
+static size_t
+prefetch_read(struct escl_stream *s, unsigned char *buf, size_t len)
+{
+    struct escl_prefetch *p = s->prefetch;
+    ssize_t n;
+
+    pthread_mutex_lock(&p->lock);
+    while (s->offset == p->size && !p->done)
+        pthread_cond_wait(&p->cond, &p->lock);
+    if (len > p->size - s->offset)
+        len = p->size - s->offset;
+    pthread_mutex_unlock(&p->lock);
+    if (len == 0)
+        return 0;
+    n = pread(fileno(p->file), buf, len, s->offset);
+    if (n <= 0)
+        return 0;
+    s->offset += n;
+    return n;
+}
+
+/**
+ * \fn static CURLcode prefetch_wait(struct escl_prefetch *p)
+ * \brief Waits for the whole page.
+ *
+ * \return the result of the transfer
+ */
+static CURLcode
+prefetch_wait(struct escl_prefetch *p)
+{
+    CURLcode res;
+
+    pthread_mutex_lock(&p->lock);
+    while (!p->done)
+        pthread_cond_wait(&p->cond, &p->lock);
+    res = p->result;
+    pthread_mutex_unlock(&p->lock);
+    return res;
+}
+
+/**
+ * \fn void escl_prefetch_start(capabilities_t *scanner, const ESCL_Device *device, char *scanJob, char *result)
+ * \brief Asks the next page of an ADF job while the current one is still used
+ *        by the frontend, so that the feeder doesn't wait for it.  The page
+ *        is taken by the next 'escl_scan' or 'escl_scan_stream'.  Only one
+ *        page is asked in advance.
+ *        This function is called in the 'sane_read' function, at the end of
+ *        a page that isn't the last one.
+ */
+void
+escl_prefetch_start(capabilities_t *scanner, const ESCL_Device *device, char *scanJob, char *result)
+{
+    const char *scan_jobs = "/eSCL/";
+    const char *scanner_start = "/NextDocument";
+    struct escl_prefetch *p = NULL;
+
+    escl_prefetch_abort(scanner);
+    if (device == NULL || scanJob == NULL || result == NULL)
+        return;
+    p = calloc(1, sizeof(*p));
+    if (p == NULL)
+        return;
+    p->file = tmpfile();
+    if (p->file == NULL) {
+        free(p);
+        return;
+    }
+    p->device = device;
+    snprintf(p->path, sizeof(p->path), "%s%s%s%s",
+             scan_jobs, scanJob, result, scanner_start);
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    if (pthread_create(&p->thread, NULL, prefetch_thread, p) != 0) {
+        DBG(10, "eSCL prefetch : can't start a thread\n");
+        pthread_cond_destroy(&p->cond);
+        pthread_mutex_destroy(&p->lock);
+        fclose(p->file);
+        free(p);
+        return;
+    }
+    DBG(10, "eSCL prefetch : %s\n", p->path);
+    scanner->prefetch = p;
+}
+
+/**
+ * \fn void escl_prefetch_abort(capabilities_t *scanner)
+ * \brief Forgets the page asked in advance, if any.
+ */
+void
+escl_prefetch_abort(capabilities_t *scanner)
+{
+    if (scanner->prefetch == NULL)
+        return;
+    prefetch_free(scanner->prefetch);
+    scanner->prefetch = NULL;
+}
+
+/**
+ * \fn static SANE_Status prefetch_page(capabilities_t *scanner, struct escl_prefetch *p, SANE_Bool whole)
+ * \brief Hands the page asked in advance over to the scanner.
+ *
+ * \return status (if everything is OK, status = SANE_STATUS_GOOD, otherwise, SANE_STATUS_NO_DOCS/SANE_STATUS_NO_MEM/SANE_STATUS_INVAL)
+ */
+static SANE_Status
+prefetch_page(capabilities_t *scanner, struct escl_prefetch *p, SANE_Bool whole)
+{
+    struct escl_stream *s = NULL;
+    CURLcode res;
+
+    if (whole) {
+        res = prefetch_wait(p);
+    }
+    else {
+        /* wait for the start of the document */
+        pthread_mutex_lock(&p->lock);
+        while (p->size == 0 && !p->done)
+            pthread_cond_wait(&p->cond, &p->lock);
+        res = p->done ? p->result : CURLE_OK;
+        pthread_mutex_unlock(&p->lock);
+    }
+    if (res != CURLE_OK) {
+        DBG( 10, "Unable to scan: %s\n", curl_easy_strerror(res));
+        prefetch_free(p);
+        return (SANE_STATUS_INVAL);
+    }
+    pthread_mutex_lock(&p->lock);
+    scanner->real_read = p->size;
+    pthread_mutex_unlock(&p->lock);
+    DBG(10, "eSCL scan : page received in advance (%ld)\n", scanner->real_read);
+    if (scanner->real_read == 0) {
+        prefetch_free(p);
+        return (SANE_STATUS_NO_DOCS);
+    }
+    if (whole) {
+        /* the thread is over, the file is ours */
+        pthread_join(p->thread, NULL);
+        pthread_cond_destroy(&p->cond);
+        pthread_mutex_destroy(&p->lock);
+        if (scanner->tmp)
+            fclose(scanner->tmp);
+        scanner->tmp = p->file;
+        free(p);
+        fseek(scanner->tmp, 0, SEEK_SET);
+        return (SANE_STATUS_GOOD);
+    }
+    s = calloc(1, sizeof(*s));
+    if (s == NULL) {
+        prefetch_free(p);
+        return (SANE_STATUS_NO_MEM);
+    }
+    s->prefetch = p;
+    scanner->stream = s;
+    return (SANE_STATUS_GOOD);
+}
+
+/**
+ * \fn static SANE_Bool prefetch_take(capabilities_t *scanner, const char *path, SANE_Bool whole, SANE_Status *status)
+ * \brief Uses the page asked in advance, if it is the one at 'path'.  If
+ *        'whole' is set, the page is waited for and handed over in the
+ *        temporary file, like 'escl_scan' does.  Otherwise it is decoded
+ *        while it is still received, like with 'escl_scan_stream'.
+ *        'status' is set like these functions do.
+ *
+ * \return SANE_TRUE if the page was asked in advance, SANE_FALSE if it has to be asked now
+ */
+static SANE_Bool
+prefetch_take(capabilities_t *scanner, const char *path, SANE_Bool whole,
+              SANE_Status *status)
+{
+    struct escl_prefetch *p = scanner->prefetch;
+
+    if (p == NULL)
+        return (SANE_FALSE);
+    scanner->prefetch = NULL;
+    if (strcmp(p->path, path)) {
+        prefetch_free(p);
+        return (SANE_FALSE);
+    }
+    *status = prefetch_page(scanner, p, whole);
+    return (SANE_TRUE);
+}
+#else
+
+void
+escl_prefetch_start(capabilities_t __sane_unused__ *scanner,
+                    const ESCL_Device __sane_unused__ *device,
+                    char __sane_unused__ *scanJob,
+                    char __sane_unused__ *result)
+{
+}
+
+void
+escl_prefetch_abort(capabilities_t __sane_unused__ *scanner)
+{
+}
+
+static SANE_Bool
+prefetch_take(capabilities_t __sane_unused__ *scanner,
+              const char __sane_unused__ *path,
+              SANE_Bool __sane_unused__ whole,
+              SANE_Status __sane_unused__ *status)
+{
+    return (SANE_FALSE);
+}
+#endif
+
+/**
+ * \fn static size_t stream_callback(void *str, size_t size, size_t nmemb, void *userp)
+ * \brief Callback function that keeps the received data for the decoder.
+ *        The decoder takes everything before more data is asked for, so the
+ *        buffer only grows by what curl delivers in one go.
+ *
+ * \return the number of bytes taken, 0 stops the transfer
+ */
+static size_t
+stream_callback(void *str, size_t size, size_t nmemb, void *userp)
+{
+    capabilities_t *scanner = (capabilities_t *)userp;
+    struct escl_stream *s = scanner->stream;
+    size_t len = size * nmemb;
+
+    if (s->pos > 0) {
+        memmove(s->data, s->data + s->pos, s->size - s->pos);
+        s->size -= s->pos;
+        s->pos = 0;
+    }
+    if (s->size + len > s->alloc) {
+        size_t alloc = s->alloc ? s->alloc : CURL_MAX_WRITE_SIZE;
+        unsigned char *data;
+
+        while (alloc < s->size + len)
+            alloc *= 2;
+        data = realloc(s->data, alloc);
+        if (data == NULL) {
+            DBG(10, "eSCL stream : Memory allocation problem\n");
+            return 0;
+        }
+        s->data = data;
+        s->alloc = alloc;
+    }
+    memcpy(s->data + s->size, str, len);
+    s->size += len;
+    scanner->real_read += len;
+    return len;
+}
+
+/**
+ * \fn static void stream_pump(struct escl_stream *s)
+ * \brief Lets curl work until it delivers more data or the transfer ends.
+ */
+static void
+stream_pump(struct escl_stream *s)
+{
+    size_t size = s->size;
+    int running = 0;
+    CURLMsg *msg;
+    int left;
+
+    while (!s->done && s->size == size) {
+        if (curl_multi_perform(s->multi, &running) != CURLM_OK) {
+            s->result = CURLE_RECV_ERROR;
+            s->done = 1;
+            break;
+        }
+        if (running == 0) {
+            s->result = CURLE_RECV_ERROR;
+            while ((msg = curl_multi_info_read(s->multi, &left)) != NULL)
+                if (msg->msg == CURLMSG_DONE)
+                    s->result = msg->data.result;
+            s->done = 1;
+            break;
+        }
+        if (s->size == size &&
+            curl_multi_wait(s->multi, NULL, 0, 1000, NULL) != CURLM_OK) {
+            s->result = CURLE_RECV_ERROR;
+            s->done = 1;
+        }
+    }
+}
+
+/**
+ * \fn void escl_stream_close(capabilities_t *scanner)
+ * \brief Stops receiving the document, if it is still coming in.
+ */
+void
+escl_stream_close(capabilities_t *scanner)
+{
+    struct escl_stream *s = scanner->stream;
+
+    if (s == NULL)
+        return;
+#ifdef ESCL_USE_THREADS
+    if (s->prefetch)
+        prefetch_free(s->prefetch);
+#endif
+    if (s->multi) {
+        if (s->curl)
+            curl_multi_remove_handle(s->multi, s->curl);
+        curl_multi_cleanup(s->multi);
+    }
+    if (s->curl)
+        curl_easy_cleanup(s->curl);
+    free(s->data);
+    free(s);
+    scanner->stream = NULL;
+}
+
+/**
+ * \fn SANE_Status escl_scan_stream(capabilities_t *scanner, const ESCL_Device *device, char *scanJob, char *result)
+ * \brief Like 'escl_scan', but it only starts receiving the document.  The
+ *        decoder takes the data with 'escl_stream_read' as it arrives, so
+ *        the first lines are available long before the whole page is.
+ *
+ * \return status (if everything is OK, status = SANE_STATUS_GOOD, otherwise, SANE_STATUS_NO_DOCS/SANE_STATUS_NO_MEM/SANE_STATUS_INVAL)
+ */
+SANE_Status
+escl_scan_stream(capabilities_t *scanner, const ESCL_Device *device, char *scanJob, char *result)
+{
+    const char *scan_jobs = "/eSCL/";
+    const char *scanner_start = "/NextDocument";
+    char scan_cmd[PATH_MAX] = { 0 };
+    struct escl_stream *s;
+    SANE_Status status = SANE_STATUS_GOOD;
+
+    if (device == NULL)
+        return (SANE_STATUS_NO_MEM);
+    escl_stream_close(scanner);
+    scanner->real_read = 0;
+    snprintf(scan_cmd, sizeof(scan_cmd), "%s%s%s%s",
+             scan_jobs, scanJob, result, scanner_start);
+    if (prefetch_take(scanner, scan_cmd, SANE_FALSE, &status))
+        return (status);
+    s = calloc(1, sizeof(*s));
+    if (s == NULL)
+        return (SANE_STATUS_NO_MEM);
+    scanner->stream = s;
+    s->multi = curl_multi_init();
+    s->curl = curl_easy_init();
+    if (s->multi == NULL || s->curl == NULL) {
+        escl_stream_close(scanner);
+        return (SANE_STATUS_NO_MEM);
+    }
+    escl_curl_url(s->curl, device, scan_cmd);
+    curl_easy_setopt(s->curl, CURLOPT_WRITEFUNCTION, stream_callback);
+    curl_easy_setopt(s->curl, CURLOPT_WRITEDATA, scanner);
+    curl_easy_setopt(s->curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(s->curl, CURLOPT_MAXREDIRS, 3L);
+    if (curl_multi_add_handle(s->multi, s->curl) != CURLM_OK) {
+        escl_stream_close(scanner);
+        return (SANE_STATUS_NO_MEM);
+    }
+
+    /* wait for the start of the document */
+    stream_pump(s);
+    if (s->done && s->result != CURLE_OK) {
+        DBG( 10, "Unable to scan: %s\n", curl_easy_strerror(s->result));
+        scanner->real_read = 0;
+        escl_stream_close(scanner);
+        return (SANE_STATUS_INVAL);
+    }
+    DBG(10, "eSCL scan stream : first data (%ld)\n", scanner->real_read);
+    if (scanner->real_read == 0) {
+        escl_stream_close(scanner);
+        return SANE_STATUS_NO_DOCS;
+    }
+    return (SANE_STATUS_GOOD);
+}
+
+/**
+ * \fn size_t escl_stream_read(capabilities_t *scanner, unsigned char *buf, size_t len)
+ * \brief Takes up to 'len' bytes of the document, waiting for them if
+ *        necessary.
+ *
+ * \return the number of bytes, 0 at the end of the document
+ */
+size_t
+escl_stream_read(capabilities_t *scanner, unsigned char *buf, size_t len)
+{
+    struct escl_stream *s = scanner->stream;
+
+    if (s == NULL)
+        return 0;
+#ifdef ESCL_USE_THREADS
+    if (s->prefetch)
+        return prefetch_read(s, buf, len);
+#endif
+    if (s->pos == s->size)
+        stream_pump(s);
+    if (len > s->size - s->pos)
+        len = s->size - s->pos;
+    memcpy(buf, s->data + s->pos, len);
+    s->pos += len;
+    return len;
+}
+
+/**
+ * \fn SANE_Status escl_stream_status(capabilities_t *scanner)
+ * \brief Tells whether the document was received without an error so far.
+ *
+ * \return SANE_STATUS_GOOD, or SANE_STATUS_IO_ERROR if the transfer failed
+ */
+SANE_Status
+escl_stream_status(capabilities_t *scanner)
+{
+    struct escl_stream *s = scanner->stream;
+
+#ifdef ESCL_USE_THREADS
+    if (s && s->prefetch) {
+        CURLcode res = CURLE_OK;
+
+        pthread_mutex_lock(&s->prefetch->lock);
+        if (s->prefetch->done)
+            res = s->prefetch->result;
+        pthread_mutex_unlock(&s->prefetch->lock);
+        if (res != CURLE_OK) {
+            DBG(10, "eSCL stream : %s\n", curl_easy_strerror(res));
+            return (SANE_STATUS_IO_ERROR);
+        }
+        return (SANE_STATUS_GOOD);
+    }
+#endif
+    if (s && s->done && s->result != CURLE_OK) {
+        DBG(10, "eSCL stream : %s\n", curl_easy_strerror(s->result));
+        return (SANE_STATUS_IO_ERROR);
+    }
+    return (SANE_STATUS_GOOD);
+}
+
+/**
+ * \fn SANE_Status escl_decode_read(capabilities_t *scanner, unsigned char *buf, int maxlen, int *len)
+ * \brief Hands out the lines of the image, decoding them as they are
+ *        needed.
+ *
+ * \return SANE_STATUS_GOOD, SANE_STATUS_EOF after the last line, or the
+ *         error of the decoder
+ */
+SANE_Status
+escl_decode_read(capabilities_t *scanner, unsigned char *buf, int maxlen, int *len)
+{
+    SANE_Status status;
+    int n;
+
+    *len = 0;
+    while (*len < maxlen) {
+        if (scanner->row_read == scanner->row_size) {
+            if (scanner->rows_left == 0)
+                break;
+            status = scanner->decode_row(scanner, scanner->row);
+            if (status == SANE_STATUS_GOOD)
+                status = escl_stream_status(scanner);
+            if (status != SANE_STATUS_GOOD) {
+                *len = 0;
+                return (status);
+            }
+            scanner->rows_left--;
+            scanner->row_read = 0;
+        }
+        n = scanner->row_size - scanner->row_read;
+        if (n > maxlen - *len)
+            n = maxlen - *len;
+        memcpy(buf + *len, scanner->row + scanner->row_read, n);
+        scanner->row_read += n;
+        *len += n;
+    }
+    if (*len == 0) {
+        /* let the transfer end normally, whatever follows the image */
+        struct escl_stream *s = scanner->stream;
+
+#ifdef ESCL_USE_THREADS
+        if (s && s->prefetch)
+            prefetch_wait(s->prefetch);
+#endif
+        while (s && !s->done && !s->prefetch) {
+            s->pos = s->size;
+            stream_pump(s);
+        }
+        return (SANE_STATUS_EOF);
+    }
+    return (SANE_STATUS_GOOD);
+}
+
+/**
+ * \fn void escl_decode_end(capabilities_t *scanner)
+ * \brief Drops the decoder of the current image and what is left of the
+ *        document.
+ */
+void
+escl_decode_end(capabilities_t *scanner)
+{
+    if (scanner->decoder)
+        scanner->decode_end(scanner);
+    scanner->decoder = NULL;
+    free(scanner->row);
+    scanner->row = NULL;
+    scanner->row_size = 0;
+    scanner->row_read = 0;
+    scanner->rows_left = 0;
+    escl_stream_close(scanner);
+}
+
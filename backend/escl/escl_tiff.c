@@ -29,6 +29,7 @@
 #include "../include/_stdint.h"
 
 #include "../include/sane/sanei.h"
+#include "../include/sane/sanei_rowconv.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -46,8 +47,10 @@
 
 /**
  * \fn SANE_Status escl_sane_decompressor(escl_sane_t *handler)
- * \brief Function that aims to decompress the png image to SANE be able to read the image.
- *        This function is called in the "sane_read" function.
+ * \brief Function that aims to decompress the tiff image to SANE be able to read the image.
+ *        This function is called in the "sane_read" function.  Only the part
+ *        of the image that is kept is decoded, straight into the data read by
+ *        "sane_read".
  *
  * \return SANE_STATUS_GOOD (if everything is OK, otherwise, SANE_STATUS_NO_MEM/SANE_STATUS_INVAL)
  */
@@ -55,11 +58,14 @@ SANE_Status
 get_TIFF_data(capabilities_t *scanner, int *width, int *height, int *bps)
 {
     TIFF* tif = NULL;
+    TIFFRGBAImage img;
     uint32_t w = 0;
     uint32_t h = 0;
     unsigned char *surface = NULL;         /*  image data*/
-    int components = 4;
-    uint32_t npixels = 0;
+    int components = 3;
+    int x_off = 0;
+    int y_off = 0;
+    char emsg[1024] = { 0 };
     SANE_Status status = SANE_STATUS_GOOD;
 
     lseek(fileno(scanner->tmp), 0, SEEK_SET);
@@ -70,34 +76,45 @@ get_TIFF_data(capabilities_t *scanner, int *width, int *height, int *bps)
 	goto close_file;
     }
 
-    TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &w);
-    TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &h);
-    npixels = w * h;
-    surface = (unsigned char*) malloc(npixels * sizeof (uint32_t));
+    if (!TIFFRGBAImageOK(tif, emsg) || !TIFFRGBAImageBegin(&img, tif, 0, emsg)) {
+        DBG( 10, "Escl Tiff : %s\n", emsg);
+        status = SANE_STATUS_INVAL;
+	goto close_tiff;
+    }
+    w = img.width;
+    h = img.height;
+
+    // If necessary, trim the image: only the lines and the columns kept
+    // are decoded.
+    escl_crop_geometry(scanner, w, h, &x_off, &y_off, width, height);
+    img.req_orientation = ORIENTATION_TOPLEFT;
+    img.col_offset = x_off;
+    img.row_offset = y_off;
+    surface = (unsigned char*) malloc((size_t)*width * *height * sizeof (uint32_t));
     if (surface == NULL)
     {
         DBG( 10, "Escl Tiff : raster Memory allocation problem.\n");
         status = SANE_STATUS_INVAL;
-	goto close_tiff;
+	goto end_image;
     }
 
-    if (!TIFFReadRGBAImage(tif, w, h, (uint32_t *)surface, 0))
+    if (!TIFFRGBAImageGet(&img, (uint32_t *)surface, *width, *height))
     {
         DBG( 10, "Escl Tiff : Problem reading image data.\n");
         status = SANE_STATUS_INVAL;
         free(surface);
-	goto close_tiff;
+	goto end_image;
     }
 
+    // the frame is RGB: drop the alpha channel
+    sanei_rowconv_rgba_to_rgb(surface, surface, (size_t)*width * *height);
     *bps = components;
+    scanner->img_data = surface;
+    scanner->img_size = *width * *height * components;
+    scanner->img_read = 0;
 
-    // If necessary, trim the image.
-    surface = escl_crop_surface(scanner, surface, w, h, components, width, height);
-    if (!surface)  {
-        DBG( 10, "Escl Tiff : Surface Memory allocation problem\n");
-        status = SANE_STATUS_INVAL;
-    }
-
+end_image:
+    TIFFRGBAImageEnd(&img);
 close_tiff:
     TIFFClose(tif);
 close_file:
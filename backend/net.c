@@ -104,13 +104,13 @@ static AvahiServiceBrowser *avahi_browser = NULL;
 #if defined (HAVE_GETADDRINFO) && defined (HAVE_GETNAMEINFO)
 # define NET_USES_AF_INDEP
 # ifdef ENABLE_IPV6
-#  define NET_VERSION "1.0.14 (AF-indep+IPv6)"
+#  define NET_VERSION "1.0.15 (AF-indep+IPv6)"
 # else
-#  define NET_VERSION "1.0.14 (AF-indep)"
+#  define NET_VERSION "1.0.15 (AF-indep)"
 # endif /* ENABLE_IPV6 */
 #else
 # undef ENABLE_IPV6
-# define NET_VERSION "1.0.14"
+# define NET_VERSION "1.0.15"
 #endif /* HAVE_GETADDRINFO && HAVE_GETNAMEINFO */
 
 static SANE_Auth_Callback auth_callback;
@@ -121,6 +121,7 @@ static int client_big_endian; /* 1 == big endian; 0 == little endian */
 static int server_big_endian; /* 1 == big endian; 0 == little endian */
 static int depth; /* bits per pixel */
 static int connect_timeout = -1; /* timeout for connection to saned */
+static int option_cache = 1; /* serve option reads from a local cache */
 
 #ifndef NET_USES_AF_INDEP
 static int saned_port;
@@ -569,12 +570,80 @@ fail:
 }
 
 
+/* Option values are cached on the client side so that frontends which
+   poll option values do not cause a round trip to saned each time.
+   Only options which are solely changed by the frontend can be cached:
+   anything the device may change on its own (buttons, sensors, status
+   values; i.e. options with SANE_CAP_HARD_SELECT or without
+   SANE_CAP_SOFT_SELECT) is always fetched from the server.  */
+static int
+cache_option_ok (Net_Scanner * s, SANE_Int option)
+{
+  const SANE_Option_Descriptor *desc = s->opt.desc[option];
+
+  if (!option_cache || !s->value_cache || !desc)
+    return 0;
+  if (desc->type == SANE_TYPE_BUTTON || desc->type == SANE_TYPE_GROUP)
+    return 0;
+  if (desc->size <= 0)
+    return 0;
+  return SANE_OPTION_IS_SETTABLE (desc->cap)
+    && !(desc->cap & SANE_CAP_HARD_SELECT);
+}
+
+static void
+cache_drop (Net_Scanner * s, SANE_Int option)
+{
+  if (s->value_cache && s->value_cache[option])
+    {
+      DBG (4, "cache_drop: option %d\n", option);
+      free (s->value_cache[option]);
+      s->value_cache[option] = NULL;
+    }
+}
+
+static void
+cache_invalidate (Net_Scanner * s)
+{
+  int option_number;
+
+  if (!s->value_cache)
+    return;
+
+  DBG (3, "cache_invalidate: dropping cached option values\n");
+  for (option_number = 0; option_number < s->opt.num_options;
+       option_number++)
+    cache_drop (s, option_number);
+}
+
+static void
+cache_store (Net_Scanner * s, SANE_Int option, const void *value)
+{
+  SANE_Word size;
+
+  if (!cache_option_ok (s, option))
+    return;
+
+  size = s->opt.desc[option]->size;
+  if (!s->value_cache[option])
+    {
+      s->value_cache[option] = malloc (size);
+      if (!s->value_cache[option])
+	return;
+    }
+  DBG (4, "cache_store: option %d, %d bytes\n", option, size);
+  memcpy (s->value_cache[option], value, size);
+}
+
 static SANE_Status
 fetch_options (Net_Scanner * s)
 {
   int option_number;
   DBG (3, "fetch_options: %p\n", (void *) s);
 
+  /* option sizes and capabilities may change along with the descriptors */
+  cache_invalidate (s);
+
   if (s->opt.num_options)
     {
       DBG (2, "fetch_options: %d option descriptors cached... freeing\n",
@@ -625,6 +694,14 @@ fetch_options (Net_Scanner * s)
 	    }
 	}
       s->local_opt.num_options = s->opt.num_options;
+
+      if (option_cache)
+	{
+	  s->value_cache = calloc (s->opt.num_options, sizeof (void *));
+	  if (!s->value_cache)
+	    DBG (1, "fetch_options: couldn't malloc value cache, "
+		 "option values will not be cached\n");
+	}
     }
   else if (s->local_opt.num_options != s->opt.num_options)
     {
@@ -990,6 +1067,7 @@ sane_init (SANE_Int * version_code, SANE_Auth_Callback authorize)
   devlist = NULL;
   first_device = NULL;
   first_handle = NULL;
+  option_cache = 1;
 
 #if WITH_AVAHI
   net_avahi_init ();
@@ -1069,6 +1147,26 @@ sane_init (SANE_Int * version_code, SANE_Auth_Callback authorize)
 		  DBG (2, "sane_init: connect timeout set to %d seconds\n", connect_timeout);
 		}
 
+	      continue;
+	    }
+	  if (strstr(device_name, "option_cache") != NULL)
+	    {
+	      optval = strchr(device_name, '=');
+
+	      if (!optval)
+		continue;
+
+	      optval = sanei_config_skip_whitespace (++optval);
+	      if ((optval != NULL) && (*optval != '\0'))
+		{
+		  option_cache = (strncmp (optval, "off", 3) != 0
+				  && strncmp (optval, "no", 2) != 0
+				  && strcmp (optval, "0") != 0);
+
+		  DBG (2, "sane_init: option value cache %s\n",
+		       option_cache ? "enabled" : "disabled");
+		}
+
 	      continue;
 	    }
 #if WITH_AVAHI
@@ -1684,6 +1782,13 @@ sane_close (SANE_Handle handle)
   else
     first_handle = s->next;
 
+  if (s->value_cache)
+    {
+      DBG (2, "sane_close: removing cached option values\n");
+      cache_invalidate (s);
+      free (s->value_cache);
+    }
+
   if (s->opt.num_options)
     {
       DBG (2, "sane_close: removing cached option descriptors\n");
@@ -1797,6 +1902,16 @@ sane_control_option (SANE_Handle handle, SANE_Int option,
   if (action == SANE_ACTION_SET_AUTO)
     value_size = 0;
 
+  if (action == SANE_ACTION_GET_VALUE && s->value_cache
+      && s->value_cache[option])
+    {
+      DBG (3, "sane_control_option: option %d served from cache\n", option);
+      memcpy (value, s->value_cache[option], value_size);
+      if (info)
+	*info = 0;
+      return SANE_STATUS_GOOD;
+    }
+
   req.handle = s->handle;
   req.option = option;
   req.action = action;
@@ -1843,8 +1958,21 @@ sane_control_option (SANE_Handle handle, SANE_Int option,
 		     s->opt.desc[option]->size, reply.value_size);
 	    }
 
+	  /* keep the value cache in sync: a get fills it, a set stores the
+	     value the backend reports back unless it was rounded or other
+	     options may have changed along with it */
 	  if (reply.info & SANE_INFO_RELOAD_OPTIONS)
-	    s->options_valid = 0;
+	    {
+	      s->options_valid = 0;
+	      cache_invalidate (s);
+	    }
+	  else if (action == SANE_ACTION_SET_AUTO
+		   || (reply.info & SANE_INFO_INEXACT)
+		   || (SANE_Word) value_size != reply.value_size
+		   || (SANE_Word) value_size != s->opt.desc[option]->size)
+	    cache_drop (s, option);
+	  else
+	    cache_store (s, option, value);
 	}
       sanei_w_free (&s->hw->wire,
 		    (WireCodecFunc) sanei_w_control_option_reply, &reply);
@@ -1922,6 +2050,10 @@ sane_start (SANE_Handle handle)
   hang_over = -1;
   left_over = -1;
 
+  /* backends may adjust option values once the scan parameters are
+     known, so don't trust cached values across a scan */
+  cache_invalidate (s);
+
   if (s->data >= 0)
     {
       DBG (2, "sane_start: data pipe already exists\n");
@@ -2057,6 +2189,10 @@ sane_start (SANE_Handle handle)
   hang_over = -1;
   left_over = -1;
 
+  /* backends may adjust option values once the scan parameters are
+     known, so don't trust cached values across a scan */
+  cache_invalidate (s);
+
   if (s->data >= 0)
     {
       DBG (2, "sane_start: data pipe already exists\n");
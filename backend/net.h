@@ -70,6 +70,7 @@ typedef struct Net_Scanner
 
     int options_valid;			/* are the options current? */
     SANE_Option_Descriptor_Array opt, local_opt;
+    void **value_cache;			/* cached option values (or NULL) */
 
     SANE_Word handle;		/* remote handle (it's a word, not a ptr!) */
 
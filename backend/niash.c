@@ -462,7 +462,10 @@ _WaitForLamp (TScanner * s, unsigned char *pabCalibTable)
           if (fHasCal)
             DBG (DBG_MSG, "_WaitForLamp: entering delay loop\r");
           else
-            DBG (DBG_MSG, "_WaitForLamp: delay loop %d        \r", ++iDelay);
+            {
+              ++iDelay;
+              DBG (DBG_MSG, "_WaitForLamp: delay loop %d        \r", iDelay);
+            }
           sleep (1);
           fHasCal = SANE_FALSE;
           gettimeofday (&now[!iCurrent], 0);
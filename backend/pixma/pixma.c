@@ -53,6 +53,12 @@
 #ifdef HAVE_FCNTL_H
 # include <fcntl.h>
 #endif
+#ifdef HAVE_MMAP
+# include <sys/mman.h>
+#endif
+#ifdef HAVE_SYS_SELECT_H
+# include <sys/select.h>
+#endif
 
 #include "pixma_rename.h"
 #include "pixma.h"
@@ -93,6 +99,29 @@
 #define BUTTON_GROUP_SIZE ( opt_adf_orientation - opt_button_1 + 1 )
 #define BUTTON_GROUP_INDEX(x) ( x - opt_button_1 )
 
+/* The reader task hands the image to sane_read() in a ring buffer when the
+ * compiler has atomics, else (or with PIXMA_READER_BUFFER=0) through a pipe. */
+#if defined(__GNUC__) && defined(__ATOMIC_SEQ_CST) && defined(HAVE_FCNTL_H) \
+  && defined(HAVE_SYS_SELECT_H)
+# define PIXMA_USE_RING
+#endif
+#define PIXMA_RING_KB 1024	/* default size of the ring buffer */
+
+/* Single producer, single consumer ring buffer between reader_loop() and
+ * sane_read(). head and tail count all bytes written and read, head - tail
+ * is the fill level. The data follows this header.
+ * rpipe, the select fd, holds one byte while wake is set, so it is readable
+ * as long as there is data: the reader task sets wake and writes the byte,
+ * sane_read() clears it and reads the byte back once the ring is empty. */
+typedef struct pixma_ring_t
+{
+  size_t head;			/* advanced by the reader task only */
+  size_t tail;			/* advanced by sane_read() only */
+  size_t size;			/* power of 2 */
+  size_t map_size;		/* shared with a forked reader, else 0 */
+  int wake;			/* a byte is in rpipe, or on its way */
+} pixma_ring_t;
+
 typedef struct pixma_sane_t
 {
   struct pixma_sane_t *next;
@@ -124,6 +153,10 @@ typedef struct pixma_sane_t
   SANE_Pid reader_taskid;
   int wpipe, rpipe;
   SANE_Bool reader_stop;
+  /* if ring is set, the pipes only carry wake-ups: wpipe/rpipe when
+     data arrives, space_wpipe/space_rpipe when space is freed */
+  pixma_ring_t *ring;
+  int space_wpipe, space_rpipe;
 
   /* Valid for JPEG source */
   djpeg_dest_ptr jdst;
@@ -1083,6 +1116,239 @@ init_option_descriptors (pixma_sane_t * ss)
 		 ((cfg->cap & PIXMA_CAP_EVENTS) != 0));
 }
 
+#define RING_DATA(r) ((uint8_t *) ((r) + 1))
+
+/* call only when the reader task is gone */
+static void
+ring_destroy (pixma_sane_t * ss)
+{
+  if (!ss->ring)
+    return;
+  if (ss->space_wpipe != -1)
+    close (ss->space_wpipe);
+  close (ss->space_rpipe);
+  ss->space_wpipe = -1;
+  ss->space_rpipe = -1;
+#if defined(HAVE_MMAP) && defined(MAP_ANONYMOUS)
+  if (ss->ring->map_size)
+    munmap (ss->ring, ss->ring->map_size);
+  else
+#endif
+    free (ss->ring);
+  ss->ring = NULL;
+}
+
+#ifdef PIXMA_USE_RING
+static pixma_ring_t *
+ring_create (unsigned line_size, int shared)
+{
+  pixma_ring_t *ring;
+  size_t size, map_size;
+  int kb;
+
+  kb = getenv_atoi ("PIXMA_READER_BUFFER", PIXMA_RING_KB);
+  if (kb <= 0)
+    return NULL;
+  for (size = 4096; size < (size_t) kb * 1024 || size < 4 * (size_t) line_size;)
+    size *= 2;
+  map_size = sizeof (pixma_ring_t) + size;
+
+  if (shared)
+    {
+#if defined(HAVE_MMAP) && defined(MAP_ANONYMOUS)
+      ring = mmap (NULL, map_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+      if (ring == MAP_FAILED)
+        return NULL;
+      ring->map_size = map_size;
+#else
+      return NULL;
+#endif
+    }
+  else
+    {
+      ring = malloc (map_size);
+      if (!ring)
+        return NULL;
+      ring->map_size = 0;
+    }
+  ring->head = 0;
+  ring->tail = 0;
+  ring->size = size;
+  ring->wake = 0;
+  return ring;
+}
+
+static void
+ring_wake (int fd)
+{
+  char c = 0;
+
+  /* fd is non-blocking, a full pipe wakes the other side anyway */
+  while (write (fd, &c, 1) == -1 && errno == EINTR)
+    {
+    }
+}
+
+/* Reader task: wait for free space. Returns the nr of contiguous free bytes
+ * at *dst, or 0 when the reader is stopped or sane_read() is gone. */
+static size_t
+ring_reserve (pixma_sane_t * ss, uint8_t ** dst)
+{
+  pixma_ring_t *ring = ss->ring;
+  size_t head = ring->head, used, pos;
+  char wakeups[64];
+  int count;
+
+  for (;;)
+    {
+      if (ss->reader_stop)
+        return 0;
+      used = head - __atomic_load_n (&ring->tail, __ATOMIC_SEQ_CST);
+      if (used < ring->size)
+        break;
+      count = read (ss->space_rpipe, wakeups, sizeof (wakeups));
+      if (count == 0 || (count == -1 && errno != EINTR))
+        return 0;
+    }
+  pos = head & (ring->size - 1);
+  *dst = RING_DATA (ring) + pos;
+  /* the free space may wrap around the end of the ring */
+  return (used > pos) ? ring->size - used : ring->size - pos;
+}
+
+/* Reader task: publish count bytes written at the position of ring_reserve() */
+static void
+ring_commit (pixma_sane_t * ss, size_t count)
+{
+  pixma_ring_t *ring = ss->ring;
+  size_t head = ring->head;
+
+  __atomic_store_n (&ring->head, head + count, __ATOMIC_SEQ_CST);
+  if (__atomic_exchange_n (&ring->wake, 1, __ATOMIC_SEQ_CST) == 0)
+    ring_wake (ss->wpipe);
+}
+
+/* sane_read(): wait until fd is readable without reading from it. Returns
+ * like select(), 0 only when block is not set. */
+static int
+ring_select (int fd, int block)
+{
+  struct timeval timeout = { 0, 0 };
+  fd_set fds;
+
+  FD_ZERO (&fds);
+  FD_SET (fd, &fds);
+  return select (fd + 1, &fds, NULL, NULL, (block) ? NULL : &timeout);
+}
+
+/* sane_read(): the ring looked empty, take the wake-up byte out of rpipe
+ * unless data arrived meanwhile. */
+static void
+ring_settle (pixma_sane_t * ss)
+{
+  pixma_ring_t *ring = ss->ring;
+  char c;
+  int wake = 0;
+
+  if (__atomic_exchange_n (&ring->wake, 0, __ATOMIC_SEQ_CST) == 0)
+    return;
+  /* with new data the byte stays, unless the reader task saw wake cleared
+     and writes a second one */
+  if (__atomic_load_n (&ring->head, __ATOMIC_SEQ_CST) != ring->tail
+      && __atomic_compare_exchange_n (&ring->wake, &wake, 1, 0,
+                                      __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+    return;
+  /* the byte may still be on its way, also in non-blocking mode */
+  while (read (ss->rpipe, &c, 1) == -1)
+    {
+      if (errno == EAGAIN)
+        ring_select (ss->rpipe, 1);
+      else if (errno != EINTR)
+        break;
+    }
+}
+
+/* sane_read(): like read() on the pipe, returns the nr of bytes copied,
+ * 0 when the reader task has finished or -1 with errno set (EAGAIN in
+ * non-blocking mode). */
+static int
+ring_read (pixma_sane_t * ss, uint8_t * buf, unsigned size)
+{
+  pixma_ring_t *ring = ss->ring;
+  size_t tail = ring->tail, avail, pos, n, first;
+  int flags, result;
+
+  for (;;)
+    {
+      avail = __atomic_load_n (&ring->head, __ATOMIC_SEQ_CST) - tail;
+      if (avail > 0)
+        break;
+      if (__atomic_load_n (&ring->wake, __ATOMIC_SEQ_CST))
+        {
+          /* a byte left from data that was already read */
+          ring_settle (ss);
+          continue;
+        }
+      flags = fcntl (ss->rpipe, F_GETFL);
+      result = ring_select (ss->rpipe, flags == -1 || !(flags & O_NONBLOCK));
+      if (result <= 0)
+        {
+          if (result == 0)
+            errno = EAGAIN;
+          return -1;
+        }
+      /* readable without wake set: the reader task closed wpipe after its
+         last commit */
+      if (!__atomic_load_n (&ring->wake, __ATOMIC_SEQ_CST))
+        {
+          avail = __atomic_load_n (&ring->head, __ATOMIC_SEQ_CST) - tail;
+          if (avail == 0)
+            return 0;
+          break;
+        }
+    }
+
+  n = (avail < size) ? avail : size;
+  pos = tail & (ring->size - 1);
+  first = (n < ring->size - pos) ? n : ring->size - pos;
+  memcpy (buf, RING_DATA (ring) + pos, first);
+  memcpy (buf + first, RING_DATA (ring), n - first);
+  __atomic_store_n (&ring->tail, tail + n, __ATOMIC_SEQ_CST);
+  /* rpipe stays readable while data is left */
+  if (__atomic_load_n (&ring->head, __ATOMIC_SEQ_CST) == tail + n)
+    ring_settle (ss);
+  /* the reader task only waits for space when the ring was full */
+  if (__atomic_load_n (&ring->head, __ATOMIC_SEQ_CST) - tail == ring->size)
+    ring_wake (ss->space_wpipe);
+  return n;
+}
+#endif /* PIXMA_USE_RING */
+
+/* read image data of the reader task, like read() on rpipe */
+static int
+read_reader_output (pixma_sane_t * ss, void *buf, unsigned size)
+{
+#ifdef PIXMA_USE_RING
+  if (ss->ring)
+    return ring_read (ss, buf, size);
+#endif
+  return read (ss->rpipe, buf, size);
+}
+
+/* sane_read() side: no more image data wanted from the reader task */
+static void
+close_reader_output (pixma_sane_t * ss)
+{
+  close (ss->rpipe);
+  ss->rpipe = -1;
+  if (ss->space_wpipe != -1)
+    {
+      close (ss->space_wpipe);
+      ss->space_wpipe = -1;
+    }
+}
+
 /* Writing to reader_ss outside reader_process() is a BUG! */
 static pixma_sane_t *reader_ss = NULL;
 
@@ -1174,6 +1440,31 @@ reader_loop (pixma_sane_t * ss)
   count = pixma_scan (ss->s, &ss->sp);
   if (count >= 0)
     {
+#ifdef PIXMA_USE_RING
+      if (ss->ring)
+        {
+          /* the image goes straight into the ring */
+          uint8_t *dst;
+          size_t len;
+
+          for (;;)
+            {
+              len = ring_reserve (ss, &dst);
+              if (len == 0)
+                {
+                  pixma_cancel (ss->s);
+                  dst = buf;
+                }
+              if (len == 0 || len > bufsize)
+                len = bufsize;
+              if ((count = pixma_read_image (ss->s, dst, len)) <= 0)
+                break;
+              if (dst != buf)
+                ring_commit (ss, count);
+            }
+        }
+      else
+#endif
       while ((count = pixma_read_image (ss->s, buf, bufsize)) > 0)
         {
           if (write_all (ss, buf, count) != count)
@@ -1214,8 +1505,7 @@ reader_process (void *arg)
   sigaction (SIGINT, &sa, NULL);
   sigaction (SIGPIPE, &sa, NULL);
   sigaction (SIGTERM, &sa, NULL);
-  close (ss->rpipe);
-  ss->rpipe = -1;
+  close_reader_output (ss);
   return reader_loop (ss);
 }
 
@@ -1242,7 +1532,16 @@ terminate_reader_task (pixma_sane_t * ss, int *exit_code)
 
   pid = ss->reader_taskid;
   if (!sanei_thread_is_valid (pid))
-    return pid;
+    {
+      ring_destroy (ss);
+      return pid;
+    }
+  /* a reader task waiting for space in the ring wakes up */
+  if (ss->space_wpipe != -1)
+    {
+      close (ss->space_wpipe);
+      ss->space_wpipe = -1;
+    }
   if (sanei_thread_is_forked ())
     {
       sanei_thread_kill (pid);
@@ -1254,6 +1553,7 @@ terminate_reader_task (pixma_sane_t * ss, int *exit_code)
     }
   result = sanei_thread_waitpid (pid, &status);
   sanei_thread_invalidate (ss->reader_taskid);
+  ring_destroy (ss);
 
   if (ss->sp.source != PIXMA_SOURCE_ADF && ss->sp.source != PIXMA_SOURCE_ADFDUP)
     ss->idle = SANE_TRUE;
@@ -1305,6 +1605,29 @@ start_reader_task (pixma_sane_t * ss)
   ss->reader_stop = SANE_FALSE;
 
   is_forked = sanei_thread_is_forked ();
+#ifdef PIXMA_USE_RING
+  ring_destroy (ss);
+  if ((ss->ring = ring_create (ss->sp.line_size, is_forked)) != NULL)
+    {
+      if (pipe (fds) == -1)
+        {
+          PDBG (pixma_dbg (1, "WARNING:start_reader_task():pipe() failed %s\n",
+                           strerror (errno)));
+          ring_destroy (ss);
+        }
+      else
+        {
+          ss->space_rpipe = fds[0];
+          ss->space_wpipe = fds[1];
+          /* wake-ups must never block */
+          fcntl (ss->wpipe, F_SETFL, O_NONBLOCK);
+          fcntl (ss->space_wpipe, F_SETFL, O_NONBLOCK);
+        }
+    }
+  PDBG (pixma_dbg (3, "Reader task output: %s of %lu bytes\n",
+                   (ss->ring) ? "ring buffer" : "pipe",
+                   (ss->ring) ? (unsigned long) ss->ring->size : 0UL));
+#endif
   if (is_forked)
     {
       pid = sanei_thread_begin (reader_process, ss);
@@ -1324,6 +1647,7 @@ start_reader_task (pixma_sane_t * ss)
       close (ss->rpipe);
       ss->wpipe = -1;
       ss->rpipe = -1;
+      ring_destroy (ss);
       PDBG (pixma_dbg (1, "ERROR:unable to start reader task\n"));
       return PIXMA_ENOMEM;
     }
@@ -1355,7 +1679,7 @@ jpeg_fill_input_buffer(j_decompress_ptr cinfo)
 
   for (retry = 0; retry < 30; retry ++ )
     {
-      size = read (mgr->s->rpipe, mgr->buffer, 1024);
+      size = read_reader_output (mgr->s, mgr->buffer, 1024);
       if (size == 0)
         {
           return FALSE;
@@ -1592,9 +1916,8 @@ read_image (pixma_sane_t * ss, void *buf, unsigned size, int *readlen)
           status = pixma_jpeg_read_header(ss);
           if (status != SANE_STATUS_GOOD)
             {
-              close (ss->rpipe);
+              close_reader_output (ss);
               pixma_jpeg_finish(ss);
-              ss->rpipe = -1;
               if (sanei_thread_is_valid (terminate_reader_task (ss, &status))
                 && status != SANE_STATUS_GOOD)
                 {
@@ -1615,7 +1938,7 @@ read_image (pixma_sane_t * ss, void *buf, unsigned size, int *readlen)
           pixma_jpeg_read(ss, buf, size, &count);
         }
       else
-        count = read (ss->rpipe, buf, size);
+        count = read_reader_output (ss, buf, size);
     }
   while (count == -1 && errno == EINTR);
 
@@ -1628,8 +1951,7 @@ read_image (pixma_sane_t * ss, void *buf, unsigned size, int *readlen)
           PDBG (pixma_dbg (1, "WARNING:read_image():read() failed %s\n",
                strerror (errno)));
         }
-      close (ss->rpipe);
-      ss->rpipe = -1;
+      close_reader_output (ss);
       terminate_reader_task (ss, NULL);
       if (ss->sp.mode_jpeg)
         pixma_jpeg_finish(ss);
@@ -1644,8 +1966,7 @@ read_image (pixma_sane_t * ss, void *buf, unsigned size, int *readlen)
     }
   if (ss->image_bytes_read >= ss->sp.image_size)
     {
-      close (ss->rpipe);
-      ss->rpipe = -1;
+      close_reader_output (ss);
       terminate_reader_task (ss, NULL);
       if (ss->sp.mode_jpeg)
         pixma_jpeg_finish(ss);
@@ -1655,10 +1976,9 @@ read_image (pixma_sane_t * ss, void *buf, unsigned size, int *readlen)
       PDBG (pixma_dbg (3, "read_image():reader task closed the pipe:%"
 		       PRIu64" bytes received, %"PRIu64" bytes expected\n",
 		       ss->image_bytes_read, ss->sp.image_size));
-      close (ss->rpipe);
+      close_reader_output (ss);
       if (ss->sp.mode_jpeg)
         pixma_jpeg_finish(ss);
-      ss->rpipe = -1;
       if (sanei_thread_is_valid (terminate_reader_task (ss, &status))
       	  && status != SANE_STATUS_GOOD)
         {
@@ -1804,6 +2124,8 @@ sane_open (SANE_String_Const name, SANE_Handle * h)
   sanei_thread_initialize (ss->reader_taskid);
   ss->wpipe = -1;
   ss->rpipe = -1;
+  ss->space_wpipe = -1;
+  ss->space_rpipe = -1;
   ss->idle = SANE_TRUE;
   ss->scanning = SANE_FALSE;
   ss->sp.frontend_cancel = SANE_FALSE;
@@ -1982,9 +2304,8 @@ sane_start (SANE_Handle h)
           status = pixma_jpeg_read_header(ss);
           if (status != SANE_STATUS_GOOD)
             {
-              close (ss->rpipe);
+              close_reader_output (ss);
               pixma_jpeg_finish(ss);
-              ss->rpipe = -1;
               if (sanei_thread_is_valid (terminate_reader_task (ss, &error))
                 && error != SANE_STATUS_GOOD)
                 {
@@ -2088,10 +2409,9 @@ sane_cancel (SANE_Handle h)
   ss->sp.frontend_cancel = SANE_TRUE;
   if (ss->idle)
     return;
-  close (ss->rpipe);
+  close_reader_output (ss);
   if (ss->sp.mode_jpeg)
     pixma_jpeg_finish(ss);
-  ss->rpipe = -1;
   terminate_reader_task (ss, NULL);
   ss->idle = SANE_TRUE;
 }
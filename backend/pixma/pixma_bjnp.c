@@ -45,6 +45,7 @@
 
 #include  "../include/sane/config.h"
 #include  "../include/sane/sane.h"
+#include  "../include/sane/sanei_config.h"
 
 /*
  * Standard types etc
@@ -99,6 +100,12 @@
 #ifdef HAVE_FCNTL_H
 #include <fcntl.h>
 #endif
+#include <stddef.h>
+
+#ifdef USE_PTHREAD
+#include <pthread.h>
+#define BJNP_USE_THREADS
+#endif
 
 #include "pixma_bjnp_private.h"
 #include "pixma_bjnp.h"
@@ -121,6 +128,16 @@
 static bjnp_device_t device[BJNP_NO_DEVICES];
 static int bjnp_no_devices = 0;
 
+#ifdef BJNP_USE_THREADS
+/* background discovery that refreshes the cache */
+static pthread_t refresh_thread;
+static int refresh_started = 0;
+static int refresh_finished = 0;	/* set by the thread, under cache_mutex */
+static bjnp_cache_entry_t refresh_cache[BJNP_CACHE_MAX];
+static int refresh_count = 0;
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 /*
  * Private functions
  */
@@ -322,6 +339,23 @@ get_address_info ( const bjnp_sockaddr_t *addr, char * addr_string, int *port)
     }
 }
 
+static int
+get_numeric_address (const bjnp_sockaddr_t *addr, char *addr_string)
+{
+  /*
+   * Numeric address that getaddrinfo accepts again, including the scope
+   * of a link local IPv6 address.
+   * Returns 0 on success, -1 on errors
+   */
+
+  if (getnameinfo (&(addr->addr), sa_size (addr), addr_string, BJNP_HOST_MAX,
+                   NULL, 0, NI_NUMERICHOST) != 0)
+    {
+      return -1;
+    }
+  return 0;
+}
+
 static int
 parse_IEEE1284_to_model (char *scanner_id, char *model)
 {
@@ -374,7 +408,7 @@ charTo2byte (char *d, const char *s, int len)
   for (i = 0; i < len; i++)
     {
       d[2 * i] = '\0';
-      if (s[i] == '\0')
+      if (done == 0 && s[i] == '\0')
 	{
 	  done = 1;
 	}
@@ -699,7 +733,7 @@ udp_command (const int dev_no, char *command, int cmd_len, char *response,
 	  FD_SET (sockfd, &fdset);
 
 	  timeout.tv_sec = device[dev_no].bjnp_ip_timeout /1000;
-	  timeout.tv_usec = device[dev_no].bjnp_ip_timeout %1000;
+	  timeout.tv_usec = (device[dev_no].bjnp_ip_timeout %1000) * BJNP_USLEEP_MS;
 	}
       while (((result =
 	       select (sockfd + 1, &fdset, NULL, NULL, &timeout)) <= 0)
@@ -733,6 +767,36 @@ udp_command (const int dev_no, char *command, int cmd_len, char *response,
   return -1;
 }
 
+static void
+get_model_from_identity (int protocol, struct IDENTITY *id, char *model)
+{
+  /*
+   * Extract make and model from the IEEE 1284 id of a get id response
+   */
+
+  char scanner_id[BJNP_IEEE1284_MAX];
+  int id_len;
+
+  if (protocol == PROTOCOL_BJNP)
+    {
+      id_len = MIN(ntohl( id-> cmd.payload_len ) - sizeof(id-> payload.bjnp.id_len), BJNP_IEEE1284_MAX - 1);
+      strncpy(scanner_id, id->payload.bjnp.id, id_len);
+      scanner_id[id_len] = '\0';
+    }
+  else
+    {
+      id_len = MIN(ntohl( id-> cmd.payload_len ), BJNP_IEEE1284_MAX - 1);
+      strncpy(scanner_id, id->payload.mfnp.id, id_len);
+      scanner_id[id_len] = '\0';
+    }
+  PDBG (bjnp_dbg (LOG_INFO, "get_scanner_id: Scanner identity string = %s - length = %d\n", scanner_id, id_len));
+
+  /* get make&model from IEEE1284 id  */
+
+  parse_IEEE1284_to_model (scanner_id, model);
+  PDBG (bjnp_dbg (LOG_INFO, "get_scanner_id: Scanner model = %s\n", model));
+}
+
 static int
 get_scanner_id (const int dev_no, char *model)
 {
@@ -743,11 +807,8 @@ get_scanner_id (const int dev_no, char *model)
    */
 
   struct BJNP_command cmd;
-  struct IDENTITY *id;
-  char scanner_id[BJNP_IEEE1284_MAX];
   int resp_len;
   char resp_buf[BJNP_RESP_MAX];
-  int id_len;
 
   /* set defaults */
 
@@ -768,29 +829,8 @@ get_scanner_id (const int dev_no, char *model)
   PDBG (bjnp_dbg (LOG_DEBUG2, "get_scanner_id: scanner identity:\n"));
   PDBG (bjnp_hexdump (LOG_DEBUG2, resp_buf, resp_len));
 
-  id = (struct IDENTITY *) resp_buf;
-
-  if (device[dev_no].protocol == PROTOCOL_BJNP)
-    {
-      id_len = MIN(ntohl( id-> cmd.payload_len ) - sizeof(id-> payload.bjnp.id_len), BJNP_IEEE1284_MAX);
-      strncpy(scanner_id, id->payload.bjnp.id, id_len);
-      scanner_id[id_len] = '\0';
-    }
-  else
-    {
-      id_len = MIN(ntohl( id-> cmd.payload_len ), BJNP_IEEE1284_MAX);
-      strncpy(scanner_id, id->payload.mfnp.id, id_len);
-      scanner_id[id_len] = '\0';
-    }
-  PDBG (bjnp_dbg (LOG_INFO, "get_scanner_id: Scanner identity string = %s - length = %d\n", scanner_id, id_len));
-
-  /* get make&model from IEEE1284 id  */
-
-  if (model != NULL)
-  {
-    parse_IEEE1284_to_model (scanner_id, model);
-    PDBG (bjnp_dbg (LOG_INFO, "get_scanner_id: Scanner model = %s\n", model));
-  }
+  get_model_from_identity (device[dev_no].protocol, (struct IDENTITY *) resp_buf,
+                           model);
   return 0;
 }
 
@@ -1092,6 +1132,186 @@ bjnp_send_broadcast (int sockfd, const bjnp_sockaddr_t * broadcast_addr, int por
   return sockfd;
 }
 
+static int
+bjnp_open_discovery_sockets (int *socket_fd, bjnp_sockaddr_t *broadcast_addr,
+                             fd_set *fdset, int *last_socketfd)
+{
+  /*
+   * Prepare a broadcast socket for each suitable interface
+   * socket_fd, broadcast_addr: (write) the sockets and their broadcast address
+   * fdset: (write) set of the sockets for select
+   * last_socketfd: (write) highest socket for select
+   * returns: number of sockets
+   */
+
+  int no_sockets = 0;
+
+  FD_ZERO (fdset);
+  *last_socketfd = 0;
+
+#ifdef HAVE_IFADDRS_H
+  {
+    struct ifaddrs *interfaces = NULL;
+    struct ifaddrs *interface;
+    getifaddrs (&interfaces);
+
+    /* create a socket for each suitable interface */
+
+    interface = interfaces;
+    while ((no_sockets < BJNP_SOCK_MAX) && (interface != NULL))
+      {
+        if ( ! (interface -> ifa_flags & IFF_POINTOPOINT) &&
+            ( (socket_fd[no_sockets] =
+                      prepare_socket( interface -> ifa_name,
+                                      (bjnp_sockaddr_t *) interface -> ifa_addr,
+                                      (bjnp_sockaddr_t *) interface -> ifa_broadaddr,
+                                      &broadcast_addr[no_sockets] ) ) != -1 ) )
+          {
+            /* track highest used socket for later use in select */
+            if (socket_fd[no_sockets] > *last_socketfd)
+              {
+                *last_socketfd = socket_fd[no_sockets];
+              }
+            FD_SET (socket_fd[no_sockets], fdset);
+            no_sockets++;
+          }
+        interface = interface->ifa_next;
+      }
+    freeifaddrs (interfaces);
+  }
+#else
+  /* we have no easy way to find interfaces with their broadcast addresses. */
+  /* use global broadcast and all-hosts instead */
+  {
+    bjnp_sockaddr_t local;
+    bjnp_sockaddr_t bc_addr;
+
+    memset( &local, 0, sizeof( local) );
+    local.ipv4.sin_family = AF_INET;
+    local.ipv4.sin_addr.s_addr = htonl (INADDR_ANY);
+
+    bc_addr.ipv4.sin_family = AF_INET;
+    bc_addr.ipv4.sin_port = htons(0);
+    bc_addr.ipv4.sin_addr.s_addr = htonl (INADDR_BROADCAST);
+
+    socket_fd[no_sockets] = prepare_socket( "any_interface",
+                                   &local,
+                                   &bc_addr,
+                                   &broadcast_addr[no_sockets] );
+    if (socket_fd[no_sockets] >= 0)
+      {
+        FD_SET (socket_fd[no_sockets], fdset);
+        if (socket_fd[no_sockets] > *last_socketfd)
+          {
+            *last_socketfd = socket_fd[no_sockets];
+          }
+        no_sockets++;
+      }
+#ifdef ENABLE_IPV6
+    local.ipv6.sin6_family = AF_INET6;
+    local.ipv6.sin6_addr = in6addr_any;
+
+    socket_fd[no_sockets] = prepare_socket( "any_interface",
+                                   &local,
+                                   NULL,
+                                   &broadcast_addr[no_sockets] );
+    if (socket_fd[no_sockets] >= 0)
+      {
+        FD_SET (socket_fd[no_sockets], fdset);
+        if (socket_fd[no_sockets] > *last_socketfd)
+          {
+            *last_socketfd = socket_fd[no_sockets];
+          }
+        no_sockets++;
+      }
+#endif
+  }
+#endif
+  return no_sockets;
+}
+
+static void
+bjnp_broadcast_discover (const int *socket_fd, const bjnp_sockaddr_t *broadcast_addr,
+                         int no_sockets)
+{
+  /* send BJNP_MAX_BROADCAST_ATTEMPTS broadcasts on each prepared socket */
+
+  struct BJNP_command cmd;
+  int attempt;
+  int i;
+  int j;
+
+  for (attempt = 0; attempt < BJNP_MAX_BROADCAST_ATTEMPTS; attempt++)
+    {
+      for ( i=0; i < no_sockets; i++)
+        {
+	  j = 0;
+          while(bjnp_protocol_defs[j].protocol_version != PROTOCOL_NONE)
+	    {
+	      set_cmd_from_string (bjnp_protocol_defs[j].proto_string, &cmd, CMD_UDP_DISCOVER, 0);
+              bjnp_send_broadcast ( socket_fd[i], &broadcast_addr[i],
+                                    bjnp_protocol_defs[j].default_port, cmd, sizeof (cmd));
+	      j++;
+	    }
+	}
+      /* wait for some time between broadcast packets */
+      usleep (BJNP_BROADCAST_INTERVAL * BJNP_USLEEP_MS);
+    }
+}
+
+static int
+bjnp_recv_discover_response (int sockfd, unsigned char *resp_buf, int resp_len,
+                             bjnp_sockaddr_t *scanner_sa,
+                             bjnp_protocol_defs_t **protocol_defs)
+{
+  /*
+   * Receive a response to a broadcast discover
+   * scanner_sa: (write) address of the scanner
+   * protocol_defs: (write) protocol of the response
+   * returns: length of the response, -1 if this is not a scanner's response
+   */
+
+  struct DISCOVER_RESPONSE *disc_resp = ( struct DISCOVER_RESPONSE *) resp_buf;
+  socklen_t socklen;
+  int numbytes;
+
+  socklen =  sizeof(*scanner_sa);
+  if ((numbytes =
+       recvfrom (sockfd, resp_buf, resp_len, 0,
+                 &(scanner_sa->addr), &socklen ) ) == -1)
+    {
+      PDBG (bjnp_dbg
+	    (LOG_INFO, "sanei_find_devices: no data received"));
+      return -1;
+    }
+
+  PDBG (bjnp_dbg (LOG_DEBUG2, "sanei_find_devices: Discover response:\n"));
+  PDBG (bjnp_hexdump (LOG_DEBUG2, resp_buf, numbytes));
+
+  /* check if something sensible is returned */
+  *protocol_defs = get_protocol_by_proto_string(disc_resp-> response.BJNP_id);
+  if ( (numbytes < (int)sizeof (struct BJNP_command)) ||
+       (*protocol_defs == NULL))
+    {
+      /* not a valid response, assume not a scanner  */
+
+      char bjnp_id[5];
+      strncpy(bjnp_id,  disc_resp-> response.BJNP_id, 4);
+      bjnp_id[4] = '\0';
+      PDBG (bjnp_dbg (LOG_INFO,
+        "sanei_find_devices: Invalid discover response! Length = %d, Id = %s\n",
+        numbytes, bjnp_id ) );
+      return -1;
+    }
+  if ( !(disc_resp -> response.dev_type & 0x80) )
+    {
+      /* not a response, a command from somebody else or */
+      /* a discover command that we generated */
+      return -1;
+    }
+  return numbytes;
+}
+
 static void
 bjnp_finish_job (int devno)
 {
@@ -1312,6 +1532,10 @@ bjnp_write (int devno, const SANE_Byte * buf, size_t count)
 	     (unsigned long) device[devno].scanner_data_left,
 	     (unsigned long) device[devno].scanner_data_left));
     }
+  /* read requests still in flight belong to the previous command */
+  device[devno].reads_stale += device[devno].reads_pending;
+  device[devno].reads_pending = 0;
+
   /* set BJNP command header */
 
   set_cmd_for_dev (devno, (struct BJNP_command *) &bjnp_buf, CMD_TCP_SEND, count);
@@ -1383,6 +1607,8 @@ bjnp_send_read_request (int devno)
   return 0;
 }
 
+static SANE_Status bjnp_skip_data (int devno, size_t len);
+
 static SANE_Status
 bjnp_recv_header (int devno, size_t *payload_size )
 {
@@ -1402,11 +1628,13 @@ bjnp_recv_header (int devno, size_t *payload_size )
   int result;
   int fd;
   int attempt;
+  int16_t expected;
 
   PDBG (bjnp_dbg
 	(LOG_DEBUG, "bjnp_recv_header: receiving response header\n") );
   fd = device[devno].tcp_socket;
 
+next_header:
   *payload_size = 0;
   attempt = 0;
   do
@@ -1416,7 +1644,7 @@ bjnp_recv_header (int devno, size_t *payload_size )
       FD_SET (fd, &input);
 
       timeout.tv_sec = device[devno].bjnp_ip_timeout /1000;
-      timeout.tv_usec = device[devno].bjnp_ip_timeout %1000;
+      timeout.tv_usec = (device[devno].bjnp_ip_timeout %1000) * BJNP_USLEEP_MS;
     }
   while ( ( (result = select (fd + 1, &input, NULL, NULL, &timeout)) <= 0) &&
 	 (errno == EINTR) && (attempt++ < BJNP_MAX_SELECT_ATTEMPTS));
@@ -1464,6 +1692,34 @@ bjnp_recv_header (int devno, size_t *payload_size )
       return SANE_STATUS_IO_ERROR;
     }
 
+  /* with several read requests in flight, the response is for the oldest */
+
+  expected = device[devno].serial;
+  if (device[devno].last_cmd == CMD_TCP_REQ && device[devno].reads_pending > 1)
+    expected -= device[devno].reads_pending - 1;
+
+  if (resp_buf.cmd_code == CMD_TCP_REQ && device[devno].reads_stale > 0 &&
+      (int16_t) (expected - ntohs (resp_buf.seq_no)) > 0)
+    {
+      /* a read request sent beyond the last block got answered after all */
+      if (device[devno].last_cmd == CMD_TCP_REQ && ntohl (resp_buf.payload_len) > 0)
+        {
+          /* the scanner answers in order, so this is the data we asked for,
+             the oldest pending request takes the place of the stale one */
+          PDBG (bjnp_dbg
+                (LOG_DEBUG, "bjnp_recv_header: data received on stale read request %d\n",
+                 (int) ntohs (resp_buf.seq_no)));
+          expected = ntohs (resp_buf.seq_no);
+        }
+      else
+        {
+          device[devno].reads_stale--;
+          if (bjnp_skip_data (devno, ntohl (resp_buf.payload_len)) != SANE_STATUS_GOOD)
+            return SANE_STATUS_IO_ERROR;
+          goto next_header;
+        }
+    }
+
   if (resp_buf.cmd_code != device[devno].last_cmd)
     {
       PDBG (bjnp_dbg
@@ -1473,12 +1729,12 @@ bjnp_recv_header (int devno, size_t *payload_size )
       return SANE_STATUS_IO_ERROR;
     }
 
-  if (ntohs (resp_buf.seq_no) != (uint16_t) device[devno].serial)
+  if (ntohs (resp_buf.seq_no) != (uint16_t) expected)
     {
       PDBG (bjnp_dbg
 	    (LOG_CRIT,
 	     "bjnp_recv_header: ERROR - Received response has serial %d, expected %d\n",
-	     (int) ntohs (resp_buf.seq_no), (int) device[devno].serial));
+	     (int) ntohs (resp_buf.seq_no), (int) expected));
       return SANE_STATUS_IO_ERROR;
     }
 
@@ -1524,6 +1780,11 @@ bjnp_init_device_structure(int dn, bjnp_sockaddr_t *sa, bjnp_protocol_defs_t *pr
   device[dn].last_cmd = 0;
   device[dn].blocksize = BJNP_BLOCKSIZE_START;
   device[dn].last_block = 0;
+  device[dn].read_ahead = BJNP_READ_AHEAD;
+  if (getenv ("PIXMA_BJNP_READ_AHEAD"))
+    device[dn].read_ahead = MAX (1, atoi (getenv ("PIXMA_BJNP_READ_AHEAD")));
+  device[dn].reads_pending = 0;
+  device[dn].reads_stale = 0;
   /* fill mac_address */
 
   if (bjnp_get_scanner_mac_address(dn, device[dn].mac_address) != 0 )
@@ -1595,7 +1856,7 @@ bjnp_recv_data (int devno, SANE_Byte * buffer, size_t start_pos, size_t * len)
       FD_ZERO (&input);
       FD_SET (fd, &input);
       timeout.tv_sec = device[devno].bjnp_ip_timeout /1000;
-      timeout.tv_usec = device[devno].bjnp_ip_timeout %1000;
+      timeout.tv_usec = (device[devno].bjnp_ip_timeout %1000) * BJNP_USLEEP_MS;
     }
   while (((result = select (fd + 1, &input, NULL, NULL, &timeout)) <= 0) &&
 	 (errno == EINTR) && (attempt++ < BJNP_MAX_SELECT_ATTEMPTS));
@@ -1639,6 +1900,77 @@ bjnp_recv_data (int devno, SANE_Byte * buffer, size_t start_pos, size_t * len)
   return SANE_STATUS_GOOD;
 }
 
+static SANE_Status
+bjnp_skip_data (int devno, size_t len)
+{
+/*
+ * This function reads and drops len bytes of payload data.
+ */
+  SANE_Byte buffer[BJNP_RESP_MAX];
+  size_t recvd;
+
+  if (len > 0)
+    PDBG (bjnp_dbg (LOG_NOTICE, "bjnp_skip_data: WARNING - dropping %ld bytes of payload\n",
+                    (long) len));
+  while (len > 0)
+    {
+      recvd = MIN (len, sizeof (buffer));
+      if (bjnp_recv_data (devno, buffer, 0, &recvd) != SANE_STATUS_GOOD || recvd == 0)
+        return SANE_STATUS_IO_ERROR;
+      len -= recvd;
+    }
+  return SANE_STATUS_GOOD;
+}
+
+static void
+bjnp_set_rcvbuf (int devno)
+{
+/*
+ * Make the TCP receive buffer large enough for the responses to all
+ * read requests in flight, so the scanner can keep sending.
+ * The buffer is never made smaller than the system default.
+ */
+  int val;
+  int cur;
+  socklen_t len = sizeof (cur);
+
+  if (device[devno].read_ahead <= 1 || device[devno].tcp_socket == -1 ||
+      device[devno].blocksize <= BJNP_BLOCKSIZE_START)
+    return;
+  val = device[devno].read_ahead *
+    (device[devno].blocksize + sizeof (struct BJNP_command));
+  if (getsockopt (device[devno].tcp_socket, SOL_SOCKET, SO_RCVBUF, &cur, &len) == 0 &&
+      cur >= val)
+    return;
+  PDBG (bjnp_dbg (LOG_DEBUG, "bjnp_set_rcvbuf: TCP receive buffer set to %d bytes\n", val));
+  setsockopt (device[devno].tcp_socket, SOL_SOCKET, SO_RCVBUF, &val, sizeof (val));
+}
+
+static int
+bjnp_request_reads (int devno, size_t wanted)
+{
+/*
+ * Send read requests, so that up to read_ahead are in flight, as long as
+ * the blocks for the ones already in flight don't cover the wanted data.
+ * Until the block size of the scanner is known, only one is sent.
+ * Returns: 0 on success, else -1
+ */
+  int max = device[devno].read_ahead;
+
+  if (device[devno].blocksize <= BJNP_BLOCKSIZE_START)
+    max = 1;
+
+  while (device[devno].reads_pending == 0 ||
+         (device[devno].reads_pending < max &&
+          device[devno].reads_pending * device[devno].blocksize < wanted))
+    {
+      if (bjnp_send_read_request (devno) != 0)
+        return -1;
+      device[devno].reads_pending++;
+    }
+  return 0;
+}
+
 static int
 bjnp_open_tcp (int devno)
 {
@@ -1702,6 +2034,10 @@ bjnp_open_tcp (int devno)
           (sock, &(addr->addr), sa_size(device[devno].addr)) == 0)
 	    {
               device[devno].tcp_socket = sock;
+              device[devno].scanner_data_left = 0;
+              device[devno].reads_pending = 0;
+              device[devno].reads_stale = 0;
+              bjnp_set_rcvbuf (devno);
               PDBG( bjnp_dbg(LOG_INFO, "bjnp_open_tcp: created socket %d\n", sock));
               return 0;
 	    }
@@ -1879,19 +2215,27 @@ bjnp_allocate_device (SANE_String_Const devname,
   return BJNP_STATUS_GOOD;
 }
 
-static void add_scanner(SANE_Int *dev_no,
-                        const char *uri,
+static int add_scanner(SANE_Int *dev_no,
+                       const char *uri,
 			SANE_Status (*attach_bjnp)
 			              (SANE_String_Const devname,
 			               SANE_String_Const serial,
 			               const struct pixma_config_t *cfg),
-                       const struct pixma_config_t *const pixma_devices[])
+                       const struct pixma_config_t *const pixma_devices[],
+                       char *model)
 
 {
+  /*
+   * Allocate and attach the scanner at uri
+   * model: (write) make & model of the scanner, may be NULL
+   * returns: 0 when the scanner was attached, -1 otherwise
+   */
+
   char scanner_host[BJNP_HOST_MAX];
   char serial[BJNP_SERIAL_MAX];
   char makemodel[BJNP_MODEL_MAX];
   const struct pixma_config_t *cfg = NULL;
+  int result = -1;
 
   /* Allocate device structure for scanner */
   switch (bjnp_allocate_device (uri, dev_no, scanner_host))
@@ -1924,6 +2268,11 @@ static void add_scanner(SANE_Int *dev_no,
                case SANE_STATUS_GOOD:
                  PDBG (bjnp_dbg (LOG_NOTICE, "add_scanner: New scanner added: %s, serial %s, mac address: %s.\n",
 	                         uri, serial, device[*dev_no].mac_address));
+                 if (model != NULL)
+                   {
+                     strcpy (model, makemodel);
+                   }
+                 result = 0;
                  break;
                default:
                  PDBG (bjnp_dbg (LOG_CRIT, "add_scanner: unexpected error (out of memory?), adding %s\n", makemodel));
@@ -1941,6 +2290,7 @@ static void add_scanner(SANE_Int *dev_no,
 	                 uri));
         break;
     }
+  return result;
 }
 
 int add_timeout_to_uri(char *uri, int timeout, int max_len)
@@ -1984,26 +2334,603 @@ int add_timeout_to_uri(char *uri, int timeout, int max_len)
   return 0;
 }
 
-/** Public functions **/
-
-/** Initialize sanei_bjnp.
+/*
+ * Discovery cache
  *
- * Call this before any other sanei_bjnp function.
+ * The scanners found by a discovery are stored in ~/.sane/pixma-bjnp.cache,
+ * one line per scanner:
+ * device <method>\t<address>\t<port>\t<host>\t<mac address>\t<make & model>
+ * The next discovery sends a unicast discover to each of them and does not
+ * have to wait for the responses to a broadcast.
  */
-extern void
-sanei_bjnp_init (void)
+
+static int
+bjnp_cache_path (char *path, size_t size)
 {
-  DBG_INIT();
-  bjnp_no_devices = 0;
-}
+  /*
+   * Path of the cache file, PIXMA_BJNP_CACHE overrides the default,
+   * an empty PIXMA_BJNP_CACHE disables the cache.
+   * returns: 0 on success, -1 if there is no cache
+   */
 
-/**
- * Find devices that implement the bjnp protocol
- *
- * The function attach is called for every device which has been found.
- *
- * @param attach attach function
- *
+  const char *env;
+
+  if ((env = getenv ("PIXMA_BJNP_CACHE")) != NULL)
+    {
+      if (env[0] == '\0')
+        {
+          return -1;
+        }
+      snprintf (path, size, "%s", env);
+      return 0;
+    }
+  if ((env = getenv ("HOME")) == NULL)
+    {
+      return -1;
+    }
+  snprintf (path, size, "%s/.sane/%s", env, BJNP_CACHE_FILE);
+  return 0;
+}
+
+static int
+bjnp_cache_find (const bjnp_cache_entry_t *cache, int count, const char *mac_address)
+{
+  int i;
+
+  for (i = 0; i < count; i++)
+    {
+      if (strcmp (cache[i].mac_address, mac_address) == 0)
+        {
+          return i;
+        }
+    }
+  return -1;
+}
+
+static int
+bjnp_cache_add (bjnp_cache_entry_t *cache, int count, const bjnp_cache_entry_t *entry)
+{
+  /*
+   * Add entry, or replace the entry for the same scanner
+   * returns: the new number of entries
+   */
+
+  int i;
+
+  if ((i = bjnp_cache_find (cache, count, entry->mac_address)) == -1)
+    {
+      if (count == BJNP_CACHE_MAX)
+        {
+          return count;
+        }
+      i = count++;
+    }
+  memcpy (&cache[i], entry, sizeof (bjnp_cache_entry_t));
+  return count;
+}
+
+static void
+bjnp_cache_set_entry (bjnp_cache_entry_t *entry, const bjnp_protocol_defs_t *protocol_defs,
+                      const bjnp_sockaddr_t *scanner_sa, const char *host,
+                      const char *mac_address, const char *model)
+{
+  memset (entry, 0, sizeof (bjnp_cache_entry_t));
+  snprintf (entry->method, sizeof (entry->method), "%s", protocol_defs->method_string);
+  if (get_numeric_address (scanner_sa, entry->address) != 0)
+    {
+      entry->address[0] = '\0';
+    }
+  entry->port = get_port_from_sa (*scanner_sa);
+  snprintf (entry->host, sizeof (entry->host), "%s", host);
+  snprintf (entry->mac_address, sizeof (entry->mac_address), "%s", mac_address);
+  snprintf (entry->model, sizeof (entry->model), "%s", model);
+  entry->answered = 1;
+}
+
+static int
+bjnp_cache_load (bjnp_cache_entry_t *cache)
+{
+  /*
+   * Read the scanners of the cache file
+   * returns: the number of scanners
+   */
+
+  char path[PATH_MAX];
+  char line[1024];
+  char *field[6];
+  char *p;
+  FILE *fp;
+  size_t len;
+  int count = 0;
+  int i;
+
+  if ((bjnp_cache_path (path, sizeof (path)) != 0) ||
+      ((fp = fopen (path, "r")) == NULL))
+    {
+      return 0;
+    }
+
+  while ((count < BJNP_CACHE_MAX) && (fgets (line, sizeof (line), fp) != NULL))
+    {
+      len = strlen (line);
+      if ((len > 0) && (line[len - 1] == '\n'))
+        {
+          line[--len] = '\0';
+        }
+      if (strncmp (line, "device ", 7) != 0)
+        {
+          continue;
+        }
+      p = line + 7;
+      for (i = 0; (i < 6) && (p != NULL); i++)
+        {
+          field[i] = p;
+          if ((p = strchr (p, '\t')) != NULL)
+            {
+              *p++ = '\0';
+            }
+        }
+      if ((i < 6) || (p != NULL) || (get_protocol_by_method (field[0]) == NULL) ||
+          (field[1][0] == '\0') || (atoi (field[2]) <= 0) ||
+          (field[3][0] == '\0') || (field[4][0] == '\0'))
+        {
+          PDBG (bjnp_dbg (LOG_INFO, "bjnp_cache_load: skipping invalid line in %s\n", path));
+          continue;
+        }
+
+      memset (&cache[count], 0, sizeof (bjnp_cache_entry_t));
+      snprintf (cache[count].method, sizeof (cache[count].method), "%s", field[0]);
+      snprintf (cache[count].address, sizeof (cache[count].address), "%s", field[1]);
+      cache[count].port = atoi (field[2]);
+      snprintf (cache[count].host, sizeof (cache[count].host), "%s", field[3]);
+      snprintf (cache[count].mac_address, sizeof (cache[count].mac_address), "%s", field[4]);
+      snprintf (cache[count].model, sizeof (cache[count].model), "%s", field[5]);
+      count++;
+    }
+  fclose (fp);
+  PDBG (bjnp_dbg (LOG_DEBUG, "bjnp_cache_load: %d scanners in %s\n", count, path));
+  return count;
+}
+
+typedef struct
+{
+  const bjnp_cache_entry_t *cache;
+  int count;
+  int saved;
+} bjnp_cache_list_t;
+
+static SANE_Status
+bjnp_cache_write (FILE *fp, void *data)
+{
+  /*
+   * Write the scanners that answered, callback of sanei_config_write_file
+   */
+
+  bjnp_cache_list_t *list = data;
+  const bjnp_cache_entry_t *cache = list->cache;
+  int i;
+
+  fprintf (fp, "# SANE pixma BJNP scanner cache, generated automatically\n");
+  for (i = 0; i < list->count; i++)
+    {
+      if (!cache[i].answered || (cache[i].address[0] == '\0') ||
+          strpbrk (cache[i].host, "\t\n") || strpbrk (cache[i].model, "\t\n"))
+        {
+          continue;
+        }
+      fprintf (fp, "device %s\t%s\t%d\t%s\t%s\t%s\n", cache[i].method,
+               cache[i].address, cache[i].port, cache[i].host,
+               cache[i].mac_address, cache[i].model);
+      list->saved++;
+    }
+  return ferror (fp) ? SANE_STATUS_IO_ERROR : SANE_STATUS_GOOD;
+}
+
+static void
+bjnp_cache_save (const bjnp_cache_entry_t *cache, int count)
+{
+  /*
+   * Write the scanners that answered to the cache file
+   */
+
+  char path[PATH_MAX];
+  bjnp_cache_list_t list;
+  SANE_Status status;
+
+  if (bjnp_cache_path (path, sizeof (path)) != 0)
+    {
+      return;
+    }
+  list.cache = cache;
+  list.count = count;
+  list.saved = 0;
+
+  /* the background discovery and the caller write the same file */
+
+#ifdef BJNP_USE_THREADS
+  pthread_mutex_lock (&cache_mutex);
+#endif
+  status = sanei_config_write_file (path, bjnp_cache_write, &list);
+#ifdef BJNP_USE_THREADS
+  pthread_mutex_unlock (&cache_mutex);
+#endif
+  if (status != SANE_STATUS_GOOD)
+    {
+      PDBG (bjnp_dbg (LOG_NOTICE, "bjnp_cache_save: Cannot write %s\n", path));
+    }
+  else
+    {
+      PDBG (bjnp_dbg (LOG_DEBUG, "bjnp_cache_save: %d scanners in %s\n", list.saved, path));
+    }
+}
+
+static int
+bjnp_cache_probe (bjnp_cache_entry_t *cache, int count)
+{
+  /*
+   * Send a unicast discover to all cached scanners at once and wait until
+   * each of them answered, at most BJNP_BC_RESPONSE_TIMEOUT.
+   * A scanner only counts when its mac address is still the cached one.
+   * returns: the number of scanners that answered
+   */
+
+  int sockfd[BJNP_CACHE_MAX];
+  struct BJNP_command cmd;
+  unsigned char resp_buf[BJNP_RESP_MAX];
+  struct DISCOVER_RESPONSE *disc_resp = (struct DISCOVER_RESPONSE *) resp_buf;
+  char mac_address[BJNP_HOST_MAX];
+  char port[BJNP_PORT_MAX];
+  struct addrinfo hints;
+  struct addrinfo *res;
+  struct timeval start;
+  struct timeval now;
+  struct timeval timeout;
+  fd_set fdset;
+  int answered = 0;
+  int attempt;
+  int last_socketfd;
+  int numbytes;
+  int left;
+  int result;
+  int i;
+
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+  hints.ai_socktype = SOCK_DGRAM;
+
+  for (i = 0; i < count; i++)
+    {
+      cache[i].answered = 0;
+      sockfd[i] = -1;
+      sprintf (port, "%d", cache[i].port);
+      if (getaddrinfo (cache[i].address, port, &hints, &res) != 0)
+        {
+          PDBG (bjnp_dbg (LOG_INFO, "bjnp_cache_probe: Invalid address %s\n", cache[i].address));
+          continue;
+        }
+      if (((sockfd[i] = socket (res->ai_family, SOCK_DGRAM, IPPROTO_UDP)) != -1) &&
+          (connect (sockfd[i], res->ai_addr, res->ai_addrlen) != 0))
+        {
+          close (sockfd[i]);
+          sockfd[i] = -1;
+        }
+      freeaddrinfo (res);
+    }
+
+  gettimeofday (&start, NULL);
+  for (attempt = 0; (attempt < BJNP_MAX_BROADCAST_ATTEMPTS) && (answered < count); attempt++)
+    {
+      for (i = 0; i < count; i++)
+        {
+          if ((sockfd[i] != -1) && !cache[i].answered)
+            {
+              set_cmd_from_string (get_protocol_by_method (cache[i].method)->proto_string,
+                                   &cmd, CMD_UDP_DISCOVER, 0);
+              send (sockfd[i], &cmd, sizeof (cmd), 0);
+            }
+        }
+
+      /* the attempts share the response timeout */
+
+      for (;;)
+        {
+          gettimeofday (&now, NULL);
+          left = BJNP_BC_RESPONSE_TIMEOUT * (attempt + 1) / BJNP_MAX_BROADCAST_ATTEMPTS -
+                 ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_usec - start.tv_usec) / 1000);
+
+          FD_ZERO (&fdset);
+          last_socketfd = -1;
+          for (i = 0; i < count; i++)
+            {
+              if ((sockfd[i] != -1) && !cache[i].answered)
+                {
+                  FD_SET (sockfd[i], &fdset);
+                  last_socketfd = MAX (last_socketfd, sockfd[i]);
+                }
+            }
+          if ((left <= 0) || (last_socketfd == -1))
+            {
+              break;
+            }
+
+          timeout.tv_sec = left / 1000;
+          timeout.tv_usec = (left % 1000) * BJNP_USLEEP_MS;
+          if ((result = select (last_socketfd + 1, &fdset, NULL, NULL, &timeout)) <= 0)
+            {
+              if ((result < 0) && (errno == EINTR))
+                {
+                  continue;
+                }
+              break;
+            }
+
+          for (i = 0; i < count; i++)
+            {
+              if ((sockfd[i] == -1) || !FD_ISSET (sockfd[i], &fdset))
+                {
+                  continue;
+                }
+              numbytes = recv (sockfd[i], resp_buf, sizeof (resp_buf), 0);
+              if ((numbytes == -1) && (errno == ECONNREFUSED))
+                {
+                  /* nothing listens on this address any more */
+
+                  PDBG (bjnp_dbg (LOG_INFO, "bjnp_cache_probe: %s does not answer\n",
+                                   cache[i].address));
+                  close (sockfd[i]);
+                  sockfd[i] = -1;
+                  continue;
+                }
+              if ((numbytes < (int) offsetof (struct DISCOVER_RESPONSE, addresses)) ||
+                  !(disc_resp->response.dev_type & 0x80) ||
+                  (disc_resp->response.cmd_code != CMD_UDP_DISCOVER))
+                {
+                  continue;
+                }
+              u8tohex (mac_address, disc_resp->mac_addr, sizeof (disc_resp->mac_addr));
+              if (strcmp (mac_address, cache[i].mac_address) != 0)
+                {
+                  PDBG (bjnp_dbg (LOG_INFO, "bjnp_cache_probe: %s is now used by scanner %s\n",
+                                   cache[i].address, mac_address));
+                  close (sockfd[i]);
+                  sockfd[i] = -1;
+                  continue;
+                }
+              PDBG (bjnp_dbg (LOG_DEBUG, "bjnp_cache_probe: %s (%s) answered\n",
+                               cache[i].host, cache[i].model));
+              cache[i].answered = 1;
+              answered++;
+            }
+        }
+    }
+
+  for (i = 0; i < count; i++)
+    {
+      if (sockfd[i] != -1)
+        {
+          close (sockfd[i]);
+        }
+    }
+  PDBG (bjnp_dbg (LOG_DEBUG, "bjnp_cache_probe: %d of %d cached scanners answered\n",
+                   answered, count));
+  return answered;
+}
+
+#ifdef BJNP_USE_THREADS
+static int
+bjnp_probe_model (const bjnp_sockaddr_t *scanner_sa, const bjnp_protocol_defs_t *protocol_defs,
+                  char *model)
+{
+  /*
+   * get make & model of a scanner that has no device structure
+   * returns: 0 on success, -1 in case of errors
+   */
+
+  struct BJNP_command cmd;
+  char resp_buf[BJNP_RESP_MAX];
+  struct timeval timeout;
+  fd_set fdset;
+  int numbytes = -1;
+  int sockfd;
+  int try;
+
+  if ((sockfd = socket (scanner_sa->addr.sa_family, SOCK_DGRAM, IPPROTO_UDP)) == -1)
+    {
+      return -1;
+    }
+  if (connect (sockfd, &(scanner_sa->addr), sa_size (scanner_sa)) != 0)
+    {
+      close (sockfd);
+      return -1;
+    }
+
+  set_cmd_from_string (protocol_defs->proto_string, &cmd, CMD_UDP_GET_ID, 0);
+  for (try = 0; (try < BJNP_UDP_RETRY_MAX) && (numbytes < (int) sizeof (struct BJNP_command)); try++)
+    {
+      if (send (sockfd, &cmd, sizeof (cmd), 0) != sizeof (cmd))
+        {
+          continue;
+        }
+      FD_ZERO (&fdset);
+      FD_SET (sockfd, &fdset);
+      timeout.tv_sec = BJNP_BC_RESPONSE_TIMEOUT / 1000;
+      timeout.tv_usec = (BJNP_BC_RESPONSE_TIMEOUT % 1000) * BJNP_USLEEP_MS;
+      if (select (sockfd + 1, &fdset, NULL, NULL, &timeout) > 0)
+        {
+          numbytes = recv (sockfd, resp_buf, sizeof (resp_buf), 0);
+        }
+    }
+  close (sockfd);
+
+  if (numbytes < (int) sizeof (struct BJNP_command))
+    {
+      return -1;
+    }
+  get_model_from_identity (protocol_defs->protocol_version, (struct IDENTITY *) resp_buf,
+                           model);
+  return 0;
+}
+
+static void *
+bjnp_refresh (void *arg)
+{
+  /*
+   * Background discovery: broadcast a discover and add all scanners that
+   * answer to the cache, for the next discovery. Scanners are not attached.
+   */
+
+  int socket_fd[BJNP_SOCK_MAX];
+  bjnp_sockaddr_t broadcast_addr[BJNP_SOCK_MAX];
+  bjnp_sockaddr_t scanner_sa;
+  unsigned char resp_buf[2048];
+  struct DISCOVER_RESPONSE *disc_resp = (struct DISCOVER_RESPONSE *) resp_buf;
+  bjnp_protocol_defs_t *protocol_defs;
+  bjnp_cache_entry_t entry;
+  char scanner_host[BJNP_HOST_MAX];
+  char mac_address[BJNP_HOST_MAX];
+  char makemodel[BJNP_MODEL_MAX];
+  fd_set fdset;
+  fd_set active_fdset;
+  struct timeval timeout;
+  int last_socketfd;
+  int no_sockets;
+  int port;
+  int i;
+
+  (void) arg;
+  memset (&scanner_sa, 0, sizeof (scanner_sa));
+
+  no_sockets = bjnp_open_discovery_sockets (socket_fd, broadcast_addr, &fdset,
+                                            &last_socketfd);
+  bjnp_broadcast_discover (socket_fd, broadcast_addr, no_sockets);
+
+  timeout.tv_sec = 0;
+  timeout.tv_usec = BJNP_BC_RESPONSE_TIMEOUT * BJNP_USLEEP_MS;
+  active_fdset = fdset;
+
+  while (select (last_socketfd + 1, &active_fdset, NULL, NULL, &timeout) > 0)
+    {
+      for (i = 0; i < no_sockets; i++)
+        {
+          if (!FD_ISSET (socket_fd[i], &active_fdset) ||
+              (bjnp_recv_discover_response (socket_fd[i], resp_buf, sizeof (resp_buf),
+                                            &scanner_sa, &protocol_defs) <
+               (int) offsetof (struct DISCOVER_RESPONSE, addresses)))
+            {
+              continue;
+            }
+
+          /* each scanner answers every broadcast */
+
+          u8tohex (mac_address, disc_resp->mac_addr, sizeof (disc_resp->mac_addr));
+          if ((bjnp_cache_find (refresh_cache, refresh_count, mac_address) != -1) ||
+              (bjnp_probe_model (&scanner_sa, protocol_defs, makemodel) != 0))
+            {
+              continue;
+            }
+          /*
+           * use the address, as get_scanner_name does when there is no
+           * name: a reverse lookup can take as long as the resolver timeout
+           * and sanei_bjnp_exit waits for this thread. The next full
+           * discovery stores the host name.
+           */
+
+          scanner_host[0] = '\0';
+          get_address_info (&scanner_sa, scanner_host, &port);
+          if (scanner_host[0] == '\0')
+            {
+              continue;
+            }
+          bjnp_cache_set_entry (&entry, protocol_defs, &scanner_sa, scanner_host,
+                                mac_address, makemodel);
+          refresh_count = bjnp_cache_add (refresh_cache, refresh_count, &entry);
+          PDBG (bjnp_dbg (LOG_DEBUG, "bjnp_refresh: found %s (%s)\n", scanner_host, makemodel));
+        }
+      active_fdset = fdset;
+      timeout.tv_sec = 0;
+      timeout.tv_usec = BJNP_BC_RESPONSE_TIMEOUT * BJNP_USLEEP_MS;
+    }
+
+  for (i = 0; i < no_sockets; i++)
+    close (socket_fd[i]);
+
+  bjnp_cache_save (refresh_cache, refresh_count);
+
+  pthread_mutex_lock (&cache_mutex);
+  refresh_finished = 1;
+  pthread_mutex_unlock (&cache_mutex);
+  return NULL;
+}
+
+static void
+bjnp_join_refresh (void)
+{
+  /* wait for the background discovery to finish */
+
+  if (refresh_started)
+    {
+      pthread_join (refresh_thread, NULL);
+      refresh_started = 0;
+    }
+}
+
+static int
+bjnp_start_refresh (const bjnp_cache_entry_t *cache, int count)
+{
+  /*
+   * Start the background discovery, unless it runs already
+   * cache: the scanners that answered, these stay in the cache
+   * returns: 0 on success, -1 if no thread can be started
+   */
+
+  int finished;
+
+  if (refresh_started)
+    {
+      pthread_mutex_lock (&cache_mutex);
+      finished = refresh_finished;
+      pthread_mutex_unlock (&cache_mutex);
+      if (!finished)
+        {
+          return 0;
+        }
+      /* a scanner may have been switched on since the last refresh */
+      bjnp_join_refresh ();
+    }
+  memcpy (refresh_cache, cache, count * sizeof (bjnp_cache_entry_t));
+  refresh_count = count;
+  refresh_finished = 0;
+  if (pthread_create (&refresh_thread, NULL, bjnp_refresh, NULL) != 0)
+    {
+      PDBG (bjnp_dbg (LOG_NOTICE, "bjnp_start_refresh: Cannot start thread: %s\n",
+                       strerror (errno)));
+      return -1;
+    }
+  refresh_started = 1;
+  return 0;
+}
+#endif
+
+/** Public functions **/
+
+/** Initialize sanei_bjnp.
+ *
+ * Call this before any other sanei_bjnp function.
+ */
+extern void
+sanei_bjnp_init (void)
+{
+  DBG_INIT();
+  bjnp_no_devices = 0;
+}
+
+/**
+ * Find devices that implement the bjnp protocol
+ *
+ * The function attach is called for every device which has been found.
+ *
+ * @param attach attach function
+ *
  * @return SANE_STATUS_GOOD - on success (even if no scanner was found)
  */
 extern SANE_Status
@@ -2014,29 +2941,28 @@ sanei_bjnp_find_devices (const char **conf_devices,
 			      const struct pixma_config_t *cfg),
 			 const struct pixma_config_t *const pixma_devices[])
 {
-  int numbytes = 0;
-  struct BJNP_command cmd;
   unsigned char resp_buf[2048];
-  struct DISCOVER_RESPONSE *disc_resp = ( struct DISCOVER_RESPONSE *) & resp_buf;
   int socket_fd[BJNP_SOCK_MAX];
   int no_sockets;
   int i;
   int j;
-  int attempt;
   int last_socketfd = 0;
   fd_set fdset;
   fd_set active_fdset;
   struct timeval timeout;
-  char scanner_host[HOST_NAME_MAX];
-  char uri[HOST_NAME_MAX + 32];
+  char scanner_host[BJNP_HOST_MAX];
+  char uri[BJNP_METHOD_MAX + BJNP_HOST_MAX + 32];
+  char makemodel[BJNP_MODEL_MAX];
   int dev_no;
   int port;
   int auto_detect = 1;
   int timeout_default = BJNP_TIMEOUT_DEFAULT;
   bjnp_sockaddr_t broadcast_addr[BJNP_SOCK_MAX];
   bjnp_sockaddr_t scanner_sa;
-  socklen_t socklen;
   bjnp_protocol_defs_t *protocol_defs;
+  bjnp_cache_entry_t cache[BJNP_CACHE_MAX];
+  bjnp_cache_entry_t entry;
+  int cache_count;
 
   memset( broadcast_addr, 0, sizeof( broadcast_addr) );
   memset( &scanner_sa, 0 ,sizeof( scanner_sa ) );
@@ -2079,9 +3005,9 @@ sanei_bjnp_find_devices (const char **conf_devices,
 	  else
             {
               PDBG (bjnp_dbg (LOG_DEBUG, "sanei_bjnp_find_devices: Adding scanner from pixma.conf: %s\n", conf_devices[i]));
-              memcpy(uri, conf_devices[i], sizeof(uri));
+              snprintf(uri, sizeof(uri), "%s", conf_devices[i]);
               add_timeout_to_uri(uri, timeout_default, sizeof(uri));
-              add_scanner(&dev_no, uri, attach_bjnp, pixma_devices);
+              add_scanner(&dev_no, uri, attach_bjnp, pixma_devices, NULL);
 	    }
         }
       PDBG (bjnp_dbg (LOG_DEBUG, "sanei_bjnp_find_devices: Added all specified scanners.\n"));
@@ -2096,109 +3022,60 @@ sanei_bjnp_find_devices (const char **conf_devices,
       return SANE_STATUS_GOOD;
     }
   /*
-   * Send UDP DISCOVER to discover scanners and return the list of scanners found
+   * Check the scanners found by earlier discoveries with a unicast
+   * discover first. When all of them answer, the broadcast only refreshes
+   * the cache in the background, so we do not wait for its responses.
    */
 
-  PDBG (bjnp_dbg( LOG_DEBUG, "sanei_bjnp_find_devices: Start auto-detection.\n" ) );
-  FD_ZERO (&fdset);
-
-  no_sockets = 0;
-#ifdef HAVE_IFADDRS_H
-  {
-    struct ifaddrs *interfaces = NULL;
-    struct ifaddrs *interface;
-    getifaddrs (&interfaces);
+  cache_count = bjnp_cache_load (cache);
+  if (cache_count > 0)
+    {
+      bjnp_cache_probe (cache, cache_count);
+      for (i = 0; i < cache_count; i++)
+        {
+          if (cache[i].answered &&
+              (snprintf (uri, sizeof (uri), "%s://%s:%d/timeout=%d", cache[i].method,
+                         cache[i].host, cache[i].port, timeout_default) < (int) sizeof (uri)))
+            {
+              add_scanner (&dev_no, uri, attach_bjnp, pixma_devices, NULL);
+            }
+        }
+    }
 
-    /* create a socket for each suitable interface */
+  /* drop the cached scanners that did not answer */
 
-    interface = interfaces;
-    while ((no_sockets < BJNP_SOCK_MAX) && (interface != NULL))
-      {
-        if ( ! (interface -> ifa_flags & IFF_POINTOPOINT) &&
-            ( (socket_fd[no_sockets] =
-                      prepare_socket( interface -> ifa_name,
-                                      (bjnp_sockaddr_t *) interface -> ifa_addr,
-                                      (bjnp_sockaddr_t *) interface -> ifa_broadaddr,
-                                      &broadcast_addr[no_sockets] ) ) != -1 ) )
-          {
-            /* track highest used socket for later use in select */
-            if (socket_fd[no_sockets] > last_socketfd)
-              {
-                last_socketfd = socket_fd[no_sockets];
-              }
-            FD_SET (socket_fd[no_sockets], &fdset);
-            no_sockets++;
-          }
-        interface = interface->ifa_next;
-      }
-    freeifaddrs (interfaces);
-  }
-#else
-  /* we have no easy way to find interfaces with their broadcast addresses. */
-  /* use global broadcast and all-hosts instead */
-  {
-    bjnp_sockaddr_t local;
-    bjnp_sockaddr_t bc_addr;
+  for (i = 0, j = 0; i < cache_count; i++)
+    {
+      if (cache[i].answered)
+        {
+          cache[j++] = cache[i];
+        }
+    }
 
-    memset( &local, 0, sizeof( local) );
-    local.ipv4.sin_family = AF_INET;
-    local.ipv4.sin_addr.s_addr = htonl (INADDR_ANY);
+#ifdef BJNP_USE_THREADS
+  if ((cache_count > 0) && (j == cache_count) && (bjnp_start_refresh (cache, j) == 0))
+    {
+      PDBG (bjnp_dbg (LOG_DEBUG, "sanei_find_devices: all %d cached scanners answered\n",
+                       cache_count));
+      return SANE_STATUS_GOOD;
+    }
+#endif
+  cache_count = j;
 
-    bc_addr.ipv4.sin_family = AF_INET;
-    bc_addr.ipv4.sin_port = htons(0);
-    bc_addr.ipv4.sin_addr.s_addr = htonl (INADDR_BROADCAST);
+  /*
+   * Send UDP DISCOVER to discover scanners and return the list of scanners found
+   */
 
-    socket_fd[no_sockets] = prepare_socket( "any_interface",
-                                   &local,
-                                   &bc_addr,
-                                   &broadcast_addr[no_sockets] );
-    if (socket_fd[no_sockets] >= 0)
-      {
-        FD_SET (socket_fd[no_sockets], &fdset);
-        if (socket_fd[no_sockets] > last_socketfd)
-          {
-            last_socketfd = socket_fd[no_sockets];
-          }
-        no_sockets++;
-      }
-#ifdef ENABLE_IPV6
-    local.ipv6.sin6_family = AF_INET6;
-    local.ipv6.sin6_addr = in6addr_any;
+  PDBG (bjnp_dbg( LOG_DEBUG, "sanei_bjnp_find_devices: Start auto-detection.\n" ) );
 
-    socket_fd[no_sockets] = prepare_socket( "any_interface",
-                                   &local,
-                                   NULL,
-                                   &broadcast_addr[no_sockets] );
-    if (socket_fd[no_sockets] >= 0)
-      {
-        FD_SET (socket_fd[no_sockets], &fdset);
-        if (socket_fd[no_sockets] > last_socketfd)
-          {
-            last_socketfd = socket_fd[no_sockets];
-          }
-        no_sockets++;
-      }
-#endif
-  }
+#ifdef BJNP_USE_THREADS
+  /* a background refresh would hold the same broadcast sockets */
+  bjnp_join_refresh ();
 #endif
 
-  /* send BJNP_MAX_BROADCAST_ATTEMPTS broadcasts on each prepared socket */
-  for (attempt = 0; attempt < BJNP_MAX_BROADCAST_ATTEMPTS; attempt++)
-    {
-      for ( i=0; i < no_sockets; i++)
-        {
-	  j = 0;
-          while(bjnp_protocol_defs[j].protocol_version != PROTOCOL_NONE)
-	    {
-	      set_cmd_from_string (bjnp_protocol_defs[j].proto_string, &cmd, CMD_UDP_DISCOVER, 0);
-              bjnp_send_broadcast ( socket_fd[i], &broadcast_addr[i],
-                                    bjnp_protocol_defs[j].default_port, cmd, sizeof (cmd));
-	      j++;
-	    }
-	}
-      /* wait for some time between broadcast packets */
-      usleep (BJNP_BROADCAST_INTERVAL * BJNP_USLEEP_MS);
-    }
+  no_sockets = bjnp_open_discovery_sockets (socket_fd, broadcast_addr, &fdset,
+                                            &last_socketfd);
+  bjnp_broadcast_discover (socket_fd, broadcast_addr, no_sockets);
 
   /* wait for a UDP response */
 
@@ -2216,42 +3093,11 @@ sanei_bjnp_find_devices (const char **conf_devices,
 	{
 	  if (FD_ISSET (socket_fd[i], &active_fdset))
 	    {
-              socklen =  sizeof(scanner_sa);
-	      if ((numbytes =
-		   recvfrom (socket_fd[i], resp_buf, sizeof (resp_buf), 0,
-                             &(scanner_sa.addr), &socklen ) ) == -1)
-		{
-		  PDBG (bjnp_dbg
-			(LOG_INFO, "sanei_find_devices: no data received"));
-		  break;
-		}
-	      else
-		{
-		  PDBG (bjnp_dbg (LOG_DEBUG2, "sanei_find_devices: Discover response:\n"));
-		  PDBG (bjnp_hexdump (LOG_DEBUG2, &resp_buf, numbytes));
-
-		  /* check if something sensible is returned */
-		  protocol_defs = get_protocol_by_proto_string(disc_resp-> response.BJNP_id);
-		  if ( (numbytes < (int)sizeof (struct BJNP_command)) ||
-		       (protocol_defs == NULL))
-		    {
-		      /* not a valid response, assume not a scanner  */
-
-                      char bjnp_id[5];
-                      strncpy(bjnp_id,  disc_resp-> response.BJNP_id, 4);
-                      bjnp_id[4] = '\0';
-                      PDBG (bjnp_dbg (LOG_INFO,
-                        "sanei_find_devices: Invalid discover response! Length = %d, Id = %s\n",
-                        numbytes, bjnp_id ) );
-		      break;
-		    }
-                  if ( !(disc_resp -> response.dev_type & 0x80) )
-                    {
-                      /* not a response, a command from somebody else or */
-                      /* a discover command that we generated */
-                      break;
-                    }
-		};
+	      if (bjnp_recv_discover_response (socket_fd[i], resp_buf, sizeof (resp_buf),
+	                                       &scanner_sa, &protocol_defs) == -1)
+	        {
+	          continue;
+	        }
 
 	      port = get_port_from_sa(scanner_sa);
 	      /* scanner found, get IP-address or hostname */
@@ -2261,8 +3107,12 @@ sanei_bjnp_find_devices (const char **conf_devices,
 	      sprintf (uri, "%s://%s:%d/timeout=%d", protocol_defs->method_string, scanner_host,
 		           port, timeout_default);
 
-              add_scanner( &dev_no, uri, attach_bjnp, pixma_devices);
-
+              if (add_scanner( &dev_no, uri, attach_bjnp, pixma_devices, makemodel) == 0)
+                {
+                  bjnp_cache_set_entry (&entry, protocol_defs, &scanner_sa, scanner_host,
+                                        device[dev_no].mac_address, makemodel);
+                  cache_count = bjnp_cache_add (cache, cache_count, &entry);
+                }
 	    }
 	}
       active_fdset = fdset;
@@ -2274,9 +3124,23 @@ sanei_bjnp_find_devices (const char **conf_devices,
   for (i = 0; i < no_sockets; i++)
     close (socket_fd[i]);
 
+  bjnp_cache_save (cache, cache_count);
   return SANE_STATUS_GOOD;
 }
 
+/**
+ * Stop sanei_bjnp.
+ *
+ * Waits for a discovery that still runs in the background.
+ */
+extern void
+sanei_bjnp_exit (void)
+{
+#ifdef BJNP_USE_THREADS
+  bjnp_join_refresh ();
+#endif
+}
+
 /** Open a BJNP device.
  *
  * The device is opened by its name devname and the device number is
@@ -2436,10 +3300,14 @@ sanei_bjnp_read_bulk (SANE_Int dn, SANE_Byte * buffer, size_t * size)
 	  /* There is no data in flight from the scanner, send new read request */
 
           PDBG (bjnp_dbg (LOG_DEBUG,
-                          "bjnp_read_bulk: No (more) scanner data available, requesting more( blocksize = %ld = %lx\n",
-                          (long int) device[dn].blocksize, (long int) device[dn].blocksize ));
+                          "bjnp_read_bulk: No (more) scanner data available, requesting more( blocksize = %ld = %lx, %d requests in flight\n",
+                          (long int) device[dn].blocksize, (long int) device[dn].blocksize,
+                          device[dn].reads_pending ));
+
+          /* keep more read requests in flight, so the scanner can send the
+             next blocks while we are reading this one */
 
-          if ((error = bjnp_send_read_request (dn)) != SANE_STATUS_GOOD)
+          if ((error = bjnp_request_reads (dn, requested - recvd)) != SANE_STATUS_GOOD)
             {
               *size = recvd;
               return SANE_STATUS_IO_ERROR;
@@ -2449,17 +3317,26 @@ sanei_bjnp_read_bulk (SANE_Int dn, SANE_Byte * buffer, size_t * size)
               *size = recvd;
               return SANE_STATUS_IO_ERROR;
             }
+          device[dn].reads_pending--;
+
           /* correct blocksize if applicable */
 
-          device[dn].blocksize = MAX (device[dn].blocksize, device[dn].scanner_data_left);
+          if (device[dn].scanner_data_left > device[dn].blocksize)
+            {
+              device[dn].blocksize = device[dn].scanner_data_left;
+              bjnp_set_rcvbuf (dn);
+            }
 
           if ( device[dn].scanner_data_left < device[dn].blocksize)
             {
               /* the scanner will not react at all to a read request, when no more data is available */
               /* we now determine end of data by comparing the payload size to the maximum blocksize */
               /* this block is shorter than blocksize, so after this block we are done */
+              /* and the read requests still in flight will not be answered */
 
               device[dn].last_block = 1;
+              device[dn].reads_stale += device[dn].reads_pending;
+              device[dn].reads_pending = 0;
             }
         }
 
@@ -63,6 +63,12 @@
  */
 extern void sanei_bjnp_init (void);
 
+/** Stop sanei_bjnp.
+ *
+ * Waits for a scanner discovery that still runs in the background.
+ */
+extern void sanei_bjnp_exit (void);
+
 /** Find scanners responding to a BJNP broadcast.
  *
  * The function sanei_bjnp_attach is called for every device which has
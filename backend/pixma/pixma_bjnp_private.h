@@ -76,6 +76,9 @@
 #define BJNP_NO_DEVICES 16		/* max number of open devices */
 #define BJNP_SCAN_BUF_MAX 65536		/* size of scanner data intermediate buffer */
 #define BJNP_BLOCKSIZE_START 512	/* startsize for last block detection */
+#define BJNP_READ_AHEAD 1		/* default max nr of TCP read requests in flight */
+#define BJNP_CACHE_MAX BJNP_NO_DEVICES	/* max nr of scanners in the cache */
+#define BJNP_CACHE_FILE "pixma-bjnp.cache"	/* cache name in ~/.sane */
 
 /* timers */
 #define BJNP_BROADCAST_INTERVAL 10 	/* ms between broadcasts */
@@ -367,6 +370,9 @@ typedef struct device_s
   size_t blocksize;		/* size of (TCP) blocks returned by the scanner */
   size_t scanner_data_left;	/* TCP data left from last read request */
   char last_block;		/* last TCP read command was shorter than blocksize */
+  int read_ahead;		/* max nr of TCP read requests in flight */
+  int reads_pending;		/* read requests sent, but not answered yet */
+  int reads_stale;		/* read requests sent beyond the end of data */
 
   /* device information */
   char mac_address[BJNP_HOST_MAX];
@@ -384,3 +390,18 @@ typedef struct device_s
   uint32_t status_key;		/* key of last received status message */
 #endif
 } bjnp_device_t;
+
+/*
+ * Scanner found by an earlier discovery, see sanei_bjnp_find_devices
+ */
+
+typedef struct
+{
+  char method[BJNP_METHOD_MAX];	/* bjnp or mfnp */
+  char address[BJNP_HOST_MAX];	/* numeric address the scanner answered from */
+  int port;
+  char host[BJNP_HOST_MAX];	/* host part of the URI */
+  char mac_address[BJNP_HOST_MAX];
+  char model[BJNP_MODEL_MAX];	/* make & model */
+  int answered;			/* answered the unicast discover */
+} bjnp_cache_entry_t;
@@ -297,6 +297,7 @@ pixma_io_cleanup (void)
   while (first_io)
     pixma_disconnect (first_io);
   clear_scanner_list ();
+  sanei_bjnp_exit ();
 }
 
 unsigned
@@ -1115,6 +1115,91 @@ reorder_pixels (uint8_t * linebuf, uint8_t * sptr, unsigned c, unsigned n,
   memcpy (sptr, linebuf, line_size);
 }
 
+/* Copy one c byte pixel; constant sizes let the compiler use plain moves
+ * instead of a memcpy() call per pixel. */
+#define GATHER_PIXELS(size)                                     \
+  for (i = 0; i < w; i++)                                       \
+    {                                                           \
+      memcpy (dptr, sptr + (size) * (b * m + a), (size));       \
+      dptr += (size);                                           \
+      if (++b == n)                                             \
+        {                                                       \
+          b = 0;                                                \
+          a++;                                                  \
+        }                                                       \
+    }
+
+/* Crop, reorder and convert a raw line in one pass.
+ * Pixels xs .. xs+w-1 of the raw line sptr are written to dptr.  With n > 1
+ * the line holds n sub-images of m pixels each, and pixel i of the image is
+ * pixel i/n of sub-image i%n (the layout reorder_pixels() undoes).  Pixels
+ * are c bytes; with gray set, the 48 bit RGB pixels are converted to 16 bit
+ * gray like pixma_rgb_to_gray() does.
+ * dptr may only overlap sptr if n == 1.
+ * Returns the end of the written data. */
+static uint8_t *
+gather_line (uint8_t * dptr, const uint8_t * sptr, unsigned c, unsigned n,
+             unsigned m, unsigned xs, unsigned w, int gray)
+{
+  unsigned i, a, b;
+
+  if (n <= 1)
+    {
+      n = 1;
+      m = 0;
+    }
+  a = xs / n;                   /* pixel within the sub-image */
+  b = xs % n;                   /* sub-image */
+
+  if (gray)
+    {
+      for (i = 0; i < w; i++)
+        {
+          const uint8_t *p = sptr + 6 * (b * m + a);
+          unsigned g = ((p[0] + (p[1] << 8)) * 2126
+                        + (p[2] + (p[3] << 8)) * 7152
+                        + (p[4] + (p[5] << 8)) * 722) / 10000;
+
+          *dptr++ = g;
+          *dptr++ = g >> 8;
+          if (++b == n)
+            {
+              b = 0;
+              a++;
+            }
+        }
+      return dptr;
+    }
+
+  if (n == 1)
+    {
+      memmove (dptr, sptr + c * xs, c * w);
+      return dptr + c * w;
+    }
+
+  switch (c)
+    {
+    case 1:
+      GATHER_PIXELS (1);
+      break;
+    case 2:
+      GATHER_PIXELS (2);
+      break;
+    case 3:
+      GATHER_PIXELS (3);
+      break;
+    case 6:
+      GATHER_PIXELS (6);
+      break;
+    default:
+      GATHER_PIXELS (c);
+      break;
+    }
+  return dptr;
+}
+
+#undef GATHER_PIXELS
+
 /* the scanned image must be shrunk by factor "scale"
  * the image can be formatted as rgb (c=3) or gray (c=1)
  * we need to crop the left side (xs)
@@ -1182,8 +1267,9 @@ static unsigned
 post_process_image_data (pixma_t * s, pixma_imagebuf_t * ib)
 {
   mp150_t *mp = (mp150_t *) s->subdriver;
-  unsigned c, lines, line_size, n, m, cw, cx;
-  uint8_t *sptr, *dptr, *gptr, *cptr;
+  unsigned c, lines, line_size, n, m, cw;
+  uint8_t *sptr, *cptr, *end;
+  int gray;
 
   if (s->param->mode_jpeg)
     {
@@ -1197,7 +1283,7 @@ post_process_image_data (pixma_t * s, pixma_imagebuf_t * ib)
   c = (is_gray_16(s) ? 3 : s->param->channels)
       * ((s->param->software_lineart) ? 8 : s->param->depth) / 8;   /* color channels count */
   cw = c * s->param->w;                                             /* image width */
-  cx = c * s->param->xs;                                            /* x-offset */
+  gray = is_gray_16(s) && !s->param->software_lineart;             /* 48 bit RGB to 16 bit gray */
 
   /* special image format parameters
    * n: no. of sub-images
@@ -1211,8 +1297,28 @@ post_process_image_data (pixma_t * s, pixma_imagebuf_t * ib)
     n = s->param->xdpi / 1200;
   m = (n > 0) ? s->param->wx / n : 1;
 
+  /* special image format for *most* devices at high dpi.
+   * MP220, MX360 and generation 5 scanners are exceptions */
+  if (n <= 1
+      || s->cfg->pid == MP220_PID
+      || s->cfg->pid == MX360_PID
+      || (mp->generation >= 5
+          /* generation 5 scanners *with* special image format */
+          && s->cfg->pid != MG2200_PID
+          && s->cfg->pid != MG3200_PID
+          && s->cfg->pid != MG4200_PID
+          && s->cfg->pid != MG5600_PID
+          && s->cfg->pid != MG5700_PID
+          && s->cfg->pid != MG6200_PID
+          && s->cfg->pid != MP230_PID
+          && s->cfg->pid != MX470_PID
+          && s->cfg->pid != MX510_PID
+          && s->cfg->pid != XK90_PID
+          && s->cfg->pid != MX520_PID))
+    n = 1;
+
   /* Initialize pointers */
-  sptr = dptr = gptr = cptr = mp->imgbuf;
+  sptr = cptr = mp->imgbuf;
 
   /* walk through complete received lines */
   line_size = get_cis_line_size (s);
@@ -1232,47 +1338,36 @@ post_process_image_data (pixma_t * s, pixma_imagebuf_t * ib)
           /*PDBG (pixma_dbg (4, "*post_process_image_data***** Pointers: sptr=%lx, dptr=%lx, linebuf=%lx ***** \n",
                            sptr, dptr, mp->linebuf));*/
 
-          /* special image format for *most* devices at high dpi.
-           * MP220, MX360 and generation 5 scanners are exceptions */
-          if (n > 1
-              && s->cfg->pid != MP220_PID
-              && s->cfg->pid != MX360_PID
-              && (mp->generation < 5
-                  /* generation 5 scanners *with* special image format */
-                  || s->cfg->pid == MG2200_PID
-                  || s->cfg->pid == MG3200_PID
-                  || s->cfg->pid == MG4200_PID
-                  || s->cfg->pid == MG5600_PID
-                  || s->cfg->pid == MG5700_PID
-                  || s->cfg->pid == MG6200_PID
-                  || s->cfg->pid == MP230_PID
-                  || s->cfg->pid == MX470_PID
-                  || s->cfg->pid == MX510_PID
-                  || s->cfg->pid == XK90_PID
-                  || s->cfg->pid == MX520_PID))
-              reorder_pixels (mp->linebuf, sptr, c, n, m, s->param->wx, line_size);
-
-
           /* scale image */
           if (mp->scale > 1)
           {
+            if (n > 1)
+              reorder_pixels (mp->linebuf, sptr, c, n, m, s->param->wx, line_size);
+
             /* Crop line inside shrink_image() */
             shrink_image(cptr, sptr, s->param->xs, s->param->w, s->param->wx, mp->scale, c);
+
+            /* Color to Grayscale convert for 16bit gray */
+            end = gray ? pixma_rgb_to_gray (cptr, cptr, s->param->w, c) : cptr + cw;
+          }
+          else if (n > 1 && cptr + cw > sptr)
+          {
+            /* the line is compacted in place: a reordered line that
+             * would overwrite its own pixels goes through linebuf */
+            end = gather_line (mp->linebuf, sptr, c, n, m, s->param->xs, s->param->w, gray);
+            memcpy (cptr, mp->linebuf, end - mp->linebuf);
+            end = cptr + (end - mp->linebuf);
           }
           else
           {
-            /* Crop line to selected borders */
-            memmove(cptr, sptr + cx, cw);
+            /* Reorder, crop and convert to 16bit gray in one pass */
+            end = gather_line (cptr, sptr, c, n, m, s->param->xs, s->param->w, gray);
           }
 
           /* Color / Gray to Lineart convert */
           if (s->param->software_lineart)
-              cptr = gptr = pixma_binarize_line (s->param, gptr, cptr, s->param->w, c);
-          /* Color to Grayscale convert for 16bit gray */
-          else if (is_gray_16(s))
-            cptr = gptr = pixma_rgb_to_gray (gptr, cptr, s->param->w, c);
-          else
-              cptr += cw;
+              end = pixma_binarize_line (s->param, cptr, cptr, s->param->w, c);
+          cptr = end;
         }
     }
   ib->rptr = mp->imgbuf;
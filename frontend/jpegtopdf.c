@@ -20,6 +20,8 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include "../include/sane/config.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -30,7 +32,13 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <time.h>
+
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+
 #include "jpegtopdf.h"
+#include "stiff.h"
 
 #ifndef PATH_MAX
 # define PATH_MAX 4096
@@ -47,12 +55,21 @@
 #define SANE_PDF_CREATER "sane"
 #define SANE_PDF_PRODUCER "sane"
 
-/* PDF File Header */
+/* PDF File Header, cross-reference streams and 16 bit samples need 1.5 */
+#ifdef HAVE_LIBZ
+#define SANE_PDF_HEADER "%%PDF-1.5\n"
+#else
 #define SANE_PDF_HEADER "%%PDF-1.3\n"
+#endif
 
 /* trailer format */
 #define SANE_PDF_TRAILER_OBJ "trailer\n<<\n/Size %d\n/Root 1 0 R\n/Info 3 0 R\n>>\nstartxref\n%lld\n%%%%EOF\n"
 
+/* cross-reference stream format, entries are type, offset, generation */
+#define SANE_PDF_XREF_STREAM_OBJ "%d 0 obj\n<<\n/Type /XRef\n/Size %d\n/W [ 1 5 2 ]\n/Root 1 0 R\n/Info 3 0 R\n/Filter /FlateDecode\n/Length %d\n>>\nstream\n"
+#define SANE_PDF_XREF_STREAM_END "\nendstream\nendobj\nstartxref\n%lld\n%%%%EOF\n"
+#define SANE_PDF_XREF_STREAM_ENTRY (8)
+
 /* xref format */
 #define SANE_PDF_XREF_OBJ1 "xref\n0 %d\n0000000000 65535 f \n"
 #define SANE_PDF_XREF_OBJ2 "%010lld 00000 n \n"
@@ -83,9 +100,17 @@
 
 /* XObject(Image) format */
 #define SANE_PDF_IMAGE_OBJ1 "%d 0 obj\n<<\n/Length %d 0 R\n/Type /XObject\n/Subtype /Image\n"
-#define SANE_PDF_IMAGE_OBJ2 "/Width %d /Height %d\n/ColorSpace /%s\n/BitsPerComponent %d\n"
+#define SANE_PDF_IMAGE_OBJ2 "/Width %d /Height %d\n/ColorSpace %s\n/BitsPerComponent %d\n"
 #define SANE_PDF_IMAGE_OBJ3 "/Filter /DCTDecode\n>>\nstream\n"
-#define SANE_PDF_IMAGE_OBJ	SANE_PDF_IMAGE_OBJ1 SANE_PDF_IMAGE_OBJ2 SANE_PDF_IMAGE_OBJ3
+#define SANE_PDF_IMAGE_OBJ3_FLATE "/Filter /FlateDecode\n>>\nstream\n"
+#define SANE_PDF_IMAGE_OBJ3_FLATE_MONO "/Decode [ 1 0 ]\n/Filter /FlateDecode\n>>\nstream\n"
+#define SANE_PDF_IMAGE_OBJ3_G4 "/Filter /CCITTFaxDecode\n/DecodeParms << /K -1 /Columns %d /Rows %d /BlackIs1 true >>\n>>\nstream\n"
+#define SANE_PDF_IMAGE_OBJ	SANE_PDF_IMAGE_OBJ1 SANE_PDF_IMAGE_OBJ2
+
+/* ICC profile format, the images refer to it */
+#define SANE_PDF_ICC_OBJ "%d 0 obj\n<<\n/N %d\n/Length %d\n>>\nstream\n"
+#define SANE_PDF_ICC_OBJ_FLATE "%d 0 obj\n<<\n/N %d\n/Filter /FlateDecode\n/Length %d\n>>\nstream\n"
+#define SANE_PDF_ICC_COLORSPACE "[ /ICCBased %d 0 R ]"
 
 /* Length format */
 #define SANE_PDF_LENGTH_OBJ "%d 0 obj\n%d\nendobj\n"
@@ -94,21 +119,22 @@
 #define SANE_PDF_END_ST_OBJ "\nendstream\nendobj\n"
 
 
-/* object id of first page */
+/* object id of first page, or of the ICC profile */
 #define SANE_PDF_FIRST_PAGE_ID (4)
 
 /* xref max value */
 #define SANE_PDF_XREF_MAX (9999999999LL)
 
-/* pdfwork->offset_table */
+/* object ids of the document objects */
 enum {
-	SANE_PDF_ENDDOC_XREF = 0,
-	SANE_PDF_ENDDOC_CATALOG,
+	SANE_PDF_ENDDOC_CATALOG = 1,
 	SANE_PDF_ENDDOC_PAGES,
 	SANE_PDF_ENDDOC_INFO,
-	SANE_PDF_ENDDOC_NUM,
 };
 
+/* size of the compressed image data buffer */
+#define SANE_PDF_OUT_SIZE (16384)
+
 /* pdfpage->offset_table */
 enum {
 	SANE_PDF_PAGE_OBJ_PAGE = 0,
@@ -119,11 +145,12 @@ enum {
 	SANE_PDF_PAGE_OBJ_NUM,
 };
 
-/* Page object info */
+/* Page object info, only kept while the page is written */
 typedef struct sane_pdf_page {
 	SANE_Int		page;			/* page No. */
 	SANE_Int		obj_id;			/* Page object id */
 	SANE_Int		image_type;		/* ColorSpace, BitsPerComponent */
+	SANE_Int		filter;			/* image compression */
 	SANE_Int		res;			/* image resolution */
 	SANE_Int		w;				/* width (image res) */
 	SANE_Int		h;				/* height (image res) */
@@ -131,9 +158,16 @@ typedef struct sane_pdf_page {
 	SANE_Int		h_72;			/* height (72dpi) */
 	SANE_Int64		offset_table[SANE_PDF_PAGE_OBJ_NUM];	/* xref table */
 	SANE_Int		stream_len;		/* stream object length */
-	SANE_Int		status;			/* page object status */
-	struct sane_pdf_page	*prev;	/* previous page data */
-	struct sane_pdf_page	*next;	/* next page data */
+	SANE_Int		bpl;			/* bytes per row of the image */
+	SANE_Byte		*row;			/* G4: row being collected */
+	SANE_Byte		*ref;			/* G4: previous row */
+	SANE_Int		fill;			/* G4: bytes in row */
+	SANE_G4_Bits	g4;
+	SANE_Byte		*out;			/* compressed data */
+#ifdef HAVE_LIBZ
+	z_stream		zs;
+	SANE_Int		zs_init;
+#endif
 } SANE_pdf_page;
 
 
@@ -141,9 +175,13 @@ typedef struct sane_pdf_page {
 typedef struct {
 	SANE_Int		obj_num;		/* xref - num, trailer - Size */
 	SANE_Int		page_num;		/* Pages - Count */
-	SANE_Int64		offset_table[SANE_PDF_ENDDOC_NUM];	/* xref table */
-	SANE_pdf_page		*first;			/* first page data */
-	SANE_pdf_page		*last;			/* last page data */
+	SANE_Int64		offset;			/* bytes written so far */
+	SANE_Int64		*xref;			/* offset of each object */
+	SANE_Int		xref_max;		/* entries in xref */
+	SANE_pdf_page		*cur;			/* page being written */
+	SANE_Int		first_page_id;	/* Page object id of page 1 */
+	SANE_Int		icc_id;			/* ICC profile object id, or 0 */
+	SANE_Int		icc_n;			/* ICC profile components */
 	FILE*			fd;				/* destination file */
 } SANE_pdf_work;
 
@@ -170,15 +208,95 @@ EXIT:
         return  ret;
 }
 
-static SANE_Int64 _get_current_offset( FILE *fd )
+/* all output goes through here, so that the offsets are known without
+   asking the file, which may be a pipe */
+static SANE_Int _write_data(
+		SANE_pdf_work *		pwork,
+		const void *		lpSrc,
+		SANE_Int			writeSize )
 {
-	SANE_Int64	offset64 = (SANE_Int64)fseek( fd, 0, SEEK_CUR );
+	if ( re_write_if_fail( pwork->fd, (void *)lpSrc, writeSize ) < 0 ) {
+		return SANE_ERR;
+	}
+	pwork->offset += writeSize;
+	return SANE_NO_ERR;
+}
+
+static SANE_Int64 _get_current_offset( SANE_pdf_work *pwork )
+{
+	SANE_Int64	offset64 = pwork->offset;
 
 	if ( offset64 > SANE_PDF_XREF_MAX ) offset64 = -1;
 
 	return offset64;
 }
 
+static void _free_page( SANE_pdf_page *p )
+{
+	if ( p == NULL ) {
+		return;
+	}
+#ifdef HAVE_LIBZ
+	if ( p->zs_init ) {
+		deflateEnd( &p->zs );
+	}
+#endif
+	free( (void *)p->row );
+	free( (void *)p->ref );
+	free( (void *)p->out );
+	free( (void *)p );
+}
+
+/* image data of the current page, counted in the stream length */
+static SANE_Int _write_stream( SANE_pdf_work *pwork, const void *data, SANE_Int len )
+{
+	if ( len <= 0 ) {
+		return SANE_NO_ERR;
+	}
+	if ( _write_data( pwork, data, len ) < 0 ) {
+		fprintf ( stderr, " Error is occured in re_write_if_fail.\n" );
+		return SANE_ERR;
+	}
+	pwork->cur->stream_len += len;
+	return SANE_NO_ERR;
+}
+
+#ifdef HAVE_LIBZ
+/* run deflate until it needs more input, or is done with Z_FINISH */
+static SANE_Int _deflate( SANE_pdf_work *pwork, int flush )
+{
+	SANE_pdf_page		*p = pwork->cur;
+	int				zret;
+
+	do {
+		p->zs.next_out = p->out;
+		p->zs.avail_out = SANE_PDF_OUT_SIZE;
+		zret = deflate( &p->zs, flush );
+		if ( zret == Z_STREAM_ERROR ) {
+			fprintf ( stderr, " Can't compress image!\n" );
+			return SANE_ERR;
+		}
+		if ( _write_stream( pwork, p->out, SANE_PDF_OUT_SIZE - p->zs.avail_out ) < 0 ) {
+			return SANE_ERR;
+		}
+	} while ( p->zs.avail_out == 0 || ( flush == Z_FINISH && zret != Z_STREAM_END ) );
+
+	return SANE_NO_ERR;
+}
+#endif
+
+/* G4 code one complete row */
+static SANE_Int _g4_row( SANE_pdf_work *pwork )
+{
+	SANE_pdf_page		*p = pwork->cur;
+
+	p->g4.len = 0;
+	sanei_g4_encode_row( &p->g4, p->row, p->ref, p->w );
+	memcpy( p->ref, p->row, p->bpl );
+	p->fill = 0;
+	return _write_stream( pwork, p->out, (SANE_Int)p->g4.len );
+}
+
 static SANE_Int _get_current_time( struct tm *pt, SANE_Byte *sign_c, int *ptz_h, int *ptz_m )
 {
 	SANE_Int		ret = SANE_ERR;
@@ -221,6 +339,164 @@ EXIT:
 	return ret;
 }
 
+static SANE_Int _set_xref( SANE_pdf_work *pwork, SANE_Int id, SANE_Int64 offset )
+{
+	SANE_Int64		*p;
+	SANE_Int		max;
+
+	if ( id >= pwork->xref_max ) {
+		max = pwork->xref_max ? pwork->xref_max * 2 : 64;
+		while ( max <= id ) {
+			max *= 2;
+		}
+		if ( ( p = (SANE_Int64 *)realloc( pwork->xref, max * sizeof(SANE_Int64) ) ) == NULL ) {
+			fprintf ( stderr, " Can't get work memory!\n" );
+			return SANE_ERR;
+		}
+		memset( p + pwork->xref_max, 0, ( max - pwork->xref_max ) * sizeof(SANE_Int64) );
+		pwork->xref = p;
+		pwork->xref_max = max;
+	}
+	pwork->xref[ id ] = offset;
+	return SANE_NO_ERR;
+}
+
+/* remember where the next object starts */
+static SANE_Int _start_object( SANE_pdf_work *pwork, SANE_Int id )
+{
+	SANE_Int64		offset;
+
+	if ( ( offset = _get_current_offset( pwork ) ) < 0 ) {
+		fprintf ( stderr, " offset > %lld\n", SANE_PDF_XREF_MAX );
+		return SANE_ERR;
+	}
+	return _set_xref( pwork, id, offset );
+}
+
+#ifdef HAVE_LIBZ
+/* write the cross-reference table as a compressed stream, which also
+   takes the place of the trailer */
+static SANE_Int _write_xref_stream( SANE_pdf_work *pwork )
+{
+	SANE_Int		ret = SANE_ERR, id, size, i, len;
+	SANE_Int64		offset, v;
+	SANE_Byte		str[256], *table = NULL, *z = NULL, *e;
+	uLongf			z_len;
+
+	/* the stream is the last object */
+	id = pwork->obj_num + 1;
+	size = id + 1;
+	if ( _start_object( pwork, id ) < 0 ) {
+		goto EXIT;
+	}
+	offset = pwork->xref[ id ];
+
+	z_len = compressBound( (uLong)size * SANE_PDF_XREF_STREAM_ENTRY );
+	table = (SANE_Byte *)malloc( size * SANE_PDF_XREF_STREAM_ENTRY );
+	z = (SANE_Byte *)malloc( z_len );
+	if ( table == NULL || z == NULL ) {
+		fprintf ( stderr, " Can't get work memory!\n" );
+		goto EXIT;
+	}
+
+	for ( i = 0; i < size; i++ ) {
+		e = table + i * SANE_PDF_XREF_STREAM_ENTRY;
+		v = ( i == 0 ) ? 0 : pwork->xref[ i ];
+		e[0] = ( i == 0 ) ? 0 : 1;				/* free / in use */
+		e[1] = (SANE_Byte)( v >> 32 );
+		e[2] = (SANE_Byte)( v >> 24 );
+		e[3] = (SANE_Byte)( v >> 16 );
+		e[4] = (SANE_Byte)( v >> 8 );
+		e[5] = (SANE_Byte)v;
+		e[6] = e[7] = ( i == 0 ) ? 0xff : 0;	/* generation */
+	}
+	if ( compress2( z, &z_len, table, (uLong)size * SANE_PDF_XREF_STREAM_ENTRY, Z_BEST_COMPRESSION ) != Z_OK ) {
+		fprintf ( stderr, " Can't compress xref!\n" );
+		goto EXIT;
+	}
+
+	len = snprintf( (char*)str, sizeof(str), SANE_PDF_XREF_STREAM_OBJ,
+			(int)id, (int)size, (int)z_len );
+	if ( (size_t)len >= sizeof(str) || len < 0 ) {
+		fprintf ( stderr, " string is too long!\n" );
+		goto EXIT;
+	}
+	if ( _write_data( pwork, str, len ) < 0 || _write_data( pwork, z, (SANE_Int)z_len ) < 0 ) {
+		fprintf ( stderr, " Error is occured in re_write_if_fail.\n" );
+		goto EXIT;
+	}
+	len = snprintf( (char*)str, sizeof(str), SANE_PDF_XREF_STREAM_END, offset );
+	if ( (size_t)len >= sizeof(str) || len < 0 ) {
+		fprintf ( stderr, " string is too long!\n" );
+		goto EXIT;
+	}
+	if ( _write_data( pwork, str, len ) < 0 ) {
+		fprintf ( stderr, " Error is occured in re_write_if_fail.\n" );
+		goto EXIT;
+	}
+
+	ret = SANE_NO_ERR;
+EXIT:
+	free( (void *)table );
+	free( (void *)z );
+	return ret;
+}
+#else
+/* write the cross-reference table and the trailer */
+static SANE_Int _write_xref( SANE_pdf_work *pwork )
+{
+	SANE_Int		ret = SANE_ERR, i, size, len;
+	SANE_Int64		offset;
+	SANE_Byte		str[256];
+
+	size = pwork->obj_num + 1;
+	if ( ( offset = _get_current_offset( pwork ) ) < 0 ) {
+		fprintf ( stderr, " offset > %lld\n", SANE_PDF_XREF_MAX );
+		goto EXIT;
+	}
+	/* write xref(1) */
+	len = snprintf( (char*)str, sizeof(str), SANE_PDF_XREF_OBJ1, (int)size );	/* object num */
+	if ( (size_t)len >= sizeof(str) || len < 0 ) {
+		fprintf ( stderr, " string is too long!\n" );
+		goto EXIT;
+	}
+	if ( _write_data( pwork, str, len ) < 0 ) {
+		fprintf ( stderr, " Error is occured in re_write_if_fail.\n" );
+		goto EXIT;
+	}
+
+	/* write xref(2) : object id = 1 ~ */
+	for ( i = 1; i < size; i++ ) {
+		len = snprintf( (char*)str, sizeof(str), SANE_PDF_XREF_OBJ2, pwork->xref[ i ] );
+		if ( (size_t)len >= sizeof(str) || len < 0 ) {
+			fprintf ( stderr, " string is too long!\n" );
+			goto EXIT;
+		}
+		if ( _write_data( pwork, str, len ) < 0 ) {
+			fprintf ( stderr, " Error is occured in re_write_if_fail.\n" );
+			goto EXIT;
+		}
+	}
+
+	/* trailer */
+	len = snprintf( (char*)str, sizeof(str), SANE_PDF_TRAILER_OBJ,
+			(int)size,											/* object num */
+			offset );											/* xref offset */
+	if ( (size_t)len >= sizeof(str) || len < 0 ) {
+		fprintf ( stderr, " string is too long!\n" );
+		goto EXIT;
+	}
+	if ( _write_data( pwork, str, len ) < 0 ) {
+		fprintf ( stderr, " Error is occured in re_write_if_fail.\n" );
+		goto EXIT;
+	}
+
+	ret = SANE_NO_ERR;
+EXIT:
+	return ret;
+}
+#endif
+
 SANE_Int sane_pdf_open( void **ppw, FILE *fd )
 {
 	SANE_Int		ret = SANE_ERR;
@@ -230,16 +506,20 @@ SANE_Int sane_pdf_open( void **ppw, FILE *fd )
 		fprintf ( stderr, " Initialize parameter is error!\n" );
 		goto	EXIT;
 	}
-	else if ( ( p = (SANE_pdf_work *)calloc(1, sizeof(SANE_pdf_page) ) ) == NULL ) {
+	else if ( ( p = (SANE_pdf_work *)calloc(1, sizeof(SANE_pdf_work) ) ) == NULL ) {
 		fprintf ( stderr, " Can't get work memory!\n" );
 		goto	EXIT;
 	}
 
 	p->fd = fd;
+	p->first_page_id = SANE_PDF_FIRST_PAGE_ID;
 	p->obj_num = SANE_PDF_FIRST_PAGE_ID - 1;	/* Catalog, Pages, Info */
 	p->page_num = 0;
-	p->first = NULL;
-	p->last = NULL;
+	p->offset = 0;
+	p->xref = NULL;
+	p->cur = NULL;
+	p->icc_id = 0;
+	p->icc_n = 0;
 
 	*ppw = (void *)p;
 
@@ -250,7 +530,6 @@ EXIT:
 
 void sane_pdf_close( void *pw )
 {
-	SANE_pdf_page		*cur, *next;
 	SANE_pdf_work		*pwork = (SANE_pdf_work *)pw;
 
 	if ( pwork == NULL ) {
@@ -258,13 +537,8 @@ void sane_pdf_close( void *pw )
 		goto	EXIT;
 	}
 
-	cur = pwork->first;
-	while ( cur != NULL ) {
-		next = cur->next;
-		free( (void *)cur );
-		cur = next;
-	}
-
+	_free_page( pwork->cur );
+	free ( (void *)pwork->xref );
 	free ( (void *)pwork );
 
 EXIT:
@@ -288,7 +562,7 @@ SANE_Int sane_pdf_start_doc( void *pw )
 		fprintf ( stderr, " string is too long!\n" );
 		goto EXIT;
 	}
-	if ( ( ldata = re_write_if_fail( pwork->fd, str, len ) ) < 0 ) {
+	if ( ( ldata = _write_data( pwork, str, len ) ) < 0 ) {
 		fprintf ( stderr, " Error is occured in re_write_if_fail.\n" );
 		goto EXIT;
 	}
@@ -300,8 +574,7 @@ EXIT:
 
 SANE_Int sane_pdf_end_doc( void *pw )
 {
-	SANE_Int		ret = SANE_ERR, ldata, i, size, w_count;
-	SANE_pdf_page		*p = NULL;
+	SANE_Int		ret = SANE_ERR, ldata, i;
 	SANE_Byte		str[1024], str_t[64];
 	SANE_Int			len;
 	SANE_pdf_work		*pwork = (SANE_pdf_work *)pw;
@@ -314,13 +587,13 @@ SANE_Int sane_pdf_end_doc( void *pw )
 		fprintf ( stderr, " Initialize parameter is error!\n");
 		goto	EXIT;
 	}
-
-	size = pwork->obj_num + 1;
-	w_count = 1;
+	if ( pwork->cur != NULL ) {
+		fprintf ( stderr, " page(%d) is NG!\n", (int)pwork->cur->page );
+		goto EXIT;
+	}
 
 	/* <1> Pages */
-	if ( ( pwork->offset_table[ SANE_PDF_ENDDOC_PAGES ] = _get_current_offset( pwork->fd ) ) < 0 ) {
-		fprintf ( stderr, " offset > %lld\n", SANE_PDF_XREF_MAX );
+	if ( _start_object( pwork, SANE_PDF_ENDDOC_PAGES ) < 0 ) {
 		goto EXIT;
 	}
 	/* write Pages(1) */
@@ -329,32 +602,23 @@ SANE_Int sane_pdf_end_doc( void *pw )
 		fprintf ( stderr, " string is too long!\n" );
 		goto EXIT;
 	}
-	if ( ( ldata = re_write_if_fail( pwork->fd, str, len ) ) < 0 ) {
+	if ( ( ldata = _write_data( pwork, str, len ) ) < 0 ) {
 		fprintf ( stderr, " Error is occured in re_write_if_fail.\n" );
 		goto EXIT;
 	}
 
 	/* write Pages(2) ... Kids array */
-	p = pwork->first;
-	i = 0;
-	while ( p != NULL ) {
-		i++;
-		if ( p->status != SANE_NO_ERR ) {
-			fprintf ( stderr, " page(%d) is NG!\n", i );
-			goto EXIT;
-		}
-
-		len = snprintf( (char*)str, sizeof(str), SANE_PDF_PAGES_OBJ2, (int)p->obj_id );	/* Page object id */
+	for ( i = 0; i < pwork->page_num; i++ ) {
+		len = snprintf( (char*)str, sizeof(str), SANE_PDF_PAGES_OBJ2,
+				(int)( pwork->first_page_id + i * SANE_PDF_PAGE_OBJ_NUM + SANE_PDF_PAGE_OBJ_PAGE ) );	/* Page object id */
 		if ( (size_t)len >= sizeof(str) || len < 0 ) {
 			fprintf ( stderr, " string is too long!\n" );
 			goto EXIT;
 		}
-		if ( ( ldata = re_write_if_fail( pwork->fd, str, len ) ) < 0 ) {
+		if ( ( ldata = _write_data( pwork, str, len ) ) < 0 ) {
 			fprintf ( stderr, " Error is occured in re_write_if_fail.\n" );
 			goto EXIT;
 		}
-
-		p = p->next;
 	}
 
 	/* write Pages(3) */
@@ -363,14 +627,13 @@ SANE_Int sane_pdf_end_doc( void *pw )
 		fprintf ( stderr, " string is too long!\n" );
 		goto EXIT;
 	}
-	if ( ( ldata = re_write_if_fail( pwork->fd, str, len ) ) < 0 ) {
+	if ( ( ldata = _write_data( pwork, str, len ) ) < 0 ) {
 		fprintf ( stderr, " Error is occured in re_write_if_fail.\n" );
 		goto EXIT;
 	}
 
 	/* <2> Catalog */
-	if ( ( pwork->offset_table[ SANE_PDF_ENDDOC_CATALOG ] = _get_current_offset( pwork->fd ) ) < 0 ) {
-		fprintf ( stderr, " offset > %lld\n", SANE_PDF_XREF_MAX );
+	if ( _start_object( pwork, SANE_PDF_ENDDOC_CATALOG ) < 0 ) {
 		goto EXIT;
 	}
 	/* write Catalog */
@@ -379,14 +642,13 @@ SANE_Int sane_pdf_end_doc( void *pw )
 		fprintf ( stderr, " string is too long!\n" );
 		goto EXIT;
 	}
-	if ( ( ldata = re_write_if_fail( pwork->fd, str, len ) ) < 0 ) {
+	if ( ( ldata = _write_data( pwork, str, len ) ) < 0 ) {
 		fprintf ( stderr, " Error is occured in re_write_if_fail.\n" );
 		goto EXIT;
 	}
 
 	/* <3> Info */
-	if ( ( pwork->offset_table[ SANE_PDF_ENDDOC_INFO ] = _get_current_offset( pwork->fd ) ) < 0 ) {
-		fprintf ( stderr, " offset > %lld\n", SANE_PDF_XREF_MAX );
+	if ( _start_object( pwork, SANE_PDF_ENDDOC_INFO ) < 0 ) {
 		goto EXIT;
 	}
 	if ( _get_current_time( &tm, &sign_c, &tz_h, &tz_m ) == SANE_ERR ) {
@@ -407,82 +669,107 @@ SANE_Int sane_pdf_end_doc( void *pw )
 		fprintf ( stderr, " string is too long!\n" );
 		goto EXIT;
 	}
-	if ( ( ldata = re_write_if_fail( pwork->fd, str, len ) ) < 0 ) {
+	if ( ( ldata = _write_data( pwork, str, len ) ) < 0 ) {
 		fprintf ( stderr, " Error is occured in re_write_if_fail.\n" );
 		goto EXIT;
 	}
 
-	/* <4> xref */
-	if ( ( pwork->offset_table[ SANE_PDF_ENDDOC_XREF ] = _get_current_offset( pwork->fd ) ) < 0 ) {
-		fprintf ( stderr, " offset > %lld\n", SANE_PDF_XREF_MAX );
+	/* <4> xref, trailer */
+#ifdef HAVE_LIBZ
+	if ( _write_xref_stream( pwork ) < 0 ) {
 		goto EXIT;
 	}
-	/* write xref(1) */
-	len = snprintf( (char*)str, sizeof(str), SANE_PDF_XREF_OBJ1, (int)size );	/* object num */
-	if ( (size_t)len >= sizeof(str) || len < 0 ) {
-		fprintf ( stderr, " string is too long!\n" );
+#else
+	if ( _write_xref( pwork ) < 0 ) {
 		goto EXIT;
 	}
-	if ( ( ldata = re_write_if_fail( pwork->fd, str, len ) ) < 0 ) {
-		fprintf ( stderr, " Error is occured in re_write_if_fail.\n" );
+#endif
+
+	ret = SANE_NO_ERR;
+EXIT:
+	return ret;
+}
+
+SANE_Int sane_pdf_set_icc_profile( void *pw, const SANE_Byte *data, SANE_Int size )
+{
+	SANE_Int		ret = SANE_ERR, ldata, n, id;
+	SANE_Byte		str[256];
+	SANE_Int			len;
+	const SANE_Byte		*stream = data;
+	SANE_Int		stream_len = size;
+	const char		*fmt = SANE_PDF_ICC_OBJ;
+#ifdef HAVE_LIBZ
+	SANE_Byte		*z = NULL;
+	uLongf			z_len;
+#endif
+	SANE_pdf_work		*pwork = (SANE_pdf_work *)pw;
+
+	if ( pwork == NULL || data == NULL || size < 20 ) {
+		fprintf ( stderr, " Initialize parameter is error!\n");
+		goto	EXIT;
+	}
+	else if ( pwork->page_num > 0 || pwork->icc_id > 0 ) {
+		fprintf ( stderr, " ICC profile must come before the first page!\n" );
+		goto	EXIT;
+	}
+
+	/* data colour space of the profile, see ICC.1:2010 7.2.6 */
+	if ( memcmp( data + 16, "GRAY", 4 ) == 0 ) {
+		n = 1;
+	}
+	else if ( memcmp( data + 16, "RGB ", 4 ) == 0 ) {
+		n = 3;
+	}
+	else {
+		fprintf ( stderr, " ICC profile is neither gray nor RGB!\n" );
+		goto	EXIT;
+	}
+
+	/* the profile is written once, in place of the first page */
+	id = pwork->first_page_id;
+	if ( _start_object( pwork, id ) < 0 ) {
 		goto EXIT;
 	}
+#ifdef HAVE_LIBZ
+	z_len = compressBound( (uLong)size );
+	if ( ( z = (SANE_Byte *)malloc( z_len ) ) != NULL &&
+			compress2( z, &z_len, data, (uLong)size, Z_DEFAULT_COMPRESSION ) == Z_OK ) {
+		stream = z;
+		stream_len = (SANE_Int)z_len;
+		fmt = SANE_PDF_ICC_OBJ_FLATE;
+	}
+#endif
 
-	/* write xref(2) */
-	len = snprintf( (char*)str, sizeof(str), SANE_PDF_XREF_OBJ2 SANE_PDF_XREF_OBJ2 SANE_PDF_XREF_OBJ2,
-			pwork->offset_table[ SANE_PDF_ENDDOC_CATALOG ],			/* object id = 1 : Catalog */
-			pwork->offset_table[ SANE_PDF_ENDDOC_PAGES ],			/* object id = 2 : Pages */
-			pwork->offset_table[ SANE_PDF_ENDDOC_INFO ] );			/* object id = 3 : Info */
+	len = snprintf( (char*)str, sizeof(str), fmt, (int)id, (int)n, (int)stream_len );
 	if ( (size_t)len >= sizeof(str) || len < 0 ) {
 		fprintf ( stderr, " string is too long!\n" );
 		goto EXIT;
 	}
-	if ( ( ldata = re_write_if_fail( pwork->fd, str, len ) ) < 0 ) {
+	if ( ( ldata = _write_data( pwork, str, len ) ) < 0 ||
+			( ldata = _write_data( pwork, stream, stream_len ) ) < 0 ) {
 		fprintf ( stderr, " Error is occured in re_write_if_fail.\n" );
 		goto EXIT;
 	}
-	w_count += SANE_PDF_FIRST_PAGE_ID - 1;
-
-	/* write xref(3) */
-	p = pwork->first;
-	while ( p != NULL ) {
-		/* write offset : SANE_PDF_PAGE_OBJ_PAGE -> SANE_PDF_PAGE_OBJ_CONTENTS_LEN */
-		for ( i = 0; i < SANE_PDF_PAGE_OBJ_NUM; i++ ) {
-			len = snprintf( (char*)str, sizeof(str), SANE_PDF_XREF_OBJ2, p->offset_table[ i ] );	/* object id = 3 ~ */
-			if ( (size_t)len >= sizeof(str) || len < 0 ) {
-				fprintf ( stderr, " string is too long!\n" );
-				goto EXIT;
-			}
-			if ( ( ldata = re_write_if_fail( pwork->fd, str, len ) ) < 0 ) {
-				fprintf ( stderr, " Error is occured in re_write_if_fail.\n" );
-				goto EXIT;
-			}
-			w_count ++;
-		}
-		p = p->next;
-	}
-	/* check object number */
-	if ( w_count != size ) {
-		fprintf ( stderr, " object number is wrong.\n" );
-		goto EXIT;
-	}
-
-	/* <4> trailer */
-	len = snprintf( (char*)str, sizeof(str), SANE_PDF_TRAILER_OBJ,
-			(int)size,											/* object num */
-			pwork->offset_table[ SANE_PDF_ENDDOC_XREF ] );		/* xref offset */
+	len = snprintf( (char*)str, sizeof(str), SANE_PDF_END_ST_OBJ );
 	if ( (size_t)len >= sizeof(str) || len < 0 ) {
 		fprintf ( stderr, " string is too long!\n" );
 		goto EXIT;
 	}
-	if ( ( ldata = re_write_if_fail( pwork->fd, str, len ) ) < 0 ) {
+	if ( ( ldata = _write_data( pwork, str, len ) ) < 0 ) {
 		fprintf ( stderr, " Error is occured in re_write_if_fail.\n" );
 		goto EXIT;
 	}
 
+	pwork->icc_id = id;
+	pwork->icc_n = n;
+	pwork->first_page_id ++;
+	pwork->obj_num ++;
 
 	ret = SANE_NO_ERR;
 EXIT:
+#ifdef HAVE_LIBZ
+	free( (void *)z );
+#endif
 	return ret;
 }
 
@@ -493,58 +780,91 @@ SANE_Int sane_pdf_start_page(
 	SANE_Int		res,
 	SANE_Int		type,
 	SANE_Int		rotate )
+{
+	return sane_pdf_start_page_filter( pw, w, h, res, type, rotate, SANE_PDF_FILTER_DCT );
+}
+
+SANE_Int sane_pdf_start_page_filter(
+	void		*pw,
+	SANE_Int		w,
+	SANE_Int		h,
+	SANE_Int		res,
+	SANE_Int		type,
+	SANE_Int		rotate,
+	SANE_Int		filter )
 {
 	SANE_Int		ret = SANE_ERR, ldata;
 	SANE_pdf_page		*p = NULL;
 	SANE_Byte		str[1024];
 	SANE_Int			len, len_c;
-	SANE_Byte		*ProcSetImage[SANE_PDF_IMAGE_NUM]		= { (SANE_Byte *)"ImageC", (SANE_Byte *)"ImageG", (SANE_Byte *)"ImageG" };
-	SANE_Byte		*ColorSpace[SANE_PDF_IMAGE_NUM]			= { (SANE_Byte *)"DeviceRGB", (SANE_Byte *)"DeviceGray", (SANE_Byte *)"DeviceGray" };
-	SANE_Int		BitsPerComponent[SANE_PDF_IMAGE_NUM]	= { 8, 8, 1 };
+	SANE_Byte		*ProcSetImage[SANE_PDF_IMAGE_NUM]		= { (SANE_Byte *)"ImageC", (SANE_Byte *)"ImageG", (SANE_Byte *)"ImageB", (SANE_Byte *)"ImageC", (SANE_Byte *)"ImageG" };
+	SANE_Byte		*ColorSpace[SANE_PDF_IMAGE_NUM]			= { (SANE_Byte *)"/DeviceRGB", (SANE_Byte *)"/DeviceGray", (SANE_Byte *)"/DeviceGray", (SANE_Byte *)"/DeviceRGB", (SANE_Byte *)"/DeviceGray" };
+	SANE_Byte		icc_cs[32], *cs;
+	SANE_Int		BitsPerComponent[SANE_PDF_IMAGE_NUM]	= { 8, 8, 1, 16, 16 };
+	SANE_Int		Samples[SANE_PDF_IMAGE_NUM]				= { 3, 1, 1, 3, 1 };
 	SANE_pdf_work		*pwork = (SANE_pdf_work *)pw;
 
 	if ( pwork == NULL || w <= 0 || h <= 0 || res <= 0 ||
-			!( type == SANE_PDF_IMAGE_COLOR || type == SANE_PDF_IMAGE_GRAY || type == SANE_PDF_IMAGE_MONO ) ||
-			!( rotate == SANE_PDF_ROTATE_OFF || rotate == SANE_PDF_ROTATE_ON ) ) {
+			type < 0 || type >= SANE_PDF_IMAGE_NUM ||
+			!( rotate == SANE_PDF_ROTATE_OFF || rotate == SANE_PDF_ROTATE_ON ) ||
+			( filter == SANE_PDF_FILTER_DCT && BitsPerComponent[ type ] == 16 ) ||
+			( filter == SANE_PDF_FILTER_G4 && type != SANE_PDF_IMAGE_MONO ) ||
+#ifndef HAVE_LIBZ
+			filter == SANE_PDF_FILTER_FLATE ||
+#endif
+			filter < 0 || filter >= SANE_PDF_FILTER_NUM ) {
 		fprintf ( stderr, " Initialize parameter is error!\n");
 		goto	EXIT;
 	}
+	else if ( pwork->cur != NULL ) {
+		fprintf ( stderr, " page(%d) is not finished!\n", (int)pwork->cur->page );
+		goto	EXIT;
+	}
 	else if ( ( p = (SANE_pdf_page *)calloc( 1, sizeof(SANE_pdf_page) ) ) == NULL ) {
 		fprintf ( stderr, " Can't get work memory!\n" );
 		goto	EXIT;
 	}
 
-	pwork->obj_num += SANE_PDF_PAGE_OBJ_NUM;
-	pwork->page_num ++;
-
-	p->prev = p->next = NULL;
-	if ( pwork->first == NULL ) {
-		/* append first page */
-		pwork->first = p;
-	}
-	if ( pwork->last == NULL ) {
-		/* append first page */
-		pwork->last = p;
+	p->filter = filter;
+	p->w = w; p->h = h;
+	p->bpl = ( w * Samples[ type ] * BitsPerComponent[ type ] + 7 ) / 8;
+	if ( filter == SANE_PDF_FILTER_G4 ) {
+		p->row = (SANE_Byte *)malloc( p->bpl );
+		p->ref = (SANE_Byte *)calloc( 1, p->bpl );
+		p->out = (SANE_Byte *)malloc( SANE_G4_ROW_BYTES( w ) + 8 );
+		p->g4.out = p->out;
+		if ( p->row == NULL || p->ref == NULL || p->out == NULL ) {
+			fprintf ( stderr, " Can't get work memory!\n" );
+			_free_page( p );
+			goto	EXIT;
+		}
 	}
-	else {
-		/* append page */
-		pwork->last->next = p;
-		p->prev = pwork->last;
-		pwork->last = p;
+#ifdef HAVE_LIBZ
+	else if ( filter == SANE_PDF_FILTER_FLATE ) {
+		if ( ( p->out = (SANE_Byte *)malloc( SANE_PDF_OUT_SIZE ) ) == NULL ||
+				deflateInit( &p->zs, Z_DEFAULT_COMPRESSION ) != Z_OK ) {
+			fprintf ( stderr, " Can't get work memory!\n" );
+			_free_page( p );
+			goto	EXIT;
+		}
+		p->zs_init = 1;
 	}
+#endif
+
+	pwork->obj_num += SANE_PDF_PAGE_OBJ_NUM;
+	pwork->page_num ++;
+	pwork->cur = p;
 
 	p->page = pwork->page_num;
-	/* page obj id : page1=4, page2=4+5=9, page3=4+5*2=14, ... */
-	p->obj_id = SANE_PDF_FIRST_PAGE_ID + ( p->page - 1 ) * SANE_PDF_PAGE_OBJ_NUM;
+	/* page obj id : page1=4, page2=4+5=9, page3=4+5*2=14, ... (one more
+	   with an ICC profile) */
+	p->obj_id = pwork->first_page_id + ( p->page - 1 ) * SANE_PDF_PAGE_OBJ_NUM;
 	p->image_type = type;
 	p->res = res;
-	p->w = w; p->h = h;
 	p->w_72 = w * 72 / res; p->h_72 = h * 72 / res;
 	p->stream_len = 0;
-	p->status = SANE_ERR;
-
 	/* <1> Page */
-	if ( ( p->offset_table[ SANE_PDF_PAGE_OBJ_PAGE ] = _get_current_offset( pwork->fd ) ) < 0 ) {
+	if ( ( p->offset_table[ SANE_PDF_PAGE_OBJ_PAGE ] = _get_current_offset( pwork ) ) < 0 ) {
 		fprintf ( stderr, " offset > %lld\n", SANE_PDF_XREF_MAX );
 		goto EXIT;
 	}
@@ -571,13 +891,13 @@ SANE_Int sane_pdf_start_page(
 		fprintf ( stderr, " string is too long!\n" );
 		goto EXIT;
 	}
-	if ( ( ldata = re_write_if_fail( pwork->fd, str, len ) ) < 0 ) {
+	if ( ( ldata = _write_data( pwork, str, len ) ) < 0 ) {
 		fprintf ( stderr, " Error is occured in re_write_if_fail.\n" );
 		goto EXIT;
 	}
 
 	/* <2> Contents */
-	if ( ( p->offset_table[ SANE_PDF_PAGE_OBJ_CONTENTS ] = _get_current_offset( pwork->fd ) ) < 0 ) {
+	if ( ( p->offset_table[ SANE_PDF_PAGE_OBJ_CONTENTS ] = _get_current_offset( pwork ) ) < 0 ) {
 		fprintf ( stderr, " offset > %lld\n", SANE_PDF_XREF_MAX );
 		goto EXIT;
 	}
@@ -589,7 +909,7 @@ SANE_Int sane_pdf_start_page(
 		fprintf ( stderr, " string is too long!\n" );
 		goto EXIT;
 	}
-	if ( ( ldata = re_write_if_fail( pwork->fd, str, len ) ) < 0 ) {
+	if ( ( ldata = _write_data( pwork, str, len ) ) < 0 ) {
 		fprintf ( stderr, " Error is occured in re_write_if_fail.\n" );
 		goto EXIT;
 	}
@@ -601,7 +921,7 @@ SANE_Int sane_pdf_start_page(
 		fprintf ( stderr, " string is too long!\n" );
 		goto EXIT;
 	}
-	if ( ( ldata = re_write_if_fail( pwork->fd, str, len ) ) < 0 ) {
+	if ( ( ldata = _write_data( pwork, str, len ) ) < 0 ) {
 		fprintf ( stderr, " Error is occured in re_write_if_fail.\n" );
 		goto EXIT;
 	}
@@ -612,13 +932,13 @@ SANE_Int sane_pdf_start_page(
 		fprintf ( stderr, " string is too long!\n" );
 		goto EXIT;
 	}
-	if ( ( ldata = re_write_if_fail( pwork->fd, str, len ) ) < 0 ) {
+	if ( ( ldata = _write_data( pwork, str, len ) ) < 0 ) {
 		fprintf ( stderr, " Error is occured in re_write_if_fail.\n" );
 		goto EXIT;
 	}
 
 	/* <3> Length of Contents - stream */
-	if ( ( p->offset_table[ SANE_PDF_PAGE_OBJ_CONTENTS_LEN ] = _get_current_offset( pwork->fd ) ) < 0 ) {
+	if ( ( p->offset_table[ SANE_PDF_PAGE_OBJ_CONTENTS_LEN ] = _get_current_offset( pwork ) ) < 0 ) {
 		fprintf ( stderr, " offset > %lld\n", SANE_PDF_XREF_MAX );
 		goto EXIT;
 	}
@@ -630,28 +950,55 @@ SANE_Int sane_pdf_start_page(
 		fprintf ( stderr, " string is too long!\n" );
 		goto EXIT;
 	}
-	if ( ( ldata = re_write_if_fail( pwork->fd, str, len ) ) < 0 ) {
+	if ( ( ldata = _write_data( pwork, str, len ) ) < 0 ) {
 		fprintf ( stderr, " Error is occured in re_write_if_fail.\n" );
 		goto EXIT;
 	}
 
 	/* <4> XObject(Image) */
-	if ( ( p->offset_table[ SANE_PDF_PAGE_OBJ_IMAGE ] = _get_current_offset( pwork->fd ) ) < 0 ) {
+	if ( ( p->offset_table[ SANE_PDF_PAGE_OBJ_IMAGE ] = _get_current_offset( pwork ) ) < 0 ) {
 		fprintf ( stderr, " offset > %lld\n", SANE_PDF_XREF_MAX );
 		goto EXIT;
 	}
+	/* the ICC profile, if it fits the image */
+	cs = ColorSpace[ type ];
+	if ( pwork->icc_id > 0 && Samples[ type ] == pwork->icc_n ) {
+		snprintf( (char*)icc_cs, sizeof(icc_cs), SANE_PDF_ICC_COLORSPACE, (int)pwork->icc_id );
+		cs = icc_cs;
+	}
 	/* write XObject */
 	len = snprintf( (char*)str, sizeof(str), SANE_PDF_IMAGE_OBJ,
 			(int)(p->obj_id + SANE_PDF_PAGE_OBJ_IMAGE),		/* object id ( XObject(Image) ) */
 			(int)(p->obj_id + SANE_PDF_PAGE_OBJ_IMAGE_LEN),	/* object id ( Length of XObject ) */
 			(int)p->w, (int)p->h,							/* Width/Height */
-			ColorSpace[ type ],								/* ColorSpace */
+			cs,												/* ColorSpace */
 			(int)BitsPerComponent[ type ] );				/* BitsPerComponent */
 	if ( (size_t)len >= sizeof(str) || len < 0 ) {
 		fprintf ( stderr, " string is too long!\n" );
 		goto EXIT;
 	}
-	if ( ( ldata = re_write_if_fail( pwork->fd, str, len ) ) < 0 ) {
+	if ( ( ldata = _write_data( pwork, str, len ) ) < 0 ) {
+		fprintf ( stderr, " Error is occured in re_write_if_fail.\n" );
+		goto EXIT;
+	}
+	/* write XObject filter */
+	if ( filter == SANE_PDF_FILTER_G4 ) {
+		len = snprintf( (char*)str, sizeof(str), SANE_PDF_IMAGE_OBJ3_G4,
+				(int)p->w, (int)p->h );						/* Columns/Rows */
+	}
+	else if ( filter == SANE_PDF_FILTER_FLATE ) {
+		/* SANE lineart has 1 for black */
+		len = snprintf( (char*)str, sizeof(str), type == SANE_PDF_IMAGE_MONO ?
+				SANE_PDF_IMAGE_OBJ3_FLATE_MONO : SANE_PDF_IMAGE_OBJ3_FLATE );
+	}
+	else {
+		len = snprintf( (char*)str, sizeof(str), SANE_PDF_IMAGE_OBJ3 );
+	}
+	if ( (size_t)len >= sizeof(str) || len < 0 ) {
+		fprintf ( stderr, " string is too long!\n" );
+		goto EXIT;
+	}
+	if ( ( ldata = _write_data( pwork, str, len ) ) < 0 ) {
 		fprintf ( stderr, " Error is occured in re_write_if_fail.\n" );
 		goto EXIT;
 	}
@@ -659,12 +1006,66 @@ SANE_Int sane_pdf_start_page(
 	ret = SANE_NO_ERR;
 EXIT:
 	return ret;
+}
+
+SANE_Int sane_pdf_write( void *pw, const SANE_Byte *data, SANE_Int len )
+{
+	SANE_Int		ret = SANE_ERR, n;
+	SANE_pdf_page		*p = NULL;
+	SANE_pdf_work		*pwork = (SANE_pdf_work *)pw;
+
+	if ( pwork == NULL || data == NULL || len < 0 ) {
+		fprintf ( stderr, " Initialize parameter is error!\n" );
+		goto	EXIT;
+	}
+
+	p = pwork->cur;
+	if ( p == NULL ) {
+		fprintf ( stderr, " No page is started!\n" );
+		goto	EXIT;
+	}
+
+	switch ( p->filter ) {
+#ifdef HAVE_LIBZ
+	case SANE_PDF_FILTER_FLATE:
+		p->zs.next_in = (Bytef *)data;
+		p->zs.avail_in = (uInt)len;
+		if ( _deflate( pwork, Z_NO_FLUSH ) < 0 ) {
+			goto EXIT;
+		}
+		break;
+#endif
+	case SANE_PDF_FILTER_G4:
+		/* the rows may come in pieces */
+		while ( len > 0 ) {
+			n = p->bpl - p->fill;
+			if ( n > len ) {
+				n = len;
+			}
+			memcpy( p->row + p->fill, data, n );
+			p->fill += n;
+			data += n;
+			len -= n;
+			if ( p->fill == p->bpl && _g4_row( pwork ) < 0 ) {
+				goto EXIT;
+			}
+		}
+		break;
+	default:
+		if ( _write_stream( pwork, data, len ) < 0 ) {
+			goto EXIT;
+		}
+		break;
+	}
 
+	ret = SANE_NO_ERR;
+EXIT:
+	return ret;
 }
 
 SANE_Int sane_pdf_end_page( void *pw )
 {
-	SANE_Int		ret = SANE_ERR, ldata;
+	SANE_Int		ret = SANE_ERR, ldata, i;
 	SANE_pdf_page		*p = NULL;
 	SANE_Byte		str[1024];
 	SANE_Int			len;
@@ -675,21 +1076,48 @@ SANE_Int sane_pdf_end_page( void *pw )
 		goto	EXIT;
 	}
 
-	p = pwork->last;
+	p = pwork->cur;
+	if ( p == NULL ) {
+		fprintf ( stderr, " No page is started!\n" );
+		goto	EXIT;
+	}
+
+	/* <1> rest of the compressed image */
+#ifdef HAVE_LIBZ
+	if ( p->filter == SANE_PDF_FILTER_FLATE ) {
+		p->zs.avail_in = 0;
+		if ( _deflate( pwork, Z_FINISH ) < 0 ) {
+			goto EXIT;
+		}
+	}
+#endif
+	if ( p->filter == SANE_PDF_FILTER_G4 ) {
+		if ( p->fill > 0 ) {
+			memset( p->row + p->fill, 0, p->bpl - p->fill );
+			if ( _g4_row( pwork ) < 0 ) {
+				goto EXIT;
+			}
+		}
+		p->g4.len = 0;
+		sanei_g4_end( &p->g4 );
+		if ( _write_stream( pwork, p->out, (SANE_Int)p->g4.len ) < 0 ) {
+			goto EXIT;
+		}
+	}
 
-	/* <1> endstream, endobj (XObject) */
+	/* <2> endstream, endobj (XObject) */
 	len = snprintf( (char*)str, sizeof(str), SANE_PDF_END_ST_OBJ );
 	if ( (size_t)len >= sizeof(str) || len < 0 ) {
 		fprintf ( stderr, " string is too long!\n" );
 		goto EXIT;
 	}
-	if ( ( ldata = re_write_if_fail( pwork->fd, str, len ) ) < 0 ) {
+	if ( ( ldata = _write_data( pwork, str, len ) ) < 0 ) {
 		fprintf ( stderr, " Error is occured in re_write_if_fail.\n" );
 		goto EXIT;
 	}
 
-	/* <2> Length of XObject - stream */
-	if ( ( p->offset_table[ SANE_PDF_PAGE_OBJ_IMAGE_LEN ] = _get_current_offset( pwork->fd ) ) < 0 ) {
+	/* <3> Length of XObject - stream */
+	if ( ( p->offset_table[ SANE_PDF_PAGE_OBJ_IMAGE_LEN ] = _get_current_offset( pwork ) ) < 0 ) {
 		fprintf ( stderr, " offset > %lld\n", SANE_PDF_XREF_MAX );
 		goto EXIT;
 	}
@@ -701,13 +1129,64 @@ SANE_Int sane_pdf_end_page( void *pw )
 		fprintf ( stderr, " string is too long!\n" );
 		goto EXIT;
 	}
-	if ( ( ldata = re_write_if_fail( pwork->fd, str, len ) ) < 0 ) {
+	if ( ( ldata = _write_data( pwork, str, len ) ) < 0 ) {
 		fprintf ( stderr, " Error is occured in re_write_if_fail.\n" );
 		goto EXIT;
 	}
 
+	/* <4> the page is complete, only its offsets are kept */
+	for ( i = 0; i < SANE_PDF_PAGE_OBJ_NUM; i++ ) {
+		if ( _set_xref( pwork, p->obj_id + i, p->offset_table[ i ] ) < 0 ) {
+			goto EXIT;
+		}
+	}
+	_free_page( p );
+	pwork->cur = NULL;
+
+	ret = SANE_NO_ERR;
+EXIT:
+	return ret;
+}
+
+SANE_Int sane_pdf_abort_page( void *pw )
+{
+	SANE_Int		ret = SANE_ERR;
+	SANE_pdf_page		*p = NULL;
+	SANE_pdf_work		*pwork = (SANE_pdf_work *)pw;
+	SANE_Int64		start;
+
+	if ( pwork == NULL ) {
+		fprintf ( stderr, " Initialize parameter is error!\n" );
+		goto	EXIT;
+	}
+
+	p = pwork->cur;
+	if ( p == NULL ) {
+		/* no unfinished page */
+		ret = SANE_NO_ERR;
+		goto EXIT;
+	}
+
+	/* cut the page off the file.  Written to a pipe, the bytes stay,
+	   but nothing refers to them and the next page reuses the object
+	   ids. */
+	start = p->offset_table[ SANE_PDF_PAGE_OBJ_PAGE ];
+	if ( fflush( pwork->fd ) == 0 &&
+			fseek( pwork->fd, (long)start, SEEK_SET ) == 0 ) {
+		if ( ftruncate( fileno( pwork->fd ), (off_t)start ) != 0 ) {
+			fprintf ( stderr, " Can't truncate file!\n" );
+			goto EXIT;
+		}
+		pwork->offset = start;
+	}
+
+	_free_page( p );
+	pwork->cur = NULL;
+
+	pwork->obj_num -= SANE_PDF_PAGE_OBJ_NUM;
+	pwork->page_num --;
+
 	ret = SANE_NO_ERR;
-	p->status = SANE_NO_ERR;
 EXIT:
 	return ret;
 }
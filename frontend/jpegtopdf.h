@@ -42,9 +42,18 @@ enum {
 	SANE_PDF_IMAGE_COLOR = 0,	/* RGB24bit */
 	SANE_PDF_IMAGE_GRAY,		/* Gray8bit */
 	SANE_PDF_IMAGE_MONO,		/* Gray1bit */
+	SANE_PDF_IMAGE_COLOR16,		/* RGB48bit, Flate only */
+	SANE_PDF_IMAGE_GRAY16,		/* Gray16bit, Flate only */
 	SANE_PDF_IMAGE_NUM,
 };
 
+enum {
+	SANE_PDF_FILTER_DCT = 0,	/* JPEG data from the caller */
+	SANE_PDF_FILTER_FLATE,		/* samples, compressed with zlib */
+	SANE_PDF_FILTER_G4,			/* Gray1bit, CCITT Group 4 coded */
+	SANE_PDF_FILTER_NUM,
+};
+
 /* sane_pdf_StartPage - rotate */
 enum {
 	SANE_PDF_ROTATE_OFF = 0,	/* rotate off */
@@ -69,9 +78,17 @@ SANE_Int sane_pdf_open( void **ppw, FILE* fd );
 void sane_pdf_close( void *pw );
 
 SANE_Int sane_pdf_start_doc( void *pw );
+/* optional, after sane_pdf_start_doc: the profile is written once and
+ * used by all pages of matching colour space */
+SANE_Int sane_pdf_set_icc_profile( void *pw, const SANE_Byte *data, SANE_Int size );
 SANE_Int sane_pdf_end_doc( void *pw );
 
 SANE_Int sane_pdf_start_page( void *pw, SANE_Int w, SANE_Int h, SANE_Int res, SANE_Int type, SANE_Int rotate );
+SANE_Int sane_pdf_start_page_filter( void *pw, SANE_Int w, SANE_Int h, SANE_Int res, SANE_Int type, SANE_Int rotate, SANE_Int filter );
+/* image data of the current page: JPEG data for DCT, samples in PDF
+ * order (big endian, 1 is black for Gray1bit) for Flate and G4 */
+SANE_Int sane_pdf_write( void *pw, const SANE_Byte *data, SANE_Int len );
 SANE_Int sane_pdf_end_page( void *pw );
+SANE_Int sane_pdf_abort_page( void *pw );
 
 #endif /* __JPEG_TO_PDF_H__ */
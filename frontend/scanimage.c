@@ -40,9 +40,21 @@
 #include <unistd.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <limits.h>
 #include <libgen.h>     // for basename()
 #include <sys/types.h>
 #include <sys/stat.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef HAVE_SYS_SELECT_H
+#include <sys/select.h>
+#endif
+#include <time.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #ifdef HAVE_LIBPNG
 #include <png.h>
@@ -50,6 +62,7 @@
 
 #ifdef HAVE_LIBJPEG
 #include <jpeglib.h>
+#include <jerror.h>
 #endif
 
 #include "../include/_stdint.h"
@@ -57,6 +70,7 @@
 #include "../include/sane/sane.h"
 #include "../include/sane/sanei.h"
 #include "../include/sane/saneopts.h"
+#include "../include/sane/sanei_rowconv.h"
 
 #include "sicc.h"
 #include "stiff.h"
@@ -82,6 +96,84 @@ typedef struct
 }
 Image;
 
+/* One sane_read() worth of data handed from the reader to the encoder. */
+typedef struct
+{
+  SANE_Byte *data;
+  SANE_Int len;
+  SANE_Status status;
+  double start;		/* when sane_read() was called, for --perf-trace */
+  double read;		/* time spent in sane_read() */
+}
+Read_Chunk;
+
+/* Bounded ring of chunks between the thread draining the backend and the
+   thread converting and encoding the image.  The reader fills the slot
+   after the last queued one, the encoder owns the slot at head until it
+   asks for the next one. */
+typedef struct
+{
+  Read_Chunk *chunks;
+  int num_chunks;
+  int head;		/* slot currently (or next) owned by the encoder */
+  int count;		/* queued slots, including the one the encoder holds */
+  int held;		/* encoder holds the slot at head */
+  int stop;		/* encoder asked the reader to quit */
+  int running;		/* reader thread has been started */
+#ifdef HAVE_PTHREAD_H
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+#endif
+}
+Read_Queue;
+
+/* A frame of a page that has been read into memory, to be encoded later. */
+typedef struct
+{
+  SANE_Parameters parm;
+  SANE_Byte *data;
+  size_t len;
+}
+Page_Frame;
+
+typedef struct
+{
+  Page_Frame *frames;
+  int num_frames;
+  int frame;		/* frame being replayed */
+  size_t pos;		/* replay position within that frame */
+}
+Page;
+
+/* One sane_read() call, as recorded by --perf-trace.  All times are in
+   seconds. */
+typedef struct
+{
+  double start;		/* sane_read() called, relative to the trace start */
+  double read;		/* blocked in sane_read(), backend and transport */
+  double wait;		/* encoder waiting for the data */
+  double encode;	/* encoder converting and writing the data */
+  SANE_Int len;
+  SANE_Status status;
+}
+Perf_Record;
+
+typedef struct
+{
+  FILE *fp;
+  double origin;	/* time the trace started */
+  int frame;		/* number of frames read so far */
+  int call;		/* sane_read() calls in the current frame */
+  int pending;		/* last still needs its encode time */
+  double handed;	/* time the last chunk was handed to the encoder */
+  Perf_Record last;
+  Perf_Record *records;
+  int num_records;
+  int max_records;
+}
+Perf_Trace;
+
 #define OPTION_FORMAT   1001
 #define OPTION_MD5	1002
 #define OPTION_BATCH_COUNT	1003
@@ -90,6 +182,16 @@ Image;
 #define OPTION_BATCH_INCREMENT	1006
 #define OPTION_BATCH_PROMPT    1007
 #define OPTION_BATCH_PRINT     1008
+#define OPTION_READ_AHEAD      1009
+#define OPTION_BATCH_WORKERS   1010
+#define OPTION_BATCH_SINGLE    1011
+#define OPTION_TIFF_COMPRESSION 1012
+#define OPTION_PERF_TRACE      1013
+#define OPTION_BENCHMARK       1014
+#define OPTION_BENCHMARK_READ_SIZES 1015
+#define OPTION_BENCHMARK_IO    1016
+#define OPTION_BENCHMARK_OPTION 1017
+#define OPTION_PDF_COMPRESSION 1018
 
 #define BATCH_COUNT_UNLIMITED -1
 
@@ -105,6 +207,13 @@ static struct option basic_options[] = {
   {"all-options", no_argument, NULL, 'A'},
   {"version", no_argument, NULL, 'V'},
   {"buffer-size", required_argument, NULL, 'B'},
+  {"read-ahead", required_argument, NULL, OPTION_READ_AHEAD},
+  {"perf-trace", required_argument, NULL, OPTION_PERF_TRACE},
+  {"benchmark", optional_argument, NULL, OPTION_BENCHMARK},
+  {"benchmark-read-sizes", required_argument, NULL,
+   OPTION_BENCHMARK_READ_SIZES},
+  {"benchmark-io", required_argument, NULL, OPTION_BENCHMARK_IO},
+  {"benchmark-option", required_argument, NULL, OPTION_BENCHMARK_OPTION},
   {"batch", optional_argument, NULL, 'b'},
   {"batch-count", required_argument, NULL, OPTION_BATCH_COUNT},
   {"batch-start", required_argument, NULL, OPTION_BATCH_START_AT},
@@ -112,7 +221,11 @@ static struct option basic_options[] = {
   {"batch-increment", required_argument, NULL, OPTION_BATCH_INCREMENT},
   {"batch-print", no_argument, NULL, OPTION_BATCH_PRINT},
   {"batch-prompt", no_argument, NULL, OPTION_BATCH_PROMPT},
+  {"batch-workers", required_argument, NULL, OPTION_BATCH_WORKERS},
+  {"batch-single-file", no_argument, NULL, OPTION_BATCH_SINGLE},
   {"format", required_argument, NULL, OPTION_FORMAT},
+  {"tiff-compression", required_argument, NULL, OPTION_TIFF_COMPRESSION},
+  {"pdf-compression", required_argument, NULL, OPTION_PDF_COMPRESSION},
   {"accept-md5-only", no_argument, NULL, OPTION_MD5},
   {"icc-profile", required_argument, NULL, 'i'},
   {"dont-scan", no_argument, NULL, 'n'},
@@ -126,6 +239,11 @@ static struct option basic_options[] = {
 #define OUTPUT_JPEG     4
 #define OUTPUT_PDF      5
 
+#define PDF_COMPRESSION_AUTO	0
+#define PDF_COMPRESSION_JPEG	1
+#define PDF_COMPRESSION_FLATE	2
+#define PDF_COMPRESSION_G4	3
+
 #define BASE_OPTSTRING	"d:hi:Lf:o:B:nvVTAbp"
 #define STRIP_HEIGHT	256	/* # lines we increment image height */
 
@@ -139,6 +257,8 @@ static const char* output_file = NULL;
 static int test = 0;
 static int all = 0;
 static int output_format = OUTPUT_UNKNOWN;
+static int tiff_compression = SANE_TIFF_COMPRESSION_NONE;
+static int pdf_compression = PDF_COMPRESSION_AUTO;
 static int help = 0;
 static int dont_scan = 0;
 static const char *prog_name = NULL;
@@ -163,6 +283,17 @@ static SANE_Word br_x = 0;
 static SANE_Word br_y = 0;
 static SANE_Byte *buffer = NULL;
 static size_t buffer_size = 0;
+static size_t read_ahead = 0;
+static const char *perf_trace_path = NULL;
+
+#define MAX_BENCHMARK_OPTIONS 8
+static int benchmark = 0;	/* scans per benchmark combination */
+static const char *benchmark_read_sizes = NULL;
+static int benchmark_io = 1;	/* bit 0 blocking, bit 1 non-blocking */
+static const char *benchmark_option[MAX_BENCHMARK_OPTIONS];
+static int num_benchmark_options = 0;
+static Read_Queue read_queue;
+static Perf_Trace perf_trace;
 
 
 static void
@@ -1243,7 +1374,7 @@ write_png_header (SANE_Frame format, int width, int height, int depth, int dpi,
 
   if (icc_profile)
     {
-      void *icc_buffer = sanei_load_icc_profile(icc_profile, &icc_size);
+      const void *icc_buffer = sanei_icc_profile_get(icc_profile, &icc_size);
       if (icc_size > 0)
         {
 	  /* libpng will abort if the profile and image colour spaces do not match*/
@@ -1265,7 +1396,7 @@ write_png_header (SANE_Frame format, int width, int height, int depth, int dpi,
                                 *info_ptr,
                                 basename (icc_profile_cp),
                                 PNG_COMPRESSION_TYPE_BASE,
-                                icc_buffer,
+                                (void *) icc_buffer,
                                 icc_size);
                   free(icc_profile_cp);
 	        }
@@ -1281,7 +1412,6 @@ write_png_header (SANE_Frame format, int width, int height, int depth, int dpi,
 		  fprintf(stderr, "Ignoring 'RGB ' space ICC profile because the image is Grayscale.\n");
 		}
 	    }
-	  free(icc_buffer);
 	}
     }
 
@@ -1290,14 +1420,73 @@ write_png_header (SANE_Frame format, int width, int height, int depth, int dpi,
 #endif
 
 #ifdef HAVE_LIBJPEG
+/* libjpeg destination for the JPEG image of a PDF page.  It goes
+   through the PDF writer, which counts the bytes for the xref. */
+typedef struct
+{
+  struct jpeg_destination_mgr pub;
+  void *pw;
+  JOCTET buffer[16384];
+}
+Pdf_Jpeg_Dest;
+
+static void
+pdf_jpeg_init (j_compress_ptr cinfo)
+{
+  Pdf_Jpeg_Dest *dest = (Pdf_Jpeg_Dest *) cinfo->dest;
+
+  dest->pub.next_output_byte = dest->buffer;
+  dest->pub.free_in_buffer = sizeof (dest->buffer);
+}
+
+static boolean
+pdf_jpeg_empty (j_compress_ptr cinfo)
+{
+  Pdf_Jpeg_Dest *dest = (Pdf_Jpeg_Dest *) cinfo->dest;
+
+  if (sane_pdf_write (dest->pw, dest->buffer, sizeof (dest->buffer)) < 0)
+    ERREXIT (cinfo, JERR_FILE_WRITE);
+  pdf_jpeg_init (cinfo);
+  return TRUE;
+}
+
+static void
+pdf_jpeg_term (j_compress_ptr cinfo)
+{
+  Pdf_Jpeg_Dest *dest = (Pdf_Jpeg_Dest *) cinfo->dest;
+  size_t len = sizeof (dest->buffer) - dest->pub.free_in_buffer;
+
+  if (len > 0 && sane_pdf_write (dest->pw, dest->buffer, (SANE_Int) len) < 0)
+    ERREXIT (cinfo, JERR_FILE_WRITE);
+}
+
+static void
+pdf_jpeg_dest (j_compress_ptr cinfo, void *pw)
+{
+  Pdf_Jpeg_Dest *dest;
+
+  dest = (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_PERMANENT,
+				     sizeof (Pdf_Jpeg_Dest));
+  dest->pub.init_destination = pdf_jpeg_init;
+  dest->pub.empty_output_buffer = pdf_jpeg_empty;
+  dest->pub.term_destination = pdf_jpeg_term;
+  dest->pw = pw;
+  cinfo->dest = &dest->pub;
+}
+
+/* Start a JPEG image, written to `ofp' or, if `pw' is given, as the
+   image of the current PDF page. */
 static void
 write_jpeg_header (SANE_Frame format, int width, int height, int dpi, FILE *ofp,
-                   struct jpeg_compress_struct *cinfo,
+                   void *pw, struct jpeg_compress_struct *cinfo,
                    struct jpeg_error_mgr *jerr)
 {
   cinfo->err = jpeg_std_error(jerr);
   jpeg_create_compress(cinfo);
-  jpeg_stdio_dest(cinfo, ofp);
+  if (pw)
+    pdf_jpeg_dest(cinfo, pw);
+  else
+    jpeg_stdio_dest(cinfo, ofp);
 
   cinfo->image_width = width;
   cinfo->image_height = height;
@@ -1328,233 +1517,882 @@ write_jpeg_header (SANE_Frame format, int width, int height, int dpi, FILE *ofp,
 }
 #endif
 
+/* Make room for at least `lines' rows in the image buffer.  The buffer
+   grows geometrically so that images of unknown length are not copied
+   over and over again. */
 static void *
-advance (Image * image)
+image_grow (Image * image, size_t lines)
 {
-  if (++image->x >= image->width)
+  size_t row_size = (size_t) image->width * image->num_channels;
+  size_t old_height = image->data ? image->height : 0;
+  size_t new_height = old_height;
+  uint8_t *data;
+
+  if (image->data && lines <= old_height)
+    return image->data;
+
+  if (new_height < STRIP_HEIGHT)
+    new_height = STRIP_HEIGHT;
+  while (new_height < lines)
+    new_height *= 2;
+
+  data = realloc (image->data, new_height * row_size);
+  if (!data)
     {
-      image->x = 0;
-      if (++image->y >= image->height || !image->data)
-	{
-	  size_t old_size = 0, new_size;
+      fprintf (stderr, "%s: can't allocate image buffer (%dx%zu)\n",
+	       prog_name, image->width, new_height);
+      return NULL;
+    }
+  memset (data + old_height * row_size, 0,
+	  (new_height - old_height) * row_size);
+
+  image->data = data;
+  image->height = new_height;
+  return data;
+}
 
-	  if (image->data)
-	    old_size = image->height * image->width * image->num_channels;
+/* Append `len' bytes of scan data for `channel' to the image buffer.
+   Single-pass images are copied as a block, the frames of three-pass
+   images are interleaved into RGB. */
+static void *
+image_append (Image * image, int channel, const SANE_Byte * src, int len)
+{
+  size_t pos = (size_t) image->y * image->width + image->x;
 
-	  image->height += STRIP_HEIGHT;
-	  new_size = image->height * image->width * image->num_channels;
+  if (!image_grow (image, (pos + len) / image->width + 1))
+    return NULL;
 
-	  if (image->data)
-	    image->data = realloc (image->data, new_size);
-	  else
-	    image->data = malloc (new_size);
-	  if (image->data)
-	    memset (image->data + old_size, 0, new_size - old_size);
-	}
+  if (image->num_channels == 1)
+    memcpy (image->data + pos, src, len);
+  else
+    {
+      uint8_t *dst = image->data + pos * image->num_channels + channel;
+
+      for (int i = 0; i < len; ++i)
+	dst[i * image->num_channels] = src[i];
     }
-  if (!image->data)
-    fprintf (stderr, "%s: can't allocate image buffer (%dx%d)\n",
-	     prog_name, image->width, image->height);
+
+  pos += len;
+  image->y = pos / image->width;
+  image->x = pos % image->width;
   return image->data;
 }
 
-static SANE_Status
-scan_it (FILE *ofp, void* pw)
+/* Time in seconds for measuring durations.  It doesn't jump when the
+   wall clock is set, where the system provides a monotonic clock. */
+static double
+time_now (void)
 {
-  int i, len, first_frame = 1, offset = 0, must_buffer = 0;
-  uint64_t hundred_percent = 0;
-  SANE_Byte min = 0xff, max = 0;
-  SANE_Parameters parm;
-  SANE_Status status;
-  Image image = { 0, 0, 0, 0, 0, 0 };
-  static const char *format_name[] = {
-    "gray", "RGB", "red", "green", "blue"
-  };
-  uint64_t total_bytes = 0, expected_bytes;
-  SANE_Int hang_over = -1;
-#ifdef HAVE_LIBPNG
-  int pngrow = 0;
-  png_bytep pngbuf = NULL;
-  png_structp png_ptr;
-  png_infop info_ptr;
-#endif
-#ifdef HAVE_LIBJPEG
-  int jpegrow = 0;
-  JSAMPLE *jpegbuf = NULL;
-  struct jpeg_compress_struct cinfo;
-  struct jpeg_error_mgr jerr;
+#if defined(_POSIX_TIMERS) && _POSIX_TIMERS > 0 && defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+
+  if (clock_gettime (CLOCK_MONOTONIC, &ts) == 0)
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 #endif
+  {
+    struct timeval tv;
 
-  (void)pw;
+    gettimeofday (&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+  }
+}
 
-  do
+/* Current time for --perf-trace, 0 when not tracing. */
+static double
+perf_clock (void)
+{
+  return perf_trace.fp ? time_now () : 0;
+}
+
+static const char *perf_status[] = {
+  "GOOD", "UNSUPPORTED", "CANCELLED", "DEVICE_BUSY", "INVAL", "EOF",
+  "JAMMED", "NO_DOCS", "COVER_OPEN", "IO_ERROR", "NO_MEM",
+  "ACCESS_DENIED", "WARMING_UP", "HW_LOCKED", "UNKNOWN"
+};
+#define PERF_STATUS_UNKNOWN \
+  ((int) (sizeof (perf_status) / sizeof (perf_status[0])) - 1)
+
+static int
+perf_status_index (SANE_Status status)
+{
+  if ((unsigned) status < PERF_STATUS_UNKNOWN)
+    return status;
+  return PERF_STATUS_UNKNOWN;
+}
+
+/* Start the trace file, one CSV line per sane_read() call. */
+static void
+perf_trace_open (const char *path)
+{
+  perf_trace.fp = fopen (path, "w");
+  if (!perf_trace.fp)
     {
-      if (!first_frame)
-	{
-#ifdef SANE_STATUS_WARMING_UP
-          do
-	    {
-	      status = sane_start (device);
-	    }
-	  while(status == SANE_STATUS_WARMING_UP);
-#else
-	  status = sane_start (device);
-#endif
-	  if (status != SANE_STATUS_GOOD)
-	    {
-	      fprintf (stderr, "%s: sane_start: %s\n",
-		       prog_name, sane_strstatus (status));
-	      goto cleanup;
-	    }
-	}
+      fprintf (stderr, "%s: can't open %s: %s\n", prog_name, path,
+	       strerror (errno));
+      scanimage_exit (1);
+    }
+  perf_trace.origin = perf_clock ();
+  fprintf (perf_trace.fp,
+	   "frame,call,start_ms,bytes,read_ms,wait_ms,encode_ms,status\n");
+}
 
-      status = sane_get_parameters (device, &parm);
-      if (status != SANE_STATUS_GOOD)
-	{
-	  fprintf (stderr, "%s: sane_get_parameters: %s\n",
-		   prog_name, sane_strstatus (status));
-	  goto cleanup;
-	}
+/* The encoder is done with the last chunk, write out its line. */
+static void
+perf_trace_finish (double now)
+{
+  Perf_Record *rec = &perf_trace.last;
 
-      if (verbose)
-	{
-	  if (first_frame)
-	    {
-	      if (parm.lines >= 0)
-		fprintf (stderr, "%s: scanning image of size %dx%d pixels at "
-			 "%d bits/pixel\n",
-			 prog_name, parm.pixels_per_line, parm.lines,
-			 parm.depth * (SANE_FRAME_RGB == parm.format ? 3 : 1));
-	      else
-		fprintf (stderr, "%s: scanning image %d pixels wide and "
-			 "variable height at %d bits/pixel\n",
-			 prog_name, parm.pixels_per_line,
-			 parm.depth * (SANE_FRAME_RGB == parm.format ? 3 : 1));
-	    }
+  if (!perf_trace.pending)
+    return;
+  perf_trace.pending = 0;
 
-	  fprintf (stderr, "%s: acquiring %s frame\n", prog_name,
-	   parm.format <= SANE_FRAME_BLUE ? format_name[parm.format]:"Unknown");
-	}
+  rec->encode = now - perf_trace.handed;
+  fprintf (perf_trace.fp, "%d,%d,%.3f,%d,%.3f,%.3f,%.3f,%s\n",
+	   perf_trace.frame, perf_trace.call, rec->start * 1e3, rec->len,
+	   rec->read * 1e3, rec->wait * 1e3, rec->encode * 1e3,
+	   perf_status[perf_status_index (rec->status)]);
 
-      if (first_frame)
-	{
-          image.num_channels = 1;
-	  switch (parm.format)
-	    {
-	    case SANE_FRAME_RED:
-	    case SANE_FRAME_GREEN:
-	    case SANE_FRAME_BLUE:
-	      assert (parm.depth == 8);
-	      must_buffer = 1;
-	      offset = parm.format - SANE_FRAME_RED;
-	      image.num_channels = 3;
-	      break;
+  if (perf_trace.num_records == perf_trace.max_records)
+    {
+      int max = perf_trace.max_records ? 2 * perf_trace.max_records : 1024;
+      Perf_Record *p = realloc (perf_trace.records, max * sizeof (*p));
 
-	    case SANE_FRAME_RGB:
-	      assert ((parm.depth == 8) || (parm.depth == 16));
-	    case SANE_FRAME_GRAY:
-	      assert ((parm.depth == 1) || (parm.depth == 8)
-		      || (parm.depth == 16));
-	      if (parm.lines < 0)
-		{
-		  must_buffer = 1;
-		  offset = 0;
-		}
-	      else
-		  switch(output_format)
-		  {
-		  case OUTPUT_TIFF:
-		    sanei_write_tiff_header (parm.format,
-					     parm.pixels_per_line, parm.lines,
-					     parm.depth, resolution_value,
-					     icc_profile, ofp);
-		    break;
-		  case OUTPUT_PNM:
-		    write_pnm_header (parm.format, parm.pixels_per_line,
-				      parm.lines, parm.depth, ofp);
-		    break;
-#ifdef HAVE_LIBPNG
-		  case OUTPUT_PNG:
-		    write_png_header (parm.format, parm.pixels_per_line,
-				      parm.lines, parm.depth, resolution_value,
-				      icc_profile, ofp, &png_ptr, &info_ptr);
-		    break;
-#endif
-#ifdef HAVE_LIBJPEG
-		  case OUTPUT_PDF:
-		    sane_pdf_start_page ( pw, parm.pixels_per_line, parm.lines,
-		               resolution_value, SANE_PDF_IMAGE_COLOR,
-		               SANE_PDF_ROTATE_OFF);
-		    write_jpeg_header (parm.format, parm.pixels_per_line,
-				       parm.lines, resolution_value,
-				       ofp, &cinfo, &jerr);
-		    break;
-		  case OUTPUT_JPEG:
-		    write_jpeg_header (parm.format, parm.pixels_per_line,
-				       parm.lines, resolution_value,
-				       ofp, &cinfo, &jerr);
-		    break;
-#endif
-		  }
-	      break;
+      if (!p)
+	return;		/* the summary will miss some calls */
+      perf_trace.records = p;
+      perf_trace.max_records = max;
+    }
+  perf_trace.records[perf_trace.num_records++] = *rec;
+}
 
-            default:
-	      break;
-	    }
-#ifdef HAVE_LIBPNG
-	  if(output_format == OUTPUT_PNG)
-	    pngbuf = malloc(parm.bytes_per_line);
-#endif
-#ifdef HAVE_LIBJPEG
-	  if(output_format == OUTPUT_JPEG || output_format == OUTPUT_PDF)
-	    jpegbuf = malloc(parm.bytes_per_line);
-#endif
+/* Record a sane_read() call.  The encoder asked for the data at called,
+   the backend was called at start and took read seconds. */
+static void
+perf_trace_read (double called, double start, double read, SANE_Int len,
+		 SANE_Status status)
+{
+  double now;
 
-	  if (must_buffer)
-	    {
-	      /* We're either scanning a multi-frame image or the
-		 scanner doesn't know what the eventual image height
-		 will be (common for hand-held scanners).  In either
-		 case, we need to buffer all data before we can write
-		 the image.  */
-	      image.width = parm.bytes_per_line;
+  if (!perf_trace.fp)
+    return;
 
-	      if (parm.lines >= 0)
-		/* See advance(); we allocate one extra line so we
-		   don't end up realloc'ing in when the image has been
-		   filled in.  */
-		image.height = parm.lines - STRIP_HEIGHT + 1;
-	      else
-		image.height = 0;
+  now = perf_clock ();
+  perf_trace_finish (called);
+
+  perf_trace.call++;
+  perf_trace.last.start = start - perf_trace.origin;
+  perf_trace.last.read = read;
+  perf_trace.last.wait = now - called;
+  perf_trace.last.encode = 0;
+  perf_trace.last.len = len;
+  perf_trace.last.status = status;
+  perf_trace.pending = 1;
+  perf_trace.handed = now;
+}
 
-	      image.x = image.width - 1;
-	      image.y = -1;
-	      if (!advance (&image))
-		{
-		  status = SANE_STATUS_NO_MEM;
-		  goto cleanup;
-		}
-	    }
-	}
-      else
-	{
-	  assert (parm.format >= SANE_FRAME_RED
-		  && parm.format <= SANE_FRAME_BLUE);
-	  offset = parm.format - SANE_FRAME_RED;
-	  image.x = image.y = 0;
-	}
-      hundred_percent = ((uint64_t)parm.bytes_per_line) * parm.lines
-	* ((parm.format == SANE_FRAME_RGB || parm.format == SANE_FRAME_GRAY) ? 1:3);
+static void
+perf_trace_frame (void)
+{
+  if (!perf_trace.fp)
+    return;
+  perf_trace.frame++;
+  perf_trace.call = 0;
+}
 
+static void
+perf_trace_frame_done (void)
+{
+  if (!perf_trace.fp)
+    return;
+  perf_trace_finish (perf_clock ());
+  fflush (perf_trace.fp);
+}
+
+static int
+perf_compare (const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* Nearest rank percentile of n sorted values. */
+static double
+perf_percentile (const double *v, int n, int percent)
+{
+  int k = (int) (((long) percent * n + 99) / 100) - 1;
+
+  if (n == 0)
+    return 0;
+  return v[k < 0 ? 0 : k];
+}
+
+/* One summary line with the total and the percentiles of a column. */
+static void
+perf_summary_line (const char *name, int column)
+{
+  static const int percent[] = { 50, 90, 99, 100 };
+  int n = perf_trace.num_records;
+  double *v, total = 0;
+  int i;
+
+  v = malloc ((n ? n : 1) * sizeof (double));
+  if (!v)
+    return;
+  for (i = 0; i < n; ++i)
+    {
+      Perf_Record *rec = &perf_trace.records[i];
+
+      v[i] = (column == 0 ? rec->read : column == 1 ? rec->wait
+	      : rec->encode) * 1e3;
+      total += v[i];
+    }
+  qsort (v, n, sizeof (double), perf_compare);
+
+  fprintf (perf_trace.fp, "# %-6s %10.3f", name, total);
+  for (i = 0; i < (int) (sizeof (percent) / sizeof (percent[0])); ++i)
+    fprintf (perf_trace.fp, " %9.3f", perf_percentile (v, n, percent[i]));
+  fputc ('\n', perf_trace.fp);
+  free (v);
+}
+
+/* Append the summary and close the trace file. */
+static void
+perf_trace_close (void)
+{
+  double elapsed;
+  uint64_t bytes = 0;
+  int count[PERF_STATUS_UNKNOWN + 1] = { 0 };
+  int i;
+
+  if (!perf_trace.fp)
+    return;
+
+  perf_trace_finish (perf_clock ());
+  elapsed = perf_clock () - perf_trace.origin;
+  for (i = 0; i < perf_trace.num_records; ++i)
+    {
+      bytes += perf_trace.records[i].len;
+      count[perf_status_index (perf_trace.records[i].status)]++;
+    }
+
+  fprintf (perf_trace.fp, "# frames %d calls %d bytes %" PRIu64
+	   " elapsed %.3f s %.3f MB/s\n", perf_trace.frame,
+	   perf_trace.num_records, bytes, elapsed,
+	   elapsed > 0 ? bytes / elapsed / 1e6 : 0.);
+  fprintf (perf_trace.fp, "# ms     %10s %9s %9s %9s %9s\n",
+	   "total", "p50", "p90", "p99", "max");
+  perf_summary_line ("read", 0);
+  perf_summary_line ("wait", 1);
+  perf_summary_line ("encode", 2);
+  fprintf (perf_trace.fp, "# status");
+  for (i = 0; i <= PERF_STATUS_UNKNOWN; ++i)
+    if (count[i])
+      fprintf (perf_trace.fp, " %s %d", perf_status[i], count[i]);
+  fputc ('\n', perf_trace.fp);
+
+  fclose (perf_trace.fp);
+  perf_trace.fp = NULL;
+  free (perf_trace.records);
+  perf_trace.records = NULL;
+}
+
+/* Allocate the chunks of the read-ahead queue.  The queue holds at least
+   two chunks of buffer_size bytes each, and as many as fit into
+   read_ahead bytes.  Without thread support, or with a read-ahead of
+   zero, scan data is read straight into the input buffer instead. */
+static void
+read_queue_init (Read_Queue * q)
+{
+  memset (q, 0, sizeof (*q));
+#ifdef HAVE_PTHREAD_H
+  if (read_ahead == 0 || buffer_size == 0)
+    return;
+
+  q->num_chunks = read_ahead / buffer_size;
+  if (q->num_chunks < 2)
+    q->num_chunks = 2;
+
+  q->chunks = calloc (q->num_chunks, sizeof (Read_Chunk));
+  if (q->chunks)
+    for (int i = 0; i < q->num_chunks; ++i)
+      {
+	q->chunks[i].data = malloc (buffer_size);
+	if (!q->chunks[i].data)
+	  {
+	    while (i--)
+	      free (q->chunks[i].data);
+	    free (q->chunks);
+	    q->chunks = NULL;
+	    break;
+	  }
+      }
+  if (!q->chunks)
+    {
+      fprintf (stderr, "%s: can't allocate read-ahead buffer, "
+	       "reading without it\n", prog_name);
+      q->num_chunks = 0;
+      return;
+    }
+
+  pthread_mutex_init (&q->lock, NULL);
+  pthread_cond_init (&q->cond, NULL);
+#endif
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *
+read_queue_reader (void *arg)
+{
+  Read_Queue *q = arg;
+  Read_Chunk *chunk;
+  SANE_Status status;
+
+  do
+    {
+      pthread_mutex_lock (&q->lock);
+      while (q->count == q->num_chunks && !q->stop)
+	pthread_cond_wait (&q->cond, &q->lock);
+      if (q->stop)
+	{
+	  pthread_mutex_unlock (&q->lock);
+	  break;
+	}
+      chunk = &q->chunks[(q->head + q->count) % q->num_chunks];
+      pthread_mutex_unlock (&q->lock);
+
+      /* the encoder never looks past the queued slots, so the chunk can
+         be filled without holding the lock */
+      chunk->start = perf_clock ();
+      status = sane_read (device, chunk->data, buffer_size, &chunk->len);
+      chunk->read = perf_clock () - chunk->start;
+      chunk->status = status;
+
+      pthread_mutex_lock (&q->lock);
+      q->count++;
+      pthread_cond_signal (&q->cond);
+      pthread_mutex_unlock (&q->lock);
+    }
+  while (status == SANE_STATUS_GOOD);
+
+  return NULL;
+}
+#endif
+
+/* Start reading the current frame ahead of the encoder. */
+static void
+read_queue_start (Read_Queue * q)
+{
+  perf_trace_frame ();
+#ifdef HAVE_PTHREAD_H
+  if (q->num_chunks == 0)
+    return;
+
+  q->head = q->count = q->held = q->stop = 0;
+  if (pthread_create (&q->thread, NULL, read_queue_reader, q) == 0)
+    q->running = 1;
+  else
+    fprintf (stderr, "%s: can't start reader thread, reading without "
+	     "read-ahead\n", prog_name);
+#else
+  (void) q;
+#endif
+}
+
+/* Hand the next chunk of scan data to the encoder.  The chunk stays valid
+   until the next call. */
+static SANE_Status
+read_queue_get (Read_Queue * q, SANE_Byte ** data, SANE_Int * len)
+{
+  double called = perf_clock ();
+  SANE_Status status;
+
+#ifdef HAVE_PTHREAD_H
+  if (q->running)
+    {
+      Read_Chunk *chunk;
+
+      pthread_mutex_lock (&q->lock);
+      if (q->held)
+	{
+	  q->head = (q->head + 1) % q->num_chunks;
+	  q->count--;
+	  q->held = 0;
+	  pthread_cond_signal (&q->cond);
+	}
+      while (q->count == 0)
+	pthread_cond_wait (&q->cond, &q->lock);
+      chunk = &q->chunks[q->head];
+      q->held = 1;
+      pthread_mutex_unlock (&q->lock);
+
+      *data = chunk->data;
+      *len = chunk->len;
+      perf_trace_read (called, chunk->start, chunk->read, chunk->len,
+		       chunk->status);
+      return chunk->status;
+    }
+#else
+  (void) q;
+#endif
+  *data = buffer;
+  status = sane_read (device, buffer, buffer_size, len);
+  perf_trace_read (called, called, perf_clock () - called, *len, status);
+  return status;
+}
+
+/* Stop the reader of the current frame and wait for it to finish.  Safe
+   to call when no reader is running. */
+static void
+read_queue_stop (Read_Queue * q)
+{
+  perf_trace_frame_done ();
+#ifdef HAVE_PTHREAD_H
+  if (!q->running)
+    return;
+
+  pthread_mutex_lock (&q->lock);
+  q->stop = 1;
+  pthread_cond_signal (&q->cond);
+  pthread_mutex_unlock (&q->lock);
+
+  pthread_join (q->thread, NULL);
+  q->running = 0;
+#else
+  (void) q;
+#endif
+}
+
+/* Free the chunks of the read-ahead queue, stopping a reader that is still
+   running on an error path first. */
+static void
+read_queue_free (Read_Queue * q)
+{
+#ifdef HAVE_PTHREAD_H
+  if (q->running)
+    {
+      sane_cancel (device);
+      read_queue_stop (q);
+    }
+  if (!q->chunks)
+    return;
+
+  for (int i = 0; i < q->num_chunks; ++i)
+    free (q->chunks[i].data);
+  free (q->chunks);
+  q->chunks = NULL;
+  q->num_chunks = 0;
+  pthread_mutex_destroy (&q->lock);
+  pthread_cond_destroy (&q->cond);
+#else
+  (void) q;
+#endif
+}
+
+/* Start the next frame, either on the device or in a recorded page. */
+static SANE_Status
+frame_start (Page * page)
+{
+  SANE_Status status;
+
+  if (page)
+    {
+      if (++page->frame >= page->num_frames)
+	return SANE_STATUS_INVAL;
+      page->pos = 0;
+      return SANE_STATUS_GOOD;
+    }
+
+#ifdef SANE_STATUS_WARMING_UP
+  do
+    {
+      status = sane_start (device);
+    }
+  while(status == SANE_STATUS_WARMING_UP);
+#else
+  status = sane_start (device);
+#endif
+  return status;
+}
+
+static SANE_Status
+frame_get_parameters (Page * page, SANE_Parameters * parm)
+{
+  if (page)
+    {
+      if (page->frame >= page->num_frames)
+	return SANE_STATUS_INVAL;
+      *parm = page->frames[page->frame].parm;
+      return SANE_STATUS_GOOD;
+    }
+  return sane_get_parameters (device, parm);
+}
+
+/* Get the next chunk of data of the current frame.  A recorded page is
+   handed out in chunks of the input buffer size, just like sane_read()
+   would. */
+static SANE_Status
+frame_read (Page * page, SANE_Byte ** data, SANE_Int * len)
+{
+  if (page)
+    {
+      Page_Frame *frame = &page->frames[page->frame];
+      size_t left = frame->len - page->pos;
+
+      if (left == 0)
+	{
+	  *len = 0;
+	  return SANE_STATUS_EOF;
+	}
+      if (left > buffer_size)
+	left = buffer_size;
+      *data = frame->data + page->pos;
+      *len = left;
+      page->pos += left;
+      return SANE_STATUS_GOOD;
+    }
+  return read_queue_get (&read_queue, data, len);
+}
+
+/* G4 only works for lineart, other images get the next best choice. */
+static int
+tiff_page_compression (const SANE_Parameters * parm)
+{
+  if (tiff_compression != SANE_TIFF_COMPRESSION_G4 || parm->depth == 1)
+    return tiff_compression;
+#ifdef HAVE_LIBZ
+  return SANE_TIFF_COMPRESSION_DEFLATE;
+#else
+  return SANE_TIFF_COMPRESSION_PACKBITS;
+#endif
+}
+
+/* Start a TIFF image.  Pages of a multi-page file in `pw' and compressed
+   images go through a SANE_Tiff_Doc, returned in `tiff'.  Other images
+   only get their header and the data is written to `ofp' as it is. */
+static SANE_Status
+start_tiff_page (FILE * ofp, void *pw, SANE_Tiff_Doc * local,
+		 const SANE_Parameters * parm, int height,
+		 SANE_Tiff_Doc ** tiff)
+{
+  int compression = tiff_page_compression (parm);
+
+  *tiff = pw;
+  if (!pw && compression == SANE_TIFF_COMPRESSION_NONE)
+    {
+      sanei_write_tiff_header (parm->format, parm->pixels_per_line, height,
+			       parm->depth, resolution_value, icc_profile,
+			       ofp);
+      return SANE_STATUS_GOOD;
+    }
+
+  if (!pw)
+    {
+      sanei_tiff_doc_init (local, ofp);
+      *tiff = local;
+    }
+  if (sanei_tiff_doc_start_page (*tiff, parm->format, parm->pixels_per_line,
+				 height, parm->depth, resolution_value,
+				 icc_profile, compression))
+    {
+      fprintf (stderr, "%s: cannot write TIFF image\n", prog_name);
+      return SANE_STATUS_IO_ERROR;
+    }
+  return SANE_STATUS_GOOD;
+}
+
+#ifdef HAVE_LIBJPEG
+/* Lineart is kept as it is, everything else goes through JPEG unless
+   asked otherwise. */
+static int
+pdf_page_filter (const SANE_Parameters * parm)
+{
+  switch (pdf_compression)
+    {
+    case PDF_COMPRESSION_JPEG:
+      return SANE_PDF_FILTER_DCT;
+    case PDF_COMPRESSION_FLATE:
+      return SANE_PDF_FILTER_FLATE;
+    default:
+      break;
+    }
+  return parm->depth == 1 ? SANE_PDF_FILTER_G4 : SANE_PDF_FILTER_DCT;
+}
+
+/* Start a PDF page of `height' lines, with the JPEG image if the page
+   uses DCT. */
+static SANE_Status
+start_pdf_page (void *pw, const SANE_Parameters * parm, int height,
+		int filter, struct jpeg_compress_struct *cinfo,
+		struct jpeg_error_mgr *jerr)
+{
+  int color = (parm->format != SANE_FRAME_GRAY);
+  int type;
+
+  /* JPEG takes 8 bit samples only, lineart is expanded to gray */
+  if (filter == SANE_PDF_FILTER_DCT)
+    type = color ? SANE_PDF_IMAGE_COLOR : SANE_PDF_IMAGE_GRAY;
+  else if (parm->depth == 1)
+    type = SANE_PDF_IMAGE_MONO;
+  else if (parm->depth == 16)
+    type = color ? SANE_PDF_IMAGE_COLOR16 : SANE_PDF_IMAGE_GRAY16;
+  else
+    type = color ? SANE_PDF_IMAGE_COLOR : SANE_PDF_IMAGE_GRAY;
+
+  if (sane_pdf_start_page_filter (pw, parm->pixels_per_line, height,
+				  resolution_value > 0 ? resolution_value : 72,
+				  type, SANE_PDF_ROTATE_OFF, filter) < 0)
+    {
+      fprintf (stderr, "%s: cannot write PDF page\n", prog_name);
+      return SANE_STATUS_IO_ERROR;
+    }
+  if (filter == SANE_PDF_FILTER_DCT)
+    write_jpeg_header (parm->format, parm->pixels_per_line, height,
+		       resolution_value, NULL, pw, cinfo, jerr);
+  return SANE_STATUS_GOOD;
+}
+
+/* Write one row of `len' bytes of a JPEG image or PDF page.  The row
+   may be changed. */
+static SANE_Status
+write_jpeg_row (void *pw, int filter, const SANE_Parameters * parm,
+		struct jpeg_compress_struct *cinfo, JSAMPLE * row, int len,
+		JSAMPLE * row8)
+{
+  if (filter != SANE_PDF_FILTER_DCT)
+    {
+#ifndef WORDS_BIGENDIAN
+      /* PDF samples are big-endian */
+      if (parm->depth == 16)
+	sanei_rowconv_swap16 (row, len);
+#endif
+      if (sane_pdf_write (pw, row, len) < 0)
+	{
+	  fprintf (stderr, "%s: cannot write PDF page\n", prog_name);
+	  return SANE_STATUS_IO_ERROR;
+	}
+      return SANE_STATUS_GOOD;
+    }
+
+  if (parm->depth == 1)
+    {
+      sanei_rowconv_1to8 (row, row8, len * 8);
+      row = row8;
+    }
+  else if (parm->depth == 16)
+    {
+      /* JPEG is an 8-bit format, so we need to throw away the low
+	 byte from each 16-bit value. */
+      sanei_rowconv_16to8 (row, row8, len / 2);
+      row = row8;
+    }
+  jpeg_write_scanlines (cinfo, &row, 1);
+  return SANE_STATUS_GOOD;
+}
+#endif
+
+/* Scan an image from the device and write it to `ofp'.  If `page' is
+   given, the image is taken from a page recorded earlier instead. */
+static SANE_Status
+scan_it (FILE *ofp, void* pw, Page *page)
+{
+  int i, len, first_frame = 1, offset = 0, must_buffer = 0;
+  uint64_t hundred_percent = 0;
+  SANE_Byte *data;
+  SANE_Byte min = 0xff, max = 0;
+  SANE_Parameters parm;
+  SANE_Status status;
+  Image image = { 0, 0, 0, 0, 0, 0 };
+  static const char *format_name[] = {
+    "gray", "RGB", "red", "green", "blue"
+  };
+  uint64_t total_bytes = 0, expected_bytes;
+  SANE_Int hang_over = -1;
+#ifdef HAVE_LIBPNG
+  int pngrow = 0;
+  png_bytep pngbuf = NULL;
+  png_structp png_ptr;
+  png_infop info_ptr;
+#endif
+#ifdef HAVE_LIBJPEG
+  int jpegrow = 0;
+  JSAMPLE *jpegbuf = NULL;
+  JSAMPLE *jpeg8 = NULL;
+  struct jpeg_compress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  int pdf_filter = SANE_PDF_FILTER_DCT;
+#endif
+  SANE_Tiff_Doc local_tiff, *tiff = NULL;
+
+  do
+    {
+      if (!first_frame)
+	{
+	  status = frame_start (page);
+	  if (status != SANE_STATUS_GOOD)
+	    {
+	      fprintf (stderr, "%s: sane_start: %s\n",
+		       prog_name, sane_strstatus (status));
+	      goto cleanup;
+	    }
+	}
+
+      status = frame_get_parameters (page, &parm);
+      if (status != SANE_STATUS_GOOD)
+	{
+	  fprintf (stderr, "%s: sane_get_parameters: %s\n",
+		   prog_name, sane_strstatus (status));
+	  goto cleanup;
+	}
+
+      if (verbose)
+	{
+	  if (first_frame)
+	    {
+	      if (parm.lines >= 0)
+		fprintf (stderr, "%s: scanning image of size %dx%d pixels at "
+			 "%d bits/pixel\n",
+			 prog_name, parm.pixels_per_line, parm.lines,
+			 parm.depth * (SANE_FRAME_RGB == parm.format ? 3 : 1));
+	      else
+		fprintf (stderr, "%s: scanning image %d pixels wide and "
+			 "variable height at %d bits/pixel\n",
+			 prog_name, parm.pixels_per_line,
+			 parm.depth * (SANE_FRAME_RGB == parm.format ? 3 : 1));
+	    }
+
+	  fprintf (stderr, "%s: acquiring %s frame\n", prog_name,
+	   parm.format <= SANE_FRAME_BLUE ? format_name[parm.format]:"Unknown");
+	}
+
+      if (first_frame)
+	{
+          image.num_channels = 1;
+#ifdef HAVE_LIBJPEG
+	  memset (&cinfo, 0, sizeof (cinfo));
+	  if (output_format == OUTPUT_PDF)
+	    pdf_filter = pdf_page_filter (&parm);
+#endif
+	  switch (parm.format)
+	    {
+	    case SANE_FRAME_RED:
+	    case SANE_FRAME_GREEN:
+	    case SANE_FRAME_BLUE:
+	      assert (parm.depth == 8);
+	      must_buffer = 1;
+	      offset = parm.format - SANE_FRAME_RED;
+	      image.num_channels = 3;
+	      break;
+
+	    case SANE_FRAME_RGB:
+	      assert ((parm.depth == 8) || (parm.depth == 16));
+	    case SANE_FRAME_GRAY:
+	      assert ((parm.depth == 1) || (parm.depth == 8)
+		      || (parm.depth == 16));
+	      /* compressed TIFF does not need the height in advance */
+	      if (parm.lines < 0
+		  && !(output_format == OUTPUT_TIFF
+		       && tiff_page_compression (&parm)
+			  != SANE_TIFF_COMPRESSION_NONE))
+		{
+		  must_buffer = 1;
+		  offset = 0;
+		}
+	      else
+		  switch(output_format)
+		  {
+		  case OUTPUT_TIFF:
+		    status = start_tiff_page (ofp, pw, &local_tiff, &parm,
+					      parm.lines, &tiff);
+		    if (status != SANE_STATUS_GOOD)
+		      goto cleanup;
+		    break;
+		  case OUTPUT_PNM:
+		    write_pnm_header (parm.format, parm.pixels_per_line,
+				      parm.lines, parm.depth, ofp);
+		    break;
+#ifdef HAVE_LIBPNG
+		  case OUTPUT_PNG:
+		    write_png_header (parm.format, parm.pixels_per_line,
+				      parm.lines, parm.depth, resolution_value,
+				      icc_profile, ofp, &png_ptr, &info_ptr);
+		    break;
+#endif
+#ifdef HAVE_LIBJPEG
+		  case OUTPUT_PDF:
+		    status = start_pdf_page (pw, &parm, parm.lines,
+					     pdf_filter, &cinfo, &jerr);
+		    if (status != SANE_STATUS_GOOD)
+		      goto cleanup;
+		    break;
+		  case OUTPUT_JPEG:
+		    write_jpeg_header (parm.format, parm.pixels_per_line,
+				       parm.lines, resolution_value,
+				       ofp, NULL, &cinfo, &jerr);
+		    break;
+#endif
+		  }
+	      break;
+
+            default:
+	      break;
+	    }
+#ifdef HAVE_LIBPNG
+	  if(output_format == OUTPUT_PNG)
+	    pngbuf = malloc(parm.bytes_per_line);
+#endif
+#ifdef HAVE_LIBJPEG
+	  if(output_format == OUTPUT_JPEG || output_format == OUTPUT_PDF)
+	    {
+	      jpegbuf = malloc(parm.bytes_per_line);
+	      /* JPEG only takes 8 bit samples */
+	      if (pdf_filter != SANE_PDF_FILTER_DCT)
+		;
+	      else if (parm.depth == 1)
+		jpeg8 = malloc(parm.bytes_per_line * 8);
+	      else if (parm.depth == 16)
+		jpeg8 = malloc(parm.bytes_per_line / 2);
+	    }
+#endif
+
+	  if (must_buffer)
+	    {
+	      /* We're either scanning a multi-frame image or the
+		 scanner doesn't know what the eventual image height
+		 will be (common for hand-held scanners).  In either
+		 case, we need to buffer all data before we can write
+		 the image.  */
+	      image.width = parm.bytes_per_line;
+	      image.height = 0;
+	      image.x = image.y = 0;
+	      if (!image_grow (&image, parm.lines >= 0 ? parm.lines + 1 : 0))
+		{
+		  status = SANE_STATUS_NO_MEM;
+		  goto cleanup;
+		}
+	    }
+	}
+      else
+	{
+	  assert (parm.format >= SANE_FRAME_RED
+		  && parm.format <= SANE_FRAME_BLUE);
+	  offset = parm.format - SANE_FRAME_RED;
+	  image.x = image.y = 0;
+	}
+      hundred_percent = ((uint64_t)parm.bytes_per_line) * parm.lines
+	* ((parm.format == SANE_FRAME_RGB || parm.format == SANE_FRAME_GRAY) ? 1:3);
+
+      if (!page)
+	read_queue_start (&read_queue);
       while (1)
 	{
 	  double progr;
-	  status = sane_read (device, buffer, buffer_size, &len);
+	  status = frame_read (page, &data, &len);
 	  total_bytes += (SANE_Word) len;
           progr = ((total_bytes * 100.) / (double) hundred_percent);
           if (progr > 100.)
 	    progr = 100.;
-          if (progress)
+          if (progress && !page)
             {
               if (parm.lines >= 0)
                 fprintf(stderr, "Progress: %3.1f%%\r", progr);
@@ -1571,6 +2409,11 @@ scan_it (FILE *ofp, void* pw)
 		{
 		  fprintf (stderr, "%s: sane_read: %s\n",
 			   prog_name, sane_strstatus (status));
+		  if (!page)
+		    read_queue_stop (&read_queue);
+		  /* keep what was scanned, as for uncompressed images */
+		  if (tiff == &local_tiff)
+		    sanei_tiff_doc_end_page (tiff);
 		  return status;
 		}
 	      break;
@@ -1578,54 +2421,10 @@ scan_it (FILE *ofp, void* pw)
 
 	  if (must_buffer)
 	    {
-	      switch (parm.format)
+	      if (!image_append (&image, offset, data, len))
 		{
-		case SANE_FRAME_RED:
-		case SANE_FRAME_GREEN:
-		case SANE_FRAME_BLUE:
-		  image.num_channels = 3;
-		  for (i = 0; i < len; ++i)
-		    {
-		      image.data[offset + 3 * i] = buffer[i];
-		      if (!advance (&image))
-			{
-			  status = SANE_STATUS_NO_MEM;
-			  goto cleanup;
-			}
-		    }
-		  offset += 3 * len;
-		  break;
-
-		case SANE_FRAME_RGB:
-		  image.num_channels = 1;
-		  for (i = 0; i < len; ++i)
-		    {
-		      image.data[offset + i] = buffer[i];
-		      if (!advance (&image))
-			  {
-			    status = SANE_STATUS_NO_MEM;
-			    goto cleanup;
-			  }
-		    }
-		  offset += len;
-		  break;
-
-		case SANE_FRAME_GRAY:
-		  image.num_channels = 1;
-		  for (i = 0; i < len; ++i)
-		    {
-		      image.data[offset + i] = buffer[i];
-		      if (!advance (&image))
-			  {
-			    status = SANE_STATUS_NO_MEM;
-			    goto cleanup;
-			  }
-		    }
-		  offset += len;
-		  break;
-
-                default:
-		  break;
+		  status = SANE_STATUS_NO_MEM;
+		  goto cleanup;
 		}
 	    }
 	  else			/* ! must_buffer */
@@ -1637,34 +2436,21 @@ scan_it (FILE *ofp, void* pw)
 		  int left = len;
 		  while(pngrow + left >= parm.bytes_per_line)
 		    {
-		      memcpy(pngbuf + pngrow, buffer + idx, parm.bytes_per_line - pngrow);
+		      memcpy(pngbuf + pngrow, data + idx, parm.bytes_per_line - pngrow);
 		      if(parm.depth == 1)
-			{
-			  int j;
-			  for(j = 0; j < parm.bytes_per_line; j++)
-			    pngbuf[j] = ~pngbuf[j];
-			}
+			sanei_rowconv_invert(pngbuf, parm.bytes_per_line);
 #ifndef WORDS_BIGENDIAN
                       /* SANE is endian-native, PNG is big-endian, */
                       /* see: https://www.w3.org/TR/2003/REC-PNG-20031110/#7Integers-and-byte-order */
                       if (parm.depth == 16)
-                        {
-                          int j;
-                          for (j = 0; j < parm.bytes_per_line; j += 2)
-                            {
-                              SANE_Byte LSB;
-                              LSB = pngbuf[j];
-                              pngbuf[j] = pngbuf[j + 1];
-                              pngbuf[j + 1] = LSB;
-                            }
-                        }
+                        sanei_rowconv_swap16(pngbuf, parm.bytes_per_line);
 #endif
 		      png_write_row(png_ptr, pngbuf);
 		      idx += parm.bytes_per_line - pngrow;
 		      left -= parm.bytes_per_line - pngrow;
 		      pngrow = 0;
 		    }
-		  memcpy(pngbuf + pngrow, buffer + idx, left);
+		  memcpy(pngbuf + pngrow, data + idx, left);
 		  pngrow += left;
 		}
 	      else
@@ -1676,46 +2462,33 @@ scan_it (FILE *ofp, void* pw)
 		  int left = len;
 		  while(jpegrow + left >= parm.bytes_per_line)
 		    {
-		      memcpy(jpegbuf + jpegrow, buffer + idx, parm.bytes_per_line - jpegrow);
-		      if(parm.depth == 1)
-			{
-			  int col1, col8;
-			  JSAMPLE *buf8 = malloc(parm.bytes_per_line * 8);
-			  for(col1 = 0; col1 < parm.bytes_per_line; col1++)
-			    for(col8 = 0; col8 < 8; col8++)
-			      buf8[col1 * 8 + col8] = (jpegbuf[col1] & (1 << (8 - col8 - 1))) ? 0 : 0xff;
-		          jpeg_write_scanlines(&cinfo, &buf8, 1);
-			  free(buf8);
-			} else if(parm.depth == 16) {
-				// JPEG is an 8-bit format, so we need to throw away the low
-				// byte from each 16-bit value.
-				int col;
-				JSAMPLE *buf8 = malloc(parm.bytes_per_line/2);
-				for(col = 0; col < parm.bytes_per_line; col+=2) {
-					#ifdef WORDS_BIGENDIAN
-						// platform is big-endian, so we want the first byte of each pair
-						buf8[col/2] = jpegbuf[col];
-					#else
-						// platform is little-endian, so we want the second byte of each pair
-						buf8[col/2] = jpegbuf[col+1];
-					#endif
-				}
-				jpeg_write_scanlines(&cinfo, &buf8, 1);
-				free(buf8);
-			} else {
-		          jpeg_write_scanlines(&cinfo, &jpegbuf, 1);
-			}
+		      memcpy(jpegbuf + jpegrow, data + idx, parm.bytes_per_line - jpegrow);
+		      status = write_jpeg_row (pw, pdf_filter, &parm, &cinfo,
+					       jpegbuf, parm.bytes_per_line,
+					       jpeg8);
+		      if (status != SANE_STATUS_GOOD)
+			goto cleanup;
 		      idx += parm.bytes_per_line - jpegrow;
 		      left -= parm.bytes_per_line - jpegrow;
 		      jpegrow = 0;
 		    }
-		  memcpy(jpegbuf + jpegrow, buffer + idx, left);
+		  memcpy(jpegbuf + jpegrow, data + idx, left);
 		  jpegrow += left;
 		}
 	      else
 #endif
-	      if ((output_format == OUTPUT_TIFF) || (parm.depth != 16))
-		fwrite (buffer, 1, len, ofp);
+	      if (tiff)
+		{
+		  if (sanei_tiff_doc_write (tiff, data, len))
+		    {
+		      fprintf (stderr, "%s: cannot write TIFF image\n",
+			       prog_name);
+		      status = SANE_STATUS_IO_ERROR;
+		      goto cleanup;
+		    }
+		}
+	      else if ((output_format == OUTPUT_TIFF) || (parm.depth != 16))
+		fwrite (data, 1, len, ofp);
 	      else
 		{
 #if !defined(WORDS_BIGENDIAN)
@@ -1726,40 +2499,36 @@ scan_it (FILE *ofp, void* pw)
 		    {
 		      if (len > 0)
 			{
-			  fwrite (buffer, 1, 1, ofp);
-			  buffer[0] = (SANE_Byte) hang_over;
+			  fwrite (data, 1, 1, ofp);
+			  data[0] = (SANE_Byte) hang_over;
 			  hang_over = -1;
 			  start = 1;
 			}
 		    }
 		  /* now do the byte-swapping */
-		  for (int idx = start; idx < (len - 1); idx += 2)
-		    {
-		      unsigned char LSB;
-		      LSB = buffer[idx];
-		      buffer[idx] = buffer[idx + 1];
-		      buffer[idx + 1] = LSB;
-		    }
+		  sanei_rowconv_swap16 (data + start, len - start);
 		  /* check if we have an odd number of bytes */
 		  if (((len - start) % 2) != 0)
 		    {
-		      hang_over = buffer[len - 1];
+		      hang_over = data[len - 1];
 		      len--;
 		    }
 #endif
-		  fwrite (buffer, 1, len, ofp);
+		  fwrite (data, 1, len, ofp);
 		}
 	    }
 
 	  if (verbose && parm.depth == 8)
 	    {
 	      for (i = 0; i < len; ++i)
-		if (buffer[i] >= max)
-		  max = buffer[i];
-		else if (buffer[i] < min)
-		  min = buffer[i];
+		if (data[i] >= max)
+		  max = data[i];
+		else if (data[i] < min)
+		  min = data[i];
 	    }
 	}
+      if (!page)
+	read_queue_stop (&read_queue);
       first_frame = 0;
     }
   while (!parm.last_frame);
@@ -1770,9 +2539,10 @@ scan_it (FILE *ofp, void* pw)
 
       switch(output_format) {
       case OUTPUT_TIFF:
-	sanei_write_tiff_header (parm.format, parm.pixels_per_line,
-				 image.height, parm.depth, resolution_value,
-				 icc_profile, ofp);
+	status = start_tiff_page (ofp, pw, &local_tiff, &parm, image.height,
+				  &tiff);
+	if (status != SANE_STATUS_GOOD)
+	  goto cleanup;
       break;
       case OUTPUT_PNM:
 	write_pnm_header (parm.format, parm.pixels_per_line,
@@ -1787,17 +2557,15 @@ scan_it (FILE *ofp, void* pw)
 #endif
 #ifdef HAVE_LIBJPEG
       case OUTPUT_PDF:
-	sane_pdf_start_page ( pw, parm.pixels_per_line, parm.lines,
-	           resolution_value, SANE_PDF_IMAGE_COLOR,
-	           SANE_PDF_ROTATE_OFF);
-	write_jpeg_header (parm.format, parm.pixels_per_line,
-			   parm.lines, resolution_value,
-			   ofp, &cinfo, &jerr);
+	status = start_pdf_page (pw, &parm, image.height, pdf_filter,
+				 &cinfo, &jerr);
+	if (status != SANE_STATUS_GOOD)
+	  goto cleanup;
       break;
       case OUTPUT_JPEG:
 	write_jpeg_header (parm.format, parm.pixels_per_line,
-			   parm.lines, resolution_value,
-			   ofp, &cinfo, &jerr);
+			   image.height, resolution_value,
+			   ofp, NULL, &cinfo, &jerr);
       break;
 #endif
       }
@@ -1805,26 +2573,56 @@ scan_it (FILE *ofp, void* pw)
 #if !defined(WORDS_BIGENDIAN)
       /* multibyte pnm file may need byte swap to LE */
       /* FIXME: other bit depths? */
-      if (output_format != OUTPUT_TIFF && parm.depth == 16)
+      if (output_format != OUTPUT_TIFF && output_format != OUTPUT_JPEG
+	  && output_format != OUTPUT_PDF && parm.depth == 16)
 	{
-	  for (int idx = 0; idx < image.height * image.width; idx += 2)
+	  sanei_rowconv_swap16 (image.data,
+				(size_t) image.height * image.width);
+	}
+#endif
+
+      if (tiff)
+	{
+	  if (sanei_tiff_doc_write (tiff, image.data, (size_t) image.height
+				    * image.width * image.num_channels))
 	    {
-	      unsigned char LSB;
-	      LSB = image.data[idx];
-	      image.data[idx] = image.data[idx + 1];
-	      image.data[idx + 1] = LSB;
+	      fprintf (stderr, "%s: cannot write TIFF image\n", prog_name);
+	      status = SANE_STATUS_IO_ERROR;
+	      goto cleanup;
 	    }
 	}
-#endif
+#ifdef HAVE_LIBJPEG
+      else if (output_format == OUTPUT_JPEG || output_format == OUTPUT_PDF)
+	{
+	  int row_size = image.width * image.num_channels;
 
+	  for (i = 0; i < image.height; i++)
+	    {
+	      status = write_jpeg_row (pw, pdf_filter, &parm, &cinfo,
+				       image.data + (size_t) i * row_size,
+				       row_size, jpeg8);
+	      if (status != SANE_STATUS_GOOD)
+		goto cleanup;
+	    }
+	}
+#endif
+      else
 	fwrite (image.data, 1, image.height * image.width * image.num_channels, ofp);
     }
+    /* a single image is complete here, pages of a multi-page file are
+       finished by the caller */
+    if (tiff == &local_tiff && sanei_tiff_doc_end_page (tiff))
+      {
+	fprintf (stderr, "%s: cannot write TIFF image\n", prog_name);
+	status = SANE_STATUS_IO_ERROR;
+      }
 #ifdef HAVE_LIBPNG
     if(output_format == OUTPUT_PNG)
 	png_write_end(png_ptr, info_ptr);
 #endif
 #ifdef HAVE_LIBJPEG
-    if(output_format == OUTPUT_JPEG || output_format == OUTPUT_PDF)
+    if((output_format == OUTPUT_JPEG || output_format == OUTPUT_PDF)
+       && pdf_filter == SANE_PDF_FILTER_DCT)
 	jpeg_finish_compress(&cinfo);
 #endif
 
@@ -1832,6 +2630,10 @@ scan_it (FILE *ofp, void* pw)
   fflush( ofp );
 
 cleanup:
+  if (!page)
+    read_queue_stop (&read_queue);
+  if (tiff == &local_tiff && tiff->page)
+    sanei_tiff_doc_end_page (tiff);
 #ifdef HAVE_LIBPNG
   if(output_format == OUTPUT_PNG) {
     png_destroy_write_struct(&png_ptr, &info_ptr);
@@ -1842,27 +2644,398 @@ cleanup:
   if(output_format == OUTPUT_JPEG || output_format == OUTPUT_PDF) {
     jpeg_destroy_compress(&cinfo);
     free(jpegbuf);
+    free(jpeg8);
   }
 #endif
   if (image.data)
     free (image.data);
 
 
-  expected_bytes = ((uint64_t)parm.bytes_per_line) * parm.lines *
-    ((parm.format == SANE_FRAME_RGB
-      || parm.format == SANE_FRAME_GRAY) ? 1 : 3);
-  if (parm.lines < 0)
-    expected_bytes = 0;
-  if (total_bytes > expected_bytes && expected_bytes != 0)
+  expected_bytes = ((uint64_t)parm.bytes_per_line) * parm.lines *
+    ((parm.format == SANE_FRAME_RGB
+      || parm.format == SANE_FRAME_GRAY) ? 1 : 3);
+  if (parm.lines < 0)
+    expected_bytes = 0;
+  if (total_bytes > expected_bytes && expected_bytes != 0)
+    {
+      fprintf (stderr,
+	       "%s: WARNING: read more data than announced by backend "
+               "(%" PRIu64 "/%" PRIu64 ")\n", prog_name, total_bytes, expected_bytes);
+    }
+  else if (verbose)
+    fprintf (stderr, "%s: read %" PRIu64 " bytes in total\n", prog_name, total_bytes);
+
+  return status;
+}
+
+#ifdef HAVE_PTHREAD_H
+static void
+page_free (Page * page)
+{
+  for (int i = 0; i < page->num_frames; ++i)
+    free (page->frames[i].data);
+  free (page->frames);
+  memset (page, 0, sizeof (*page));
+}
+
+/* Read all frames of the current page into memory. */
+static SANE_Status
+record_page (Page * page)
+{
+  SANE_Status status = SANE_STATUS_GOOD;
+  Page_Frame *frame;
+  size_t alloc;
+  SANE_Byte *data;
+  SANE_Int len;
+
+  memset (page, 0, sizeof (*page));
+  do
+    {
+      if (page->num_frames > 0)
+	{
+	  status = frame_start (NULL);
+	  if (status != SANE_STATUS_GOOD)
+	    {
+	      fprintf (stderr, "%s: sane_start: %s\n",
+		       prog_name, sane_strstatus (status));
+	      break;
+	    }
+	}
+
+      frame = realloc (page->frames,
+		       (page->num_frames + 1) * sizeof (Page_Frame));
+      if (!frame)
+	{
+	  status = SANE_STATUS_NO_MEM;
+	  break;
+	}
+      page->frames = frame;
+      frame = &page->frames[page->num_frames++];
+      memset (frame, 0, sizeof (*frame));
+
+      status = sane_get_parameters (device, &frame->parm);
+      if (status != SANE_STATUS_GOOD)
+	{
+	  fprintf (stderr, "%s: sane_get_parameters: %s\n",
+		   prog_name, sane_strstatus (status));
+	  break;
+	}
+
+      alloc = 0;
+      if (frame->parm.lines > 0)
+	alloc = (size_t) frame->parm.bytes_per_line * frame->parm.lines;
+
+      read_queue_start (&read_queue);
+      while ((status = read_queue_get (&read_queue, &data, &len))
+	     == SANE_STATUS_GOOD)
+	{
+	  if (frame->len + len > alloc || !frame->data)
+	    {
+	      SANE_Byte *p;
+
+	      if (alloc < buffer_size)
+		alloc = buffer_size;
+	      while (alloc < frame->len + len)
+		alloc *= 2;
+	      p = realloc (frame->data, alloc);
+	      if (!p)
+		{
+		  status = SANE_STATUS_NO_MEM;
+		  break;
+		}
+	      frame->data = p;
+	    }
+	  memcpy (frame->data + frame->len, data, len);
+	  frame->len += len;
+
+	  if (progress && frame->parm.lines > 0)
+	    fprintf (stderr, "Progress: %3.1f%%\r", frame->len * 100.
+		     / ((double) frame->parm.bytes_per_line
+			* frame->parm.lines));
+	}
+      read_queue_stop (&read_queue);
+
+      if (status != SANE_STATUS_EOF)
+	{
+	  fprintf (stderr, "%s: sane_read: %s\n",
+		   prog_name, sane_strstatus (status));
+	  break;
+	}
+      status = SANE_STATUS_GOOD;
+    }
+  while (!frame->parm.last_frame);
+
+  if (status != SANE_STATUS_GOOD)
+    page_free (page);
+  return status;
+}
+
+/* A scanned page waiting to be encoded and written by a batch worker. */
+typedef struct Batch_Job
+{
+  struct Batch_Job *next;
+  Page page;
+  char path[PATH_MAX];
+  char part_path[PATH_MAX];
+  int done;
+  SANE_Status status;
+}
+Batch_Job;
+
+/* Workers encoding the pages of a batch while the next page is scanned.
+   Jobs are kept in scan order until they are reaped, so files show up
+   and are printed in the same order as without workers. */
+static struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t *threads;
+  int num_workers;
+  int max_pages;	/* pages kept in memory at most */
+  int num_pages;	/* pages scanned and not reaped yet */
+  int quit;
+  Batch_Job *head;	/* oldest job, reaped first */
+  Batch_Job *tail;
+  Batch_Job *todo;	/* first job no worker has picked up yet */
+}
+batch_pool;
+
+static SANE_Status
+batch_write_page (Batch_Job * job)
+{
+  SANE_Status status;
+  FILE *ofp;
+
+  ofp = fopen (job->part_path, "w");
+  if (ofp == NULL)
+    {
+      fprintf (stderr, "cannot open %s\n", job->part_path);
+      return SANE_STATUS_ACCESS_DENIED;
+    }
+
+  status = scan_it (ofp, NULL, &job->page);
+  if (status == SANE_STATUS_EOF)
+    status = SANE_STATUS_GOOD;
+
+  if (0 != fclose (ofp) && status == SANE_STATUS_GOOD)
+    {
+      fprintf (stderr, "cannot close image file\n");
+      status = SANE_STATUS_ACCESS_DENIED;
+    }
+  /* let the fully written file show up */
+  if (status == SANE_STATUS_GOOD && rename (job->part_path, job->path))
+    {
+      fprintf (stderr, "cannot rename %s to %s\n", job->part_path,
+	       job->path);
+      status = SANE_STATUS_ACCESS_DENIED;
+    }
+  if (status != SANE_STATUS_GOOD)
+    unlink (job->part_path);
+  return status;
+}
+
+static void *
+batch_worker (void *arg)
+{
+  Batch_Job *job;
+
+  (void) arg;
+  pthread_mutex_lock (&batch_pool.lock);
+  for (;;)
+    {
+      while (!batch_pool.todo && !batch_pool.quit)
+	pthread_cond_wait (&batch_pool.cond, &batch_pool.lock);
+      job = batch_pool.todo;
+      if (!job)
+	break;
+      batch_pool.todo = job->next;
+      pthread_mutex_unlock (&batch_pool.lock);
+
+      job->status = batch_write_page (job);
+      page_free (&job->page);
+
+      pthread_mutex_lock (&batch_pool.lock);
+      job->done = 1;
+      pthread_cond_broadcast (&batch_pool.cond);
+    }
+  pthread_mutex_unlock (&batch_pool.lock);
+  return NULL;
+}
+
+static void
+batch_pool_start (int num_workers)
+{
+  memset (&batch_pool, 0, sizeof (batch_pool));
+  batch_pool.threads = calloc (num_workers, sizeof (pthread_t));
+  if (!batch_pool.threads)
+    return;
+  pthread_mutex_init (&batch_pool.lock, NULL);
+  pthread_cond_init (&batch_pool.cond, NULL);
+
+  while (batch_pool.num_workers < num_workers
+	 && pthread_create (&batch_pool.threads[batch_pool.num_workers], NULL,
+			    batch_worker, NULL) == 0)
+    batch_pool.num_workers++;
+  if (batch_pool.num_workers < num_workers)
+    fprintf (stderr, "%s: could only start %d of %d batch workers\n",
+	     prog_name, batch_pool.num_workers, num_workers);
+  batch_pool.max_pages = 2 * batch_pool.num_workers;
+}
+
+/* Retire finished jobs in scan order, then wait until no more than
+   `max_pages' pages are left.  Returns the first failure of a retired
+   job. */
+static SANE_Status
+batch_pool_reap (int batch_print, int max_pages)
+{
+  SANE_Status status = SANE_STATUS_GOOD;
+  Batch_Job *job;
+
+  pthread_mutex_lock (&batch_pool.lock);
+  for (;;)
+    {
+      while ((job = batch_pool.head) && job->done)
+	{
+	  batch_pool.head = job->next;
+	  if (!batch_pool.head)
+	    batch_pool.tail = NULL;
+	  batch_pool.num_pages--;
+
+	  if (job->status != SANE_STATUS_GOOD)
+	    {
+	      if (status == SANE_STATUS_GOOD)
+		status = job->status;
+	    }
+	  else if (batch_print)
+	    {
+	      fprintf (stdout, "%s\n", job->path);
+	      fflush (stdout);
+	    }
+	  free (job);
+	}
+      if (batch_pool.num_pages <= max_pages)
+	break;
+      pthread_cond_wait (&batch_pool.cond, &batch_pool.lock);
+    }
+  pthread_mutex_unlock (&batch_pool.lock);
+  return status;
+}
+
+/* Read the page the scanner has just started into memory and queue it
+   for the workers. */
+static SANE_Status
+batch_pool_scan (int n, const char *path, const char *part_path,
+		 int batch_print)
+{
+  SANE_Status status;
+  Batch_Job *job;
+
+  /* make room for this page first */
+  status = batch_pool_reap (batch_print, batch_pool.max_pages - 1);
+  if (status != SANE_STATUS_GOOD)
+    return status;
+
+  job = calloc (1, sizeof (*job));
+  if (!job)
+    return SANE_STATUS_NO_MEM;
+
+  status = record_page (&job->page);
+  fprintf (stderr, "Scanned page %d.", n);
+  fprintf (stderr, " (scanner status = %d)\n", status);
+  if (status != SANE_STATUS_GOOD)
+    {
+      free (job);
+      return status;
+    }
+
+  strcpy (job->path, path);
+  strcpy (job->part_path, part_path);
+
+  pthread_mutex_lock (&batch_pool.lock);
+  if (batch_pool.tail)
+    batch_pool.tail->next = job;
+  else
+    batch_pool.head = job;
+  batch_pool.tail = job;
+  if (!batch_pool.todo)
+    batch_pool.todo = job;
+  batch_pool.num_pages++;
+  pthread_cond_broadcast (&batch_pool.cond);
+  pthread_mutex_unlock (&batch_pool.lock);
+
+  return batch_pool_reap (batch_print, batch_pool.max_pages);
+}
+
+/* Wait for all queued pages to be written and stop the workers. */
+static SANE_Status
+batch_pool_finish (int batch_print)
+{
+  SANE_Status status;
+
+  status = batch_pool_reap (batch_print, 0);
+
+  pthread_mutex_lock (&batch_pool.lock);
+  batch_pool.quit = 1;
+  pthread_cond_broadcast (&batch_pool.cond);
+  pthread_mutex_unlock (&batch_pool.lock);
+
+  for (int i = 0; i < batch_pool.num_workers; ++i)
+    pthread_join (batch_pool.threads[i], NULL);
+  free (batch_pool.threads);
+  batch_pool.threads = NULL;
+  batch_pool.num_workers = 0;
+  return status;
+}
+#endif
+
+#ifdef HAVE_LIBJPEG
+/* Start a PDF document in `ofp'.  An ICC profile is written only once,
+   the pages refer to it. */
+static void
+start_pdf_doc (FILE * ofp, void **pw)
+{
+  const void *icc = NULL;
+  size_t icc_size = 0;
+
+  sane_pdf_open (pw, ofp);
+  sane_pdf_start_doc (*pw);
+  if (icc_profile)
+    icc = sanei_icc_profile_get (icc_profile, &icc_size);
+  if (icc && (icc_size > INT_MAX
+	      || sane_pdf_set_icc_profile (*pw, icc, (SANE_Int) icc_size) < 0))
+    fprintf (stderr, "Ignoring ICC profile %s for PDF output.\n",
+	     icc_profile);
+}
+#endif
+
+/* Complete the file batch mode writes all pages into.  It is removed
+   again if not a single page made it into the file. */
+static void
+finish_document (FILE *ofp, void *pw, const char *path, int pages,
+		 int batch_print)
+{
+#ifdef HAVE_LIBJPEG
+  if (output_format == OUTPUT_PDF)
     {
-      fprintf (stderr,
-	       "%s: WARNING: read more data than announced by backend "
-               "(%" PRIu64 "/%" PRIu64 ")\n", prog_name, total_bytes, expected_bytes);
+      sane_pdf_end_doc (pw);
+      sane_pdf_close (pw);
+    }
+#else
+  (void) pw;
+#endif
+  if (fclose (ofp) != 0)
+    {
+      fprintf (stderr, "cannot close image file\n");
+      pages = 0;
     }
-  else if (verbose)
-    fprintf (stderr, "%s: read %" PRIu64 " bytes in total\n", prog_name, total_bytes);
 
-  return status;
+  if (pages == 0)
+    unlink (path);
+  else if (batch_print)
+    {
+      fprintf (stdout, "%s\n", path);
+      fflush (stdout);
+    }
 }
 
 #define clean_buffer(buf,size)	memset ((buf), 0x23, size)
@@ -1978,6 +3151,315 @@ cleanup:
   return status;
 }
 
+/* Results of the scans of one benchmark combination. */
+typedef struct
+{
+  int scans;
+  uint64_t bytes;
+  double elapsed;	/* sane_start() to the end of the data, summed */
+  double first_byte;	/* sane_start() to the first data, summed */
+  double cpu;		/* process CPU time, including the backend */
+  int empty;		/* non-blocking reads without data */
+  double *latency;	/* duration of each sane_read() call */
+  int calls;
+  int max_calls;
+}
+Bench_Result;
+
+static void
+bench_add_call (Bench_Result * r, double latency)
+{
+  if (r->calls == r->max_calls)
+    {
+      int max = r->max_calls ? 2 * r->max_calls : 1024;
+      double *p = realloc (r->latency, max * sizeof (double));
+
+      if (!p)
+	return;		/* the percentiles will miss some calls */
+      r->latency = p;
+      r->max_calls = max;
+    }
+  r->latency[r->calls++] = latency;
+}
+
+/* Wait for data in non-blocking mode. */
+static void
+bench_wait (SANE_Int fd)
+{
+#ifdef HAVE_SYS_SELECT_H
+  if (fd >= 0)
+    {
+      struct timeval tv = { 1, 0 };
+      fd_set fds;
+
+      FD_ZERO (&fds);
+      FD_SET (fd, &fds);
+      select (fd + 1, &fds, NULL, NULL, &tv);
+      return;
+    }
+#endif
+  usleep (1000);
+}
+
+/* Scan one image and throw the data away. */
+static SANE_Status
+bench_scan (SANE_Byte * data, size_t read_size, int non_blocking,
+	    Bench_Result * r)
+{
+  double start = time_now (), first = -1, end = 0, t;
+  clock_t cpu = clock ();
+  uint64_t bytes = 0;
+  SANE_Parameters parm;
+  SANE_Status status;
+  SANE_Int len, fd = -1;
+
+  parm.last_frame = SANE_TRUE;
+  do
+    {
+      status = frame_start (NULL);
+      if (status != SANE_STATUS_GOOD)
+	{
+	  fprintf (stderr, "%s: sane_start: %s\n",
+		   prog_name, sane_strstatus (status));
+	  break;
+	}
+      if (non_blocking)
+	{
+	  status = sane_set_io_mode (device, SANE_TRUE);
+	  if (status != SANE_STATUS_GOOD)
+	    {
+	      fprintf (stderr, "%s: sane_set_io_mode: %s\n",
+		       prog_name, sane_strstatus (status));
+	      break;
+	    }
+	  if (sane_get_select_fd (device, &fd) != SANE_STATUS_GOOD)
+	    fd = -1;
+	}
+      status = sane_get_parameters (device, &parm);
+      if (status != SANE_STATUS_GOOD)
+	{
+	  fprintf (stderr, "%s: sane_get_parameters: %s\n",
+		   prog_name, sane_strstatus (status));
+	  break;
+	}
+
+      do
+	{
+	  t = time_now ();
+	  status = sane_read (device, data, read_size, &len);
+	  end = time_now ();
+	  bench_add_call (r, end - t);
+	  if (status == SANE_STATUS_GOOD && len == 0)
+	    {
+	      r->empty++;
+	      bench_wait (fd);
+	    }
+	  else if (status == SANE_STATUS_GOOD)
+	    {
+	      if (first < 0)
+		first = end;
+	      bytes += len;
+	    }
+	}
+      while (status == SANE_STATUS_GOOD);
+
+      if (status != SANE_STATUS_EOF)
+	{
+	  fprintf (stderr, "%s: sane_read: %s\n",
+		   prog_name, sane_strstatus (status));
+	  break;
+	}
+      status = SANE_STATUS_GOOD;
+    }
+  while (!parm.last_frame);
+  sane_cancel (device);
+
+  if (status == SANE_STATUS_GOOD)
+    {
+      r->scans++;
+      r->bytes += bytes;
+      r->elapsed += end - start;
+      r->first_byte += (first < 0 ? end : first) - start;
+      r->cpu += (double) (clock () - cpu) / CLOCKS_PER_SEC;
+    }
+  return status;
+}
+
+/* Number of comma separated values in a list. */
+static int
+list_length (const char *list)
+{
+  int n = 1;
+
+  while ((list = strchr (list, ',')))
+    {
+      ++list;
+      ++n;
+    }
+  return n;
+}
+
+/* Copy value number i of a comma separated list into buf. */
+static void
+list_value (const char *list, int i, char *buf, size_t size)
+{
+  size_t len;
+
+  while (i-- > 0)
+    list = strchr (list, ',') + 1;
+  len = strcspn (list, ",");
+  if (len >= size)
+    len = size - 1;
+  memcpy (buf, list, len);
+  buf[len] = 0;
+}
+
+/* Set one combination of the --benchmark-option values and describe it
+   in label. */
+static void
+bench_set_options (const int *value, char *label, size_t size)
+{
+  char name[128], val[128];
+  size_t used = 0;
+  int i, j;
+
+  label[0] = 0;
+  for (i = 0; i < num_benchmark_options; ++i)
+    {
+      const char *spec = benchmark_option[i];
+      const char *eq = strchr (spec, '=');
+      const SANE_Option_Descriptor *opt = NULL;
+
+      snprintf (name, sizeof (name), "%.*s", (int) (eq - spec), spec);
+      list_value (eq + 1, value[i], val, sizeof (val));
+
+      for (j = 1; j < option_number_len; ++j)
+	{
+	  opt = sane_get_option_descriptor (device, j);
+	  if (opt && opt->name && strcmp (opt->name, name) == 0)
+	    break;
+	}
+      if (j >= option_number_len)
+	{
+	  fprintf (stderr, "%s: --benchmark-option: no option `%s'\n",
+		   prog_name, name);
+	  scanimage_exit (1);
+	}
+      process_backend_option (device, j, val);
+
+      if (used < size)
+	used += snprintf (label + used, size - used, "%s=%s ", name, val);
+    }
+}
+
+static void
+bench_report (const char *label, size_t read_size, int non_blocking,
+	      Bench_Result * r)
+{
+  qsort (r->latency, r->calls, sizeof (double), perf_compare);
+
+  printf ("%sread-size=%lukB io=%s scans=%d MB/s=%.2f first-byte-ms=%.1f "
+	  "read-ms-p50=%.3f read-ms-p90=%.3f read-ms-p99=%.3f "
+	  "read-ms-max=%.3f calls=%d", label, (unsigned long) read_size / 1024,
+	  non_blocking ? "non-blocking" : "blocking", r->scans,
+	  r->elapsed > 0 ? r->bytes / r->elapsed / 1e6 : 0.,
+	  r->scans ? r->first_byte / r->scans * 1e3 : 0.,
+	  perf_percentile (r->latency, r->calls, 50) * 1e3,
+	  perf_percentile (r->latency, r->calls, 90) * 1e3,
+	  perf_percentile (r->latency, r->calls, 99) * 1e3,
+	  perf_percentile (r->latency, r->calls, 100) * 1e3, r->calls);
+  if (non_blocking)
+    printf (" empty-reads=%d", r->empty);
+  printf (" cpu-s=%.3f\n", r->cpu);
+  fflush (stdout);
+}
+
+/* Measure how fast the backend delivers data: scan each combination of
+   backend option values, read size and I/O mode a number of times. */
+static SANE_Status
+benchmark_it (void)
+{
+  int value[MAX_BENCHMARK_OPTIONS] = { 0 };
+  int count[MAX_BENCHMARK_OPTIONS];
+  int num_sizes = 1, i, j, io, s;
+  SANE_Status status = SANE_STATUS_GOOD;
+  char label[1024];
+
+  for (i = 0; i < num_benchmark_options; ++i)
+    count[i] = list_length (strchr (benchmark_option[i], '=') + 1);
+  if (benchmark_read_sizes)
+    num_sizes = list_length (benchmark_read_sizes);
+
+  do
+    {
+      bench_set_options (value, label, sizeof (label));
+
+      for (s = 0; s < num_sizes; ++s)
+	{
+	  size_t read_size = buffer_size;
+	  SANE_Byte *data;
+
+	  if (benchmark_read_sizes)
+	    {
+	      char val[32];
+
+	      list_value (benchmark_read_sizes, s, val, sizeof (val));
+	      read_size = 1024 * (size_t) atoi (val);
+	    }
+	  if (read_size == 0 || read_size > INT32_MAX)
+	    {
+	      fprintf (stderr, "%s: bad --benchmark-read-sizes\n", prog_name);
+	      return SANE_STATUS_INVAL;
+	    }
+	  data = malloc (read_size);
+	  if (!data)
+	    return SANE_STATUS_NO_MEM;
+
+	  for (io = 0; io < 2; ++io)
+	    {
+	      Bench_Result r;
+
+	      if (!(benchmark_io & (1 << io)))
+		continue;
+
+	      memset (&r, 0, sizeof (r));
+	      for (j = 0; j < benchmark; ++j)
+		{
+		  if (verbose)
+		    fprintf (stderr, "%s: benchmark %sread-size=%lukB io=%s "
+			     "scan %d\n", prog_name, label,
+			     (unsigned long) read_size / 1024,
+			     io ? "non-blocking" : "blocking", j + 1);
+		  status = bench_scan (data, read_size, io, &r);
+		  if (status != SANE_STATUS_GOOD)
+		    break;
+		}
+	      bench_report (label, read_size, io, &r);
+	      free (r.latency);
+
+	      /* a backend without non-blocking I/O fails every time */
+	      if (status == SANE_STATUS_UNSUPPORTED && io)
+		status = SANE_STATUS_GOOD;
+	      if (status != SANE_STATUS_GOOD)
+		break;
+	    }
+	  free (data);
+	  if (status != SANE_STATUS_GOOD)
+	    return status;
+	}
+
+      /* next combination of option values */
+      for (i = num_benchmark_options - 1; i >= 0; --i)
+	{
+	  if (++value[i] < count[i])
+	    break;
+	  value[i] = 0;
+	}
+    }
+  while (i >= 0);
+
+  return status;
+}
 
 static int
 get_resolution (void)
@@ -2009,6 +3491,8 @@ get_resolution (void)
 static void
 scanimage_exit (int status)
 {
+  read_queue_free (&read_queue);
+  perf_trace_close ();
   if (device)
     {
       if (verbose > 1)
@@ -2025,6 +3509,7 @@ scanimage_exit (int status)
     free (all_options);
   if (option_number)
     free (option_number);
+  sanei_icc_profile_release ();
   if (verbose > 1)
     fprintf (stderr, "scanimage: finished\n");
   exit (status);
@@ -2112,13 +3597,20 @@ main (int argc, char **argv)
   int batch_count = BATCH_COUNT_UNLIMITED;
   int batch_start_at = 1;
   int batch_increment = 1;
+  int batch_workers = 0;
+  int batch_single = 0;
+  int single_file = 0;
+  int doc_pages = 0;
+  char doc_path[PATH_MAX];
   int promptc;
   SANE_Status status;
   SANE_Int version_code;
   void *pw = NULL;
+  SANE_Tiff_Doc tiff_doc;
   FILE *ofp = NULL;
 
   buffer_size = (1024 * 1024);	/* default size */
+  read_ahead = (8 * 1024 * 1024);	/* default size */
 
   prog_name = strrchr (argv[0], '/');
   if (prog_name)
@@ -2167,6 +3659,55 @@ main (int argc, char **argv)
 	case 'B':
           buffer_size = 1024 * atoi(optarg);
 	  break;
+	case OPTION_READ_AHEAD:
+	  if (atoi (optarg) < 0)
+	    {
+	      fprintf (stderr, "%s: --read-ahead must not be negative\n",
+		       prog_name);
+	      scanimage_exit (1);
+	    }
+	  read_ahead = 1024 * (size_t) atoi (optarg);
+	  break;
+	case OPTION_PERF_TRACE:
+	  perf_trace_path = optarg;
+	  break;
+	case OPTION_BENCHMARK:
+	  benchmark = optarg ? atoi (optarg) : 3;
+	  if (benchmark < 1)
+	    {
+	      fprintf (stderr, "%s: --benchmark needs at least one scan\n",
+		       prog_name);
+	      scanimage_exit (1);
+	    }
+	  break;
+	case OPTION_BENCHMARK_READ_SIZES:
+	  benchmark_read_sizes = optarg;
+	  break;
+	case OPTION_BENCHMARK_IO:
+	  if (strcmp (optarg, "blocking") == 0)
+	    benchmark_io = 1;
+	  else if (strcmp (optarg, "non-blocking") == 0)
+	    benchmark_io = 2;
+	  else if (strcmp (optarg, "both") == 0)
+	    benchmark_io = 3;
+	  else
+	    {
+	      fprintf (stderr, "%s: --benchmark-io must be blocking, "
+		       "non-blocking or both\n", prog_name);
+	      scanimage_exit (1);
+	    }
+	  break;
+	case OPTION_BENCHMARK_OPTION:
+	  if (!strchr (optarg, '=')
+	      || num_benchmark_options == MAX_BENCHMARK_OPTIONS)
+	    {
+	      fprintf (stderr, "%s: --benchmark-option needs NAME=VALUE,... "
+		       "and can be given up to %d times\n", prog_name,
+		       MAX_BENCHMARK_OPTIONS);
+	      scanimage_exit (1);
+	    }
+	  benchmark_option[num_benchmark_options++] = optarg;
+	  break;
 	case 'T':
 	  test = 1;
 	  break;
@@ -2185,6 +3726,12 @@ main (int argc, char **argv)
 	case OPTION_BATCH_INCREMENT:
 	  batch_increment = atoi (optarg);
 	  break;
+	case OPTION_BATCH_WORKERS:
+	  batch_workers = atoi (optarg);
+	  break;
+	case OPTION_BATCH_SINGLE:
+	  batch_single = 1;
+	  break;
 	case OPTION_BATCH_START_AT:
 	  batch_start_at = atoi (optarg);
 	  break;
@@ -2243,6 +3790,60 @@ main (int argc, char **argv)
               scanimage_exit (1);
             }
 	  break;
+	case OPTION_TIFF_COMPRESSION:
+	  if (strcmp (optarg, "none") == 0)
+	    tiff_compression = SANE_TIFF_COMPRESSION_NONE;
+	  else if (strcmp (optarg, "packbits") == 0)
+	    tiff_compression = SANE_TIFF_COMPRESSION_PACKBITS;
+	  else if (strcmp (optarg, "deflate") == 0)
+	    {
+#ifdef HAVE_LIBZ
+	      tiff_compression = SANE_TIFF_COMPRESSION_DEFLATE;
+#else
+	      fprintf(stderr, "Deflate support not compiled in\n");
+	      scanimage_exit (1);
+#endif
+	    }
+	  else if (strcmp (optarg, "g4") == 0)
+	    tiff_compression = SANE_TIFF_COMPRESSION_G4;
+	  else
+	    {
+	      fprintf(stderr, "Unknown TIFF compression '%s'.\n", optarg);
+	      fprintf(stderr, "Supported compressions: none, packbits");
+#ifdef HAVE_LIBZ
+	      fprintf(stderr, ", deflate");
+#endif
+	      fprintf(stderr, ", g4.\n");
+	      scanimage_exit (1);
+	    }
+	  break;
+	case OPTION_PDF_COMPRESSION:
+	  if (strcmp (optarg, "auto") == 0)
+	    pdf_compression = PDF_COMPRESSION_AUTO;
+	  else if (strcmp (optarg, "jpeg") == 0)
+	    pdf_compression = PDF_COMPRESSION_JPEG;
+	  else if (strcmp (optarg, "flate") == 0)
+	    {
+#ifdef HAVE_LIBZ
+	      pdf_compression = PDF_COMPRESSION_FLATE;
+#else
+	      fprintf(stderr, "Flate support not compiled in\n");
+	      scanimage_exit (1);
+#endif
+	    }
+	  else if (strcmp (optarg, "g4") == 0)
+	    pdf_compression = PDF_COMPRESSION_G4;
+	  else
+	    {
+	      fprintf(stderr, "Unknown PDF compression '%s'.\n", optarg);
+	      fprintf(stderr, "Supported compressions: auto, jpeg");
+#ifdef HAVE_LIBZ
+	      fprintf(stderr, ", flate");
+#endif
+	      fprintf(stderr, ", g4.\n");
+	      scanimage_exit (1);
+	    }
+	  break;
 	case OPTION_MD5:
 	  accept_only_md5_auth = 1;
 	  break;
@@ -2379,7 +3980,9 @@ Parameters are separated by a blank from single-character options (e.g.\n\
 -d epson) and by a \"=\" from multi-character options (e.g. --device-name=epson).\n\
 -d, --device-name=DEVICE   use a given scanner device (e.g. hp:/dev/scanner)\n\
     --format=pnm|tiff|png|jpeg|pdf  file format of output file\n\
--i, --icc-profile=PROFILE  include this ICC profile into TIFF file\n", prog_name);
+    --tiff-compression=none|packbits|deflate|g4  compression of TIFF output\n\
+    --pdf-compression=auto|jpeg|flate|g4  compression of PDF images\n\
+-i, --icc-profile=PROFILE  include this ICC profile into TIFF, PNG or PDF\n", prog_name);
       printf ("\
 -L, --list-devices         show available scanner devices\n\
 -f, --formatted-device-list=FORMAT similar to -L, but the FORMAT of the output\n\
@@ -2396,7 +3999,11 @@ Parameters are separated by a blank from single-character options (e.g.\n\
     --batch-double         increment page number by two, same as\n\
                            --batch-increment=2\n\
     --batch-print          print image filenames to stdout\n\
-    --batch-prompt         ask for pressing a key before scanning a page\n");
+    --batch-prompt         ask for pressing a key before scanning a page\n\
+    --batch-workers=#      encode up to # pages in parallel while scanning\n\
+                           the next ones (default 0, not for PDF)\n\
+    --batch-single-file    write all pages into one multi-page TIFF file,\n\
+                           PDF output always does that\n");
       printf ("\
     --accept-md5-only      only accept authorization requests using md5\n\
 -p, --progress             print progress messages\n\
@@ -2407,7 +4014,19 @@ Parameters are separated by a blank from single-character options (e.g.\n\
 -A, --all-options          list all available backend options\n\
 -h, --help                 display this help message and exit\n\
 -v, --verbose              give even more status messages\n\
--B, --buffer-size=#        change input buffer size (in kB, default 32)\n");
+-B, --buffer-size=#        change input buffer size (in kB, default 32)\n\
+    --read-ahead=#         amount of scan data (in kB) read ahead of the\n\
+                           image encoder, 0 disables it (default 8192)\n\
+    --perf-trace=FILE      write the timing of every sane_read() call to\n\
+                           FILE, as CSV followed by a summary\n");
+      printf ("\
+    --benchmark[=#]        scan # times (default 3) without writing the\n\
+                           image and report the read throughput\n\
+    --benchmark-read-sizes=#,...  sane_read() sizes in kB to benchmark,\n\
+                           default is the --buffer-size\n\
+    --benchmark-io=blocking|non-blocking|both  I/O modes to benchmark\n\
+    --benchmark-option=NAME=VALUE,...  backend option values to benchmark,\n\
+                           may be given more than once\n");
       printf ("\
 -V, --version              print version information\n");
     }
@@ -2418,6 +4037,9 @@ Parameters are separated by a blank from single-character options (e.g.\n\
       scanimage_exit (1);
     }
 
+  /* a benchmark writes no image */
+  if (output_format == OUTPUT_UNKNOWN && benchmark)
+    output_format = OUTPUT_PNM;
   if (output_format == OUTPUT_UNKNOWN)
     {
       output_format = guess_output_format(output_file);
@@ -2435,7 +4057,13 @@ Parameters are separated by a blank from single-character options (e.g.\n\
          environment variable SANE_DEFAULT_DEVICE.  If this variable
          is not set, we open the first device we find (if any): */
       devname = defdevname;
-      if (!devname)
+      /* the empty name opens the first available device, which the dll
+         backend takes from its device cache without loading the other
+         backends */
+      if (!devname
+	  && (status = sane_open ("", &device)) == SANE_STATUS_GOOD)
+	devname = "";
+      else if (!devname)
 	{
 	  status = sane_get_devices (&device_list, SANE_FALSE);
 	  if (status != SANE_STATUS_GOOD)
@@ -2453,7 +4081,8 @@ Parameters are separated by a blank from single-character options (e.g.\n\
 	}
     }
 
-  status = sane_open (devname, &device);
+  if (!device)
+    status = sane_open (devname, &device);
   if (status != SANE_STATUS_GOOD)
     {
       fprintf (stderr, "%s: open of device %s failed: %s\n",
@@ -2622,14 +4251,16 @@ Parameters are separated by a blank from single-character options (e.g.\n\
       /* output device-specific help */
       if (help)
 	{
-	  printf ("\nOptions specific to device `%s':\n", devname);
+	  printf ("\nOptions specific to device `%s':\n",
+		  devname[0] ? devname : "default");
 	  print_options(device, num_dev_options, SANE_FALSE);
 	}
 
       /*  list all device-specific options */
       if (all)
 	{
-	  printf ("\nAll options specific to device `%s':\n", devname);
+	  printf ("\nAll options specific to device `%s':\n",
+		  devname[0] ? devname : "default");
 	  print_options(device, num_dev_options, SANE_TRUE);
 	  scanimage_exit (0);
 	}
@@ -2682,7 +4313,9 @@ List of available devices:", prog_name);
   signal (SIGINT, sighandler);
   signal (SIGTERM, sighandler);
 
-  if (test == 0)
+  if (benchmark)
+    status = benchmark_it ();
+  else if (test == 0)
     {
       int n = batch_start_at;
 
@@ -2711,6 +4344,16 @@ List of available devices:", prog_name);
 	  }
 	}
 
+      /* all pages of a batch go into one PDF, and into one TIFF on request */
+      single_file = batch && (output_format == OUTPUT_PDF
+			      || (batch_single && output_format == OUTPUT_TIFF));
+      if (batch && batch_single && !single_file)
+	{
+	  fprintf (stderr, "%s: --batch-single-file needs TIFF or PDF "
+		   "output\n", prog_name);
+	  scanimage_exit (1);
+	}
+
       if (!batch)
         {
           ofp = stdout;
@@ -2724,11 +4367,19 @@ List of available devices:", prog_name);
                   scanimage_exit(1);
                 }
             }
+          /* the IFD offset in the header is only known at the end */
+          if (output_format == OUTPUT_TIFF
+              && tiff_compression != SANE_TIFF_COMPRESSION_NONE
+              && fseek (ofp, 0, SEEK_CUR) != 0)
+            {
+              fprintf(stderr, "%s: compressed TIFF output needs a seekable "
+                      "file, use --output-file\n", prog_name);
+              scanimage_exit(1);
+            }
 #ifdef HAVE_LIBJPEG
          if (output_format == OUTPUT_PDF)
            {
-             sane_pdf_open(&pw, ofp );
-             sane_pdf_start_doc( pw );
+             start_pdf_doc (ofp, &pw);
            }
 #endif
         }
@@ -2751,18 +4402,29 @@ List of available devices:", prog_name);
       }
 
       buffer = malloc (buffer_size);
+      if (perf_trace_path)
+	perf_trace_open (perf_trace_path);
+      read_queue_init (&read_queue);
+#ifdef HAVE_PTHREAD_H
+      /* pages of a single file document are written in order */
+      if (batch && batch_workers > 0 && !single_file)
+	batch_pool_start (batch_workers);
+#else
+      if (batch && batch_workers > 0)
+	fprintf (stderr, "%s: built without thread support, ignoring "
+		 "--batch-workers\n", prog_name);
+#endif
 
       do
 	{
 	  char path[PATH_MAX];
 	  char part_path[PATH_MAX];
+	  int page_ok;
 	  if (batch)  /* format is NULL unless batch mode */
 	    {
 	      sprintf (path, format, n);	/* love --(C++) */
 	      strcpy (part_path, path);
-#ifdef HAVE_LIBJPEG
-	      if (output_format != OUTPUT_PDF)
-#endif
+	      if (!single_file)
      	         strcat (part_path, ".part");
 
 	      if (batch_prompt)
@@ -2779,14 +4441,8 @@ List of available devices:", prog_name);
 			fprintf(stderr, "%s: stdin error: %s\n", prog_name, strerror(errno));
 		      if (ofp)
 			{
-#ifdef HAVE_LIBJPEG
-	                  if (output_format == OUTPUT_PDF)
-			    {
-		              sane_pdf_end_doc( pw );
-			      sane_pdf_close ( pw );
-			    }
-#endif
-			  fclose (ofp);
+			  finish_document (ofp, pw, doc_path, doc_pages,
+					   batch_print);
 			  ofp = NULL;
 			}
 		      break;	/* get out of this loop */
@@ -2808,7 +4464,12 @@ List of available devices:", prog_name);
 	    {
 	      fprintf (stderr, "%s: sane_start: %s\n",
 		       prog_name, sane_strstatus (status));
-	      if (ofp )
+	      if (ofp && single_file)
+		{
+		  finish_document (ofp, pw, doc_path, doc_pages, batch_print);
+		  ofp = NULL;
+		}
+	      else if (ofp )
 		{
 #ifdef HAVE_LIBJPEG
 	          if (output_format == OUTPUT_PDF)
@@ -2823,6 +4484,14 @@ List of available devices:", prog_name);
 	      break;
 	    }
 
+#ifdef HAVE_PTHREAD_H
+	  if (batch_pool.num_workers > 0)
+	    {
+	      status = batch_pool_scan (n, path, part_path, batch_print);
+	      n += batch_increment;
+	      continue;
+	    }
+#endif
 
 	  /* write to .part file while scanning is in progress */
 	  if (batch)
@@ -2837,6 +4506,16 @@ List of available devices:", prog_name);
 	          if (output_format == OUTPUT_PDF && ofp != NULL)
 	             init_pdf = SANE_TRUE;
 #endif
+		  if (single_file && ofp != NULL)
+		    {
+		      strcpy (doc_path, part_path);
+		      doc_pages = 0;
+		      if (output_format == OUTPUT_TIFF)
+			{
+			  sanei_tiff_doc_init (&tiff_doc, ofp);
+			  pw = &tiff_doc;
+			}
+		    }
 	        }
 	      if (NULL == ofp)
 		{
@@ -2847,21 +4526,41 @@ List of available devices:", prog_name);
 #ifdef HAVE_LIBJPEG
 	      if (init_pdf )
 	        {
-		  sane_pdf_open( &pw, ofp );
-		  sane_pdf_start_doc ( pw );
+		  start_pdf_doc (ofp, &pw);
 		}
 #endif
 	    }
 
-	  status = scan_it (ofp, pw);
+	  status = scan_it (ofp, pw, NULL);
 
+	  /* complete the page, or cut off what was written of it */
+	  page_ok = (status == SANE_STATUS_GOOD || status == SANE_STATUS_EOF);
 #ifdef HAVE_LIBJPEG
 	  if (output_format == OUTPUT_PDF)
 	    {
+	      if (page_ok)
+		{
 		  sane_pdf_end_page( pw );
 		  fflush( ofp );
+		}
+	      else
+		sane_pdf_abort_page( pw );
 	    }
 #endif
+	  if (single_file && output_format == OUTPUT_TIFF)
+	    {
+	      if (!page_ok)
+		sanei_tiff_doc_abort_page (&tiff_doc);
+	      else if (sanei_tiff_doc_end_page (&tiff_doc))
+		{
+		  fprintf (stderr, "cannot write image file\n");
+		  sanei_tiff_doc_abort_page (&tiff_doc);
+		  status = SANE_STATUS_IO_ERROR;
+		  page_ok = 0;
+		}
+	    }
+	  if (single_file && page_ok)
+	    ++doc_pages;
 
 	  if (batch)
 	    {
@@ -2876,10 +4575,8 @@ List of available devices:", prog_name);
 	      status = SANE_STATUS_GOOD;
 	      if (batch)
 		{
-#ifdef HAVE_LIBJPEG
-	          if (output_format != OUTPUT_PDF)
+	          if (!single_file)
 		    {
-#endif
 		      if (!ofp || 0 != fclose(ofp))
 		        {
 		           fprintf (stderr, "cannot close image file\n");
@@ -2903,9 +4600,7 @@ List of available devices:", prog_name);
 			        fflush (stdout);
 			     }
 		        }
-#ifdef HAVE_LIBJPEG
 		    }
-#endif
 		}
               else
                 {
@@ -2925,7 +4620,17 @@ List of available devices:", prog_name);
                 }
 	      break;
 	    default:
-	      if (batch)
+	      if (batch && single_file)
+		{
+		  /* keep the pages scanned so far */
+		  if (ofp)
+		    {
+		      finish_document (ofp, pw, doc_path, doc_pages,
+				       batch_print);
+		      ofp = NULL;
+		    }
+		}
+	      else if (batch)
 		{
 		  if (ofp)
 		    {
@@ -2958,21 +4663,23 @@ List of available devices:", prog_name);
 	      && (batch_count == BATCH_COUNT_UNLIMITED || --batch_count))
 	     && SANE_STATUS_GOOD == status);
 
+#ifdef HAVE_PTHREAD_H
+      if (batch_pool.num_workers > 0)
+	{
+	  SANE_Status pool_status = batch_pool_finish (batch_print);
+
+	  if (pool_status != SANE_STATUS_GOOD)
+	    status = pool_status;
+	}
+#endif
+
       if (batch)
 	{
-#ifdef HAVE_LIBJPEG
-	  if (output_format == OUTPUT_PDF)
-            {
-	      if (output_file && ofp)
-	        {
-	          sane_pdf_end_doc( pw );
-	          fflush( ofp );
-	          sane_pdf_close ( pw );
-                  fclose(ofp);
-                  ofp = NULL;
-		}
+	  if (ofp)
+	    {
+	      finish_document (ofp, pw, doc_path, doc_pages, batch_print);
+	      ofp = NULL;
 	    }
-#endif
 	  int num_pgs = (n - batch_start_at) / batch_increment;
 	  fprintf (stderr, "Batch terminated, %d page%s scanned\n",
 		   num_pgs, num_pgs == 1 ? "" : "s");
@@ -19,7 +19,20 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "sicc.h"
 
 void *
 sanei_load_icc_profile (const char *path, size_t *size)
@@ -65,3 +78,122 @@ sanei_load_icc_profile (const char *path, size_t *size)
   }
   return NULL;
 }
+
+typedef struct icc_entry
+{
+  struct icc_entry *next;
+  char *path;
+  void *data;			/* NULL if the profile could not be loaded */
+  size_t size;
+  int mapped;
+} ICC_Entry;
+
+static ICC_Entry *icc_cache = NULL;
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t icc_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void
+icc_map (ICC_Entry *e)
+{
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+  unsigned char head[4];
+  size_t stated_size;
+  struct stat s;
+  void *data;
+  int fd;
+
+  fd = open (e->path, O_RDONLY);
+  if (fd < 0)
+    return;
+  if (fstat (fd, &s) < 0 || read (fd, head, 4) != 4)
+    {
+      close (fd);
+      return;
+    }
+  stated_size = ((size_t) head[0] << 24) + (head[1] << 16) + (head[2] << 8)
+    + head[3];
+  if (stated_size < 4 || stated_size > (size_t) s.st_size)
+    {
+      close (fd);
+      return;
+    }
+  data = mmap (NULL, stated_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (data == MAP_FAILED)
+    return;
+
+  e->data = data;
+  e->size = stated_size;
+  e->mapped = 1;
+#else
+  (void) e;
+#endif
+}
+
+const void *
+sanei_icc_profile_get (const char *path, size_t *size)
+{
+  ICC_Entry *e;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock (&icc_lock);
+#endif
+  for (e = icc_cache; e; e = e->next)
+    if (strcmp (e->path, path) == 0)
+      break;
+
+  if (!e && (e = calloc (1, sizeof (*e))) != NULL)
+    {
+      if ((e->path = strdup (path)) == NULL)
+	{
+	  free (e);
+	  e = NULL;
+	}
+      else
+	{
+	  /* anything mmap does not like gets the full error reporting */
+	  icc_map (e);
+	  if (!e->data)
+	    e->data = sanei_load_icc_profile (path, &e->size);
+	  e->next = icc_cache;
+	  icc_cache = e;
+	}
+    }
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock (&icc_lock);
+#endif
+
+  if (!e || !e->data)
+    {
+      *size = 0;
+      return NULL;
+    }
+  *size = e->size;
+  return e->data;
+}
+
+void
+sanei_icc_profile_release (void)
+{
+  ICC_Entry *e;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock (&icc_lock);
+#endif
+  while ((e = icc_cache) != NULL)
+    {
+      icc_cache = e->next;
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+      if (e->mapped)
+	munmap (e->data, e->size);
+      else
+#endif
+	free (e->data);
+      free (e->path);
+      free (e);
+    }
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock (&icc_lock);
+#endif
+}
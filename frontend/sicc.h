@@ -17,3 +17,15 @@
 
 void *
 sanei_load_icc_profile (const char *path, size_t *size);
+
+/* The profile at path, loaded (memory mapped where possible) on the
+   first call and shared by every later one, also from other threads.
+   The data must not be changed or freed, it stays valid until
+   sanei_icc_profile_release () is called.  Returns NULL if the profile
+   can't be loaded, the error is only reported once. */
+const void *
+sanei_icc_profile_get (const char *path, size_t *size);
+
+/* Drop all profiles loaded by sanei_icc_profile_get () */
+void
+sanei_icc_profile_release (void);
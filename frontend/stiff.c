@@ -29,10 +29,17 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "../include/sane/config.h"
+#include "../include/_stdint.h"
 #include "../include/sane/sane.h"
 
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+
 #include "sicc.h"
 #include "stiff.h"
 
@@ -53,6 +60,16 @@ typedef struct {
 #define IFDE_TYP_LONG     (4)
 #define IFDE_TYP_RATIONAL (5)
 
+/* Image data that is not a single uncompressed strip behind the IFD */
+typedef struct {
+    int compression;
+    int predictor;
+    int rows;            /* rows per strip */
+    int count;           /* number of strips */
+    const long *offsets;
+    const long *bytecounts;
+} STRIPS;
+
 static IFD *
 create_ifd (void)
 
@@ -147,17 +164,24 @@ write_i4 (FILE *fptr, int val, int motorola)
 }
 
 static void
-write_ifd (FILE *fptr, IFD *ifd, int motorola)
-{int k;
-    IFD_ENTRY *ifde;
-
-    if (!ifd) return;
-
+write_file_header (FILE *fptr, int motorola)
+{
     if (motorola) putc ('M', fptr), putc ('M', fptr);
     else putc ('I', fptr), putc ('I', fptr);
 
     write_i2 (fptr, 42, motorola);  /* Magic */
     write_i4 (fptr, 8, motorola);   /* Offset to first IFD */
+}
+
+static void
+write_ifd (FILE *fptr, IFD *ifd, int motorola, int header)
+{int k;
+    IFD_ENTRY *ifde;
+
+    if (!ifd) return;
+
+    if (header)
+        write_file_header (fptr, motorola);
     write_i2 (fptr, ifd->ntags, motorola);
 
     for (k = 0; k < ifd->ntags; k++)
@@ -179,15 +203,56 @@ write_ifd (FILE *fptr, IFD *ifd, int motorola)
     write_i4 (fptr, 0, motorola); /* End of IFD chain */
 }
 
+/* I prefer motorola format. Its human readable. But for 16 bit, */
+/* the image format is defined by SANE to be the native byte order */
+static int
+tiff_motorola (int depth)
+{int check = 1;
+
+    if (depth <= 8) return 1;
+    return ((*((char *)&check)) == 0);
+}
+
 
+/* Strip offsets or byte counts go into the IFD entry for a single */
+/* strip, otherwise into an array at array_offset.                 */
 static void
-write_tiff_bw_header (FILE *fptr, int width, int height, int resolution)
+add_strip_entry (IFD *ifd, int tag, const STRIPS *strips,
+                 const long *values, int value, int array_offset)
+{
+    if (strips && strips->count > 1)
+        add_ifd_entry (ifd, tag, IFDE_TYP_LONG, strips->count, array_offset);
+    else if (strips)
+        add_ifd_entry (ifd, tag, IFDE_TYP_LONG, 1, (int) values[0]);
+    else
+        add_ifd_entry (ifd, tag, IFDE_TYP_LONG, 1, value);
+}
+
+static void
+write_strip_arrays (FILE *fptr, const STRIPS *strips, int motorola)
+{int k;
+
+    if (!strips || strips->count <= 1) return;
+
+    for (k = 0; k < strips->count; k++)
+        write_i4 (fptr, (int) strips->offsets[k], motorola);
+    for (k = 0; k < strips->count; k++)
+        write_i4 (fptr, (int) strips->bytecounts[k], motorola);
+}
+
+/* The header writers put the IFD of an image at file position base and */
+/* return the position of its next IFD offset. The TIFF file header is  */
+/* only written for the first image, at base 0. Without strips, the    */
+/* image data follows as one uncompressed strip.                        */
+static long
+write_tiff_bw_header (FILE *fptr, long base, int motorola,
+                      const STRIPS *strips, int width, int height, int resolution)
 {IFD *ifd;
-    int header_size = 8, ifd_size;
+    int header_size = base ? 0 : 8, ifd_size;
     int strip_offset, data_offset, data_size;
+    int strip_data, array_offset;
     int strip_bytecount;
     int ntags;
-    int motorola;
 
     ifd = create_ifd ();
 
@@ -202,9 +267,14 @@ write_tiff_bw_header (FILE *fptr, int width, int height, int resolution)
         data_size += 2*4 + 2*4;
     }
 
+    /* strip offsets and byte counts, behind all other values */
+    strip_data = (strips && strips->count > 1) ? strips->count*4 : 0;
+    data_size += 2*strip_data;
+
     ifd_size = 2 + ntags*12 + 4;
-    data_offset = header_size + ifd_size;
+    data_offset = (int) base + header_size + ifd_size;
     strip_offset = data_offset + data_size;
+    array_offset = strip_offset - 2*strip_data;
 
     /* New subfile type */
     add_ifd_entry (ifd, 254, IFDE_TYP_LONG, 1, 0);
@@ -216,22 +286,24 @@ write_tiff_bw_header (FILE *fptr, int width, int height, int resolution)
                    1, height);
     /* bits per sample */
     add_ifd_entry (ifd, 258, IFDE_TYP_SHORT, 1, 1);
-    /* compression (uncompressed) */
-    add_ifd_entry (ifd, 259, IFDE_TYP_SHORT, 1, 1);
+    /* compression */
+    add_ifd_entry (ifd, 259, IFDE_TYP_SHORT, 1, strips ? strips->compression : 1);
     /* photometric interpretation */
     add_ifd_entry (ifd, 262, IFDE_TYP_SHORT, 1, 0);
     /* fill order */
     add_ifd_entry (ifd, 266, IFDE_TYP_SHORT, 1, 1);
     /* strip offset */
-    add_ifd_entry (ifd, 273, IFDE_TYP_LONG, 1, strip_offset);
+    add_strip_entry (ifd, 273, strips, strips ? strips->offsets : NULL,
+                     strip_offset, array_offset);
     /* orientation */
     add_ifd_entry (ifd, 274, IFDE_TYP_SHORT, 1, 1);
     /* samples per pixel */
     add_ifd_entry (ifd, 277, IFDE_TYP_SHORT, 1, 1);
     /* rows per strip */
-    add_ifd_entry (ifd, 278, IFDE_TYP_LONG, 1, height);
+    add_ifd_entry (ifd, 278, IFDE_TYP_LONG, 1, strips ? strips->rows : height);
     /* strip bytecount */
-    add_ifd_entry (ifd, 279, IFDE_TYP_LONG, 1, strip_bytecount);
+    add_strip_entry (ifd, 279, strips, strips ? strips->bytecounts : NULL,
+                     strip_bytecount, array_offset + strip_data);
     if (resolution > 0)
     {
         /* x resolution */
@@ -247,9 +319,7 @@ write_tiff_bw_header (FILE *fptr, int width, int height, int resolution)
         add_ifd_entry (ifd, 296, IFDE_TYP_SHORT, 1, 2);
     }
 
-    /* I prefer motorola format. Its human readable. */
-    motorola = 1;
-    write_ifd (fptr, ifd, motorola);
+    write_ifd (fptr, ifd, motorola, base == 0);
 
     /* Write x/y resolution */
     if (resolution > 0)
@@ -260,24 +330,30 @@ write_tiff_bw_header (FILE *fptr, int width, int height, int resolution)
         write_i4 (fptr, 1, motorola);
     }
 
+    write_strip_arrays (fptr, strips, motorola);
+
     free_ifd (ifd);
+
+    return base + header_size + 2 + ntags*12;
 }
 
-static void
-write_tiff_grey_header (FILE *fptr, int width, int height, int depth,
+static long
+write_tiff_grey_header (FILE *fptr, long base, int motorola,
+                        const STRIPS *strips, int width, int height, int depth,
                         int resolution, const char *icc_profile)
 {IFD *ifd;
-    int header_size = 8, ifd_size;
+    int header_size = base ? 0 : 8, ifd_size;
     int strip_offset, data_offset, data_size;
+    int strip_data, array_offset;
     int strip_bytecount;
     int ntags;
-    int motorola, bps, maxsamplevalue;
-    void *icc_buffer = NULL;
+    int bps, maxsamplevalue;
+    const void *icc_buffer = NULL;
     size_t icc_size = 0;
 
     if (icc_profile)
     {
-      icc_buffer = sanei_load_icc_profile(icc_profile, &icc_size);
+      icc_buffer = sanei_icc_profile_get(icc_profile, &icc_size);
     }
 
     ifd = create_ifd ();
@@ -301,9 +377,17 @@ write_tiff_grey_header (FILE *fptr, int width, int height, int depth,
         data_size += icc_size;
     }
 
+    if (strips && strips->predictor > 1)
+        ntags += 1;
+
+    /* strip offsets and byte counts, behind all other values */
+    strip_data = (strips && strips->count > 1) ? strips->count*4 : 0;
+    data_size += 2*strip_data;
+
     ifd_size = 2 + ntags*12 + 4;
-    data_offset = header_size + ifd_size;
+    data_offset = (int) base + header_size + ifd_size;
     strip_offset = data_offset + data_size;
+    array_offset = strip_offset - 2*strip_data;
 
     /* New subfile type */
     add_ifd_entry (ifd, 254, IFDE_TYP_LONG, 1, 0);
@@ -315,20 +399,22 @@ write_tiff_grey_header (FILE *fptr, int width, int height, int depth,
                    1, height);
     /* bits per sample */
     add_ifd_entry (ifd, 258, IFDE_TYP_SHORT, 1, depth);
-    /* compression (uncompressed) */
-    add_ifd_entry (ifd, 259, IFDE_TYP_SHORT, 1, 1);
+    /* compression */
+    add_ifd_entry (ifd, 259, IFDE_TYP_SHORT, 1, strips ? strips->compression : 1);
     /* photometric interpretation */
     add_ifd_entry (ifd, 262, IFDE_TYP_SHORT, 1, 1);
     /* strip offset */
-    add_ifd_entry (ifd, 273, IFDE_TYP_LONG, 1, strip_offset);
+    add_strip_entry (ifd, 273, strips, strips ? strips->offsets : NULL,
+                     strip_offset, array_offset);
     /* orientation */
     add_ifd_entry (ifd, 274, IFDE_TYP_SHORT, 1, 1);
     /* samples per pixel */
     add_ifd_entry (ifd, 277, IFDE_TYP_SHORT, 1, 1);
     /* rows per strip */
-    add_ifd_entry (ifd, 278, IFDE_TYP_LONG, 1, height);
+    add_ifd_entry (ifd, 278, IFDE_TYP_LONG, 1, strips ? strips->rows : height);
     /* strip bytecount */
-    add_ifd_entry (ifd, 279, IFDE_TYP_LONG, 1, strip_bytecount);
+    add_strip_entry (ifd, 279, strips, strips ? strips->bytecounts : NULL,
+                     strip_bytecount, array_offset + strip_data);
     /* min sample value */
     add_ifd_entry (ifd, 280, IFDE_TYP_SHORT, 1, 0);
     /* max sample value */
@@ -348,24 +434,19 @@ write_tiff_grey_header (FILE *fptr, int width, int height, int depth,
         add_ifd_entry (ifd, 296, IFDE_TYP_SHORT, 1, 2);
     }
 
-    if (icc_size > 0) /* add ICC-profile TAG */
+    if (strips && strips->predictor > 1)
     {
-      add_ifd_entry(ifd, 34675, 7, (int) icc_size, data_offset);
-      data_offset += icc_size;
+        /* predictor */
+        add_ifd_entry (ifd, 317, IFDE_TYP_SHORT, 1, strips->predictor);
     }
 
-    /* I prefer motorola format. Its human readable. But for 16 bit, */
-    /* the image format is defined by SANE to be the native byte order */
-    if (bps == 1)
+    if (icc_size > 0) /* add ICC-profile TAG */
     {
-        motorola = 1;
-    }
-    else
-    {int check = 1;
-        motorola = ((*((char *)&check)) == 0);
+      add_ifd_entry(ifd, 34675, 7, (int) icc_size, data_offset);
+      data_offset += icc_size;
     }
 
-    write_ifd (fptr, ifd, motorola);
+    write_ifd (fptr, ifd, motorola, base == 0);
 
     /* Write x/y resolution */
     if (resolution > 0)
@@ -381,26 +462,30 @@ write_tiff_grey_header (FILE *fptr, int width, int height, int depth,
       fwrite(icc_buffer, icc_size, 1, fptr);
     }
 
-    free(icc_buffer);
+    write_strip_arrays (fptr, strips, motorola);
 
     free_ifd (ifd);
+
+    return base + header_size + 2 + ntags*12;
 }
 
-static void
-write_tiff_color_header (FILE *fptr, int width, int height, int depth,
+static long
+write_tiff_color_header (FILE *fptr, long base, int motorola,
+                         const STRIPS *strips, int width, int height, int depth,
                          int resolution, const char *icc_profile)
 {IFD *ifd;
-    int header_size = 8, ifd_size;
+    int header_size = base ? 0 : 8, ifd_size;
     int strip_offset, data_offset, data_size;
+    int strip_data, array_offset;
     int strip_bytecount;
     int ntags;
-    int motorola, bps, maxsamplevalue;
-    void *icc_buffer = NULL;
+    int bps, maxsamplevalue;
+    const void *icc_buffer = NULL;
     size_t icc_size = 0;
 
     if (icc_profile)
     {
-      icc_buffer = sanei_load_icc_profile(icc_profile, &icc_size);
+      icc_buffer = sanei_icc_profile_get(icc_profile, &icc_size);
     }
 
 
@@ -426,10 +511,18 @@ write_tiff_color_header (FILE *fptr, int width, int height, int depth,
         data_size += icc_size;
     }
 
+    if (strips && strips->predictor > 1)
+        ntags += 1;
+
+
+    /* strip offsets and byte counts, behind all other values */
+    strip_data = (strips && strips->count > 1) ? strips->count*4 : 0;
+    data_size += 2*strip_data;
 
     ifd_size = 2 + ntags*12 + 4;
-    data_offset = header_size + ifd_size;
+    data_offset = (int) base + header_size + ifd_size;
     strip_offset = data_offset + data_size;
+    array_offset = strip_offset - 2*strip_data;
 
     /* New subfile type */
     add_ifd_entry (ifd, 254, IFDE_TYP_LONG, 1, 0);
@@ -442,20 +535,22 @@ write_tiff_color_header (FILE *fptr, int width, int height, int depth,
     /* bits per sample */
     add_ifd_entry (ifd, 258, IFDE_TYP_SHORT, 3, data_offset);
     data_offset += 3*2;
-    /* compression (uncompressed) */
-    add_ifd_entry (ifd, 259, IFDE_TYP_SHORT, 1, 1);
+    /* compression */
+    add_ifd_entry (ifd, 259, IFDE_TYP_SHORT, 1, strips ? strips->compression : 1);
     /* photometric interpretation */
     add_ifd_entry (ifd, 262, IFDE_TYP_SHORT, 1, 2);
     /* strip offset */
-    add_ifd_entry (ifd, 273, IFDE_TYP_LONG, 1, strip_offset);
+    add_strip_entry (ifd, 273, strips, strips ? strips->offsets : NULL,
+                     strip_offset, array_offset);
     /* orientation */
     add_ifd_entry (ifd, 274, IFDE_TYP_SHORT, 1, 1);
     /* samples per pixel */
     add_ifd_entry (ifd, 277, IFDE_TYP_SHORT, 1, 3);
     /* rows per strip */
-    add_ifd_entry (ifd, 278, IFDE_TYP_LONG, 1, height);
+    add_ifd_entry (ifd, 278, IFDE_TYP_LONG, 1, strips ? strips->rows : height);
     /* strip bytecount */
-    add_ifd_entry (ifd, 279, IFDE_TYP_LONG, 1, strip_bytecount);
+    add_strip_entry (ifd, 279, strips, strips ? strips->bytecounts : NULL,
+                     strip_bytecount, array_offset + strip_data);
     /* min sample value */
     add_ifd_entry (ifd, 280, IFDE_TYP_SHORT, 3, data_offset);
     data_offset += 3*2;
@@ -479,6 +574,12 @@ write_tiff_color_header (FILE *fptr, int width, int height, int depth,
         add_ifd_entry (ifd, 296, IFDE_TYP_SHORT, 1, 2);
     }
 
+    if (strips && strips->predictor > 1)
+    {
+        /* predictor */
+        add_ifd_entry (ifd, 317, IFDE_TYP_SHORT, 1, strips->predictor);
+    }
+
     if (icc_size > 0) /* add ICC-profile TAG */
     {
       add_ifd_entry(ifd, 34675, 7, (int) icc_size, data_offset);
@@ -486,18 +587,7 @@ write_tiff_color_header (FILE *fptr, int width, int height, int depth,
     }
 
 
-    /* I prefer motorola format. Its human readable. But for 16 bit, */
-    /* the image format is defined by SANE to be the native byte order */
-    if (bps == 1)
-    {
-        motorola = 1;
-    }
-    else
-    {int check = 1;
-        motorola = ((*((char *)&check)) == 0);
-    }
-
-    write_ifd (fptr, ifd, motorola);
+    write_ifd (fptr, ifd, motorola, base == 0);
 
     /* Write bits per sample value values */
     write_i2 (fptr, depth, motorola);
@@ -529,15 +619,18 @@ write_tiff_color_header (FILE *fptr, int width, int height, int depth,
       fwrite(icc_buffer, icc_size, 1, fptr);
     }
 
-    free(icc_buffer);
+    write_strip_arrays (fptr, strips, motorola);
 
     free_ifd (ifd);
+
+    return base + header_size + 2 + ntags*12;
 }
 
 
-void
-sanei_write_tiff_header (SANE_Frame format, int width, int height, int depth,
-			 int resolution, const char *icc_profile, FILE *ofp)
+static long
+write_tiff_header (SANE_Frame format, int width, int height, int depth,
+                   int resolution, const char *icc_profile, FILE *ofp,
+                   long base, int motorola, const STRIPS *strips)
 {
 #ifdef __EMX__	/* OS2 - write in binary mode. */
     _fsetmode(ofp, "b");
@@ -548,14 +641,618 @@ sanei_write_tiff_header (SANE_Frame format, int width, int height, int depth,
     case SANE_FRAME_GREEN:
     case SANE_FRAME_BLUE:
     case SANE_FRAME_RGB:
-        write_tiff_color_header (ofp, width, height, depth, resolution, icc_profile);
-        break;
+        return write_tiff_color_header (ofp, base, motorola, strips, width,
+                                        height, depth, resolution,
+                                        icc_profile);
 
     default:
         if (depth == 1)
-            write_tiff_bw_header (ofp, width, height, resolution);
+            return write_tiff_bw_header (ofp, base, motorola, strips, width,
+                                         height, resolution);
         else
-            write_tiff_grey_header (ofp, width, height, depth, resolution, icc_profile);
+            return write_tiff_grey_header (ofp, base, motorola, strips, width,
+                                           height, depth, resolution,
+                                           icc_profile);
+    }
+}
+
+void
+sanei_write_tiff_header (SANE_Frame format, int width, int height, int depth,
+			 int resolution, const char *icc_profile, FILE *ofp)
+{
+    write_tiff_header (format, width, height, depth, resolution, icc_profile,
+                       ofp, 0, tiff_motorola (depth), NULL);
+}
+
+
+/* Compressed pages are collected in strips of about this size */
+#define STRIP_SIZE 65536
+
+struct sane_tiff_page
+{
+    SANE_Frame format;
+    int width, height, depth, resolution;
+    const char *icc_profile;
+    int samples;           /* samples per pixel */
+    int bytes_per_line;
+    int compression;
+    int predictor;
+    int rows_per_strip;
+    SANE_Byte *strip;      /* rows of the strip being collected */
+    size_t fill;
+    SANE_Byte *out;        /* compressed strip */
+    size_t out_size;
+    SANE_Byte *ref;        /* G4 reference line */
+    long *offsets;
+    long *bytecounts;
+    int count, max_count;
+};
+
+/* PackBits, every row is packed on its own */
+static size_t
+packbits_row (const SANE_Byte *src, int n, SANE_Byte *dst)
+{int i = 0, start, run;
+    size_t len = 0;
+
+    while (i < n)
+    {
+        for (run = 1; i + run < n && run < 128 && src[i + run] == src[i]; run++)
+            ;
+        if (run >= 3)
+        {
+            dst[len++] = (SANE_Byte) (257 - run);
+            dst[len++] = src[i];
+            i += run;
+            continue;
+        }
+
+        /* literal bytes up to the next run of three */
+        start = i;
+        while (i < n && i - start < 128
+               && !(i + 2 < n && src[i] == src[i + 1] && src[i] == src[i + 2]))
+            i++;
+        dst[len++] = (SANE_Byte) (i - start - 1);
+        memcpy (dst + len, src + start, i - start);
+        len += i - start;
+    }
+    return len;
+}
+
+#ifdef HAVE_LIBZ
+/* Horizontal differencing, for 16 bit in the native byte order */
+static void
+predict_row (SANE_Byte *row, int n, int samples, int depth)
+{
+    int i;
+
+    if (depth == 16)
+    {
+        uint16_t *p = (uint16_t *) row;
+
+        for (i = n - 1; i >= samples; i--)
+            p[i] -= p[i - samples];
+    }
+    else
+    {
+        for (i = n - 1; i >= samples; i--)
+            row[i] -= row[i - samples];
+    }
+}
+#endif
+
+
+/* CCITT Group 4 (T.6) coding of lineart, a set bit is black. */
+
+typedef struct {
+    unsigned char len;
+    unsigned short code;
+} G4_CODE;
+
+/* terminating codes for runs 0-63, make up codes for 64-1728 and */
+/* extended make up codes for 1792-2560                           */
+static const G4_CODE g4_white[104] = {
+    { 8, 0x035 }, { 6, 0x007 }, { 4, 0x007 }, { 4, 0x008 }, { 4, 0x00b }, { 4, 0x00c },
+    { 4, 0x00e }, { 4, 0x00f }, { 5, 0x013 }, { 5, 0x014 }, { 5, 0x007 }, { 5, 0x008 },
+    { 6, 0x008 }, { 6, 0x003 }, { 6, 0x034 }, { 6, 0x035 }, { 6, 0x02a }, { 6, 0x02b },
+    { 7, 0x027 }, { 7, 0x00c }, { 7, 0x008 }, { 7, 0x017 }, { 7, 0x003 }, { 7, 0x004 },
+    { 7, 0x028 }, { 7, 0x02b }, { 7, 0x013 }, { 7, 0x024 }, { 7, 0x018 }, { 8, 0x002 },
+    { 8, 0x003 }, { 8, 0x01a }, { 8, 0x01b }, { 8, 0x012 }, { 8, 0x013 }, { 8, 0x014 },
+    { 8, 0x015 }, { 8, 0x016 }, { 8, 0x017 }, { 8, 0x028 }, { 8, 0x029 }, { 8, 0x02a },
+    { 8, 0x02b }, { 8, 0x02c }, { 8, 0x02d }, { 8, 0x004 }, { 8, 0x005 }, { 8, 0x00a },
+    { 8, 0x00b }, { 8, 0x052 }, { 8, 0x053 }, { 8, 0x054 }, { 8, 0x055 }, { 8, 0x024 },
+    { 8, 0x025 }, { 8, 0x058 }, { 8, 0x059 }, { 8, 0x05a }, { 8, 0x05b }, { 8, 0x04a },
+    { 8, 0x04b }, { 8, 0x032 }, { 8, 0x033 }, { 8, 0x034 }, { 5, 0x01b }, { 5, 0x012 },
+    { 6, 0x017 }, { 7, 0x037 }, { 8, 0x036 }, { 8, 0x037 }, { 8, 0x064 }, { 8, 0x065 },
+    { 8, 0x068 }, { 8, 0x067 }, { 9, 0x0cc }, { 9, 0x0cd }, { 9, 0x0d2 }, { 9, 0x0d3 },
+    { 9, 0x0d4 }, { 9, 0x0d5 }, { 9, 0x0d6 }, { 9, 0x0d7 }, { 9, 0x0d8 }, { 9, 0x0d9 },
+    { 9, 0x0da }, { 9, 0x0db }, { 9, 0x098 }, { 9, 0x099 }, { 9, 0x09a }, { 6, 0x018 },
+    { 9, 0x09b }, { 11, 0x008 }, { 11, 0x00c }, { 11, 0x00d }, { 12, 0x012 }, { 12, 0x013 },
+    { 12, 0x014 }, { 12, 0x015 }, { 12, 0x016 }, { 12, 0x017 }, { 12, 0x01c }, { 12, 0x01d },
+    { 12, 0x01e }, { 12, 0x01f }
+};
+
+static const G4_CODE g4_black[104] = {
+    { 10, 0x037 }, { 3, 0x002 }, { 2, 0x003 }, { 2, 0x002 }, { 3, 0x003 }, { 4, 0x003 },
+    { 4, 0x002 }, { 5, 0x003 }, { 6, 0x005 }, { 6, 0x004 }, { 7, 0x004 }, { 7, 0x005 },
+    { 7, 0x007 }, { 8, 0x004 }, { 8, 0x007 }, { 9, 0x018 }, { 10, 0x017 }, { 10, 0x018 },
+    { 10, 0x008 }, { 11, 0x067 }, { 11, 0x068 }, { 11, 0x06c }, { 11, 0x037 }, { 11, 0x028 },
+    { 11, 0x017 }, { 11, 0x018 }, { 12, 0x0ca }, { 12, 0x0cb }, { 12, 0x0cc }, { 12, 0x0cd },
+    { 12, 0x068 }, { 12, 0x069 }, { 12, 0x06a }, { 12, 0x06b }, { 12, 0x0d2 }, { 12, 0x0d3 },
+    { 12, 0x0d4 }, { 12, 0x0d5 }, { 12, 0x0d6 }, { 12, 0x0d7 }, { 12, 0x06c }, { 12, 0x06d },
+    { 12, 0x0da }, { 12, 0x0db }, { 12, 0x054 }, { 12, 0x055 }, { 12, 0x056 }, { 12, 0x057 },
+    { 12, 0x064 }, { 12, 0x065 }, { 12, 0x052 }, { 12, 0x053 }, { 12, 0x024 }, { 12, 0x037 },
+    { 12, 0x038 }, { 12, 0x027 }, { 12, 0x028 }, { 12, 0x058 }, { 12, 0x059 }, { 12, 0x02b },
+    { 12, 0x02c }, { 12, 0x05a }, { 12, 0x066 }, { 12, 0x067 }, { 10, 0x00f }, { 12, 0x0c8 },
+    { 12, 0x0c9 }, { 12, 0x05b }, { 12, 0x033 }, { 12, 0x034 }, { 12, 0x035 }, { 13, 0x06c },
+    { 13, 0x06d }, { 13, 0x04a }, { 13, 0x04b }, { 13, 0x04c }, { 13, 0x04d }, { 13, 0x072 },
+    { 13, 0x073 }, { 13, 0x074 }, { 13, 0x075 }, { 13, 0x076 }, { 13, 0x077 }, { 13, 0x052 },
+    { 13, 0x053 }, { 13, 0x054 }, { 13, 0x055 }, { 13, 0x05a }, { 13, 0x05b }, { 13, 0x064 },
+    { 13, 0x065 }, { 11, 0x008 }, { 11, 0x00c }, { 11, 0x00d }, { 12, 0x012 }, { 12, 0x013 },
+    { 12, 0x014 }, { 12, 0x015 }, { 12, 0x016 }, { 12, 0x017 }, { 12, 0x01c }, { 12, 0x01d },
+    { 12, 0x01e }, { 12, 0x01f }
+};
+
+/* vertical mode for b1 - a1 = -3 ... 3 */
+static const G4_CODE g4_vertical[7] = {
+    { 7, 0x03 }, { 6, 0x03 }, { 3, 0x03 }, { 1, 0x1 }, { 3, 0x2 }, { 6, 0x02 }, { 7, 0x02 }
+};
+
+static void
+g4_put (SANE_G4_Bits *b, const G4_CODE *c)
+{
+    b->acc = (b->acc << c->len) | c->code;
+    b->bits += c->len;
+    while (b->bits >= 8)
+    {
+        b->bits -= 8;
+        b->out[b->len++] = (SANE_Byte) (b->acc >> b->bits);
+    }
+    b->acc &= (1u << b->bits) - 1;
+}
+
+static void
+g4_put_run (SANE_G4_Bits *b, const G4_CODE *tab, int run)
+{
+    while (run >= 2624)
+    {
+        g4_put (b, &tab[63 + (2560 >> 6)]);
+        run -= 2560;
+    }
+    if (run >= 64)
+    {
+        g4_put (b, &tab[63 + (run >> 6)]);
+        run &= 63;
+    }
+    g4_put (b, &tab[run]);
+}
+
+static int
+g4_pixel (const SANE_Byte *row, int x)
+{
+    return (row[x >> 3] >> (7 - (x & 7))) & 1;
+}
+
+/* first pixel from x on that does not have the given color */
+static int
+g4_find (const SANE_Byte *row, int x, int width, int color)
+{
+    SANE_Byte skip = color ? 0xff : 0x00;
+
+    while (x < width)
+    {
+        if ((x & 7) == 0 && row[x >> 3] == skip)
+            x += 8;
+        else if (g4_pixel (row, x) != color)
+            return x;
+        else
+            x++;
+    }
+    return width;
+}
+
+void
+sanei_g4_encode_row (SANE_G4_Bits *b, const SANE_Byte *row,
+                     const SANE_Byte *ref, int width)
+{
+    static const G4_CODE pass = { 4, 0x1 }, horizontal = { 3, 0x1 };
+    int a0 = 0, a1, a2, b1, b2, color = 0;
+
+    a1 = g4_find (row, 0, width, 0);
+    b1 = g4_find (ref, 0, width, 0);
+    for (;;)
+    {
+        b2 = (b1 < width) ? g4_find (ref, b1, width, g4_pixel (ref, b1)) : width;
+        if (b2 < a1)
+        {
+            g4_put (b, &pass);
+            a0 = b2;
+        }
+        else if (b1 - a1 >= -3 && b1 - a1 <= 3)
+        {
+            g4_put (b, &g4_vertical[b1 - a1 + 3]);
+            a0 = a1;
+            color = !color;
+        }
+        else
+        {
+            a2 = (a1 < width) ? g4_find (row, a1, width, !color) : width;
+            g4_put (b, &horizontal);
+            g4_put_run (b, color ? g4_black : g4_white, a1 - a0);
+            g4_put_run (b, color ? g4_white : g4_black, a2 - a1);
+            a0 = a2;
+        }
+        if (a0 >= width)
+            break;
+        a1 = g4_find (row, a0, width, color);
+        b1 = g4_find (ref, a0, width, !color);
+        b1 = g4_find (ref, b1, width, color);
+    }
+}
+
+void
+sanei_g4_end (SANE_G4_Bits *b)
+{
+    static const G4_CODE eol = { 12, 0x1 };
+
+    /* EOFB */
+    g4_put (b, &eol);
+    g4_put (b, &eol);
+    if (b->bits > 0)
+        b->out[b->len++] = (SANE_Byte) (b->acc << (8 - b->bits));
+    b->acc = 0;
+    b->bits = 0;
+}
+
+static size_t
+g4_encode_strip (struct sane_tiff_page *page, int rows)
+{
+    SANE_G4_Bits b = { page->out, 0, 0, 0 };
+    const SANE_Byte *row = page->strip;
+    int y;
+
+    /* every strip starts from an all white reference line */
+    memset (page->ref, 0, page->bytes_per_line);
+    for (y = 0; y < rows; y++, row += page->bytes_per_line)
+    {
+        sanei_g4_encode_row (&b, row, page->ref, page->width);
+        memcpy (page->ref, row, page->bytes_per_line);
+    }
+    sanei_g4_end (&b);
+    return b.len;
+}
+
+
+static int
+flush_strip (SANE_Tiff_Doc *doc)
+{
+    struct sane_tiff_page *page = doc->page;
+    int bpl = page->bytes_per_line;
+    int rows = (int) ((page->fill + bpl - 1) / bpl);
+    size_t len = 0;
+    long pos;
+    int y;
+
+    if (rows == 0)
+        return 0;
+
+    /* complete a partial last row */
+    memset (page->strip + page->fill, 0, (size_t) rows * bpl - page->fill);
+
+    switch (page->compression)
+    {
+    case SANE_TIFF_COMPRESSION_PACKBITS:
+        for (y = 0; y < rows; y++)
+            len += packbits_row (page->strip + (size_t) y * bpl, bpl,
+                                 page->out + len);
+        break;
+
+#ifdef HAVE_LIBZ
+    case SANE_TIFF_COMPRESSION_DEFLATE:
+    {
+        uLongf out_len = page->out_size;
+
+        if (page->predictor > 1)
+            for (y = 0; y < rows; y++)
+                predict_row (page->strip + (size_t) y * bpl,
+                             page->width * page->samples, page->samples,
+                             page->depth);
+        if (compress2 (page->out, &out_len, page->strip, (uLong) rows * bpl,
+                       Z_DEFAULT_COMPRESSION) != Z_OK)
+            return -1;
+        len = out_len;
+        break;
+    }
+#endif
+
+    case SANE_TIFF_COMPRESSION_G4:
+        len = g4_encode_strip (page, rows);
+        break;
+    }
+
+    if (page->count == page->max_count)
+    {
+        int max_count = page->max_count ? 2 * page->max_count : 16;
+        long *offsets, *bytecounts;
+
+        offsets = realloc (page->offsets, max_count * sizeof (long));
+        if (offsets)
+            page->offsets = offsets;
+        bytecounts = realloc (page->bytecounts, max_count * sizeof (long));
+        if (bytecounts)
+            page->bytecounts = bytecounts;
+        if (!offsets || !bytecounts)
+            return -1;
+        page->max_count = max_count;
+    }
+
+    pos = ftell (doc->ofp);
+    if (pos < 0 || fwrite (page->out, 1, len, doc->ofp) != len)
+        return -1;
+    page->offsets[page->count] = pos - doc->origin;
+    page->bytecounts[page->count] = (long) len;
+    page->count++;
+
+    page->height += rows;
+    page->fill = 0;
+    return 0;
+}
+
+static void
+free_page (SANE_Tiff_Doc *doc)
+{
+    struct sane_tiff_page *page = doc->page;
+
+    if (!page)
+        return;
+    free (page->strip);
+    free (page->out);
+    free (page->ref);
+    free (page->offsets);
+    free (page->bytecounts);
+    free (page);
+    doc->page = NULL;
+}
+
+/* Compressed pages start with their image data, the IFD follows once */
+/* the number of rows and the size of each strip is known.              */
+static int
+start_compressed_page (SANE_Tiff_Doc *doc, SANE_Frame format, int width,
+                       int depth, int resolution, const char *icc_profile,
+                       int compression)
+{
+    struct sane_tiff_page *page;
+    size_t strip_size;
+
+    switch (compression)
+    {
+    case SANE_TIFF_COMPRESSION_PACKBITS:
+        break;
+#ifdef HAVE_LIBZ
+    case SANE_TIFF_COMPRESSION_DEFLATE:
+        break;
+#endif
+    case SANE_TIFF_COMPRESSION_G4:
+        if (depth == 1 && format == SANE_FRAME_GRAY)
+            break;
+        /* fall through */
+    default:
+        return -1;
+    }
+
+    page = calloc (1, sizeof (*page));
+    if (!page)
+        return -1;
+    doc->page = page;
+
+    page->format = format;
+    page->width = width;
+    page->depth = depth;
+    page->resolution = resolution;
+    page->icc_profile = icc_profile;
+    page->samples = (format == SANE_FRAME_GRAY) ? 1 : 3;
+    if (depth == 1)
+        page->bytes_per_line = (width + 7) / 8;
+    else
+        page->bytes_per_line = width * page->samples * (depth / 8);
+    page->compression = compression;
+    if (compression == SANE_TIFF_COMPRESSION_DEFLATE && depth > 1)
+        page->predictor = 2;
+    else
+        page->predictor = 1;
+
+    page->rows_per_strip = STRIP_SIZE / page->bytes_per_line;
+    if (page->rows_per_strip < 1)
+        page->rows_per_strip = 1;
+    strip_size = (size_t) page->rows_per_strip * page->bytes_per_line;
+
+    switch (compression)
+    {
+    case SANE_TIFF_COMPRESSION_PACKBITS:
+        page->out_size = strip_size
+                         + page->rows_per_strip * ((page->bytes_per_line + 127) / 128);
+        break;
+#ifdef HAVE_LIBZ
+    case SANE_TIFF_COMPRESSION_DEFLATE:
+        page->out_size = compressBound ((uLong) strip_size);
+        break;
+#endif
+    case SANE_TIFF_COMPRESSION_G4:
+        page->out_size = (size_t) page->rows_per_strip
+                         * SANE_G4_ROW_BYTES (width) + 8;
+        page->ref = malloc (page->bytes_per_line);
         break;
     }
+    page->strip = malloc (strip_size);
+    page->out = malloc (page->out_size);
+    if (!page->strip || !page->out
+        || (compression == SANE_TIFF_COMPRESSION_G4 && !page->ref))
+    {
+        free_page (doc);
+        return -1;
+    }
+
+    if (doc->end == 0)
+        write_file_header (doc->ofp, doc->motorola);
+    return ferror (doc->ofp) ? -1 : 0;
+}
+
+static int
+end_compressed_page (SANE_Tiff_Doc *doc)
+{
+    struct sane_tiff_page *page = doc->page;
+    STRIPS strips;
+    long base;
+
+    if (flush_strip (doc))
+        return -1;
+
+    base = ftell (doc->ofp) - doc->origin;
+    if (base < 0)
+        return -1;
+
+    /* an empty image still needs a strip */
+    if (page->count == 0)
+    {
+        page->offsets = malloc (sizeof (long));
+        page->bytecounts = malloc (sizeof (long));
+        if (!page->offsets || !page->bytecounts)
+            return -1;
+        page->offsets[0] = base;
+        page->bytecounts[0] = 0;
+        page->count = 1;
+    }
+
+    if (base & 1)
+    {
+        putc (0, doc->ofp);
+        base++;
+    }
+
+    strips.compression = page->compression;
+    strips.predictor = page->predictor;
+    strips.rows = page->rows_per_strip;
+    strips.count = page->count;
+    strips.offsets = page->offsets;
+    strips.bytecounts = page->bytecounts;
+
+    doc->ifd = base;
+    doc->page_link = write_tiff_header (page->format, page->width,
+                                        page->height, page->depth,
+                                        page->resolution, page->icc_profile,
+                                        doc->ofp, base, doc->motorola,
+                                        &strips);
+    free_page (doc);
+    return ferror (doc->ofp) ? -1 : 0;
+}
+
+void
+sanei_tiff_doc_init (SANE_Tiff_Doc *doc, FILE *ofp)
+{
+    doc->ofp = ofp;
+    doc->origin = ftell (ofp);
+    if (doc->origin < 0)
+        doc->origin = 0;
+    /* all pages share one byte order, 16 bit data needs the native one */
+    doc->motorola = tiff_motorola (16);
+    doc->pages = 0;
+    doc->end = 0;
+    doc->link = 4;		/* the first IFD offset in the file header */
+    doc->ifd = 0;
+    doc->page_link = 0;
+    doc->page = NULL;
+}
+
+int
+sanei_tiff_doc_start_page (SANE_Tiff_Doc *doc, SANE_Frame format,
+                           int width, int height, int depth, int resolution,
+                           const char *icc_profile, int compression)
+{long base = doc->end;
+
+    if (compression != SANE_TIFF_COMPRESSION_NONE)
+        return start_compressed_page (doc, format, width, depth, resolution,
+                                      icc_profile, compression);
+
+    /* an IFD has to start on a word boundary */
+    if (base & 1)
+    {
+        putc (0, doc->ofp);
+        base++;
+    }
+
+    doc->ifd = base ? base : 8;
+    doc->page_link = write_tiff_header (format, width, height, depth,
+                                        resolution, icc_profile, doc->ofp,
+                                        base, doc->motorola, NULL);
+    return ferror (doc->ofp) ? -1 : 0;
+}
+
+int
+sanei_tiff_doc_write (SANE_Tiff_Doc *doc, const SANE_Byte *data, size_t len)
+{
+    struct sane_tiff_page *page = doc->page;
+    size_t strip_size, n;
+
+    if (!page)
+        return (fwrite (data, 1, len, doc->ofp) == len) ? 0 : -1;
+
+    strip_size = (size_t) page->rows_per_strip * page->bytes_per_line;
+    while (len > 0)
+    {
+        n = strip_size - page->fill;
+        if (n > len)
+            n = len;
+        memcpy (page->strip + page->fill, data, n);
+        page->fill += n;
+        data += n;
+        len -= n;
+        if (page->fill == strip_size && flush_strip (doc))
+            return -1;
+    }
+    return 0;
+}
+
+int
+sanei_tiff_doc_end_page (SANE_Tiff_Doc *doc)
+{long end;
+
+    if (doc->page && end_compressed_page (doc))
+    {
+        free_page (doc);
+        return -1;
+    }
+
+    end = ftell (doc->ofp) - doc->origin;
+    if (end < 0)
+        return -1;
+
+    /* the header points to offset 8, where the first uncompressed */
+    /* page has its IFD */
+    if (doc->pages > 0 || doc->ifd != 8)
+    {
+        if (fseek (doc->ofp, doc->origin + doc->link, SEEK_SET) != 0)
+            return -1;
+        write_i4 (doc->ofp, (int) doc->ifd, doc->motorola);
+        if (fseek (doc->ofp, doc->origin + end, SEEK_SET) != 0)
+            return -1;
+    }
+
+    doc->link = doc->page_link;
+    doc->end = end;
+    doc->pages++;
+
+    /* the file is a complete TIFF again, make it so on disk */
+    if (fflush (doc->ofp) != 0 || ferror (doc->ofp))
+        return -1;
+    return 0;
+}
+
+int
+sanei_tiff_doc_abort_page (SANE_Tiff_Doc *doc)
+{
+    free_page (doc);
+    if (fflush (doc->ofp) != 0)
+        return -1;
+    if (ftruncate (fileno (doc->ofp), doc->origin + doc->end) != 0)
+        return -1;
+    return fseek (doc->ofp, doc->origin + doc->end, SEEK_SET);
 }
@@ -18,3 +18,72 @@
 void
 sanei_write_tiff_header (SANE_Frame format, int width, int height, int depth,
                          int resolution, const char *icc_profile, FILE *ofp);
+
+/* CCITT Group 4 (T.6) coding of lineart, a set bit is black.  The code
+   bits go to out, each row adds at most SANE_G4_ROW_BYTES (width) bytes
+   to len.  The caller may take the bytes out and reset len between
+   rows. */
+typedef struct
+{
+  SANE_Byte *out;
+  size_t len;
+  unsigned int acc;		/* bits not yet in out */
+  int bits;
+} SANE_G4_Bits;
+
+/* at most 7 bits per pixel */
+#define SANE_G4_ROW_BYTES(width) ((size_t) (width) + 16)
+
+/* ref is the previous row, all white (0) for the first one */
+void sanei_g4_encode_row (SANE_G4_Bits *b, const SANE_Byte *row,
+                          const SANE_Byte *ref, int width);
+
+/* end of facsimile block, pads the last byte */
+void sanei_g4_end (SANE_G4_Bits *b);
+
+/* compression of the image data, the values are those of the TIFF tag */
+#define SANE_TIFF_COMPRESSION_NONE      1
+#define SANE_TIFF_COMPRESSION_G4        4       /* lineart only */
+#define SANE_TIFF_COMPRESSION_DEFLATE   8       /* needs zlib */
+#define SANE_TIFF_COMPRESSION_PACKBITS  32773
+
+struct sane_tiff_page;
+
+/* A multi-page TIFF file, pages are appended as they are scanned.
+   After sanei_tiff_doc_end_page() the file is a complete TIFF holding
+   all pages so far, sanei_tiff_doc_abort_page() cuts off a partially
+   written page again.
+
+   Compressed pages are written in strips as the data arrives, their IFD
+   goes behind the image data.  This needs a seekable file, but not the
+   image height in advance. */
+typedef struct
+{
+  FILE *ofp;
+  long origin;			/* file position of the TIFF header */
+  int motorola;
+  int pages;			/* number of completed pages */
+  long end;			/* end of the last completed page */
+  long link;			/* next IFD offset of the last completed page */
+  long ifd;			/* IFD of the current page */
+  long page_link;		/* next IFD offset of the current page */
+  struct sane_tiff_page *page;	/* strips of a compressed page */
+} SANE_Tiff_Doc;
+
+void sanei_tiff_doc_init (SANE_Tiff_Doc *doc, FILE *ofp);
+
+/* start a new page, height is only used for uncompressed pages */
+int sanei_tiff_doc_start_page (SANE_Tiff_Doc *doc, SANE_Frame format,
+                               int width, int height, int depth,
+                               int resolution, const char *icc_profile,
+                               int compression);
+
+/* add image data of the current page, in any amount */
+int sanei_tiff_doc_write (SANE_Tiff_Doc *doc, const SANE_Byte *data,
+                          size_t len);
+
+/* link the page into the file, call after the image data is written */
+int sanei_tiff_doc_end_page (SANE_Tiff_Doc *doc);
+
+/* drop the current page, e.g. after a cancelled scan */
+int sanei_tiff_doc_abort_page (SANE_Tiff_Doc *doc);
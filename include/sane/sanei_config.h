@@ -176,6 +176,29 @@ extern SANE_Status sanei_configure_attach (
  */
 extern const char *sanei_config_get_paths (void);
 
+/** Replace a file with newly generated contents.
+ *
+ * The contents are written by \a write_contents to a temporary file that is
+ * created with mkstemp() next to \a path and then renamed to \a path, so
+ * concurrent writers don't clobber each other and readers never see a
+ * partly written file.  If \a path already holds exactly these contents it
+ * is left alone.  The directory of \a path is created (mode 0700) if it
+ * doesn't exist, but not its parents.  Meant for caches that backends keep
+ * in the user's home directory.
+ *
+ * @param path name of the file to replace
+ * @param write_contents callback that writes the contents to \a fp and
+ *        returns SANE_STATUS_GOOD, any other status aborts the write
+ * @param data passed on to \a write_contents
+ *
+ * @return SANE_STATUS_GOOD if \a path holds the new contents,
+ *         SANE_STATUS_ACCESS_DENIED if the temporary file can't be created,
+ *         SANE_STATUS_IO_ERROR if writing or renaming it failed, or the
+ *         status returned by \a write_contents
+ */
+extern SANE_Status sanei_config_write_file (const char *path,
+  SANE_Status (*write_contents) (FILE *fp, void *data), void *data);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -40,6 +40,9 @@ extern "C" {
  * Print a message at debug level `level' or higher using a printf-like
  * function. Example: DBG(1, "sane_open: opening fd \%d\\n", fd).
  *
+ * The level is checked before the remaining arguments are evaluated, so
+ * they must not have side effects.
+ *
  * @param level debug level
  * @param fmt format (see man 3 printf for details)
  * @param ... additional arguments
@@ -145,7 +148,8 @@ DBG_LOCAL (int level, const char *msg, ...)
 # endif /* !STUBS */
 
                                   /** @hideinitializer*/
-# define DBG            DBG_LOCAL
+# define DBG(level, ...)                                \
+  ((level) <= DBG_LEVEL ? DBG_LOCAL (level, __VA_ARGS__) : (void) 0)
 
 extern void sanei_init_debug (const char * backend, int * debug_level_var);
 
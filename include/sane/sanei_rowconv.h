@@ -0,0 +1,134 @@
+/* sane - Scanner Access Now Easy.
+
+   This file is part of the SANE package.
+
+   SANE is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   SANE is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+   or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+   License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with sane; see the file COPYING.
+   If not, see <https://www.gnu.org/licenses/>.
+
+   As a special exception, the authors of SANE give permission for
+   additional uses of the libraries contained in this release of SANE.
+
+   The exception is that, if you link a SANE library with other files
+   to produce an executable, this does not by itself cause the
+   resulting executable to be covered by the GNU General Public
+   License.  Your use of that executable is in no way restricted on
+   account of linking the SANE library code into it.
+
+   This exception does not, however, invalidate any other reasons why
+   the executable file might be covered by the GNU General Public
+   License.
+
+   If you submit changes to SANE to the maintainers to be included in
+   a subsequent release, you agree by submitting the changes that
+   those changes may be distributed with this exception intact.
+
+   If you write modifications of your own for SANE, it is your choice
+   whether to permit this exception to apply to your modifications.
+   If you do not wish that, delete this exception notice.
+*/
+
+/** @file sanei_rowconv.h
+ * Sample format conversions on rows of image data.
+ *
+ * These are the conversions frontends need to hand SANE image data to
+ * file format libraries:
+ * - byte swapping of 16 bit samples
+ * - inverting of lineart data
+ * - expanding lineart to 8 bit gray
+ * - reducing 16 bit samples to 8 bit
+ * - dropping the alpha channel of RGBA data
+ *
+ * On x86 the fastest implementation the CPU supports is picked at run
+ * time.  All implementations produce exactly the same result.
+ */
+
+#ifndef SANEI_ROWCONV_H
+#define SANEI_ROWCONV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Swap the bytes of each 16 bit sample in place.
+ *
+ * @param row image data
+ * @param bytes number of bytes, a trailing odd byte is left alone
+ */
+extern void sanei_rowconv_swap16 (uint8_t * row, size_t bytes);
+
+/** Invert all bits in place.
+ *
+ * SANE lineart uses 1 for black, most file formats use 0.
+ *
+ * @param row image data
+ * @param bytes number of bytes
+ */
+extern void sanei_rowconv_invert (uint8_t * row, size_t bytes);
+
+/** Expand lineart to 8 bit gray.
+ *
+ * Set bits (black in SANE) become 0x00, clear bits become 0xff.  The
+ * most significant bit of each byte is the leftmost pixel.
+ *
+ * @param src lineart data, (pixels + 7) / 8 bytes
+ * @param dst gray data, pixels bytes
+ * @param pixels number of pixels
+ */
+extern void sanei_rowconv_1to8 (const uint8_t * src, uint8_t * dst,
+				size_t pixels);
+
+/** Reduce native endian 16 bit samples to 8 bit by dropping the low byte.
+ *
+ * The conversion may be done in place, with dst equal to src.
+ *
+ * @param src 16 bit data, 2 * samples bytes
+ * @param dst 8 bit data, samples bytes
+ * @param samples number of samples
+ */
+extern void sanei_rowconv_16to8 (const uint8_t * src, uint8_t * dst,
+				 size_t samples);
+
+/** Turn 8 bit RGBA pixels into RGB ones by dropping the alpha byte.
+ *
+ * The conversion may be done in place, with dst equal to src.
+ *
+ * @param src RGBA data, 4 * pixels bytes
+ * @param dst RGB data, 3 * pixels bytes
+ * @param pixels number of pixels
+ */
+extern void sanei_rowconv_rgba_to_rgb (const uint8_t * src, uint8_t * dst,
+				       size_t pixels);
+
+/** Name of the implementation in use, for diagnostics.
+ *
+ * @return "generic", "sse2" or "avx2"
+ */
+extern const char *sanei_rowconv_impl (void);
+
+/** Select an implementation by name, mainly for testing.
+ *
+ * @param name implementation name, or NULL for the fastest one
+ *
+ * @return 1 on success, 0 if the CPU or the build does not support it
+ */
+extern int sanei_rowconv_select (const char *name);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif /* SANEI_ROWCONV_H */
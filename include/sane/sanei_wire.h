@@ -58,6 +58,7 @@ WireDirection;
 struct Wire;
 
 typedef void (*WireCodecFunc) (struct Wire *w, void *val_ptr);
+typedef void (*WireArrayFunc) (struct Wire *w, void *val_ptr, size_t nelem);
 typedef ssize_t (*WireReadFunc) (int fd, void * buf, size_t len);
 typedef ssize_t (*WireWriteFunc) (int fd, const void * buf, size_t len);
 
@@ -73,6 +74,10 @@ typedef struct Wire
 	WireCodecFunc w_char;
 	WireCodecFunc w_word;
 	WireCodecFunc w_string;
+	/* optional bulk transfer of byte and word arrays; a codec may
+	   leave these NULL to get element-by-element transfers */
+	WireArrayFunc w_byte_array;
+	WireArrayFunc w_word_array;
       }
     codec;
     struct
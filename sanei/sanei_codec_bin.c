@@ -127,6 +127,97 @@ bin_w_word (Wire *w, void *v)
     }
 }
 
+/* Transfer NELEM bytes in as few buffer refills as possible.  */
+static void
+bin_w_byte_array (Wire *w, void *v, size_t nelem)
+{
+  SANE_Byte *b = v;
+  size_t avail;
+
+  if (w->direction == WIRE_FREE)
+    return;
+
+  while (nelem > 0)
+    {
+      sanei_w_space (w, 1);
+      if (w->status)
+	return;
+
+      avail = w->buffer.end - w->buffer.curr;
+      if (avail > nelem)
+	avail = nelem;
+
+      if (w->direction == WIRE_ENCODE)
+	memcpy (w->buffer.curr, b, avail);
+      else
+	memcpy (b, w->buffer.curr, avail);
+
+      w->buffer.curr += avail;
+      b += avail;
+      nelem -= avail;
+    }
+}
+
+/* Transfer NELEM words in bigendian byte-order.  The inner loops have
+   no dependencies between iterations, so the compiler is free to
+   vectorise the byte shuffling.  */
+static void
+bin_w_word_array (Wire *w, void *v, size_t nelem)
+{
+  SANE_Word *word = v;
+  unsigned char *p;
+  size_t avail;
+#ifndef WORDS_BIGENDIAN
+  size_t i;
+#endif
+
+  if (w->direction == WIRE_FREE)
+    return;
+
+  while (nelem > 0)
+    {
+      sanei_w_space (w, 4);
+      if (w->status)
+	return;
+
+      avail = (w->buffer.end - w->buffer.curr) / 4;
+      if (avail > nelem)
+	avail = nelem;
+
+      p = (unsigned char *) w->buffer.curr;
+#ifdef WORDS_BIGENDIAN
+      if (w->direction == WIRE_ENCODE)
+	memcpy (p, word, avail * 4);
+      else
+	memcpy (word, p, avail * 4);
+#else
+      if (w->direction == WIRE_ENCODE)
+	{
+	  for (i = 0; i < avail; ++i)
+	    {
+	      SANE_Word val = word[i];
+
+	      p[4 * i + 0] = (val >> 24) & 0xff;
+	      p[4 * i + 1] = (val >> 16) & 0xff;
+	      p[4 * i + 2] = (val >>  8) & 0xff;
+	      p[4 * i + 3] = (val >>  0) & 0xff;
+	    }
+	}
+      else
+	{
+	  for (i = 0; i < avail; ++i)
+	    word[i] = (SANE_Word) (  ((unsigned int) p[4 * i + 0] << 24)
+				   | ((unsigned int) p[4 * i + 1] << 16)
+				   | ((unsigned int) p[4 * i + 2] <<  8)
+				   | ((unsigned int) p[4 * i + 3] <<  0));
+	}
+#endif
+      w->buffer.curr += avail * 4;
+      word += avail;
+      nelem -= avail;
+    }
+}
+
 void
 sanei_codec_bin_init (Wire *w)
 {
@@ -134,4 +225,6 @@ sanei_codec_bin_init (Wire *w)
   w->codec.w_char = bin_w_byte;
   w->codec.w_word = bin_w_word;
   w->codec.w_string = bin_w_string;
+  w->codec.w_byte_array = bin_w_byte_array;
+  w->codec.w_word_array = bin_w_word_array;
 }
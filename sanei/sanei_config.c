@@ -41,11 +41,16 @@
 #include "../include/sane/config.h"
 
 #include <ctype.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
 
 #include <sys/param.h>
+#include <sys/stat.h>
 
 #include "../include/sane/sanei.h"
 #include "../include/sane/sanei_config.h"
@@ -456,3 +461,111 @@ sanei_configure_attach (const char *config_file, SANEI_Config * config,
   DBG (3, "sanei_configure_attach: exit\n");
   return status;
 }
+
+/* does FP hold the same bytes as the file PATH? */
+static int
+same_contents (FILE *fp, const char *path)
+{
+  char a[4096], b[4096];
+  size_t na, nb;
+  FILE *old;
+  int same = 0;
+
+  old = fopen (path, "rb");
+  if (!old)
+    return 0;
+
+  rewind (fp);
+  for (;;)
+    {
+      na = fread (a, 1, sizeof (a), fp);
+      nb = fread (b, 1, sizeof (b), old);
+      if (na != nb || memcmp (a, b, na) != 0)
+	break;
+      if (na == 0)
+	{
+	  same = !ferror (fp) && !ferror (old);
+	  break;
+	}
+    }
+  fclose (old);
+  return same;
+}
+
+SANE_Status
+sanei_config_write_file (const char *path,
+			 SANE_Status (*write_contents) (FILE *fp, void *data),
+			 void *data)
+{
+  char *tmp_path, *slash;
+  SANE_Status status;
+  FILE *fp;
+  int fd;
+
+  DBG_INIT ();
+
+  tmp_path = malloc (strlen (path) + 8);
+  if (!tmp_path)
+    return SANE_STATUS_NO_MEM;
+  sprintf (tmp_path, "%s.XXXXXX", path);
+
+#ifdef HAVE_MKDIR
+  slash = strrchr (tmp_path, PATH_SEP);
+  if (slash && slash != tmp_path)
+    {
+      *slash = '\0';
+      if (mkdir (tmp_path, 0700) == 0)
+	DBG (4, "sanei_config_write_file: created `%s'\n", tmp_path);
+      *slash = PATH_SEP;
+    }
+#else
+  (void) slash;
+#endif
+
+  /* a private temporary file, so concurrent writers never mix their
+     output and readers only ever see a complete file */
+  fd = mkstemp (tmp_path);
+  if (fd == -1 || (fp = fdopen (fd, "w+b")) == NULL)
+    {
+      DBG (2, "sanei_config_write_file: can't create `%s': %s\n", tmp_path,
+	   strerror (errno));
+      if (fd != -1)
+	{
+	  close (fd);
+	  unlink (tmp_path);
+	}
+      free (tmp_path);
+      return SANE_STATUS_ACCESS_DENIED;
+    }
+
+  status = write_contents (fp, data);
+  if (status == SANE_STATUS_GOOD && (fflush (fp) != 0 || ferror (fp)))
+    status = SANE_STATUS_IO_ERROR;
+
+  if (status == SANE_STATUS_GOOD && same_contents (fp, path))
+    {
+      DBG (4, "sanei_config_write_file: `%s' is unchanged\n", path);
+      fclose (fp);
+      unlink (tmp_path);
+      free (tmp_path);
+      return SANE_STATUS_GOOD;
+    }
+
+  if (fclose (fp) != 0 && status == SANE_STATUS_GOOD)
+    status = SANE_STATUS_IO_ERROR;
+  if (status == SANE_STATUS_GOOD && rename (tmp_path, path) != 0)
+    status = SANE_STATUS_IO_ERROR;
+
+  if (status != SANE_STATUS_GOOD)
+    {
+      if (status == SANE_STATUS_IO_ERROR)
+	DBG (2, "sanei_config_write_file: can't write `%s': %s\n", path,
+	     strerror (errno));
+      unlink (tmp_path);
+    }
+  else
+    DBG (4, "sanei_config_write_file: wrote `%s'\n", path);
+
+  free (tmp_path);
+  return status;
+}
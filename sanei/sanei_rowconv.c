@@ -0,0 +1,454 @@
+/* sane - Scanner Access Now Easy.
+
+   This file is part of the SANE package.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+   As a special exception, the authors of SANE give permission for
+   additional uses of the libraries contained in this release of SANE.
+
+   The exception is that, if you link a SANE library with other files
+   to produce an executable, this does not by itself cause the
+   resulting executable to be covered by the GNU General Public
+   License.  Your use of that executable is in no way restricted on
+   account of linking the SANE library code into it.
+
+   This exception does not, however, invalidate any other reasons why
+   the executable file might be covered by the GNU General Public
+   License.
+
+   If you submit changes to SANE to the maintainers to be included in
+   a subsequent release, you agree by submitting the changes that
+   those changes may be distributed with this exception intact.
+
+   If you write modifications of your own for SANE, it is your choice
+   whether to permit this exception to apply to your modifications.
+   If you do not wish that, delete this exception notice.
+
+   Sample format conversions on rows of image data.  The generic code
+   works a machine word at a time; on x86 SSE2 and AVX2 versions are
+   compiled in with target attributes and picked at run time, so the
+   library still runs on CPUs without them.
+*/
+
+#include "../include/sane/config.h"
+
+#include <string.h>
+
+#include "../include/sane/sanei_rowconv.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) \
+  && !defined(__EMX__)
+# define ROWCONV_X86 1
+# include <immintrin.h>
+#endif
+
+typedef struct
+{
+  const char *name;
+  void (*swap16) (uint8_t * row, size_t bytes);
+  void (*invert) (uint8_t * row, size_t bytes);
+  void (*expand) (const uint8_t * src, uint8_t * dst, size_t pixels);
+  void (*reduce) (const uint8_t * src, uint8_t * dst, size_t samples);
+  void (*strip) (const uint8_t * src, uint8_t * dst, size_t pixels);
+}
+Rowconv_Impl;
+
+/* Partial last byte of a lineart row, shared by all implementations. */
+static void
+expand_tail (const uint8_t * src, uint8_t * dst, size_t pixels)
+{
+  size_t i;
+
+  for (i = 0; i < pixels; i++)
+    dst[i] = (src[i / 8] & (0x80 >> (i % 8))) ? 0x00 : 0xff;
+}
+
+static void
+generic_swap16 (uint8_t * row, size_t bytes)
+{
+  size_t i = 0;
+  uint64_t w;
+
+  for (; i + 8 <= bytes; i += 8)
+    {
+      memcpy (&w, row + i, 8);
+      w = ((w & UINT64_C (0x00ff00ff00ff00ff)) << 8)
+	| ((w >> 8) & UINT64_C (0x00ff00ff00ff00ff));
+      memcpy (row + i, &w, 8);
+    }
+  for (; i + 2 <= bytes; i += 2)
+    {
+      uint8_t t = row[i];
+      row[i] = row[i + 1];
+      row[i + 1] = t;
+    }
+}
+
+static void
+generic_invert (uint8_t * row, size_t bytes)
+{
+  size_t i = 0;
+  uint64_t w;
+
+  for (; i + 8 <= bytes; i += 8)
+    {
+      memcpy (&w, row + i, 8);
+      w = ~w;
+      memcpy (row + i, &w, 8);
+    }
+  for (; i < bytes; i++)
+    row[i] = ~row[i];
+}
+
+/* Spread the bits of a byte over the bytes of a word, then turn every
+   zero byte into 0xff and every other one into 0x00. */
+static void
+generic_expand (const uint8_t * src, uint8_t * dst, size_t pixels)
+{
+#ifdef WORDS_BIGENDIAN
+  const uint64_t bits = UINT64_C (0x8040201008040201);
+#else
+  const uint64_t bits = UINT64_C (0x0102040810204080);
+#endif
+  const uint64_t low7 = UINT64_C (0x7f7f7f7f7f7f7f7f);
+  size_t i;
+  uint64_t w;
+
+  for (i = 0; i < pixels / 8; i++)
+    {
+      w = (src[i] * UINT64_C (0x0101010101010101)) & bits;
+      w = ~(((w & low7) + low7) | w) & ~low7;
+      w = (w >> 7) * 0xff;
+      memcpy (dst + 8 * i, &w, 8);
+    }
+  expand_tail (src + i, dst + 8 * i, pixels % 8);
+}
+
+static void
+generic_reduce (const uint8_t * src, uint8_t * dst, size_t samples)
+{
+  size_t i;
+
+#ifdef WORDS_BIGENDIAN
+  for (i = 0; i < samples; i++)
+    dst[i] = src[2 * i];
+#else
+  for (i = 0; i < samples; i++)
+    dst[i] = src[2 * i + 1];
+#endif
+}
+
+static void
+generic_strip (const uint8_t * src, uint8_t * dst, size_t pixels)
+{
+  size_t i;
+
+  for (i = 0; i < pixels; i++)
+    {
+      dst[3 * i] = src[4 * i];
+      dst[3 * i + 1] = src[4 * i + 1];
+      dst[3 * i + 2] = src[4 * i + 2];
+    }
+}
+
+static const Rowconv_Impl generic_impl = {
+  "generic", generic_swap16, generic_invert, generic_expand, generic_reduce,
+  generic_strip
+};
+
+#ifdef ROWCONV_X86
+
+/* x86 is little endian, so the high byte of a sample is the second one */
+
+__attribute__ ((target ("sse2")))
+static void
+sse2_swap16 (uint8_t * row, size_t bytes)
+{
+  size_t i = 0;
+
+  for (; i + 16 <= bytes; i += 16)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) (row + i));
+      v = _mm_or_si128 (_mm_slli_epi16 (v, 8), _mm_srli_epi16 (v, 8));
+      _mm_storeu_si128 ((__m128i *) (row + i), v);
+    }
+  generic_swap16 (row + i, bytes - i);
+}
+
+__attribute__ ((target ("sse2")))
+static void
+sse2_invert (uint8_t * row, size_t bytes)
+{
+  const __m128i ones = _mm_set1_epi8 (-1);
+  size_t i = 0;
+
+  for (; i + 16 <= bytes; i += 16)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) (row + i));
+      _mm_storeu_si128 ((__m128i *) (row + i), _mm_xor_si128 (v, ones));
+    }
+  generic_invert (row + i, bytes - i);
+}
+
+__attribute__ ((target ("sse2")))
+static void
+sse2_expand (const uint8_t * src, uint8_t * dst, size_t pixels)
+{
+  const __m128i bits = _mm_setr_epi8 (-128, 64, 32, 16, 8, 4, 2, 1,
+				      -128, 64, 32, 16, 8, 4, 2, 1);
+  const __m128i zero = _mm_setzero_si128 ();
+  size_t i = 0;
+
+  /* two lineart bytes give sixteen pixels */
+  for (; i + 2 <= pixels / 8; i += 2)
+    {
+      __m128i v = _mm_cvtsi32_si128 (src[i] | (src[i + 1] << 8));
+      v = _mm_unpacklo_epi8 (v, v);
+      v = _mm_unpacklo_epi16 (v, v);
+      v = _mm_unpacklo_epi32 (v, v);
+      v = _mm_cmpeq_epi8 (_mm_and_si128 (v, bits), zero);
+      _mm_storeu_si128 ((__m128i *) (dst + 8 * i), v);
+    }
+  generic_expand (src + i, dst + 8 * i, pixels - 8 * i);
+}
+
+__attribute__ ((target ("sse2")))
+static void
+sse2_reduce (const uint8_t * src, uint8_t * dst, size_t samples)
+{
+  size_t i = 0;
+
+  for (; i + 16 <= samples; i += 16)
+    {
+      __m128i a = _mm_loadu_si128 ((const __m128i *) (src + 2 * i));
+      __m128i b = _mm_loadu_si128 ((const __m128i *) (src + 2 * i + 16));
+      a = _mm_srli_epi16 (a, 8);
+      b = _mm_srli_epi16 (b, 8);
+      _mm_storeu_si128 ((__m128i *) (dst + i), _mm_packus_epi16 (a, b));
+    }
+  generic_reduce (src + 2 * i, dst + i, samples - i);
+}
+
+/* SSE2 has no byte shuffle: drop the alpha byte of the pixel pair in
+   each 64 bit half, then store the two 6 byte results one after the
+   other.  Each store writes 2 bytes too many, which the next one
+   overwrites, so stop while there is room left for them. */
+__attribute__ ((target ("sse2")))
+static void
+sse2_strip (const uint8_t * src, uint8_t * dst, size_t pixels)
+{
+  const __m128i lo = _mm_set1_epi64x (0x0000000000ffffffLL);
+  const __m128i hi = _mm_set1_epi64x (0x0000ffffff000000LL);
+  size_t i = 0;
+
+  for (; i + 5 <= pixels; i += 4)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) (src + 4 * i));
+      v = _mm_or_si128 (_mm_and_si128 (v, lo),
+			_mm_and_si128 (_mm_srli_epi64 (v, 8), hi));
+      _mm_storel_epi64 ((__m128i *) (dst + 3 * i), v);
+      _mm_storel_epi64 ((__m128i *) (dst + 3 * i + 6),
+			_mm_unpackhi_epi64 (v, v));
+    }
+  generic_strip (src + 4 * i, dst + 3 * i, pixels - i);
+}
+
+static const Rowconv_Impl sse2_impl = {
+  "sse2", sse2_swap16, sse2_invert, sse2_expand, sse2_reduce, sse2_strip
+};
+
+__attribute__ ((target ("avx2")))
+static void
+avx2_swap16 (uint8_t * row, size_t bytes)
+{
+  size_t i = 0;
+
+  for (; i + 32 <= bytes; i += 32)
+    {
+      __m256i v = _mm256_loadu_si256 ((const __m256i *) (row + i));
+      v = _mm256_or_si256 (_mm256_slli_epi16 (v, 8),
+			   _mm256_srli_epi16 (v, 8));
+      _mm256_storeu_si256 ((__m256i *) (row + i), v);
+    }
+  sse2_swap16 (row + i, bytes - i);
+}
+
+__attribute__ ((target ("avx2")))
+static void
+avx2_invert (uint8_t * row, size_t bytes)
+{
+  const __m256i ones = _mm256_set1_epi8 (-1);
+  size_t i = 0;
+
+  for (; i + 32 <= bytes; i += 32)
+    {
+      __m256i v = _mm256_loadu_si256 ((const __m256i *) (row + i));
+      _mm256_storeu_si256 ((__m256i *) (row + i),
+			   _mm256_xor_si256 (v, ones));
+    }
+  sse2_invert (row + i, bytes - i);
+}
+
+__attribute__ ((target ("avx2")))
+static void
+avx2_expand (const uint8_t * src, uint8_t * dst, size_t pixels)
+{
+  const __m256i bits = _mm256_setr_epi8 (-128, 64, 32, 16, 8, 4, 2, 1,
+					 -128, 64, 32, 16, 8, 4, 2, 1,
+					 -128, 64, 32, 16, 8, 4, 2, 1,
+					 -128, 64, 32, 16, 8, 4, 2, 1);
+  /* replicate each of the four source bytes eight times */
+  const __m256i spread = _mm256_setr_epi8 (0, 0, 0, 0, 0, 0, 0, 0,
+					   1, 1, 1, 1, 1, 1, 1, 1,
+					   2, 2, 2, 2, 2, 2, 2, 2,
+					   3, 3, 3, 3, 3, 3, 3, 3);
+  const __m256i zero = _mm256_setzero_si256 ();
+  size_t i = 0;
+
+  for (; i + 4 <= pixels / 8; i += 4)
+    {
+      uint32_t w;
+      __m256i v;
+
+      memcpy (&w, src + i, 4);
+      /* the byte shuffle works within 128 bit lanes, so put the word
+         into both of them */
+      v = _mm256_set1_epi32 ((int) w);
+      v = _mm256_shuffle_epi8 (v, spread);
+      v = _mm256_cmpeq_epi8 (_mm256_and_si256 (v, bits), zero);
+      _mm256_storeu_si256 ((__m256i *) (dst + 8 * i), v);
+    }
+  sse2_expand (src + i, dst + 8 * i, pixels - 8 * i);
+}
+
+__attribute__ ((target ("avx2")))
+static void
+avx2_reduce (const uint8_t * src, uint8_t * dst, size_t samples)
+{
+  size_t i = 0;
+
+  for (; i + 32 <= samples; i += 32)
+    {
+      __m256i a = _mm256_loadu_si256 ((const __m256i *) (src + 2 * i));
+      __m256i b = _mm256_loadu_si256 ((const __m256i *) (src + 2 * i + 32));
+      a = _mm256_srli_epi16 (a, 8);
+      b = _mm256_srli_epi16 (b, 8);
+      /* packing interleaves the 128 bit lanes, put them back in order */
+      a = _mm256_permute4x64_epi64 (_mm256_packus_epi16 (a, b), 0xd8);
+      _mm256_storeu_si256 ((__m256i *) (dst + i), a);
+    }
+  sse2_reduce (src + 2 * i, dst + i, samples - i);
+}
+
+__attribute__ ((target ("avx2")))
+static void
+avx2_strip (const uint8_t * src, uint8_t * dst, size_t pixels)
+{
+  /* the 12 colour bytes of each 128 bit lane to its front ... */
+  const __m256i pack = _mm256_setr_epi8 (0, 1, 2, 4, 5, 6, 8, 9,
+					 10, 12, 13, 14, -1, -1, -1, -1,
+					 0, 1, 2, 4, 5, 6, 8, 9,
+					 10, 12, 13, 14, -1, -1, -1, -1);
+  /* ... and the two lanes next to each other */
+  const __m256i join = _mm256_setr_epi32 (0, 1, 2, 4, 5, 6, 3, 7);
+  size_t i = 0;
+
+  for (; i + 8 <= pixels; i += 8)
+    {
+      __m256i v = _mm256_loadu_si256 ((const __m256i *) (src + 4 * i));
+      v = _mm256_permutevar8x32_epi32 (_mm256_shuffle_epi8 (v, pack), join);
+      _mm_storeu_si128 ((__m128i *) (dst + 3 * i),
+			_mm256_castsi256_si128 (v));
+      _mm_storel_epi64 ((__m128i *) (dst + 3 * i + 16),
+			_mm256_extracti128_si256 (v, 1));
+    }
+  sse2_strip (src + 4 * i, dst + 3 * i, pixels - i);
+}
+
+static const Rowconv_Impl avx2_impl = {
+  "avx2", avx2_swap16, avx2_invert, avx2_expand, avx2_reduce, avx2_strip
+};
+
+#endif /* ROWCONV_X86 */
+
+static const Rowconv_Impl *impl = NULL;
+
+int
+sanei_rowconv_select (const char *name)
+{
+  const Rowconv_Impl *best = &generic_impl;
+
+#ifdef ROWCONV_X86
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("sse2")
+      && (!name || strcmp (name, sse2_impl.name) == 0))
+    best = &sse2_impl;
+  if (__builtin_cpu_supports ("avx2")
+      && (!name || strcmp (name, avx2_impl.name) == 0))
+    best = &avx2_impl;
+#endif
+
+  if (name && strcmp (name, best->name) != 0)
+    return 0;
+
+  impl = best;
+  return 1;
+}
+
+static const Rowconv_Impl *
+get_impl (void)
+{
+  /* Selecting twice from different threads picks the same table, so
+     there is no need for locking here. */
+  if (!impl)
+    sanei_rowconv_select (NULL);
+  return impl;
+}
+
+const char *
+sanei_rowconv_impl (void)
+{
+  return get_impl ()->name;
+}
+
+void
+sanei_rowconv_swap16 (uint8_t * row, size_t bytes)
+{
+  get_impl ()->swap16 (row, bytes);
+}
+
+void
+sanei_rowconv_invert (uint8_t * row, size_t bytes)
+{
+  get_impl ()->invert (row, bytes);
+}
+
+void
+sanei_rowconv_1to8 (const uint8_t * src, uint8_t * dst, size_t pixels)
+{
+  get_impl ()->expand (src, dst, pixels);
+}
+
+void
+sanei_rowconv_16to8 (const uint8_t * src, uint8_t * dst, size_t samples)
+{
+  get_impl ()->reduce (src, dst, samples);
+}
+
+void
+sanei_rowconv_rgba_to_rgb (const uint8_t * src, uint8_t * dst, size_t pixels)
+{
+  get_impl ()->strip (src, dst, pixels);
+}
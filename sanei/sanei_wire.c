@@ -153,11 +153,31 @@ sanei_w_void (Wire * w, void __sane_unused__ * v)
   DBG (3, "sanei_w_void: wire %d (void debug output)\n", w->io.fd);
 }
 
+/* Return the codec's bulk transfer function if W_ELEMENT is one of the
+   plain byte or word element functions, or NULL otherwise.  */
+static WireArrayFunc
+bulk_array_func (Wire * w, WireCodecFunc w_element, size_t element_size)
+{
+  if (element_size == sizeof (SANE_Byte)
+      && (w_element == w->codec.w_byte || w_element == w->codec.w_char
+	  || w_element == (WireCodecFunc) sanei_w_byte
+	  || w_element == (WireCodecFunc) sanei_w_char))
+    return w->codec.w_byte_array;
+
+  if (element_size == sizeof (SANE_Word)
+      && (w_element == w->codec.w_word
+	  || w_element == (WireCodecFunc) sanei_w_word))
+    return w->codec.w_word_array;
+
+  return 0;
+}
+
 void
 sanei_w_array (Wire * w, SANE_Word * len_ptr, void **v,
 	       WireCodecFunc w_element, size_t element_size)
 {
   SANE_Word len;
+  WireArrayFunc w_bulk;
   char *val;
   int i;
 
@@ -170,11 +190,15 @@ sanei_w_array (Wire * w, SANE_Word * len_ptr, void **v,
 	{
 	  DBG (4, "sanei_w_array: FREE: freeing array (%d elements)\n",
 	       *len_ptr);
-	  val = *v;
-	  for (i = 0; i < *len_ptr; ++i)
+	  /* plain bytes and words own no memory, so skip the walk */
+	  if (!bulk_array_func (w, w_element, element_size))
 	    {
-	      (*w_element) (w, val);
-	      val += element_size;
+	      val = *v;
+	      for (i = 0; i < *len_ptr; ++i)
+		{
+		  (*w_element) (w, val);
+		  val += element_size;
+		}
 	    }
 	  free (*v);
 	  w->allocated_memory -= (*len_ptr * element_size);
@@ -231,6 +255,18 @@ sanei_w_array (Wire * w, SANE_Word * len_ptr, void **v,
     }
 
   val = *v;
+  w_bulk = bulk_array_func (w, w_element, element_size);
+  if (w_bulk && len > 0)
+    {
+      DBG (4, "sanei_w_array: transferring %d array elements in bulk\n", len);
+      (*w_bulk) (w, val, len);
+      if (w->status)
+	DBG (1, "sanei_w_array: bad status: %d\n", w->status);
+      else
+	DBG (4, "sanei_w_array: done\n");
+      return;
+    }
+
   DBG (4, "sanei_w_array: transferring array elements\n");
   for (i = 0; i < len; ++i)
     {
@@ -670,6 +706,8 @@ sanei_w_init (Wire * w, void (*codec_init_func) (Wire *))
 
   w->buffer.curr = w->buffer.start;
   w->buffer.end = w->buffer.start + w->buffer.size;
+  w->codec.w_byte_array = 0;
+  w->codec.w_word_array = 0;
   if (codec_init_func != 0)
     {
       DBG (4, "sanei_w_init: initializing codec\n");
@@ -0,0 +1,443 @@
+#include "../../../include/sane/config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "bjnp_emulator.h"
+
+/*
+ * The wire format is defined here again rather than taken from
+ * pixma_bjnp_private.h, so a layout mistake in the backend does not
+ * go unnoticed because the emulator shares it.
+ */
+
+struct __attribute__ ((__packed__)) emu_header
+{
+  char id[4];			/* BJNP or MFNP */
+  uint8_t dev_type;		/* 2 = scanner, responses have the MSB set */
+  uint8_t cmd_code;
+  uint16_t unknown;
+  uint16_t seq_no;
+  uint16_t session_id;
+  uint32_t payload_len;
+};
+
+#define EMU_RES_SCAN 0x82
+
+#define EMU_UDP_DISCOVER 0x01
+#define EMU_UDP_JOB_DETAILS 0x10
+#define EMU_UDP_CLOSE 0x11
+#define EMU_UDP_GET_ID 0x30
+#define EMU_UDP_POLL 0x32
+#define EMU_TCP_REQ 0x20
+#define EMU_TCP_SEND 0x21
+
+#define EMU_SESSION_ID 0x4711
+#define EMU_DIALOG 0x12345678
+#define EMU_PACKET_MAX 65536
+#define EMU_QUEUE_MAX 64
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+bjnp_emu_config_t bjnp_emu = {
+  NULL, 300, 65536, BJNP_EMU_LATE_IGNORE, 0, 0, 0, 0, 200000
+};
+bjnp_emu_stats_t bjnp_emu_stats;
+
+static int emu_udp = -1;
+static int emu_tcp = -1;
+static unsigned int emu_seed = 1;
+
+static pthread_mutex_t emu_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t emu_cond = PTHREAD_COND_INITIALIZER;
+
+/* button status for the next poll */
+static SANE_Byte emu_status[20];
+static int emu_status_pending;
+static uint32_t emu_status_key;
+
+static long
+usec_since (const struct timeval *t)
+{
+  struct timeval now;
+
+  gettimeofday (&now, NULL);
+  return (now.tv_sec - t->tv_sec) * 1000000L + now.tv_usec - t->tv_usec;
+}
+
+static int
+emu_chance (unsigned percent)
+{
+  return percent > 0 && (unsigned) (rand_r (&emu_seed) % 100) < percent;
+}
+
+size_t
+bjnp_emu_line_size (void)
+{
+  unsigned dpi = bjnp_emu.dpi;
+
+  if (bjnp_emu.cfg && bjnp_emu.cfg->xdpi > 0 && dpi > bjnp_emu.cfg->xdpi)
+    dpi = bjnp_emu.cfg->xdpi;
+  return (size_t) (bjnp_emu.cfg ? bjnp_emu.cfg->width : 638) * dpi / 75 * 3;
+}
+
+SANE_Byte
+bjnp_emu_image_byte (size_t pos)
+{
+  size_t line = bjnp_emu_line_size ();
+  size_t y = pos / line;
+  size_t x = pos % line / 3;
+
+  switch (pos % line % 3)
+    {
+    case 0:
+      return (SANE_Byte) (x * 256 / (line / 3));
+    case 1:
+      return (SANE_Byte) y;
+    default:
+      return (SANE_Byte) (x ^ y);
+    }
+}
+
+void
+bjnp_emu_press_button (const SANE_Byte * status, int len)
+{
+  pthread_mutex_lock (&emu_lock);
+  memset (emu_status, 0, sizeof (emu_status));
+  memcpy (emu_status, status, MIN (len, (int) sizeof (emu_status)));
+  emu_status_pending = 1;
+  pthread_mutex_unlock (&emu_lock);
+}
+
+static int
+read_full (int fd, void *buf, size_t len)
+{
+  ssize_t n;
+  size_t done = 0;
+
+  while (done < len)
+    {
+      n = recv (fd, (char *) buf + done, len - done, 0);
+      if (n <= 0)
+	return -1;
+      done += n;
+    }
+  return 0;
+}
+
+static void
+set_response (struct emu_header *resp, const struct emu_header *req,
+	      uint32_t len)
+{
+  *resp = *req;
+  resp->dev_type = EMU_RES_SCAN;
+  resp->session_id = req->cmd_code == EMU_UDP_POLL ? 0 : htons (EMU_SESSION_ID);
+  resp->payload_len = htonl (len);
+}
+
+/*******/
+/* UDP */
+/*******/
+
+static int
+udp_payload (const struct emu_header *req, const SANE_Byte * data, int len,
+	     SANE_Byte * out)
+{
+  static const SANE_Byte mac[6] = { 0x00, 0x1e, 0x8f, 0x12, 0x34, 0x56 };
+  char id[256];
+  uint16_t type;
+  uint32_t val;
+  int n;
+
+  switch (req->cmd_code)
+    {
+    case EMU_UDP_DISCOVER:
+      memcpy (out, "\x00\x01\x08\x00", 4);
+      out[4] = 6;		/* mac length */
+      out[5] = 4;		/* address length */
+      memcpy (out + 6, mac, 6);
+      memcpy (out + 12, "\x7f\x00\x00\x01", 4);
+      return 16;
+
+    case EMU_UDP_GET_ID:
+      n = snprintf (id, sizeof (id),
+		    "MFG:Canon;CMD:MultiPass 2.1,IVEC;MDL:%s series;CLS:IMAGE;DES:%s;",
+		    bjnp_emu.cfg ? bjnp_emu.cfg->model : "Unknown",
+		    bjnp_emu.cfg ? bjnp_emu.cfg->name : "Unknown");
+      if (memcmp (req->id, "MFNP", 4) == 0)
+	{
+	  memcpy (out, id, n);
+	  return n;
+	}
+      out[0] = (n + 2) >> 8;
+      out[1] = (n + 2) & 0xff;
+      memcpy (out + 2, id, n);
+      return n + 2;
+
+    case EMU_UDP_JOB_DETAILS:
+      bjnp_emu_stats.job_details++;
+      return 0;
+
+    case EMU_UDP_POLL:
+      /* result[4], dialog, unknown, key, status[20] */
+      bjnp_emu_stats.polls++;
+      memset (out, 0, 36);
+      type = len >= 2 ? (data[0] << 8 | data[1]) : 0;
+      val = htonl (EMU_DIALOG);
+      memcpy (out + 4, &val, 4);
+      val = htonl (0x14);
+      memcpy (out + 8, &val, 4);
+      pthread_mutex_lock (&emu_lock);
+      if (type == 2 && emu_status_pending)
+	{
+	  out[2] = 0x80;
+	  val = htonl (++emu_status_key);
+	  memcpy (out + 12, &val, 4);
+	  memcpy (out + 16, emu_status, sizeof (emu_status));
+	}
+      else if (type == 5)
+	emu_status_pending = 0;
+      pthread_mutex_unlock (&emu_lock);
+      return 36;
+
+    default:
+      return 0;
+    }
+}
+
+static void *
+emu_udp_thread (void *arg)
+{
+  SANE_Byte buf[2048];
+  SANE_Byte resp[2048];
+  struct emu_header *req = (struct emu_header *) buf;
+  struct sockaddr_in from;
+  socklen_t from_len;
+  ssize_t n;
+  int len;
+
+  (void) arg;
+  for (;;)
+    {
+      from_len = sizeof (from);
+      n = recvfrom (emu_udp, buf, sizeof (buf), 0,
+		    (struct sockaddr *) &from, &from_len);
+      if (n < (ssize_t) sizeof (*req))
+	continue;
+      bjnp_emu_stats.udp_requests++;
+      if (emu_chance (bjnp_emu.udp_loss))
+	{
+	  bjnp_emu_stats.udp_lost++;
+	  continue;
+	}
+      if (bjnp_emu.latency_us > 0)
+	usleep (bjnp_emu.latency_us);
+      len = udp_payload (req, buf + sizeof (*req), n - sizeof (*req),
+			 resp + sizeof (*req));
+      set_response ((struct emu_header *) resp, req, len);
+      sendto (emu_udp, resp, sizeof (*req) + len, 0,
+	      (struct sockaddr *) &from, from_len);
+    }
+  return NULL;
+}
+
+/*******/
+/* TCP */
+/*******/
+
+/* requests of one TCP connection, timestamped when they arrive */
+
+typedef struct
+{
+  struct emu_header cmd;
+  uint32_t count;		/* from the payload of a send command */
+  uint32_t len;			/* length of that payload */
+  struct timeval arrival;
+} emu_request_t;
+
+static emu_request_t emu_queue[EMU_QUEUE_MAX];
+static int emu_queue_len;
+static int emu_queue_eof;
+
+static void *
+emu_reader_thread (void *arg)
+{
+  static SANE_Byte payload[EMU_PACKET_MAX];
+  int fd = *(int *) arg;
+  emu_request_t req;
+
+  for (;;)
+    {
+      memset (&req, 0, sizeof (req));
+      if (read_full (fd, &req.cmd, sizeof (req.cmd)) != 0)
+	break;
+      req.len = ntohl (req.cmd.payload_len);
+      assert (req.len <= sizeof (payload));
+      if (read_full (fd, payload, req.len) != 0)
+	break;
+      if (req.len >= 4)
+	req.count = (uint32_t) payload[0] << 24 | payload[1] << 16 |
+	  payload[2] << 8 | payload[3];
+      gettimeofday (&req.arrival, NULL);
+      pthread_mutex_lock (&emu_lock);
+      assert (emu_queue_len < EMU_QUEUE_MAX);
+      emu_queue[emu_queue_len++] = req;
+      pthread_cond_signal (&emu_cond);
+      pthread_mutex_unlock (&emu_lock);
+    }
+  pthread_mutex_lock (&emu_lock);
+  emu_queue_eof = 1;
+  pthread_cond_signal (&emu_cond);
+  pthread_mutex_unlock (&emu_lock);
+  return NULL;
+}
+
+static void
+emu_send (int fd, const struct emu_header *req, const void *payload,
+	  uint32_t len)
+{
+  static SANE_Byte buf[sizeof (struct emu_header) + EMU_PACKET_MAX];
+
+  set_response ((struct emu_header *) buf, req, len);
+  if (len > 0)
+    memcpy (buf + sizeof (struct emu_header), payload, len);
+  assert (send (fd, buf, sizeof (struct emu_header) + len, 0) ==
+	  (ssize_t) (sizeof (struct emu_header) + len));
+}
+
+static void
+emu_serve_block (int fd, const emu_request_t * req, size_t * pos,
+		 size_t * left)
+{
+  static SANE_Byte block[EMU_PACKET_MAX];
+  size_t len = MIN (*left, MIN (bjnp_emu.blocksize, sizeof (block)));
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    block[i] = bjnp_emu_image_byte (*pos + i);
+
+  /* the block is complete at the other end after it went over the link */
+  if (bjnp_emu.rate > 0)
+    usleep (len * 1000000L / bjnp_emu.rate);
+  if (emu_chance (bjnp_emu.tcp_loss))
+    {
+      bjnp_emu_stats.retransmits++;
+      usleep (bjnp_emu.rto_us);
+    }
+  emu_send (fd, &req->cmd, block, len);
+  *pos += len;
+  *left -= len;
+}
+
+static void
+emu_serve_connection (int fd)
+{
+  pthread_t reader;
+  emu_request_t req;
+  emu_request_t deferred[EMU_QUEUE_MAX];
+  int n_deferred = 0;
+  size_t pos = 0, left = 0;
+  uint32_t confirm;
+  long wait;
+  int i;
+
+  bjnp_emu_stats.connections++;
+  emu_queue_len = 0;
+  emu_queue_eof = 0;
+  assert (pthread_create (&reader, NULL, emu_reader_thread, &fd) == 0);
+
+  for (;;)
+    {
+      pthread_mutex_lock (&emu_lock);
+      while (emu_queue_len == 0 && !emu_queue_eof)
+	pthread_cond_wait (&emu_cond, &emu_lock);
+      if (emu_queue_len == 0)
+	{
+	  pthread_mutex_unlock (&emu_lock);
+	  break;
+	}
+      req = emu_queue[0];
+      memmove (emu_queue, emu_queue + 1, --emu_queue_len * sizeof (req));
+      pthread_mutex_unlock (&emu_lock);
+
+      wait = bjnp_emu.latency_us - usec_since (&req.arrival);
+      if (wait > 0)
+	usleep (wait);
+
+      if (req.cmd.cmd_code == EMU_TCP_SEND)
+	{
+	  /* confirm the nr of bytes received, then prepare the data */
+	  confirm = htonl (req.len);
+	  emu_send (fd, &req.cmd, &confirm, 4);
+	  left = req.count;
+	  for (i = 0; i < n_deferred; i++)
+	    emu_serve_block (fd, &deferred[i], &pos, &left);
+	  n_deferred = 0;
+	}
+      else if (req.cmd.cmd_code == EMU_TCP_REQ)
+	{
+	  bjnp_emu_stats.read_requests++;
+	  if (left > 0)
+	    emu_serve_block (fd, &req, &pos, &left);
+	  else if (bjnp_emu.late == BJNP_EMU_LATE_EMPTY)
+	    emu_send (fd, &req.cmd, NULL, 0);
+	  else if (bjnp_emu.late == BJNP_EMU_LATE_DEFER)
+	    deferred[n_deferred++] = req;
+	}
+    }
+  pthread_join (reader, NULL);
+  close (fd);
+}
+
+static void *
+emu_tcp_thread (void *arg)
+{
+  int fd;
+
+  (void) arg;
+  while ((fd = accept (emu_tcp, NULL, NULL)) >= 0)
+    emu_serve_connection (fd);
+  return NULL;
+}
+
+int
+bjnp_emu_start (void)
+{
+  struct sockaddr_in sa;
+  socklen_t len = sizeof (sa);
+  pthread_t thread;
+  int val = 1;
+
+  memset (&sa, 0, sizeof (sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+  /* the scanner uses the same port number for UDP and TCP */
+
+  emu_udp = socket (AF_INET, SOCK_DGRAM, 0);
+  assert (bind (emu_udp, (struct sockaddr *) &sa, sizeof (sa)) == 0);
+  assert (getsockname (emu_udp, (struct sockaddr *) &sa, &len) == 0);
+
+  emu_tcp = socket (AF_INET, SOCK_STREAM, 0);
+  setsockopt (emu_tcp, SOL_SOCKET, SO_REUSEADDR, &val, sizeof (val));
+  assert (bind (emu_tcp, (struct sockaddr *) &sa, sizeof (sa)) == 0);
+  assert (listen (emu_tcp, 1) == 0);
+
+  assert (pthread_create (&thread, NULL, emu_udp_thread, NULL) == 0);
+  pthread_detach (thread);
+  assert (pthread_create (&thread, NULL, emu_tcp_thread, NULL) == 0);
+  pthread_detach (thread);
+
+  return ntohs (sa.sin_port);
+}
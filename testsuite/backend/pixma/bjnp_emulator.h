@@ -0,0 +1,71 @@
+#ifndef BJNP_EMULATOR_H
+#define BJNP_EMULATOR_H
+
+/*
+ * A BJNP/MFNP scanner emulator on 127.0.0.1, to test and benchmark the
+ * network code of the pixma backend without Canon hardware.
+ *
+ * UDP: answers discover, get id (MDL: is the model of the configured
+ * pixma_config_t), job details, close and button polls.
+ * TCP: a command written to the scanner whose first 4 bytes hold a big
+ * endian count N makes it return the next N bytes of a synthetic RGB image,
+ * as wide as the configured model at bjnp_emu.dpi, one block of at most
+ * bjnp_emu.blocksize bytes per read request. The image restarts on each
+ * new TCP connection.
+ *
+ * The settings in bjnp_emu may be changed between tests, the counters in
+ * bjnp_emu_stats show what happened.
+ */
+
+#include "../../../include/sane/config.h"
+#include "../../../include/sane/sane.h"
+#include "../../../backend/pixma/pixma.h"
+
+/* what to do with read requests when there is no data left */
+typedef enum
+{
+  BJNP_EMU_LATE_IGNORE,		/* never answer them, like most scanners */
+  BJNP_EMU_LATE_EMPTY,		/* answer them with an empty block */
+  BJNP_EMU_LATE_DEFER		/* answer them when the next data is there */
+} bjnp_emu_late_t;
+
+typedef struct
+{
+  const pixma_config_t *cfg;	/* the scanner model to present */
+  unsigned dpi;			/* resolution of the synthetic image */
+  size_t blocksize;		/* max payload of a read response */
+  bjnp_emu_late_t late;
+  long latency_us;		/* time to handle each request */
+  long rate;			/* link rate in bytes/s, 0 is unlimited */
+  unsigned udp_loss;		/* % of UDP requests lost */
+  unsigned tcp_loss;		/* % of TCP blocks that need a retransmit */
+  long rto_us;			/* delay of a retransmitted block */
+} bjnp_emu_config_t;
+
+typedef struct
+{
+  unsigned udp_requests;
+  unsigned udp_lost;
+  unsigned job_details;
+  unsigned polls;
+  unsigned connections;
+  unsigned read_requests;
+  unsigned retransmits;
+} bjnp_emu_stats_t;
+
+extern bjnp_emu_config_t bjnp_emu;
+extern bjnp_emu_stats_t bjnp_emu_stats;
+
+/* start the emulator, returns its port (the same for UDP and TCP) */
+extern int bjnp_emu_start (void);
+
+/* the emulated scanner reports this status on the next button poll */
+extern void bjnp_emu_press_button (const SANE_Byte * status, int len);
+
+/* byte pos of the synthetic image */
+extern SANE_Byte bjnp_emu_image_byte (size_t pos);
+
+/* bytes per line of the synthetic image */
+extern size_t bjnp_emu_line_size (void);
+
+#endif /* BJNP_EMULATOR_H */
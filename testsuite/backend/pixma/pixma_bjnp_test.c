@@ -0,0 +1,384 @@
+#include "../../../include/sane/config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/*
+ * Include pixma_bjnp.c, so the tests can use its device structures
+ * and tune the read ahead without an extra interface.
+ */
+#include "../../../backend/pixma/pixma_bjnp.c"
+
+#include "bjnp_emulator.h"
+
+/* a few models, names and sizes as in the subdrivers */
+static const pixma_config_t test_models[] = {
+  {"Canon PIXMA MP600", "MP600", 0x04a9, 0x1710, 0, NULL,
+   0, 0, 2400, 4800, 0, 0, 0, 0, 638, 877, 0},
+  {"Canon PIXMA MP600R", "MP600R", 0x04a9, 0x1711, 0, NULL,
+   0, 0, 2400, 4800, 0, 0, 0, 0, 638, 877, 0},
+  {"Canon PIXMA MG5300", "MG5300", 0x04a9, 0x1765, 0, NULL,
+   0, 0, 4800, 9600, 0, 0, 0, 0, 638, 877, 0},
+  {NULL, NULL, 0, 0, 0, NULL, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}
+};
+
+static const pixma_config_t *const test_devices[] = { test_models, NULL };
+
+/* read requests in flight to test, PIXMA_BJNP_READ_AHEAD is off by default */
+#define TEST_READ_AHEAD 4
+
+static int port;
+static SANE_Int dn;
+
+static long
+usec_since (const struct timeval *t)
+{
+  struct timeval now;
+
+  gettimeofday (&now, NULL);
+  return (now.tv_sec - t->tv_sec) * 1000000L + now.tv_usec - t->tv_usec;
+}
+
+static void
+open_device (int timeout)
+{
+  char uri[64];
+
+  snprintf (uri, sizeof (uri), "bjnp://127.0.0.1:%d/timeout=%d", port,
+	    timeout);
+  assert (sanei_bjnp_open (uri, &dn) == SANE_STATUS_GOOD);
+}
+
+/*
+ * One command/response exchange as the pixma sub drivers do it: write
+ * the command, then read the response in large chunks until EOF.
+ * pos is the position in the image of the emulator.
+ * Returns the nr of bytes read.
+ */
+static size_t
+transaction (size_t * pos, size_t count, size_t chunk)
+{
+  static SANE_Byte buf[512 * 1024];
+  SANE_Byte cmd[16];
+  size_t size, done = 0, i;
+  SANE_Status status;
+
+  memset (cmd, 0, sizeof (cmd));
+  cmd[0] = count >> 24;
+  cmd[1] = count >> 16;
+  cmd[2] = count >> 8;
+  cmd[3] = count;
+  size = sizeof (cmd);
+  assert (sanei_bjnp_write_bulk (dn, cmd, &size) == SANE_STATUS_GOOD);
+  for (;;)
+    {
+      size = chunk;
+      status = sanei_bjnp_read_bulk (dn, buf, &size);
+      if (status == SANE_STATUS_EOF)
+	break;
+      assert (status == SANE_STATUS_GOOD);
+      for (i = 0; i < size; i++)
+	assert (buf[i] == bjnp_emu_image_byte (*pos + i));
+      *pos += size;
+      done += size;
+      assert (done <= count);
+    }
+  assert (done == count);
+  return done;
+}
+
+/******************************/
+/* start of tests definitions */
+/******************************/
+
+static const pixma_config_t *attached_cfg;
+static char attached_uri[256];
+
+static SANE_Status
+attach (SANE_String_Const devname, SANE_String_Const serial,
+	const struct pixma_config_t *cfg)
+{
+  (void) serial;
+  strncpy (attached_uri, devname, sizeof (attached_uri) - 1);
+  attached_cfg = cfg;
+  return SANE_STATUS_GOOD;
+}
+
+/*
+ * a scanner from the configuration is identified by its IEEE 1284 id,
+ * MP600 and MP600R are different models
+ */
+static void
+discovery (void)
+{
+  char uri[64];
+  const char *conf[] = { "auto_detection=no", "bjnp-timeout=500", uri, NULL };
+  int i;
+
+  snprintf (uri, sizeof (uri), "bjnp://127.0.0.1:%d", port);
+  for (i = 0; test_models[i].name; i++)
+    {
+      bjnp_emu.cfg = &test_models[i];
+      attached_cfg = NULL;
+      assert (sanei_bjnp_find_devices (conf, attach, test_devices) ==
+	      SANE_STATUS_GOOD);
+      assert (attached_cfg == &test_models[i]);
+      assert (strstr (attached_uri, "timeout=500") != NULL);
+    }
+}
+
+static int
+file_contains (const char *path, const char *text)
+{
+  char buf[4096];
+  size_t len;
+  FILE *fp;
+
+  assert ((fp = fopen (path, "r")) != NULL);
+  len = fread (buf, 1, sizeof (buf) - 1, fp);
+  buf[len] = '\0';
+  fclose (fp);
+  return strstr (buf, text) != NULL;
+}
+
+/*
+ * a cached scanner is found by a unicast discover, without waiting for
+ * broadcast responses; scanners that do not answer, or answer with
+ * another mac address, are dropped from the cache
+ */
+static void
+cache (void)
+{
+  const char *conf[] = { "bjnp-timeout=500", NULL };
+  char path[] = "/tmp/pixma_bjnp_cacheXXXXXX";
+  char mac[BJNP_HOST_MAX];
+  struct timeval start;
+  long elapsed;
+  FILE *fp;
+  int fd;
+
+  /* the emulator was the only scanner of the last discovery */
+  strcpy (mac, device[0].mac_address);
+  assert ((fd = mkstemp (path)) != -1);
+  close (fd);
+  setenv ("PIXMA_BJNP_CACHE", path, 1);
+
+  assert ((fp = fopen (path, "w")) != NULL);
+  fprintf (fp, "device bjnp\t127.0.0.1\t%d\tlocalhost\t%s\tCanon MG5300 series\n",
+	   port, mac);
+  fclose (fp);
+
+  attached_cfg = NULL;
+  gettimeofday (&start, NULL);
+  assert (sanei_bjnp_find_devices (conf, attach, test_devices) ==
+	  SANE_STATUS_GOOD);
+  elapsed = usec_since (&start);
+  assert (attached_cfg == &test_models[2]);
+  assert (strstr (attached_uri, "bjnp://localhost:") != NULL);
+#ifdef BJNP_USE_THREADS
+  assert (elapsed < BJNP_BC_RESPONSE_TIMEOUT * 1000L);
+
+  /* the next discovery starts a new refresh once the last one finished */
+  gettimeofday (&start, NULL);
+  while (!refresh_finished && usec_since (&start) < 5000000L)
+    usleep (10000);
+  assert (refresh_finished);
+  assert (sanei_bjnp_find_devices (conf, attach, test_devices) ==
+	  SANE_STATUS_GOOD);
+  assert (refresh_started && !refresh_finished);
+#endif
+  sanei_bjnp_exit ();
+  assert (file_contains (path, mac));
+  printf ("cache: found in %.3f s\n", elapsed / 1e6);
+
+  assert ((fp = fopen (path, "w")) != NULL);
+  fprintf (fp, "device bjnp\t127.0.0.1\t%d\tlocalhost\t%s\tCanon MG5300 series\n",
+	   port, mac);
+  fprintf (fp, "device bjnp\t127.0.0.1\t%d\tlocalhost\t0000deadbeef\tCanon MP600 series\n",
+	   port);
+  fprintf (fp, "device mfnp\t127.0.0.1\t1\tlocalhost\t0000cafebabe\tCanon MP600R series\n");
+  fprintf (fp, "device bjnp\t127.0.0.1\tbroken line\n");
+  fclose (fp);
+
+  attached_cfg = NULL;
+  assert (sanei_bjnp_find_devices (conf, attach, test_devices) ==
+	  SANE_STATUS_GOOD);
+  sanei_bjnp_exit ();
+  assert (attached_cfg == &test_models[2]);
+  assert (file_contains (path, mac));
+  assert (!file_contains (path, "deadbeef"));
+  assert (!file_contains (path, "cafebabe"));
+
+  unlink (path);
+  unsetenv ("PIXMA_BJNP_CACHE");
+}
+
+/*
+ * data must arrive complete and in order with any number of reads in
+ * flight, also when read requests after the last block are left
+ * unanswered, answered empty or answered later with the next data
+ */
+static void
+integrity (void)
+{
+  static const size_t counts[] = { 100, 3 * 65536 + 5,
+    524288 - 512 + 16 - 8, 7 * 65536 + 1, 4096, 10 * 65536 - 1
+  };
+  static const size_t chunks[] = { 524288 - 512 + 16, 200000, 1000 };
+  int late, ra, c, k;
+  size_t pos;
+
+  for (late = BJNP_EMU_LATE_IGNORE; late <= BJNP_EMU_LATE_DEFER; late++)
+    for (ra = 1; ra <= TEST_READ_AHEAD; ra++)
+      for (c = 0; c < 3; c++)
+	{
+	  bjnp_emu.late = late;
+	  device[dn].read_ahead = ra;
+	  assert (sanei_bjnp_activate (dn) == SANE_STATUS_GOOD);
+	  pos = 0;
+	  for (k = 0; k < (int) (sizeof (counts) / sizeof (counts[0])); k++)
+	    transaction (&pos, counts[k], chunks[(k + c) % 3]);
+	  assert (sanei_bjnp_deactivate (dn) == SANE_STATUS_GOOD);
+	}
+  bjnp_emu.late = BJNP_EMU_LATE_IGNORE;
+  device[dn].read_ahead = BJNP_READ_AHEAD;
+}
+
+/* a button press is reported by the poll dialog of sanei_bjnp_read_int */
+static void
+button (void)
+{
+  static const SANE_Byte status[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 0x01 };
+  SANE_Byte buf[16];
+  size_t size;
+
+  bjnp_emu_press_button (status, sizeof (status));
+  size = sizeof (buf);
+  assert (sanei_bjnp_read_int (dn, buf, &size) == SANE_STATUS_GOOD);
+  assert (size == sizeof (buf));
+  assert (memcmp (buf, status, sizeof (status)) == 0);
+  assert (device[dn].dialog == 0x12345678);
+  assert (device[dn].status_key == 1);
+
+  /* the next call resets the status on the scanner */
+  size = sizeof (buf);
+  assert (sanei_bjnp_read_int (dn, buf, &size) == SANE_STATUS_EOF);
+  assert (device[dn].polling_status == BJNP_POLL_STATUS_RECEIVED);
+}
+
+/*
+ * UDP commands are retried after the timeout, which may be less than a
+ * second, TCP recovers lost blocks by itself
+ */
+static void
+loss (void)
+{
+  struct timeval start;
+  size_t pos;
+  int k;
+
+  bjnp_emu.udp_loss = 30;
+  bjnp_emu.tcp_loss = 10;
+  bjnp_emu.rto_us = 20000;
+  bjnp_emu.latency_us = 100000;
+  memset (&bjnp_emu_stats, 0, sizeof (bjnp_emu_stats));
+
+  /* the latency is below the timeout of the device, 300 ms */
+  gettimeofday (&start, NULL);
+  for (k = 0; k < 4; k++)
+    {
+      assert (sanei_bjnp_activate (dn) == SANE_STATUS_GOOD);
+      pos = 0;
+      transaction (&pos, 8 * 65536 + 17, 524288 - 512 + 16);
+      assert (sanei_bjnp_deactivate (dn) == SANE_STATUS_GOOD);
+    }
+  assert (bjnp_emu_stats.udp_lost > 0);
+  assert (bjnp_emu_stats.retransmits > 0);
+  assert (bjnp_emu_stats.connections == 4);
+  printf ("loss: %u of %u UDP requests lost, %u TCP retransmits, %.2f s\n",
+	  bjnp_emu_stats.udp_lost, bjnp_emu_stats.udp_requests,
+	  bjnp_emu_stats.retransmits, usec_since (&start) / 1e6);
+
+  bjnp_emu.udp_loss = 0;
+  bjnp_emu.tcp_loss = 0;
+  bjnp_emu.latency_us = 0;
+}
+
+/*
+ * the scanner sends blocks of 64k, so an image block of 512k needs 8 read
+ * requests, which each cost a round trip when only one is in flight
+ */
+static double
+throughput (int ra)
+{
+  struct timeval start;
+  size_t total = 0, pos = 0;
+  int k;
+
+  device[dn].read_ahead = ra;
+  assert (sanei_bjnp_activate (dn) == SANE_STATUS_GOOD);
+  gettimeofday (&start, NULL);
+  for (k = 0; k < 4; k++)
+    total += transaction (&pos, 524288 - 512 + 8, 524288 - 512 + 16);
+  assert (sanei_bjnp_deactivate (dn) == SANE_STATUS_GOOD);
+  device[dn].read_ahead = BJNP_READ_AHEAD;
+  return total / (usec_since (&start) / 1e6) / 1e6;
+}
+
+static void
+benchmark (void)
+{
+  static const long latencies[] = { 1000, 4000, 10000 };
+  int i;
+
+  /* a wireless link of 8 MB/s */
+  bjnp_emu.rate = 8000000;
+  for (i = 0; i < 3; i++)
+    {
+      bjnp_emu.latency_us = latencies[i];
+      printf ("latency %2ld ms: read ahead 1: %.2f MB/s, ", latencies[i] / 1000,
+	      throughput (1));
+      printf ("read ahead %d: %.2f MB/s\n", TEST_READ_AHEAD,
+	      throughput (TEST_READ_AHEAD));
+    }
+  bjnp_emu.rate = 0;
+  bjnp_emu.latency_us = 0;
+}
+
+static void
+pixma_bjnp_suite (void)
+{
+  sanei_bjnp_init ();
+  port = bjnp_emu_start ();
+
+  discovery ();
+  printf ("discovery: ok\n");
+
+  cache ();
+  printf ("cache: ok\n");
+
+  bjnp_emu.cfg = &test_models[2];
+  sanei_bjnp_init ();
+  open_device (300);
+
+  integrity ();
+  printf ("integrity: ok\n");
+
+  button ();
+  printf ("button: ok\n");
+
+  loss ();
+  benchmark ();
+}
+
+
+int
+main (void)
+{
+  pixma_bjnp_suite ();
+  return 0;
+}
+
+/* vim: set sw=2 cino=>2se-1sn-1s{s^-1st0(0u0 smarttab expandtab: */
@@ -0,0 +1,295 @@
+#include "../../../include/sane/config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/time.h>
+
+/*
+ * Include pixma.c, so the frontend side of the reader task can be tested
+ * against the fake scanner below instead of pixma_common.c.
+ */
+#include "../../../backend/pixma/pixma.c"
+
+#define FAKE_BLOCK 7777		/* bytes per pixma_read_image() */
+
+/* a scanner that returns a synthetic image of the requested size */
+static const pixma_config_t fake_cfg = {
+  "Canon PIXMA Fake", "FAKE", 0x04a9, 0xffff, 0, NULL,
+  75, 75, 600, 600, 0, 0, 0, 0, 638, 877, 0
+};
+
+struct pixma_t
+{
+  uint64_t pos;
+  uint64_t left;
+};
+
+static struct pixma_t fake;
+static long first_delay_us;	/* before the first block of a scan */
+
+static SANE_Byte
+fake_image_byte (uint64_t pos)
+{
+  return (SANE_Byte) ((pos * 2654435761u) >> 13);
+}
+
+int
+pixma_init (void)
+{
+  return 0;
+}
+
+void
+pixma_cleanup (void)
+{
+}
+
+void
+pixma_set_debug_level (int level)
+{
+  (void) level;
+}
+
+int
+pixma_find_scanners (const char **conf_devices, SANE_Bool local_only)
+{
+  (void) conf_devices;
+  (void) local_only;
+  return 1;
+}
+
+const char *
+pixma_get_device_model (unsigned devnr)
+{
+  (void) devnr;
+  return fake_cfg.name;
+}
+
+const char *
+pixma_get_device_id (unsigned devnr)
+{
+  (void) devnr;
+  return "fake:0";
+}
+
+const struct pixma_config_t *
+pixma_get_device_config (unsigned devnr)
+{
+  (void) devnr;
+  return &fake_cfg;
+}
+
+int
+pixma_open (unsigned devnr, pixma_t ** handle)
+{
+  (void) devnr;
+  *handle = &fake;
+  return 0;
+}
+
+void
+pixma_close (pixma_t * s)
+{
+  (void) s;
+}
+
+int
+pixma_check_scan_param (pixma_t * s, pixma_scan_param_t * sp)
+{
+  (void) s;
+  sp->line_size = (uint64_t) sp->w * sp->channels * (sp->depth / 8);
+  sp->image_size = sp->line_size * sp->h;
+  return 0;
+}
+
+int
+pixma_scan (pixma_t * s, pixma_scan_param_t * sp)
+{
+  s->pos = 0;
+  s->left = sp->image_size;
+  return 0;
+}
+
+int
+pixma_read_image (pixma_t * s, void *buf, unsigned len)
+{
+  SANE_Byte *b = buf;
+  unsigned i;
+
+  if (s->pos == 0 && first_delay_us)
+    usleep (first_delay_us);
+  if (len > s->left)
+    len = s->left;
+  if (len > FAKE_BLOCK)
+    len = FAKE_BLOCK;
+  for (i = 0; i < len; i++)
+    b[i] = fake_image_byte (s->pos + i);
+  s->pos += len;
+  s->left -= len;
+  return len;
+}
+
+void
+pixma_cancel (pixma_t * s)
+{
+  s->left = 0;
+}
+
+uint32_t
+pixma_wait_event (pixma_t * s, int timeout)
+{
+  (void) s;
+  (void) timeout;
+  return 0;
+}
+
+int
+pixma_activate_connection (pixma_t * s)
+{
+  (void) s;
+  return 0;
+}
+
+int
+pixma_deactivate_connection (pixma_t * s)
+{
+  (void) s;
+  return 0;
+}
+
+int
+pixma_enable_background (pixma_t * s, int enabled)
+{
+  (void) s;
+  (void) enabled;
+  return 0;
+}
+
+const char *
+pixma_get_string (pixma_t * s, pixma_string_index_t i)
+{
+  (void) s;
+  (void) i;
+  return "fake:0";
+}
+
+const pixma_config_t *
+pixma_get_config (pixma_t * s)
+{
+  (void) s;
+  return &fake_cfg;
+}
+
+void
+pixma_fill_gamma_table (double gamma, uint8_t * table, unsigned n)
+{
+  unsigned i;
+
+  (void) gamma;
+  for (i = 0; i < n; i++)
+    table[i] = i * 255 / (n - 1);
+}
+
+const char *
+pixma_strerror (int error)
+{
+  (void) error;
+  return "fake error";
+}
+
+/******************************/
+/* start of tests definitions */
+/******************************/
+
+static SANE_Handle h;
+
+static void
+check_data (const SANE_Byte * buf, SANE_Int len, uint64_t pos)
+{
+  SANE_Int i;
+
+  for (i = 0; i < len; i++)
+    assert (buf[i] == fake_image_byte (pos + i));
+}
+
+/*
+ * the select fd is readable as long as image data is left: a blocking
+ * read that had to wait for the reader task and only took part of the
+ * data, then small non-blocking reads, each after a select
+ */
+static void
+partial_read_select (void)
+{
+  SANE_Byte buf[1000];
+  SANE_Parameters par;
+  struct timeval timeout;
+  fd_set fds;
+  uint64_t pos = 0;
+  SANE_Status status;
+  SANE_Int len, fd;
+  int empty = 0;
+
+  first_delay_us = 100000;
+  assert (sane_start (h) == SANE_STATUS_GOOD);
+  assert (sane_get_parameters (h, &par) == SANE_STATUS_GOOD);
+
+  assert (sane_read (h, buf, 100, &len) == SANE_STATUS_GOOD);
+  assert (len == 100);
+  check_data (buf, len, pos);
+  pos += len;
+
+  assert (sane_set_io_mode (h, SANE_TRUE) == SANE_STATUS_GOOD);
+  assert (sane_get_select_fd (h, &fd) == SANE_STATUS_GOOD);
+  /* sane_read() closes the select fd after the last byte of the image */
+  while (pos < (uint64_t) par.bytes_per_line * par.lines)
+    {
+      FD_ZERO (&fds);
+      FD_SET (fd, &fds);
+      timeout.tv_sec = 5;
+      timeout.tv_usec = 0;
+      assert (select (fd + 1, &fds, NULL, NULL, &timeout) == 1);
+      status = sane_read (h, buf, sizeof (buf), &len);
+      assert (status == SANE_STATUS_GOOD);
+      check_data (buf, len, pos);
+      pos += len;
+      if (len == 0)
+	empty++;
+    }
+  assert (pos == (uint64_t) par.bytes_per_line * par.lines);
+  assert (sane_read (h, buf, sizeof (buf), &len) == SANE_STATUS_EOF);
+  printf ("select: %llu bytes, %d empty reads\n", (unsigned long long) pos,
+	  empty);
+  first_delay_us = 0;
+}
+
+static void
+pixma_reader_suite (void)
+{
+  SANE_Int version;
+
+  assert (sane_init (&version, NULL) == SANE_STATUS_GOOD);
+  assert (sane_open ("fake:0", &h) == SANE_STATUS_GOOD);
+
+  partial_read_select ();
+  printf ("ring buffer: ok\n");
+
+  setenv ("PIXMA_READER_BUFFER", "0", 1);
+  partial_read_select ();
+  printf ("pipe: ok\n");
+  unsetenv ("PIXMA_READER_BUFFER");
+
+  sane_close (h);
+  sane_exit ();
+}
+
+
+int
+main (void)
+{
+  pixma_reader_suite ();
+  return 0;
+}
+
+/* vim: set sw=2 cino=>2se-1sn-1s{s^-1st0(0u0 smarttab expandtab: */
@@ -7,6 +7,8 @@
 #include <errno.h>
 #include <string.h>
 #include <assert.h>
+#include <unistd.h>
+#include <dirent.h>
 
 /* sane includes for the sanei functions called */
 #include "../include/sane/sane.h"
@@ -864,6 +866,86 @@ snapscan (void)
 }
 
 
+static SANE_Status
+write_text (FILE * fp, void *data)
+{
+  fputs ((const char *) data, fp);
+  return SANE_STATUS_GOOD;
+}
+
+static SANE_Status
+write_fail (FILE * fp, void *data)
+{
+  fputs ("partial", fp);
+  return SANE_STATUS_IO_ERROR;
+}
+
+/* number of files in DIR */
+static int
+count_files (const char *dir)
+{
+  struct dirent *e;
+  DIR *d;
+  int n = 0;
+
+  d = opendir (dir);
+  assert (d != NULL);
+  while ((e = readdir (d)) != NULL)
+    if (e->d_name[0] != '.')
+      n++;
+  closedir (d);
+  return n;
+}
+
+static void
+write_file (void)
+{
+  char dir[] = "/tmp/sanei_config_testXXXXXX", sub[64], path[80], buf[64];
+  struct stat st1, st2;
+  SANE_Status status;
+  FILE *fp;
+
+  assert (mkdtemp (dir) != NULL);
+  snprintf (sub, sizeof (sub), "%s/sub", dir);
+  snprintf (path, sizeof (path), "%s/cache", sub);
+
+  /* creates the missing directory */
+  status = sanei_config_write_file (path, write_text, "one\n");
+  assert (status == SANE_STATUS_GOOD);
+  fp = fopen (path, "r");
+  assert (fp != NULL);
+  assert (fgets (buf, sizeof (buf), fp) && strcmp (buf, "one\n") == 0);
+  fclose (fp);
+  assert (stat (path, &st1) == 0);
+
+  /* same contents: the file isn't replaced */
+  status = sanei_config_write_file (path, write_text, "one\n");
+  assert (status == SANE_STATUS_GOOD);
+  assert (stat (path, &st2) == 0);
+  assert (st1.st_ino == st2.st_ino);
+
+  /* new contents replace it */
+  status = sanei_config_write_file (path, write_text, "two\n");
+  assert (status == SANE_STATUS_GOOD);
+  fp = fopen (path, "r");
+  assert (fp != NULL);
+  assert (fgets (buf, sizeof (buf), fp) && strcmp (buf, "two\n") == 0);
+  fclose (fp);
+
+  /* a failed write keeps the old file and leaves no temporary file */
+  status = sanei_config_write_file (path, write_fail, NULL);
+  assert (status == SANE_STATUS_IO_ERROR);
+  fp = fopen (path, "r");
+  assert (fp != NULL);
+  assert (fgets (buf, sizeof (buf), fp) && strcmp (buf, "two\n") == 0);
+  fclose (fp);
+  assert (count_files (sub) == 1);
+
+  unlink (path);
+  rmdir (sub);
+  rmdir (dir);
+}
+
 /**
  * create the test suite for sanei config related tests
  */
@@ -889,6 +971,8 @@ sanei_config_suite (void)
   /* backend real conf inspired cases */
   umax_pp ();
   snapscan ();
+
+  write_file ();
 }
 
 /**
@@ -0,0 +1,206 @@
+#include "../../include/sane/config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/* sane includes for the sanei functions called */
+#include "../../include/sane/sanei_rowconv.h"
+
+/* long enough for every vector width, plus odd tails */
+#define MAX_BYTES 1031
+
+static uint8_t src[MAX_BYTES + 64];
+static uint8_t row[MAX_BYTES + 64];
+static uint8_t ref[8 * MAX_BYTES + 64];
+static uint8_t out[8 * MAX_BYTES + 64];
+
+static void
+fill (uint8_t * buf, size_t len)
+{
+  static uint32_t seed = 1;
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    {
+      seed = seed * 1103515245 + 12345;
+      buf[i] = seed >> 16;
+    }
+}
+
+/******************************/
+/* start of tests definitions */
+/******************************/
+
+/*
+ * each conversion is checked against a plain loop for all lengths up to
+ * MAX_BYTES and for unaligned buffers, the bytes after the converted
+ * area must stay untouched
+ */
+static void
+swap16 (void)
+{
+  size_t len, off, i;
+
+  for (off = 0; off < 4; off++)
+    for (len = 0; len <= MAX_BYTES; len++)
+      {
+	fill (row, sizeof (row));
+	memcpy (ref, row, sizeof (row));
+	for (i = 0; i + 1 < len; i += 2)
+	  {
+	    ref[off + i] = row[off + i + 1];
+	    ref[off + i + 1] = row[off + i];
+	  }
+	sanei_rowconv_swap16 (row + off, len);
+	assert (memcmp (row, ref, sizeof (row)) == 0);
+      }
+}
+
+static void
+invert (void)
+{
+  size_t len, off, i;
+
+  for (off = 0; off < 4; off++)
+    for (len = 0; len <= MAX_BYTES; len++)
+      {
+	fill (row, sizeof (row));
+	memcpy (ref, row, sizeof (row));
+	for (i = 0; i < len; i++)
+	  ref[off + i] = ~row[off + i];
+	sanei_rowconv_invert (row + off, len);
+	assert (memcmp (row, ref, sizeof (row)) == 0);
+      }
+}
+
+static void
+expand_1to8 (void)
+{
+  size_t pixels, off, i;
+
+  for (off = 0; off < 4; off++)
+    for (pixels = 0; pixels <= 8 * 300; pixels++)
+      {
+	fill (src, sizeof (src));
+	memset (ref, 0x5a, sizeof (ref));
+	memset (out, 0x5a, sizeof (out));
+	for (i = 0; i < pixels; i++)
+	  ref[off + i] = (src[i / 8] & (1 << (7 - i % 8))) ? 0x00 : 0xff;
+	sanei_rowconv_1to8 (src, out + off, pixels);
+	assert (memcmp (out, ref, sizeof (out)) == 0);
+      }
+}
+
+static void
+reduce_16to8 (void)
+{
+  size_t samples, off, i;
+
+  for (off = 0; off < 4; off++)
+    for (samples = 0; samples <= MAX_BYTES / 2; samples++)
+      {
+	fill (src, sizeof (src));
+	memset (ref, 0x5a, sizeof (ref));
+	memset (out, 0x5a, sizeof (out));
+	for (i = 0; i < samples; i++)
+	  {
+	    uint16_t v;
+
+	    memcpy (&v, src + off + 2 * i, 2);
+	    ref[i] = v >> 8;
+	  }
+	sanei_rowconv_16to8 (src + off, out, samples);
+	assert (memcmp (out, ref, sizeof (out)) == 0);
+      }
+}
+
+/* both may be done in place, which is how the escl backend uses them */
+static void
+in_place (void)
+{
+  size_t n, i;
+
+  for (n = 0; n <= MAX_BYTES / 4; n++)
+    {
+      fill (row, sizeof (row));
+      memcpy (ref, row, sizeof (row));
+      for (i = 0; i < n; i++)
+	{
+	  uint16_t v;
+
+	  memcpy (&v, row + 2 * i, 2);
+	  ref[i] = v >> 8;
+	}
+      sanei_rowconv_16to8 (row, row, n);
+      assert (memcmp (row, ref, n) == 0);
+
+      fill (row, sizeof (row));
+      for (i = 0; i < 3 * n; i++)
+	ref[i] = row[i / 3 * 4 + i % 3];
+      sanei_rowconv_rgba_to_rgb (row, row, n);
+      assert (memcmp (row, ref, 3 * n) == 0);
+    }
+}
+
+static void
+rgba_to_rgb (void)
+{
+  size_t pixels, off, i;
+
+  for (off = 0; off < 4; off++)
+    for (pixels = 0; pixels <= MAX_BYTES / 4; pixels++)
+      {
+	fill (src, sizeof (src));
+	memset (ref, 0x5a, sizeof (ref));
+	memset (out, 0x5a, sizeof (out));
+	for (i = 0; i < pixels; i++)
+	  {
+	    ref[off + 3 * i] = src[4 * i];
+	    ref[off + 3 * i + 1] = src[4 * i + 1];
+	    ref[off + 3 * i + 2] = src[4 * i + 2];
+	  }
+	sanei_rowconv_rgba_to_rgb (src, out + off, pixels);
+	assert (memcmp (out, ref, sizeof (out)) == 0);
+      }
+}
+
+static void
+sanei_rowconv_suite (void)
+{
+  static const char *impls[] = { "generic", "sse2", "avx2" };
+  size_t i;
+
+  for (i = 0; i < sizeof (impls) / sizeof (impls[0]); i++)
+    {
+      if (!sanei_rowconv_select (impls[i]))
+	{
+	  printf ("%s: not supported, skipped\n", impls[i]);
+	  continue;
+	}
+      assert (strcmp (sanei_rowconv_impl (), impls[i]) == 0);
+
+      swap16 ();
+      invert ();
+      expand_1to8 ();
+      reduce_16to8 ();
+      rgba_to_rgb ();
+      in_place ();
+      printf ("%s: ok\n", impls[i]);
+    }
+
+  /* the default is one of the above */
+  assert (sanei_rowconv_select (NULL));
+  printf ("default: %s\n", sanei_rowconv_impl ());
+}
+
+
+int
+main (void)
+{
+  sanei_rowconv_suite ();
+  return 0;
+}
+
+/* vim: set sw=2 cino=>2se-1sn-1s{s^-1st0(0u0 smarttab expandtab: */